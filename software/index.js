@@ -71,6 +71,9 @@ document.addEventListener('keydown', function(event) {
 const gPlayButton = document.getElementById('play');
 const gVideo = document.getElementById('video');
 
+// The hls.js instance, null if the browser plays HLS itself.
+let gHls = null;
+
 function startPlaying() {
     // For mobile browsers the start of playing has to
     // be performed by a user action otherwise it will
@@ -84,14 +87,20 @@ function startPlaying() {
 }
 
 if (Hls.isSupported()) {
+    // lowLatencyMode only has an effect if watchdog is run with
+    // "-hl", when the playlist has partial segments: hls.js then
+    // follows PART-HOLD-BACK from the playlist rather than
+    // liveSyncDurationCount
     const config = {
       debug: true,
+      lowLatencyMode: true,
       liveSyncDurationCount: 3,
       liveMaxLatencyDurationCount: 5,
       maxLiveSyncPlaybackRate: 2
     };
 
     const hls = new Hls(config);
+    gHls = hls;
 
     // This puts up alert boxes in the browser that need to be dismissed
     // before continuing
@@ -128,6 +137,161 @@ if (Hls.isSupported()) {
     gVideo.addEventListener('loadedmetadata', startPlaying);
 }
 
+/* ----------------------------------------------------------------
+ * MOTION EVENT STUFF
+ * -------------------------------------------------------------- */
+
+// The motion event index that watchdog writes next to the HLS
+// playlist, one JSON object per line for each segment with motion
+// in it, see w_event.h; the thumbnails are in the same place.
+const gEventsDirectory = 'video/';
+const gEventsFileName = gEventsDirectory + 'watchdog_events.jsonl';
+
+// How often to fetch what is new in the motion event index.
+const gEventsFetchIntervalMs = 10000;
+
+// The number of most recent motion events that are shown as thumbnails.
+const gEventsThumbnailCount = 8;
+
+// Grab the element IDs.
+const gEventsTimeline = document.getElementById('events-timeline');
+const gEventsThumbnails = document.getElementById('events-thumbnails');
+
+// The motion events of today that have been read so far, oldest first.
+let gEvents = [];
+
+// How far into the motion event index, in bytes, has been read:
+// the end of the last complete line.
+let gEventsOffset = 0;
+
+// Seek the video to the peak of a motion event, provided that the
+// segment it is in is still in the playlist.
+function eventSeek(event) {
+    let seeked = false;
+
+    if (gHls && (gHls.levels.length > 0)) {
+        const level = gHls.levels[Math.max(gHls.currentLevel, 0)];
+        const fragments = (level && level.details) ? level.details.fragments : [];
+        const fragment = fragments.find(fragment => fragment.sn === event.segment);
+        if (fragment) {
+            gVideo.currentTime = fragment.start + (event.peakTimeUnixMs - event.timeUnixMs) / 1000;
+            seeked = true;
+        }
+    }
+    if (!seeked) {
+        showNotification('The motion at ' + moment(event.peakTimeUnixMs).format('HH:mm:ss') +
+                         ' is no longer in the video.');
+    }
+}
+
+// Show the motion events of today: a mark on the timeline for each
+// and thumbnails of the most recent, clicking on either seeks to it.
+function eventsDisplay(events) {
+    const startOfDayMillis = moment().startOf('day').valueOf();
+    const dayMillis = 24 * 60 * 60 * 1000;
+    const today = events.filter(event => event.peakTimeUnixMs >= startOfDayMillis);
+
+    gEventsTimeline.replaceChildren();
+    today.forEach(function(event) {
+        const mark = document.createElement('span');
+        mark.className = 'events-mark';
+        mark.style.left = (((event.peakTimeUnixMs - startOfDayMillis) * 100) / dayMillis) + '%';
+        mark.title = moment(event.peakTimeUnixMs).format('HH:mm:ss');
+        mark.addEventListener('click', () => eventSeek(event));
+        gEventsTimeline.appendChild(mark);
+    });
+
+    gEventsThumbnails.replaceChildren();
+    today.slice(-gEventsThumbnailCount).reverse().forEach(function(event) {
+        const figure = document.createElement('figure');
+        figure.className = 'events-thumbnail';
+        if (event.thumbnail) {
+            const image = document.createElement('img');
+            image.src = gEventsDirectory + event.thumbnail;
+            image.alt = 'motion';
+            // Thumbnails are deleted once their segment has long gone
+            // from the playlist
+            image.onerror = () => image.remove();
+            figure.appendChild(image);
+        }
+        const caption = document.createElement('figcaption');
+        caption.textContent = moment(event.peakTimeUnixMs).format('HH:mm:ss');
+        figure.appendChild(caption);
+        figure.addEventListener('click', () => eventSeek(event));
+        gEventsThumbnails.appendChild(figure);
+    });
+}
+
+// Fetch what has been added to the motion event index since it was
+// last fetched and, if there is anything, show it.  The fetch starts
+// one byte early, at the newline that ended the last complete line:
+// if it isn't there, or what follows is older than what has already
+// been read, or the server says that the range is beyond the end of
+// the index (416), the index has been trimmed and is read again from
+// the start; a server that ignores the range (200) sends the whole
+// index, which is just as good.
+async function eventsFetch() {
+    try {
+        const start = Math.max(gEventsOffset - 1, 0);
+        const response = await fetch(gEventsFileName, {cache: 'no-store',
+                                                       headers: {'Range': 'bytes=' + start + '-'}});
+        if (response.status === 416) {
+            gEvents = [];
+            gEventsOffset = 0;
+            eventsDisplay(gEvents);
+        } else if (response.ok) {
+            let text = await response.text();
+            let offset = start;
+            let valid = true;
+            if (response.status === 200) {
+                gEvents = [];
+                offset = 0;
+            } else if (gEventsOffset > 0) {
+                valid = text.startsWith('\n');
+                text = text.substring(1);
+                offset++;
+            }
+            // Only complete lines; the rest will be there next time
+            const end = text.lastIndexOf('\n') + 1;
+            let events = [];
+            if (valid) {
+                text.substring(0, end).split('\n').forEach(function(line) {
+                    if (line.trim().length > 0) {
+                        try {
+                            events.push(JSON.parse(line));
+                        } catch {
+                            // Not something we understand, skip it
+                        }
+                    }
+                });
+                if ((events.length > 0) && (gEvents.length > 0) &&
+                    (events[0].timeUnixMs <= gEvents[gEvents.length - 1].timeUnixMs)) {
+                    valid = false;
+                }
+            }
+            if (valid) {
+                if (events.length > 0) {
+                    const startOfDayMillis = moment().startOf('day').valueOf();
+                    gEvents = gEvents.concat(events).filter(event => event.peakTimeUnixMs >= startOfDayMillis);
+                    eventsDisplay(gEvents);
+                }
+                // The index counts bytes, not characters
+                gEventsOffset = offset + new TextEncoder().encode(text.substring(0, end)).length;
+            } else {
+                // The index has changed under our feet: start again
+                gEvents = [];
+                gEventsOffset = 0;
+                eventsFetch();
+            }
+        }
+    } catch (error) {
+        console.log('unable to fetch ' + gEventsFileName + ', error "' + error + '"');
+    }
+}
+
+eventsFetch();
+setInterval(eventsFetch, gEventsFetchIntervalMs);
+
 /* ----------------------------------------------------------------
  * NOTIFICATION STUFF
  * -------------------------------------------------------------- */
@@ -0,0 +1,955 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief An offline benchmark for the video pipeline of the watchdog
+ * application, main().
+ *
+ * This is linked in place of w_camera.cpp: it provides a replay
+ * implementation of the wCamera API which, instead of a camera, takes
+ * YUV420 frames from a raw file, from a directory of raw files or,
+ * if neither is given, synthesises them.  The frames are fed through
+ * image processing and video encoding, or either one on its own,
+ * either as fast as the pipeline will take them or at the camera
+ * frame rate, and the throughput, per-frame latency (from the frame
+ * being handed over to its buffer being released back to the
+ * "camera") and peak RSS are reported.
+ *
+ * A raw file is a straight concatenation of frames, each being the
+ * Y plane (stride x height) followed by the U and V planes (half the
+ * stride x half the height) at W_CAMERA_WIDTH_PIXELS x
+ * W_CAMERA_HEIGHT_PIXELS, e.g. as written by:
+ *
+ * ffmpeg -i in.mp4 -vf scale=950:540 -pix_fmt yuv420p -f rawvideo out.yuv
+ *
+ * Since the message queue threads are real-time, this needs to be
+ * run with sudo, just like the watchdog itself.
+ */
+
+// The CPP stuff.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>  // For std::sort()
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+// The Linux/Posix stuff.
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h> // For getrusage()
+
+// The watchdog stuff.
+#include <w_common.h>
+#include <w_util.h>
+#include <w_log.h>
+#include <w_msg.h>
+#include <w_hls.h>
+#include <w_camera.h>
+#include <w_image_processing.h>
+#include <w_video_encode.h>
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+#ifndef W_BENCHMARK_FRAME_COUNT_DEFAULT
+/** The default number of frames to feed through the pipeline; the
+ * source is looped over if it has fewer frames than this.
+ */
+# define W_BENCHMARK_FRAME_COUNT_DEFAULT 300
+#endif
+
+#ifndef W_BENCHMARK_OUTPUT_FILE_NAME_DEFAULT
+/** The default file name for the HLS output of the benchmark.
+ */
+# define W_BENCHMARK_OUTPUT_FILE_NAME_DEFAULT "benchmark"
+#endif
+
+#ifndef W_BENCHMARK_DRAIN_TIMEOUT_SECONDS
+/** How long to wait, once the last frame has been fed, for the
+ * pipeline to give all of the frames back.
+ */
+# define W_BENCHMARK_DRAIN_TIMEOUT_SECONDS 10
+#endif
+
+#ifndef W_BENCHMARK_SYNTHETIC_SQUARE_PIXELS
+/** The size of the square that moves across a synthesised frame.
+ */
+# define W_BENCHMARK_SYNTHETIC_SQUARE_PIXELS 64
+#endif
+
+#ifndef W_BENCHMARK_SYNTHETIC_SPEED_PIXELS
+/** How far the square in a synthesised frame moves each frame.
+ */
+# define W_BENCHMARK_SYNTHETIC_SPEED_PIXELS 8
+#endif
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** The stages of the pipeline that may be benchmarked.
+ */
+typedef enum {
+    W_BENCHMARK_MODE_ALL, // Image processing followed by video encode
+    W_BENCHMARK_MODE_IMAGE_PROCESSING, // Image processing on its own
+    W_BENCHMARK_MODE_VIDEO_ENCODE // Video encode on its own
+} wBenchmarkMode_t;
+
+/** Parameters passed to the benchmark.
+ */
+typedef struct {
+    std::string programName;
+    std::string inputPath;
+    std::string outputDirectory;
+    std::string outputFileName;
+    wBenchmarkMode_t mode;
+    unsigned int frameCount;
+    unsigned int stride;
+    bool realTime;
+    wVideoEncodeCodecCfg_t videoEncodeCodecCfg;
+    std::string motionDetectorName;
+} wBenchmarkParameters_t;
+
+/** A frame buffer of the replay camera.
+ */
+typedef struct {
+    uint8_t *data;
+    uint8_t *analysisData; // Y plane only, nullptr if W_CAMERA_ANALYSIS_STREAM is 0
+    unsigned int refCount;
+    std::chrono::steady_clock::time_point fedTime;
+} wBenchmarkFrame_t;
+
+/** Context for the replay camera.
+ */
+typedef struct {
+    wBenchmarkFrame_t frame[W_CAMERA_BUFFER_COUNT];
+    unsigned int frameLength;
+    std::mutex mutex; // Protects frame[] and the results below
+    std::condition_variable frameReleased;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::atomic<bool> feedDone;
+    wCommonFrameFunction_t *outputCallback;
+    std::vector<std::string> filePath;
+    unsigned int filePathIndex;
+    FILE *file;
+    std::atomic<uint64_t> frameCount;
+    unsigned int frameInUse; // The number of frames held by the pipeline
+    unsigned int frameInUseMax;
+    // The results
+    uint64_t frameMissedCount;
+    std::vector<uint32_t> latencyUs;
+    std::chrono::steady_clock::time_point firstFedTime;
+    std::chrono::steady_clock::time_point lastReleasedTime;
+} wBenchmarkCamera_t;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// The parameters of this run.
+static wBenchmarkParameters_t gParameters;
+
+// The replay camera.
+static wBenchmarkCamera_t *gCamera = nullptr;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: THE FRAME SOURCE
+ * -------------------------------------------------------------- */
+
+// Populate the list of files to read frames from: either the one
+// file or all of the files in a directory, in name order.
+static int sourceOpen(wBenchmarkCamera_t *camera, std::string path)
+{
+    int errorCode = 0;
+    struct stat status = {};
+
+    camera->filePath.clear();
+    camera->filePathIndex = 0;
+    camera->file = nullptr;
+    if (!path.empty()) {
+        errorCode = -ENOENT;
+        if (stat(path.c_str(), &status) == 0) {
+            if (S_ISDIR(status.st_mode)) {
+                DIR *directory = opendir(path.c_str());
+                if (directory) {
+                    struct dirent *entry;
+                    while ((entry = readdir(directory)) != nullptr) {
+                        std::string filePath = path + std::string(W_UTIL_DIR_SEPARATOR) +
+                                               std::string(entry->d_name);
+                        if ((stat(filePath.c_str(), &status) == 0) &&
+                            S_ISREG(status.st_mode)) {
+                            camera->filePath.push_back(filePath);
+                        }
+                    }
+                    closedir(directory);
+                    std::sort(camera->filePath.begin(), camera->filePath.end());
+                }
+            } else {
+                camera->filePath.push_back(path);
+            }
+        }
+        if (!camera->filePath.empty()) {
+            errorCode = 0;
+        } else {
+            W_LOG_ERROR("no frames to be had from \"%s\".", path.c_str());
+        }
+    }
+
+    return errorCode;
+}
+
+// Synthesise a frame: a bright square moving across a grey background.
+static void sourceSynthesise(uint8_t *data, unsigned int sequence)
+{
+    unsigned int stride = gParameters.stride;
+    unsigned int size = W_BENCHMARK_SYNTHETIC_SQUARE_PIXELS;
+    unsigned int range = W_CAMERA_WIDTH_PIXELS - size;
+    unsigned int x = (sequence * W_BENCHMARK_SYNTHETIC_SPEED_PIXELS) % (range * 2);
+    unsigned int y = (W_CAMERA_HEIGHT_PIXELS - size) / 2;
+
+    if (x >= range) {
+        // On the way back
+        x = (range * 2) - x;
+    }
+    // Grey for Y, no colour for U and V
+    memset(data, 0x80, gCamera->frameLength);
+    for (unsigned int row = y; row < y + size; row++) {
+        memset(data + (row * stride) + x, 0xf0, size);
+    }
+}
+
+// Make the analysis stream version of a frame, as the ISP would,
+// by taking every nth pixel of the Y plane; the frame is not usually
+// an exact multiple of the analysis stream size but this is near
+// enough for motion detection.
+static void sourceAnalysis(const uint8_t *data, uint8_t *analysisData)
+{
+    for (unsigned int y = 0; y < W_CAMERA_ANALYSIS_HEIGHT_PIXELS; y++) {
+        const uint8_t *row = data + (((y * W_CAMERA_HEIGHT_PIXELS) /
+                                      W_CAMERA_ANALYSIS_HEIGHT_PIXELS) * gParameters.stride);
+        for (unsigned int x = 0; x < W_CAMERA_ANALYSIS_WIDTH_PIXELS; x++) {
+            *analysisData = row[(x * W_CAMERA_WIDTH_PIXELS) / W_CAMERA_ANALYSIS_WIDTH_PIXELS];
+            analysisData++;
+        }
+    }
+}
+
+// Read the next frame from file, going on to the next file (or back
+// to the first) at the end of each one.
+static int sourceRead(wBenchmarkCamera_t *camera, uint8_t *data)
+{
+    int errorCode = -ENODATA;
+
+    // Twice around the list is more than enough to find a frame if
+    // there is one
+    for (unsigned int x = 0; (x < (camera->filePath.size() * 2) + 1) &&
+                             (errorCode != 0); x++) {
+        if (!camera->file) {
+            camera->file = fopen(camera->filePath[camera->filePathIndex].c_str(), "rb");
+        }
+        if (camera->file &&
+            (fread(data, 1, camera->frameLength, camera->file) == camera->frameLength)) {
+            errorCode = 0;
+        } else {
+            // Part-frames at the end of a file are ignored
+            if (camera->file) {
+                fclose(camera->file);
+                camera->file = nullptr;
+            }
+            camera->filePathIndex++;
+            if (camera->filePathIndex >= camera->filePath.size()) {
+                camera->filePathIndex = 0;
+            }
+        }
+    }
+
+    return errorCode;
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: THE REPLAY CAMERA
+ * -------------------------------------------------------------- */
+
+// Return the frame holding data, or nullptr; the mutex must be held.
+static wBenchmarkFrame_t *frameGet(wBenchmarkCamera_t *camera, uint8_t *data)
+{
+    wBenchmarkFrame_t *frame = nullptr;
+
+    for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(camera->frame)) &&
+                             (frame == nullptr); x++) {
+        if (data && (camera->frame[x].data == data) &&
+            (camera->frame[x].refCount > 0)) {
+            frame = &(camera->frame[x]);
+        }
+    }
+
+    return frame;
+}
+
+// Return a free frame, or nullptr; the mutex must be held.
+static wBenchmarkFrame_t *frameGetFree(wBenchmarkCamera_t *camera)
+{
+    wBenchmarkFrame_t *frame = nullptr;
+
+    for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(camera->frame)) &&
+                             (frame == nullptr); x++) {
+        if (camera->frame[x].data && (camera->frame[x].refCount == 0)) {
+            frame = &(camera->frame[x]);
+        }
+    }
+
+    return frame;
+}
+
+// Return the number of frames held by the pipeline.
+static unsigned int frameHeldCount(wBenchmarkCamera_t *camera)
+{
+    unsigned int count = 0;
+
+    camera->mutex.lock();
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(camera->frame); x++) {
+        if (camera->frame[x].refCount > 0) {
+            count++;
+        }
+    }
+    camera->mutex.unlock();
+
+    return count;
+}
+
+// The loop that feeds frames to the pipeline, as the camera would.
+// Unthrottled, a frame is fed as soon as a buffer is free; in real
+// time a frame is fed every frame period and, like the camera, if
+// all of the buffers are held by the pipeline the frame is missed.
+static void feedLoop(wBenchmarkCamera_t *camera)
+{
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds framePeriod(1000000000 / W_CAMERA_FRAME_RATE_HERTZ);
+
+    for (unsigned int sequence = 0; camera->running && wUtilKeepGoing() &&
+                                    (sequence < gParameters.frameCount); sequence++) {
+        wBenchmarkFrame_t *frame = nullptr;
+        if (gParameters.realTime) {
+            std::this_thread::sleep_until(startTime + (framePeriod * sequence));
+        }
+        std::unique_lock<std::mutex> lock(camera->mutex);
+        frame = frameGetFree(camera);
+        if (!gParameters.realTime) {
+            while (camera->running && wUtilKeepGoing() && !frame) {
+                // There's a guard on this in case of CTRL-C
+                camera->frameReleased.wait_for(lock, std::chrono::seconds(1));
+                frame = frameGetFree(camera);
+            }
+        }
+        if (frame) {
+            // Ours now, nothing else will touch it until it is fed
+            frame->refCount = 1;
+            camera->frameInUse++;
+            if (camera->frameInUse > camera->frameInUseMax) {
+                camera->frameInUseMax = camera->frameInUse;
+            }
+        } else {
+            camera->frameMissedCount++;
+        }
+        lock.unlock();
+
+        if (frame) {
+            // Filling the frame is not part of its latency
+            int errorCode = 0;
+            if (camera->filePath.empty()) {
+                sourceSynthesise(frame->data, sequence);
+            } else {
+                errorCode = sourceRead(camera, frame->data);
+            }
+            if ((errorCode == 0) && frame->analysisData) {
+                sourceAnalysis(frame->data, frame->analysisData);
+            }
+            if (errorCode == 0) {
+                frame->fedTime = std::chrono::steady_clock::now();
+                if (camera->frameCount == 0) {
+                    camera->firstFedTime = frame->fedTime;
+                }
+                camera->frameCount++;
+                if (camera->outputCallback) {
+                    camera->outputCallback(W_COMMON_PIPELINE_MAIN,
+                                           frame->data, camera->frameLength,
+                                           sequence, W_CAMERA_WIDTH_PIXELS,
+                                           W_CAMERA_HEIGHT_PIXELS,
+                                           gParameters.stride);
+                } else {
+                    wCameraFrameRelease(frame->data);
+                }
+            } else {
+                W_LOG_ERROR("unable to read a frame (%d)!", errorCode);
+                camera->mutex.lock();
+                frame->refCount = 0;
+                camera->frameInUse--;
+                camera->mutex.unlock();
+                camera->running = false;
+            }
+        }
+    }
+
+    camera->feedDone = true;
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: OTHER
+ * -------------------------------------------------------------- */
+
+// The output callback when only image processing is being measured:
+// give the frame straight back.
+static int imageProcessingSink(unsigned int pipeline,
+                               uint8_t *data, unsigned int length,
+                               unsigned int sequence,
+                               unsigned int width, unsigned int height,
+                               unsigned int stride)
+{
+    (void) pipeline;
+    (void) length;
+    (void) sequence;
+    (void) width;
+    (void) height;
+    (void) stride;
+
+    wCameraFrameRelease(data);
+
+    return 0;
+}
+
+// Parse the command-line; if this returns an error the parameters
+// will still be populated with the defaults.
+static int commandLineParse(int argc, char *argv[],
+                            wBenchmarkParameters_t *parameters)
+{
+    int errorCode = 0;
+    int x = 1;
+
+    parameters->programName = std::string(argc > 0 ? argv[0] : "watchdog_benchmark");
+    parameters->inputPath.clear();
+    parameters->outputDirectory = std::string(W_UTIL_DIR_THIS);
+    parameters->outputFileName = std::string(W_BENCHMARK_OUTPUT_FILE_NAME_DEFAULT);
+    parameters->mode = W_BENCHMARK_MODE_ALL;
+    parameters->frameCount = W_BENCHMARK_FRAME_COUNT_DEFAULT;
+    parameters->stride = W_CAMERA_WIDTH_PIXELS;
+    parameters->realTime = false;
+    parameters->videoEncodeCodecCfg.name = std::string(W_VIDEO_ENCODE_CODEC_NAME_DEFAULT);
+    parameters->videoEncodeCodecCfg.crf = -1;
+    parameters->motionDetectorName = std::string(W_IMAGE_PROCESSING_DETECTOR_NAME_DEFAULT);
+
+    while ((x < argc) && (errorCode == 0)) {
+        std::string option = std::string(argv[x]);
+        std::string value;
+        errorCode = -EINVAL;
+        if ((option == "-r") || (option == "-h")) {
+            if (option == "-r") {
+                parameters->realTime = true;
+                errorCode = 0;
+            }
+        } else if (x + 1 < argc) {
+            x++;
+            value = std::string(argv[x]);
+            if (option == "-i") {
+                parameters->inputPath = value;
+                errorCode = 0;
+            } else if (option == "-d") {
+                parameters->outputDirectory = value;
+                errorCode = 0;
+            } else if (option == "-f") {
+                parameters->outputFileName = value;
+                errorCode = 0;
+            } else if (option == "-e") {
+                parameters->videoEncodeCodecCfg.name = value;
+                errorCode = 0;
+            } else if (option == "-md") {
+                if (wImageProcessingDetectorGet(value.c_str())) {
+                    parameters->motionDetectorName = value;
+                    errorCode = 0;
+                }
+            } else if (option == "-m") {
+                errorCode = 0;
+                if (value == "all") {
+                    parameters->mode = W_BENCHMARK_MODE_ALL;
+                } else if (value == "image") {
+                    parameters->mode = W_BENCHMARK_MODE_IMAGE_PROCESSING;
+                } else if (value == "encode") {
+                    parameters->mode = W_BENCHMARK_MODE_VIDEO_ENCODE;
+                } else {
+                    errorCode = -EINVAL;
+                }
+            } else if ((option == "-n") || (option == "-s")) {
+                int integer = atoi(value.c_str());
+                if (integer > 0) {
+                    errorCode = 0;
+                    if (option == "-n") {
+                        parameters->frameCount = integer;
+                    } else {
+                        parameters->stride = integer;
+                    }
+                }
+            }
+        }
+        x++;
+    }
+    if ((parameters->stride < W_CAMERA_WIDTH_PIXELS) ||
+        ((parameters->stride & 1) != 0)) {
+        errorCode = -EINVAL;
+    }
+
+    return errorCode;
+}
+
+// Print command-line help.
+static void commandLinePrintHelp(wBenchmarkParameters_t *defaults)
+{
+    std::cout << defaults->programName << ", options are:" << std::endl;
+    std::cout << "  -i  <path> a raw YUV420 file, or a directory of them, of "
+              << W_CAMERA_WIDTH_PIXELS << "x" << W_CAMERA_HEIGHT_PIXELS
+              << " frames (default: synthesise frames)." << std::endl;
+    std::cout << "  -s  <integer> the stride of the Y plane of the frames in"
+              << " the file, must be even (default " << defaults->stride << ")."
+              << std::endl;
+    std::cout << "  -n  <integer> the number of frames to feed, looping around"
+              << " the input as necessary (default " << defaults->frameCount
+              << ")." << std::endl;
+    std::cout << "  -m  all|image|encode the stages to feed the frames through"
+              << " (default all)." << std::endl;
+    std::cout << "  -r  feed frames at " << W_CAMERA_FRAME_RATE_HERTZ
+              << " frames/second, missing frames if the pipeline is full, as"
+              << " the camera would (default: as fast as the pipeline will"
+              << " take them)." << std::endl;
+    std::cout << "  -e  <name[,name...]> the FFmpeg video encoder to use, or \""
+              << W_VIDEO_ENCODE_CODEC_NAME_AUTO << "\" (default "
+              << defaults->videoEncodeCodecCfg.name << ")." << std::endl;
+    std::cout << "  -md mog2|diff the motion detector to use (default "
+              << defaults->motionDetectorName << ")." << std::endl;
+    std::cout << "  -d  <directory path> set directory for streaming output"
+              << " (default this directory)." << std::endl;
+    std::cout << "  -f  <file name> set file name for streaming output (default "
+              << defaults->outputFileName << ")." << std::endl;
+}
+
+// Return the given percentile of a sorted vector of latencies.
+static uint32_t percentileUs(const std::vector<uint32_t> *latencyUs,
+                             unsigned int percent)
+{
+    uint32_t valueUs = 0;
+
+    if (!latencyUs->empty()) {
+        size_t index = ((latencyUs->size() * percent) + 99) / 100;
+        if (index > 0) {
+            index--;
+        }
+        valueUs = (*latencyUs)[index];
+    }
+
+    return valueUs;
+}
+
+// Print the results.
+static void resultsPrint(wBenchmarkCamera_t *camera)
+{
+    static const char *modeStr[] = {"image processing + video encode",
+                                    "image processing", "video encode"};
+    struct rusage usage = {};
+    double seconds = 0;
+
+    camera->mutex.lock();
+    std::sort(camera->latencyUs.begin(), camera->latencyUs.end());
+    if (!camera->latencyUs.empty()) {
+        seconds = std::chrono::duration<double>(camera->lastReleasedTime -
+                                                camera->firstFedTime).count();
+    }
+    W_LOG_INFO("%s, %s, %s:", modeStr[gParameters.mode],
+               gParameters.inputPath.empty() ? "synthesised frames" :
+                                               gParameters.inputPath.c_str(),
+               gParameters.realTime ? "real time" : "unthrottled");
+    W_LOG_INFO("  %d frame(s) fed, %llu missed, %d completed in %.3f second(s),"
+               " %.1f frames/second.", (int) camera->frameCount,
+               (unsigned long long) camera->frameMissedCount,
+               (int) camera->latencyUs.size(), seconds,
+               seconds > 0 ? camera->latencyUs.size() / seconds : 0);
+    W_LOG_INFO("  latency p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms.",
+               ((double) percentileUs(&camera->latencyUs, 50)) / 1000,
+               ((double) percentileUs(&camera->latencyUs, 90)) / 1000,
+               ((double) percentileUs(&camera->latencyUs, 99)) / 1000,
+               ((double) percentileUs(&camera->latencyUs, 100)) / 1000);
+    W_LOG_INFO("  frame pool of %d buffer(s), at most %d held by the pipeline.",
+               (int) W_UTIL_ARRAY_COUNT(camera->frame), camera->frameInUseMax);
+    camera->mutex.unlock();
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        // ru_maxrss is in kilobytes on Linux
+        W_LOG_INFO("  peak RSS %.1f Mbyte(s).", ((double) usage.ru_maxrss) / 1024);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: THE wCamera API, REPLAYED
+ * -------------------------------------------------------------- */
+
+// Initialise the replay camera: there is only the one, that of the
+// main pipeline, and it has a frame pool of its own making.
+int wCameraInit(unsigned int pipeline, unsigned int framePoolMaxBytes)
+{
+    int errorCode = 0;
+
+    (void) framePoolMaxBytes;
+
+    if (pipeline != W_COMMON_PIPELINE_MAIN) {
+        errorCode = -ENXIO;
+    } else if (!gCamera) {
+        errorCode = -ENOMEM;
+        gCamera = new wBenchmarkCamera_t;
+        // YUV420: the U and V planes are each a quarter of the Y plane
+        gCamera->frameLength = (gParameters.stride * W_CAMERA_HEIGHT_PIXELS) +
+                               ((gParameters.stride >> 1) * (W_CAMERA_HEIGHT_PIXELS >> 1) * 2);
+        gCamera->running = false;
+        gCamera->feedDone = false;
+        gCamera->outputCallback = nullptr;
+        gCamera->frameCount = 0;
+        gCamera->frameInUse = 0;
+        gCamera->frameInUseMax = 0;
+        gCamera->frameMissedCount = 0;
+        gCamera->filePathIndex = 0;
+        gCamera->file = nullptr;
+        gCamera->latencyUs.reserve(gParameters.frameCount);
+        errorCode = 0;
+        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gCamera->frame); x++) {
+            gCamera->frame[x].refCount = 0;
+            gCamera->frame[x].data = (uint8_t *) malloc(gCamera->frameLength);
+            gCamera->frame[x].analysisData = nullptr;
+            if (!gCamera->frame[x].data) {
+                errorCode = -ENOMEM;
+            }
+#if W_CAMERA_ANALYSIS_STREAM
+            gCamera->frame[x].analysisData = (uint8_t *) malloc(W_CAMERA_ANALYSIS_WIDTH_PIXELS *
+                                                                W_CAMERA_ANALYSIS_HEIGHT_PIXELS);
+            if (!gCamera->frame[x].analysisData) {
+                errorCode = -ENOMEM;
+            }
+#endif
+        }
+        if (errorCode == 0) {
+            errorCode = sourceOpen(gCamera, gParameters.inputPath);
+        }
+        if (errorCode != 0) {
+            wCameraDeinit(pipeline);
+        }
+    }
+
+    return errorCode;
+}
+
+// Start the replay camera.
+int wCameraStart(unsigned int pipeline, wCommonFrameFunction_t *outputCallback)
+{
+    int errorCode = -EBADF;
+
+    if ((pipeline == W_COMMON_PIPELINE_MAIN) && gCamera && !gCamera->running) {
+        errorCode = 0;
+        gCamera->outputCallback = outputCallback;
+        gCamera->feedDone = false;
+        gCamera->running = true;
+        try {
+            gCamera->thread = std::thread(feedLoop, gCamera);
+            pthread_setname_np(gCamera->thread.native_handle(), "feedLoop");
+            wUtilThreadPlacementSet(gCamera->thread.native_handle(), "feedLoop");
+        }
+        catch (int x) {
+            gCamera->running = false;
+            errorCode = -x;
+        }
+    }
+
+    return errorCode;
+}
+
+// Add a reference to a frame buffer.
+int wCameraFrameAddRef(uint8_t *data)
+{
+    int refCountOrErrorCode = -EBADF;
+
+    if (gCamera) {
+        refCountOrErrorCode = -EINVAL;
+        gCamera->mutex.lock();
+        wBenchmarkFrame_t *frame = frameGet(gCamera, data);
+        if (frame) {
+            frame->refCount++;
+            refCountOrErrorCode = (int) frame->refCount;
+        }
+        gCamera->mutex.unlock();
+    }
+
+    return refCountOrErrorCode;
+}
+
+// Release a reference to a frame buffer; when the last one goes the
+// latency of the frame is recorded.
+int wCameraFrameRelease(uint8_t *data)
+{
+    int refCountOrErrorCode = -EBADF;
+
+    if (gCamera) {
+        refCountOrErrorCode = -EINVAL;
+        gCamera->mutex.lock();
+        wBenchmarkFrame_t *frame = frameGet(gCamera, data);
+        if (frame) {
+            frame->refCount--;
+            refCountOrErrorCode = (int) frame->refCount;
+            if (frame->refCount == 0) {
+                gCamera->frameInUse--;
+                gCamera->lastReleasedTime = std::chrono::steady_clock::now();
+                gCamera->latencyUs.push_back(std::chrono::duration_cast<std::chrono::microseconds>(gCamera->lastReleasedTime -
+                                                                                                   frame->fedTime).count());
+            }
+        }
+        gCamera->mutex.unlock();
+        if (refCountOrErrorCode == 0) {
+            gCamera->frameReleased.notify_all();
+        }
+    }
+
+    return refCountOrErrorCode;
+}
+
+// Get the analysis stream version of a frame.
+int wCameraFrameAnalysisGet(uint8_t *data, uint8_t **analysisData,
+                            unsigned int *width, unsigned int *height,
+                            unsigned int *stride)
+{
+    int errorCode = -EBADF;
+
+    if (gCamera) {
+        errorCode = -EINVAL;
+        if (analysisData) {
+            errorCode = -ENOENT;
+            gCamera->mutex.lock();
+            wBenchmarkFrame_t *frame = frameGet(gCamera, data);
+            if (frame && frame->analysisData) {
+                *analysisData = frame->analysisData;
+                if (width) {
+                    *width = W_CAMERA_ANALYSIS_WIDTH_PIXELS;
+                }
+                if (height) {
+                    *height = W_CAMERA_ANALYSIS_HEIGHT_PIXELS;
+                }
+                if (stride) {
+                    *stride = W_CAMERA_ANALYSIS_WIDTH_PIXELS;
+                }
+                errorCode = 0;
+            }
+            gCamera->mutex.unlock();
+        }
+    }
+
+    return errorCode;
+}
+
+// Get the state of the frame pool of the replay camera: a frame that
+// was missed because every buffer was held counts as starved.
+int wCameraFramePoolGet(unsigned int pipeline, wCameraFramePool_t *pool,
+                        bool resetMax)
+{
+    int errorCode = -EBADF;
+
+    if ((pipeline == W_COMMON_PIPELINE_MAIN) && gCamera) {
+        errorCode = -EINVAL;
+        if (pool) {
+            gCamera->mutex.lock();
+            pool->count = W_UTIL_ARRAY_COUNT(gCamera->frame);
+            pool->bytes = pool->count * gCamera->frameLength;
+#if W_CAMERA_ANALYSIS_STREAM
+            pool->bytes += pool->count * W_CAMERA_ANALYSIS_WIDTH_PIXELS * W_CAMERA_ANALYSIS_HEIGHT_PIXELS;
+#endif
+            pool->inUse = gCamera->frameInUse;
+            pool->inUseMax = gCamera->frameInUseMax;
+            if (resetMax) {
+                gCamera->frameInUseMax = gCamera->frameInUse;
+            }
+            pool->starvedCount = gCamera->frameMissedCount;
+            gCamera->mutex.unlock();
+            errorCode = 0;
+        }
+    }
+
+    return errorCode;
+}
+
+// Get the number of frames fed.
+uint64_t wCameraFrameCountGet(unsigned int pipeline)
+{
+    uint64_t frameCount = 0;
+
+    if ((pipeline == W_COMMON_PIPELINE_MAIN) && gCamera) {
+        frameCount = gCamera->frameCount;
+    }
+
+    return frameCount;
+}
+
+// Stop the replay camera.
+int wCameraStop(unsigned int pipeline)
+{
+    int errorCode = -EBADF;
+
+    if ((pipeline == W_COMMON_PIPELINE_MAIN) && gCamera) {
+        errorCode = 0;
+        gCamera->running = false;
+        gCamera->frameReleased.notify_all();
+        if (gCamera->thread.joinable() &&
+            (gCamera->thread.get_id() != std::this_thread::get_id())) {
+            gCamera->thread.join();
+        }
+    }
+
+    return errorCode;
+}
+
+// Deinitialise the replay camera.
+void wCameraDeinit(unsigned int pipeline)
+{
+    if ((pipeline == W_COMMON_PIPELINE_MAIN) && gCamera) {
+        wCameraStop(pipeline);
+        unsigned int heldCount = frameHeldCount(gCamera);
+        if (heldCount > 0) {
+            W_LOG_WARN("%d frame(s) still held by the pipeline.", heldCount);
+        }
+        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gCamera->frame); x++) {
+            free(gCamera->frame[x].data);
+            free(gCamera->frame[x].analysisData);
+        }
+        if (gCamera->file) {
+            fclose(gCamera->file);
+        }
+        delete gCamera;
+        gCamera = nullptr;
+    }
+}
+
+// List the cameras: there's only the one.
+int wCameraList()
+{
+    W_LOG_INFO("replay camera, %dx%d, stride %d, %d buffer(s).",
+               W_CAMERA_WIDTH_PIXELS, W_CAMERA_HEIGHT_PIXELS,
+               gParameters.stride, W_CAMERA_BUFFER_COUNT);
+
+    return 1;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: MAIN
+ * -------------------------------------------------------------- */
+
+// The entry point.
+int main(int argc, char *argv[])
+{
+    int errorCode = commandLineParse(argc, argv, &gParameters);
+
+    if (errorCode == 0) {
+        // Capture CTRL-C so that we can exit in an organised fashion
+        wUtilTerminationCaptureSet();
+
+        // Place ourselves, as in the real thing, so that the threads
+        // the encoder creates land on the media CPUs
+        wUtilThreadPlacementSet(pthread_self(), "main");
+
+        // Log messages are printed by their own thread, as in the
+        // real thing
+        errorCode = wLogWriterStart();
+        if (errorCode == 0) {
+            errorCode = wMsgInit();
+        }
+        if (errorCode == 0) {
+            wCameraList();
+            errorCode = wCameraInit(W_COMMON_PIPELINE_MAIN);
+        }
+        if ((errorCode == 0) && (gParameters.mode != W_BENCHMARK_MODE_VIDEO_ENCODE)) {
+            errorCode = wImageProcessingInit(W_COMMON_PIPELINE_MAIN);
+            if (errorCode == 0) {
+                const char *name = gParameters.motionDetectorName.c_str();
+                errorCode = wImageProcessingDetectorSet(W_COMMON_PIPELINE_MAIN,
+                                                        wImageProcessingDetectorGet(name));
+            }
+        }
+        if ((errorCode == 0) && (gParameters.mode != W_BENCHMARK_MODE_IMAGE_PROCESSING)) {
+            // Make sure the output directory exists
+            system(std::string("mkdir -p " + gParameters.outputDirectory).c_str());
+            errorCode = wVideoEncodeInit(W_COMMON_PIPELINE_MAIN,
+                                         gParameters.outputDirectory,
+                                         gParameters.outputFileName,
+                                         &gParameters.videoEncodeCodecCfg);
+        }
+
+        if (errorCode == 0) {
+            switch (gParameters.mode) {
+                case W_BENCHMARK_MODE_IMAGE_PROCESSING:
+                    errorCode = wImageProcessingStart(W_COMMON_PIPELINE_MAIN,
+                                                      imageProcessingSink);
+                    break;
+                case W_BENCHMARK_MODE_VIDEO_ENCODE:
+                    errorCode = wCameraStart(W_COMMON_PIPELINE_MAIN,
+                                             wVideoEncodeFramePush);
+                    break;
+                default:
+                    errorCode = wVideoEncodeStart(W_COMMON_PIPELINE_MAIN);
+                    break;
+            }
+        }
+
+        if (errorCode == 0) {
+            wUtilThreadPlacementReport();
+            W_LOG_INFO("feeding %d frame(s), press CTRL-C to stop.",
+                       gParameters.frameCount);
+            while (!gCamera->feedDone && wUtilKeepGoing()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            // Let the pipeline give back what it has
+            wUtilTimeoutStart_t drainStart = wUtilTimeoutStart();
+            while ((frameHeldCount(gCamera) > 0) && wUtilKeepGoing() &&
+                   !wUtilTimeoutExpired(drainStart,
+                                        std::chrono::seconds(W_BENCHMARK_DRAIN_TIMEOUT_SECONDS))) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            wCameraStop(W_COMMON_PIPELINE_MAIN);
+            resultsPrint(gCamera);
+        } else {
+            W_LOG_ERROR("initialisation failure (%d)!", errorCode);
+        }
+
+        wVideoEncodeDeinit(W_COMMON_PIPELINE_MAIN);
+        wImageProcessingDeinit(W_COMMON_PIPELINE_MAIN);
+        wCameraDeinit(W_COMMON_PIPELINE_MAIN);
+        wMsgDeinit();
+        wLogWriterStop();
+    } else {
+        commandLinePrintHelp(&gParameters);
+    }
+
+    return errorCode;
+}
+
+// End of file
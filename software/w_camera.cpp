@@ -33,6 +33,10 @@
  * information, warning and errors from libcamera, but not pure debug.
  */
 
+// The CPP stuff.
+#include <memory>
+#include <atomic>
+
 // The Linux/Posix stuff.
 #include <sys/mman.h>
 #include <fcntl.h>
@@ -46,6 +50,8 @@
 #include <w_log.h>
 #include <w_msg.h>
 #include <w_image_processing.h>
+#include <w_video_encode.h>
+#include <w_stats.h>
 
 // Us.
 #include <w_camera.h>
@@ -59,18 +65,83 @@
 # define W_CAMERA_STREAM_ROLE libcamera::StreamRole::VideoRecording
 #endif
 
+#ifndef W_CAMERA_ANALYSIS_STREAM_ROLE
+// The libcamera StreamRole to use as a basis for the analysis
+// stream; on a Pi a second, smaller, YUV stream is delivered from
+// the low-resolution output of the ISP.
+# define W_CAMERA_ANALYSIS_STREAM_ROLE libcamera::StreamRole::Viewfinder
+#endif
+
+#ifndef W_CAMERA_PLANE_COUNT
+// The number of planes in a frame buffer: three for YUV420 (Y, U and V).
+# define W_CAMERA_PLANE_COUNT 3
+#endif
+
+#ifndef W_CAMERA_BUFFER_COUNT_MIN
+// The fewest frame buffers worth having: one for the camera to
+// fill while a consumer holds the other.
+# define W_CAMERA_BUFFER_COUNT_MIN 2
+#endif
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
 
-/** Context needed by the camera stuff here.
+/** The offset and length of a plane within a frame buffer.
  */
 typedef struct {
+    unsigned int offset;
+    unsigned int length;
+} wCameraPlane_t;
+
+/** The analysis stream buffer that goes with a video frame buffer,
+ * memory-mapped in the same way.
+ */
+typedef struct {
+    uint8_t *data; // The memory-mapped buffer, nullptr if not mapped (or no analysis stream)
+    unsigned int length; // The length of the whole mapping
+    wCameraPlane_t plane[W_CAMERA_PLANE_COUNT];
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+    bool valid; // True if the buffer was filled along with the video frame buffer
+} wCameraFrameAnalysis_t;
+
+/** A frame buffer, memory-mapped once in wCameraInit() and unmapped
+ * in cleanUp(), and the request it is attached to; there is one of
+ * these per Request, the index of the entry in wCameraContext_t.frames
+ * being encoded into the cookie of the FrameBuffer(s) of the Request.
+ * Other than refCount, nothing here changes between wCameraInit()
+ * and cleanUp(), hence a frame may be found and released from any
+ * thread without a lock.
+ */
+typedef struct {
+    libcamera::Request *request;
+    uint8_t *data; // The memory-mapped buffer, nullptr if not mapped
+    unsigned int length; // The length of the whole mapping
+    wCameraPlane_t plane[W_CAMERA_PLANE_COUNT];
+    wCameraFrameAnalysis_t analysis;
+    std::atomic<unsigned int> refCount; // Non-zero if held by a consumer; when this drops to zero the request is requeued
+} wCameraFrame_t;
+
+/** Context needed by the camera stuff here, one per pipeline.
+ */
+typedef struct {
+    unsigned int pipeline; // The index of this context in gContext[], also the cookie of each Request
     std::shared_ptr<libcamera::Camera> camera;
-    std::unique_ptr<libcamera::CameraManager> cameraManager;
     std::unique_ptr<libcamera::CameraConfiguration> cameraCfg;
     libcamera::FrameBufferAllocator *allocator;
     std::vector<std::unique_ptr<libcamera::Request>> requests;
+    libcamera::Stream *analysisStream; // nullptr if there is no analysis stream
+    std::unique_ptr<wCameraFrame_t[]> frames; // The frame pool, one per Request
+    unsigned int frameNum; // The number of entries in frames
+    unsigned int frameBytes; // The memory of the frame pool
+    std::atomic<unsigned int> frameInUse; // The number of frames held by consumers
+    std::atomic<unsigned int> frameInUseMax;
+    std::atomic<uint64_t> frameStarvedCount; // From gaps in the frame sequence numbers
+    bool sequenceValid; // True once sequence has been set
+    unsigned int sequence; // The sequence number of the last completed request
+    std::atomic<bool> running; // True between camera start() and stop()
     libcamera::ControlList cameraControls;
     wCommonFrameFunction_t *outputCallback;
     uint64_t frameCount;
@@ -80,8 +151,15 @@ typedef struct {
  * VARIABLES
  * -------------------------------------------------------------- */
 
-// Our context.
-static wCameraContext_t *gContext = nullptr;
+// Our contexts, one per pipeline.
+static wCameraContext_t *gContext[W_COMMON_PIPELINE_MAX_NUM] = {};
+
+// The camera manager, of which libcamera allows only one per process,
+// shared by all of the contexts.
+static std::unique_ptr<libcamera::CameraManager> gCameraManager;
+
+// The number of contexts using gCameraManager.
+static unsigned int gCameraManagerUseCount = 0;
 
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS: MISC
@@ -91,18 +169,22 @@ static wCameraContext_t *gContext = nullptr;
 // the width, height and stride of the stream  So as to avoid having
 // to search for this, we encode it into the cookie that is associated
 // with a FrameBuffer when it is created, then the requestCompleted()
-// callback can grab it.  See cookieDecode() for the reverse.
+// callback can grab it; the index of the FrameBuffer's entry in
+// the frames of its context, where its memory mapping is kept, is
+// encoded also.
+// See cookieDecode() for the reverse.
 static uint64_t cookieEncode(unsigned int width, unsigned int height,
-                             unsigned int stride)
+                             unsigned int stride, unsigned int index)
 {
     return ((uint64_t) width << 48) | ((uint64_t) (height & UINT16_MAX) << 32) |
-            (stride & UINT32_MAX);
+            ((uint64_t) (stride & UINT16_MAX) << 16) | (index & UINT16_MAX);
 }
 
-// Decode width, height and stride from a cookie; any pointer parameters
-// may be NULL.
+// Decode width, height, stride and index from a cookie; any pointer
+// parameters may be NULL.
 static void cookieDecode(uint64_t cookie, unsigned int *width,
-                         unsigned int *height, unsigned int *stride)
+                         unsigned int *height, unsigned int *stride,
+                         unsigned int *index)
 {
     if (width != nullptr) {
         *width = (cookie >> 48) & UINT16_MAX;
@@ -111,10 +193,74 @@ static void cookieDecode(uint64_t cookie, unsigned int *width,
         *height = (cookie >> 32) & UINT16_MAX;
     }
     if (stride != nullptr) {
-        *stride = cookie & UINT32_MAX;
+        *stride = (cookie >> 16) & UINT16_MAX;
+    }
+    if (index != nullptr) {
+        *index = cookie & UINT16_MAX;
     }
 }
 
+// Memory-map a frame buffer, populating data and length with the
+// mapping and the offset/length of each plane into plane[], which
+// must have W_CAMERA_PLANE_COUNT entries.
+//
+// From this post: https://forums.raspberrypi.com/viewtopic.php?t=347925,
+// need to create a memory map into the frame buffer for OpenCV or FFmpeg
+// to be able to access it.  Each plane (Y, U and V in our case) has a
+// file descriptor, but in fact they are all the same; the file
+// descriptor is for the *entire* DMA buffer, which includes all of the
+// planes at different offsets; there are three planes: Y, U and V.
+// The set of buffers never changes, hence we map each one just once
+// rather than paying for an mmap()/munmap() on every frame.
+static int frameMap(const libcamera::FrameBuffer *buffer, uint8_t **data,
+                    unsigned int *length, wCameraPlane_t *plane)
+{
+    int errorCode = -EINVAL;
+    const std::vector<libcamera::FrameBuffer::Plane> &planes = buffer->planes();
+
+    if (planes.size() == W_CAMERA_PLANE_COUNT) {
+        errorCode = 0;
+        unsigned int mappingLength = 0;
+        for (unsigned int x = 0; (x < W_CAMERA_PLANE_COUNT) && (errorCode == 0); x++) {
+            if (planes[x].fd.get() == planes[0].fd.get()) {
+                plane[x].offset = planes[x].offset;
+                plane[x].length = planes[x].length;
+                if (planes[x].offset + planes[x].length > mappingLength) {
+                    mappingLength = planes[x].offset + planes[x].length;
+                }
+                if ((x > 0) && (planes[x].offset != planes[x - 1].offset + planes[x - 1].length)) {
+                    // Image processing and video encode assume that the
+                    // planes follow on from each other
+                    W_LOG_WARN("plane %d of frame buffer is not contiguous with"
+                               " plane %d (offset %d, previous plane ends at %d).",
+                               x, x - 1, planes[x].offset,
+                               planes[x - 1].offset + planes[x - 1].length);
+                }
+            } else {
+                errorCode = -EINVAL;
+                W_LOG_ERROR("planes of frame buffer are not in the same DMA buffer!");
+            }
+        }
+        if (errorCode == 0) {
+            uint8_t *mapping = static_cast<uint8_t *> (mmap(nullptr, mappingLength,
+                                                            PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                            planes[0].fd.get(), 0));
+            if (mapping != MAP_FAILED) {
+                *data = mapping;
+                *length = mappingLength;
+            } else {
+                errorCode = -errno;
+                W_LOG_ERROR("mmap() of frame buffer returned error %d!", errorCode);
+            }
+        }
+    } else {
+        W_LOG_ERROR("expected %d planes in frame buffer but found %d!",
+                    W_CAMERA_PLANE_COUNT, (int) planes.size());
+    }
+
+    return errorCode;
+}
+
 // Configure a stream from the camera.
 static bool cameraStreamConfigure(libcamera::StreamConfiguration &streamCfg,
                                   std::string pixelFormatStr,
@@ -195,32 +341,127 @@ static bool cameraStreamConfigure(libcamera::StreamConfiguration &streamCfg,
     return formatFound && sizeFound;
 }
 
-// Close stuff and release memory.
-static void cleanUp()
+// Find the frame, currently held by a consumer, that has the given
+// data pointer, in the frame pool of whichever pipeline it belongs
+// to, and the context of that pipeline; no lock is required since
+// the data pointers of the frame pools do not change while the
+// cameras are initialised.
+static wCameraFrame_t *frameGet(uint8_t *data, wCameraContext_t **context)
 {
-    if (gContext) {
-        if (gContext->camera) {
-            gContext->camera->stop();
+    wCameraFrame_t *frame = nullptr;
+
+    for (unsigned int y = 0; data && (y < W_UTIL_ARRAY_COUNT(gContext)) &&
+                             (frame == nullptr); y++) {
+        wCameraContext_t *candidate = gContext[y];
+        for (unsigned int x = 0; candidate && (x < candidate->frameNum) &&
+                                 (frame == nullptr); x++) {
+            if ((candidate->frames[x].data == data) &&
+                (candidate->frames[x].refCount > 0)) {
+                frame = &(candidate->frames[x]);
+                *context = candidate;
+            }
         }
+    }
+
+    return frame;
+}
+
+// Note that a frame has been handed to a consumer, i.e. its
+// reference count has gone from zero to one.
+static void frameTaken(wCameraContext_t *context)
+{
+    unsigned int inUse = ++context->frameInUse;
+    unsigned int inUseMax = context->frameInUseMax;
+    while ((inUse > inUseMax) &&
+           !context->frameInUseMax.compare_exchange_weak(inUseMax, inUse)) {}
+}
+
+// Give a frame, the reference count of which has dropped to zero,
+// back to its camera: if the camera is running, requeue its request.
+static void frameReturn(wCameraContext_t *context, wCameraFrame_t *frame)
+{
+    context->frameInUse--;
+    if (context->running) {
+        frame->request->reuse(libcamera::Request::ReuseBuffers);
+        context->camera->queueRequest(frame->request);
+    }
+}
+
+// Work out how many frame buffers to ask libcamera for, given the
+// size of a frame buffer, so that the pool stays within
+// framePoolMaxBytes.
+static unsigned int framePoolCount(unsigned int frameBytes,
+                                   unsigned int framePoolMaxBytes)
+{
+    unsigned int count = W_CAMERA_BUFFER_COUNT;
+
+    if ((frameBytes > 0) && (count * frameBytes > framePoolMaxBytes)) {
+        count = framePoolMaxBytes / frameBytes;
+        if (count < W_CAMERA_BUFFER_COUNT_MIN) {
+            count = W_CAMERA_BUFFER_COUNT_MIN;
+        }
+        W_LOG_WARN("%d frame buffer(s) of %d byte(s) would exceed the frame pool"
+                   " limit of %d byte(s), asking for %d.", W_CAMERA_BUFFER_COUNT,
+                   frameBytes, framePoolMaxBytes, count);
+    }
 
-        if (gContext->cameraCfg && gContext->allocator) {
-            for (auto cfg: *(gContext->cameraCfg)) {
-                gContext->allocator->free(cfg.stream());
+    return count;
+}
+
+// Close the stuff of a pipeline and release its memory, stopping
+// the camera manager if no other pipeline is using it.
+static void cleanUp(unsigned int pipeline)
+{
+    wCameraContext_t *context = gContext[pipeline];
+
+    if (context) {
+        if (context->camera) {
+            context->running = false;
+            context->camera->stop();
+        }
+
+        // Unmap the frame buffers, noting any that a consumer
+        // failed to release
+        for (unsigned int x = 0; x < context->frameNum; x++) {
+            wCameraFrame_t *frame = &(context->frames[x]);
+            unsigned int refCount = frame->refCount.exchange(0);
+            if (refCount > 0) {
+                W_LOG_WARN("frame buffer still had %d reference(s) at clean-up.",
+                           refCount);
+                frameReturn(context, frame);
+            }
+            if (frame->data) {
+                munmap(frame->data, frame->length);
+                frame->data = nullptr;
+            }
+            if (frame->analysis.data) {
+                munmap(frame->analysis.data, frame->analysis.length);
+                frame->analysis.data = nullptr;
             }
-            delete gContext->allocator;
         }
 
-        if (gContext->camera) {
-            gContext->camera->release();
-            gContext->camera.reset();
+        if (context->cameraCfg && context->allocator) {
+            for (auto cfg: *(context->cameraCfg)) {
+                context->allocator->free(cfg.stream());
+            }
+            delete context->allocator;
         }
 
-        if (gContext->cameraManager) {
-            gContext->cameraManager->stop();
+        if (context->camera) {
+            context->camera->release();
+            context->camera.reset();
         }
 
-        delete gContext;
-        gContext = nullptr;
+        delete context;
+        gContext[pipeline] = nullptr;
+
+        if (gCameraManagerUseCount > 0) {
+            gCameraManagerUseCount--;
+        }
+        if (gCameraManager && (gCameraManagerUseCount == 0)) {
+            gCameraManager->stop();
+            gCameraManager.reset();
+        }
     }
 }
 
@@ -228,63 +469,98 @@ static void cleanUp()
  * STATIC FUNCTIONS: LIBCAMERA CALLBACK
  * -------------------------------------------------------------- */
 
-// Handle a requestCompleted event from a camera.
+// Handle a requestCompleted event from a camera.  The memory-mapped
+// frame buffer (mapped once, in wCameraInit()) is passed to
+// outputCallback without being copied and the request is only
+// requeued once the last reference to that frame has been given up
+// with wCameraFrameRelease().  If there is an analysis stream its
+// buffer travels with the video frame buffer, obtainable through
+// wCameraFrameAnalysisGet().
 static void requestCompleted(libcamera::Request *request)
 {
-    if (request->status() != libcamera::Request::RequestCancelled) {
-       const std::map<const libcamera::Stream *, libcamera::FrameBuffer *> &buffers = request->buffers();
+    // The cookie of the request is the pipeline it belongs to
+    wCameraContext_t *context = nullptr;
+    if (request->cookie() < W_UTIL_ARRAY_COUNT(gContext)) {
+        context = gContext[request->cookie()];
+    }
+
+    if (context && (request->status() != libcamera::Request::RequestCancelled)) {
+        const std::map<const libcamera::Stream *, libcamera::FrameBuffer *> &buffers = request->buffers();
+        libcamera::FrameBuffer *videoBuffer = nullptr;
+        bool frameHeld = false;
 
-       for (auto bufferPair : buffers) {
+        // The order of the buffers in the map is not defined, so
+        // find the video frame buffer first, noting on the way
+        // whether the analysis stream buffer was filled
+        for (auto bufferPair : buffers) {
             libcamera::FrameBuffer *buffer = bufferPair.second;
-            const libcamera::FrameMetadata &metadata = buffer->metadata();
+            if (bufferPair.first == context->analysisStream) {
+                unsigned int index;
+                cookieDecode(buffer->cookie(), nullptr, nullptr, nullptr, &index);
+                if (index < context->frameNum) {
+                    context->frames[index].analysis.valid = (buffer->metadata().status ==
+                                                              libcamera::FrameMetadata::FrameSuccess);
+                }
+            } else {
+                videoBuffer = buffer;
+            }
+        }
+
+        if (videoBuffer) {
+            const libcamera::FrameMetadata &metadata = videoBuffer->metadata();
+
+            // A gap in the sequence numbers means that the camera
+            // had frames it could not deliver, most likely because
+            // every buffer of the frame pool was held by a consumer
+            if (context->sequenceValid &&
+                (metadata.sequence > context->sequence + 1)) {
+                context->frameStarvedCount += metadata.sequence - context->sequence - 1;
+            }
+            context->sequence = metadata.sequence;
+            context->sequenceValid = true;
+
+            // The sensor timestamp is in nanoseconds on CLOCK_MONOTONIC
+            wStatsTimestamp(context->pipeline, W_STATS_POINT_SENSOR,
+                            metadata.sequence, (int64_t) metadata.timestamp);
+            wStatsTimestamp(context->pipeline, W_STATS_POINT_REQUEST_COMPLETED,
+                            metadata.sequence);
 
             // Grab the stream's width, height and stride, all of which
             // is encoded in the buffer's cookie when we associated it
-            // with the stream
+            // with the stream, along with the index of its mapping
             unsigned int width;
             unsigned int height;
             unsigned int stride;
-            cookieDecode(buffer->cookie(), &width, &height, &stride);
-
-            // From this post: https://forums.raspberrypi.com/viewtopic.php?t=347925,
-            // need to create a memory map into the frame buffer for OpenCV or FFmpeg
-            // to be able to access it.  Each plane (Y, U and V in our case) has a
-            // file descriptor, but in fact they are all the same; the file
-            // descriptor is for the *entire* DMA buffer, which includes all of the
-            // planes at different offsets; there are three planes: Y, U and V.
-            unsigned int dmaBufferLength = buffer->planes()[0].length +
-                                           buffer->planes()[1].length +
-                                           buffer->planes()[2].length;
-            uint8_t *dmaBuffer = static_cast<uint8_t *> (mmap(nullptr, dmaBufferLength,
-                                                              PROT_READ | PROT_WRITE, MAP_SHARED,
-                                                              buffer->planes()[0].fd.get(), 0));
-
-            if (dmaBuffer != MAP_FAILED) {
-                if (gContext->outputCallback) {
-                    // Pass a copy of the camera frame to the image processing callback
-                    uint8_t *data = (uint8_t *) malloc(dmaBufferLength);
-                    if (data) {
-                        memcpy(data, dmaBuffer, dmaBufferLength);
-                        gContext->outputCallback(data, dmaBufferLength,
-                                                 metadata.sequence,
-                                                 width, height, stride);
-                    } else {
-                        W_LOG_ERROR("unable to allocate %d byte(s) for image buffer,"
-                                    " a frame has been lost.", dmaBufferLength);
-                    }
+            unsigned int index;
+            cookieDecode(videoBuffer->cookie(), &width, &height, &stride, &index);
+
+            if ((index < context->frameNum) &&
+                context->frames[index].data) {
+                wCameraFrame_t *frame = &(context->frames[index]);
+                if (context->outputCallback) {
+                    // Hand the mapped buffer itself, with one reference,
+                    // to the image processing callback; the request is
+                    // requeued in wCameraFrameRelease()
+                    frame->refCount = 1;
+                    frameTaken(context);
+                    frameHeld = true;
+                    context->outputCallback(context->pipeline,
+                                            frame->data, frame->length,
+                                            metadata.sequence,
+                                            width, height, stride);
                 }
-                // Done with the mapping now
-                munmap(dmaBuffer, dmaBufferLength);
             } else {
-                W_LOG_ERROR("mmap() returned error %d, a frame has been lost.",
-                            errno);
+                W_LOG_ERROR("frame buffer %d is not mapped, a frame has been lost.",
+                            index);
             }
 
-            gContext->frameCount++;
+            context->frameCount++;
+        }
 
-            // Re-use the request
+        if (!frameHeld) {
+            // Nothing is holding on to the frame, re-use the request now
             request->reuse(libcamera::Request::ReuseBuffers);
-            gContext->camera->queueRequest(request);
+            context->camera->queueRequest(request);
         }
     }
 }
@@ -293,52 +569,98 @@ static void requestCompleted(libcamera::Request *request)
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
 
-// Initialise the camera.
-int wCameraInit()
+// Initialise a camera.
+int wCameraInit(unsigned int pipeline, unsigned int framePoolMaxBytes)
 {
     int errorCode = 0;
 
-    if (!gContext) {
-        gContext = new wCameraContext_t;
+    if (pipeline >= W_UTIL_ARRAY_COUNT(gContext)) {
+        errorCode = -EINVAL;
+    } else if (!gContext[pipeline]) {
+        wCameraContext_t *context = new wCameraContext_t;
+        gContext[pipeline] = context;
+        context->pipeline = pipeline;
+        context->running = false;
+        context->analysisStream = nullptr;
+        context->frameNum = 0;
+        context->frameBytes = 0;
+        context->frameInUse = 0;
+        context->frameInUseMax = 0;
+        context->frameStarvedCount = 0;
+        context->sequenceValid = false;
+        context->sequence = 0;
         errorCode = -ENXIO;
 
-        // Create and start a camera manager instance
-        gContext->cameraManager = std::make_unique<libcamera::CameraManager>();
-        gContext->cameraManager->start();
+        // Create and start the camera manager instance, unless
+        // another pipeline already has
+        if (!gCameraManager) {
+            gCameraManager = std::make_unique<libcamera::CameraManager>();
+            gCameraManager->start();
+        }
+        gCameraManagerUseCount++;
 
-       // Acquire the first (and probably only) camera
-        auto cameras = gContext->cameraManager->cameras();
-        if (!cameras.empty()) {
+        // Acquire the camera with the same index as the pipeline:
+        // the first (and probably only) one for the main pipeline
+        auto cameras = gCameraManager->cameras();
+        if (pipeline < cameras.size()) {
             errorCode = 0;
-            std::string cameraId = cameras[0]->id();
-            W_LOG_INFO("acquiring camera %s.", cameraId.c_str());
-            std::shared_ptr<libcamera::Camera> camera = gContext->cameraManager->get(cameraId);
-            gContext->camera = camera;
+            std::string cameraId = cameras[pipeline]->id();
+            W_LOG_INFO("acquiring camera %s for pipeline %d.", cameraId.c_str(),
+                       pipeline);
+            std::shared_ptr<libcamera::Camera> camera = gCameraManager->get(cameraId);
+            context->camera = camera;
             camera->acquire();
 
-            // Configure the camera with the stream
-            gContext->cameraCfg = camera->generateConfiguration({W_CAMERA_STREAM_ROLE});
-            cameraStreamConfigure(gContext->cameraCfg->at(0), W_CAMERA_STREAM_FORMAT,
+            // Configure the camera with the video stream and, if
+            // there is one, the analysis stream
+#if W_CAMERA_ANALYSIS_STREAM
+            context->cameraCfg = camera->generateConfiguration({W_CAMERA_STREAM_ROLE,
+                                                                 W_CAMERA_ANALYSIS_STREAM_ROLE});
+            if (!context->cameraCfg) {
+                // Image processing will use the video stream instead
+                W_LOG_WARN("camera cannot provide an analysis stream, continuing without.");
+            }
+#endif
+            if (!context->cameraCfg) {
+                context->cameraCfg = camera->generateConfiguration({W_CAMERA_STREAM_ROLE});
+            }
+            cameraStreamConfigure(context->cameraCfg->at(0), W_CAMERA_STREAM_FORMAT,
                                   W_CAMERA_WIDTH_PIXELS,
                                   W_CAMERA_HEIGHT_PIXELS);
+            if (context->cameraCfg->size() > 1) {
+                cameraStreamConfigure(context->cameraCfg->at(1), W_CAMERA_ANALYSIS_STREAM_FORMAT,
+                                      W_CAMERA_ANALYSIS_WIDTH_PIXELS,
+                                      W_CAMERA_ANALYSIS_HEIGHT_PIXELS);
+            }
+            // Frame buffers are held by the consumers of a frame until
+            // released, so ask for enough of them to cover the pipeline,
+            // within the memory limit for the frame pool: YUV420 is
+            // one and a half bytes per pixel
+            unsigned int frameBytes = 0;
+            for (auto &cfg: *(context->cameraCfg)) {
+                frameBytes += (cfg.size.width * cfg.size.height * 3) / 2;
+            }
+            unsigned int bufferCount = framePoolCount(frameBytes, framePoolMaxBytes);
+            for (auto &cfg: *(context->cameraCfg)) {
+                cfg.bufferCount = bufferCount;
+            }
 
 #if W_CAMERA_ROTATED_180
-            gContext->cameraCfg->orientation = libcamera::Orientation::Rotate180;
+            context->cameraCfg->orientation = libcamera::Orientation::Rotate180;
 #endif
 
             // Validate and apply the configuration
-            if (gContext->cameraCfg->validate() != libcamera::CameraConfiguration::Valid) {
+            if (context->cameraCfg->validate() != libcamera::CameraConfiguration::Valid) {
                 W_LOG_DEBUG("libcamera will adjust those values.");
             }
-            camera->configure(gContext->cameraCfg.get());
+            camera->configure(context->cameraCfg.get());
 
             W_LOG_INFO_START("validated/applied camera configuration: ");
-            for (std::size_t x = 0; x < gContext->cameraCfg->size(); x++) {
+            for (std::size_t x = 0; x < context->cameraCfg->size(); x++) {
                 if (x > 0) {
                     W_LOG_INFO_MORE(", ");
                 }
-                W_LOG_INFO_MORE("%s", gContext->cameraCfg->at(x).toString().c_str());
-                x++;
+                W_LOG_INFO_MORE("%s", context->cameraCfg->at(x).toString().c_str());
             }
             W_LOG_INFO_MORE(".");
             W_LOG_INFO_END;
@@ -352,9 +674,9 @@ int wCameraInit()
                 errorCode = -x;
             }
             if (errorCode == 0) {
-                gContext->allocator = allocator;
-                for (auto cfg = gContext->cameraCfg->begin();
-                     (cfg != gContext->cameraCfg->end()) && (errorCode == 0);
+                context->allocator = allocator;
+                for (auto cfg = context->cameraCfg->begin();
+                     (cfg != context->cameraCfg->end()) && (errorCode == 0);
                      cfg++) {
                     errorCode = allocator->allocate(cfg->stream());
                     if (errorCode >= 0) {
@@ -367,39 +689,96 @@ int wCameraInit()
                     }
                 }
             }
+            if ((errorCode == 0) && (context->cameraCfg->size() > 1)) {
+                // The analysis stream is the second one
+                context->analysisStream = context->cameraCfg->at(1).stream();
+            }
             if (errorCode == 0) {
                 W_LOG_DEBUG("creating requests to the camera using the allocated buffers.");
-                // Create a queue of requests using the allocated buffers
-                for (auto cfg: *gContext->cameraCfg) {
-                    libcamera::Stream *stream = cfg.stream();
-                    const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &buffers = allocator->buffers(stream);
-                    for (unsigned int x = 0; (x < buffers.size()) && (errorCode == 0); x++) {
-                        std::unique_ptr<libcamera::Request> request = camera->createRequest();
-                        if (request) {
-                            const std::unique_ptr<libcamera::FrameBuffer> &buffer = buffers[x];
-                            errorCode = request->addBuffer(stream, buffer.get());
+                // Create a queue of requests using the allocated buffers,
+                // one request per video frame buffer with, attached to the
+                // same request, a buffer for the analysis stream if there
+                // is one, so that the two travel together
+                libcamera::Stream *stream = context->cameraCfg->at(0).stream();
+                libcamera::Stream *analysisStream = context->analysisStream;
+                const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &buffers = allocator->buffers(stream);
+                context->frames.reset(new wCameraFrame_t[buffers.size()]);
+                for (unsigned int x = 0; (x < buffers.size()) && (errorCode == 0); x++) {
+                    // The cookie of the request is the pipeline, so that
+                    // requestCompleted() can find the context
+                    std::unique_ptr<libcamera::Request> request = camera->createRequest(pipeline);
+                    if (request) {
+                        const std::unique_ptr<libcamera::FrameBuffer> &buffer = buffers[x];
+                        errorCode = request->addBuffer(stream, buffer.get());
+                        if (errorCode == 0) {
+                            // Encode the width, height and stride into the cookie of
+                            // the FrameBuffer as we will need that information later
+                            // when converting the FrameBuffer to a form that OpenCV
+                            // and FFmpeg understand, plus the index of the entry
+                            // in the frame pool where we keep its memory mapping
+                            unsigned int index = context->frameNum;
+                            buffer->setCookie(cookieEncode(stream->configuration().size.width,
+                                                           stream->configuration().size.height,
+                                                           stream->configuration().stride,
+                                                           index));
+                            wCameraFrame_t *mapped = &(context->frames[index]);
+                            mapped->request = request.get();
+                            mapped->data = nullptr;
+                            mapped->length = 0;
+                            mapped->analysis = {};
+                            mapped->refCount = 0;
+                            context->frameNum++;
+                            // Map the frame buffer now, once, for the duration
+                            errorCode = frameMap(buffer.get(), &(mapped->data),
+                                                 &(mapped->length), mapped->plane);
                             if (errorCode == 0) {
-                                // Encode the width, height and stride into the cookie of
-                                // the FrameBuffer as we will need that information later
-                                // when converting the FrameBuffer to a form that OpenCV
-                                // and FFmpeg understand
-                                buffer->setCookie(cookieEncode(stream->configuration().size.width,
-                                                               stream->configuration().size.height,
-                                                               stream->configuration().stride));
-                                gContext->requests.push_back(std::move(request));
-                            } else {
-                                W_LOG_ERROR("can't attach buffer to camera request (error code %d)!",
-                                             errorCode);
+                                context->frameBytes += mapped->length;
                             }
+                            if ((errorCode == 0) && analysisStream) {
+                                errorCode = -ENOMEM;
+                                const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &analysisBuffers = allocator->buffers(analysisStream);
+                                if (x < analysisBuffers.size()) {
+                                    const std::unique_ptr<libcamera::FrameBuffer> &analysisBuffer = analysisBuffers[x];
+                                    errorCode = request->addBuffer(analysisStream, analysisBuffer.get());
+                                    if (errorCode == 0) {
+                                        wCameraFrameAnalysis_t *analysis = &(mapped->analysis);
+                                        analysis->width = analysisStream->configuration().size.width;
+                                        analysis->height = analysisStream->configuration().size.height;
+                                        analysis->stride = analysisStream->configuration().stride;
+                                        analysisBuffer->setCookie(cookieEncode(analysis->width,
+                                                                               analysis->height,
+                                                                               analysis->stride,
+                                                                               index));
+                                        errorCode = frameMap(analysisBuffer.get(), &(analysis->data),
+                                                             &(analysis->length), analysis->plane);
+                                        if (errorCode == 0) {
+                                            context->frameBytes += analysis->length;
+                                        }
+                                    } else {
+                                        W_LOG_ERROR("can't attach analysis buffer to camera request"
+                                                    " (error code %d)!", errorCode);
+                                    }
+                                } else {
+                                    W_LOG_ERROR("fewer analysis buffers (%d) than video buffers (%d)!",
+                                                (int) analysisBuffers.size(), (int) buffers.size());
+                                }
+                            }
+                            context->requests.push_back(std::move(request));
                         } else {
-                            errorCode = -ENOMEM;
-                            W_LOG_ERROR("unable to create request to camera!");
+                            W_LOG_ERROR("can't attach buffer to camera request (error code %d)!",
+                                         errorCode);
                         }
+                    } else {
+                        errorCode = -ENOMEM;
+                        W_LOG_ERROR("unable to create request to camera!");
                     }
                 }
             }
 
             if (errorCode == 0) {
+                // That's all of the frame memory there will be
+                W_LOG_INFO("frame pool of %d buffer(s), %d kbyte(s).",
+                           context->frameNum, context->frameBytes / 1024);
                 // We have not yet set any of the controls for the camera;
                 // the only one we care about here is the frame rate,
                 // so that the settings above match.  There is a minimum
@@ -408,30 +787,36 @@ int wCameraInit()
                 // the start() method when we start the camera.
                 // Units are microseconds.
                 int64_t frameDurationLimit = 1000000 / W_CAMERA_FRAME_RATE_HERTZ;
-                gContext->cameraControls.set(libcamera::controls::FrameDurationLimits,
+                context->cameraControls.set(libcamera::controls::FrameDurationLimits,
                                              libcamera::Span<const std::int64_t, 2>({frameDurationLimit,
                                                                                      frameDurationLimit}));
             }
         } else {
-            W_LOG_ERROR("no cameras found!");
+            W_LOG_ERROR("found %d camera(s), there is none for pipeline %d!",
+                        (int) cameras.size(), pipeline);
         }
 
         if (errorCode != 0) {
-            cleanUp();
+            cleanUp(pipeline);
         }
     }
 
     return errorCode;
 }
 
-// Start the camera.
-int wCameraStart(wCommonFrameFunction_t *outputCallback)
+// Start a camera.
+int wCameraStart(unsigned int pipeline, wCommonFrameFunction_t *outputCallback)
 {
     int errorCode = -EBADF;
+    wCameraContext_t *context = nullptr;
 
-    if (gContext) {
-        gContext->outputCallback = outputCallback;
-        std::shared_ptr<libcamera::Camera> camera = gContext->camera;
+    if (pipeline < W_UTIL_ARRAY_COUNT(gContext)) {
+        context = gContext[pipeline];
+    }
+
+    if (context) {
+        context->outputCallback = outputCallback;
+        std::shared_ptr<libcamera::Camera> camera = context->camera;
 
         // Attach the requestCompleted() handler
         // function to its events and start the camera;
@@ -439,10 +824,20 @@ int wCameraStart(wCommonFrameFunction_t *outputCallback)
         camera->requestCompleted.connect(requestCompleted);
 
         // Pedal to da metal
-        W_LOG_INFO("starting the camera and queueing requests.");
-        camera->start(&(gContext->cameraControls));
-        for (std::unique_ptr<libcamera::Request> &request: gContext->requests) {
-            camera->queueRequest(request.get());
+        W_LOG_INFO("starting the camera of pipeline %d and queueing requests.",
+                   pipeline);
+        camera->start(&(context->cameraControls));
+        context->sequenceValid = false;
+        context->running = true;
+        // Queue all of the requests, except any whose frame is still
+        // being held by a consumer from a previous start; those will
+        // be queued when the frame is released
+        for (unsigned int x = 0; x < context->frameNum; x++) {
+            wCameraFrame_t *frame = &(context->frames[x]);
+            if (frame->refCount == 0) {
+                frame->request->reuse(libcamera::Request::ReuseBuffers);
+                camera->queueRequest(frame->request);
+            }
         }
         errorCode = 0;
     }
@@ -450,37 +845,148 @@ int wCameraStart(wCommonFrameFunction_t *outputCallback)
     return errorCode;
 }
 
-// Get the current frame count of the camera.
-uint64_t wCameraFrameCountGet()
+// Add a reference to a frame buffer.
+int wCameraFrameAddRef(uint8_t *data)
+{
+    int refCountOrErrorCode = -ENOENT;
+    wCameraContext_t *context = nullptr;
+
+    // The caller holds a reference, hence the count cannot
+    // drop to zero under our feet
+    wCameraFrame_t *frame = frameGet(data, &context);
+    if (frame) {
+        refCountOrErrorCode = ++frame->refCount;
+    }
+
+    return refCountOrErrorCode;
+}
+
+// Release a reference to a frame buffer.
+int wCameraFrameRelease(uint8_t *data)
+{
+    int refCountOrErrorCode = -ENOENT;
+    wCameraContext_t *context = nullptr;
+
+    wCameraFrame_t *frame = frameGet(data, &context);
+    if (frame) {
+        // Only the caller that takes the count to zero returns
+        // the frame, however many are releasing it at once
+        unsigned int refCount = frame->refCount;
+        while ((refCount > 0) &&
+               !frame->refCount.compare_exchange_weak(refCount, refCount - 1)) {}
+        if (refCount > 0) {
+            refCountOrErrorCode = refCount - 1;
+            if (refCountOrErrorCode == 0) {
+                frameReturn(context, frame);
+            }
+        }
+    }
+
+    return refCountOrErrorCode;
+}
+
+// Get the analysis stream version of a frame.
+int wCameraFrameAnalysisGet(uint8_t *data, uint8_t **analysisData,
+                            unsigned int *width, unsigned int *height,
+                            unsigned int *stride)
+{
+    int errorCode = -EINVAL;
+    wCameraContext_t *context = nullptr;
+
+    if (analysisData) {
+        errorCode = -ENOENT;
+        wCameraFrame_t *frame = frameGet(data, &context);
+        if (frame && frame->analysis.data && frame->analysis.valid) {
+            // Only the Y plane is of interest
+            *analysisData = frame->analysis.data + frame->analysis.plane[0].offset;
+            if (width) {
+                *width = frame->analysis.width;
+            }
+            if (height) {
+                *height = frame->analysis.height;
+            }
+            if (stride) {
+                *stride = frame->analysis.stride;
+            }
+            errorCode = 0;
+        }
+    }
+
+    return errorCode;
+}
+
+// Get the state of the frame pool of a camera.
+int wCameraFramePoolGet(unsigned int pipeline, wCameraFramePool_t *pool,
+                        bool resetMax)
+{
+    int errorCode = -EBADF;
+    wCameraContext_t *context = nullptr;
+
+    if (pipeline < W_UTIL_ARRAY_COUNT(gContext)) {
+        context = gContext[pipeline];
+    }
+
+    if (context) {
+        errorCode = -EINVAL;
+        if (pool) {
+            pool->count = context->frameNum;
+            pool->bytes = context->frameBytes;
+            pool->inUse = context->frameInUse;
+            if (resetMax) {
+                pool->inUseMax = context->frameInUseMax.exchange(pool->inUse);
+            } else {
+                pool->inUseMax = context->frameInUseMax;
+            }
+            pool->starvedCount = context->frameStarvedCount;
+            errorCode = 0;
+        }
+    }
+
+    return errorCode;
+}
+
+// Get the current frame count of a camera.
+uint64_t wCameraFrameCountGet(unsigned int pipeline)
 {
     uint64_t frameCount = 0;
+    wCameraContext_t *context = nullptr;
 
-    if (gContext) {
-        frameCount = gContext->frameCount;
+    if (pipeline < W_UTIL_ARRAY_COUNT(gContext)) {
+        context = gContext[pipeline];
+    }
+
+    if (context) {
+        frameCount = context->frameCount;
     }
 
     return frameCount;
 }
 
-// Stop the camera.
-int wCameraStop()
+// Stop a camera.
+int wCameraStop(unsigned int pipeline)
 {
     int errorCode = -EBADF;
+    wCameraContext_t *context = nullptr;
+
+    if (pipeline < W_UTIL_ARRAY_COUNT(gContext)) {
+        context = gContext[pipeline];
+    }
 
-    if (gContext) {
-        W_LOG_INFO("stopping the camera.");
-        gContext->camera->stop();
-        gContext->outputCallback = nullptr;
+    if (context) {
+        W_LOG_INFO("stopping the camera of pipeline %d.", pipeline);
+        context->running = false;
+        context->camera->stop();
+        context->outputCallback = nullptr;
     }
 
     return errorCode;
 }
 
-// Deinitialise the camera.
-void wCameraDeinit()
+// Deinitialise a camera.
+void wCameraDeinit(unsigned int pipeline)
 {
-    if (gContext) {
-        cleanUp();
+    if (pipeline < W_UTIL_ARRAY_COUNT(gContext)) {
+        cleanUp(pipeline);
     }
 }
 
@@ -489,7 +995,7 @@ int wCameraList()
 {
     int errorCode = -EBADF;
 
-    if (!gContext) {
+    if (!gCameraManager) {
         errorCode = 0;
         // Create and start a camera manager instance
         std::unique_ptr<libcamera::CameraManager> cm = std::make_unique<libcamera::CameraManager>();
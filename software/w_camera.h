@@ -18,12 +18,17 @@
 #define _W_CAMERA_H_
 
 // This API is dependent on w_common.h (for wCommonFrameFunction_t,
-// W_COMMON_FRAME_RATE_HERTZ, W_COMMON_WIDTH_PIXELS and W_COMMON_HEIGHT_PIXELS).
+// W_COMMON_FRAME_RATE_HERTZ, W_COMMON_WIDTH_PIXELS and W_COMMON_HEIGHT_PIXELS)
+// and on uint8_t/uint64_t.
+#include <cstdint>
 #include <w_common.h>
 
 /** @file
  * @brief The camera API for the watchdog application; this API is
- * NOT thread-safe.
+ * NOT thread-safe.  There is one camera per pipeline (see
+ * W_COMMON_PIPELINE_MAX_NUM), the camera of pipeline N being the
+ * N'th one that libcamera finds, all of them sharing the one
+ * libcamera camera manager.
  */
 
 /* ----------------------------------------------------------------
@@ -54,58 +59,216 @@
 #define W_CAMERA_AREA_PIXELS (W_CAMERA_WIDTH_PIXELS * \
                               W_CAMERA_HEIGHT_PIXELS)
 
+#ifndef W_CAMERA_ANALYSIS_STREAM
+/** Set this to 1 to have the camera deliver, alongside each video
+ * frame, a second, smaller, copy of it, scaled by the ISP at no
+ * CPU cost, for image processing to perform motion detection on;
+ * the video stream itself then need only be good for encoding.
+ * Only the Y (luma) plane of the analysis stream is used.
+ */
+# define W_CAMERA_ANALYSIS_STREAM 1
+#endif
+
+#ifndef W_CAMERA_ANALYSIS_STREAM_FORMAT
+/** The pixel format for the analysis stream: YUV420 is the only
+ * choice offered by the Pi ISP for its low-resolution output.
+ */
+# define W_CAMERA_ANALYSIS_STREAM_FORMAT W_CAMERA_STREAM_FORMAT
+#endif
+
+#ifndef W_CAMERA_ANALYSIS_WIDTH_PIXELS
+/** Horizontal size of the analysis stream in pixels; should be no
+ * larger than the video stream and of roughly the same aspect ratio.
+ */
+# define W_CAMERA_ANALYSIS_WIDTH_PIXELS 320
+#endif
+
+#ifndef W_CAMERA_ANALYSIS_HEIGHT_PIXELS
+/** Vertical size of the analysis stream in pixels.
+ */
+# define W_CAMERA_ANALYSIS_HEIGHT_PIXELS 180
+#endif
+
 #ifndef W_CAMERA_FRAME_RATE_HERTZ
 /** Frames per second.
  */
 # define W_CAMERA_FRAME_RATE_HERTZ W_COMMON_FRAME_RATE_HERTZ
 #endif
 
+#ifndef W_CAMERA_BUFFER_COUNT
+/** The number of frame buffers to ask libcamera for: these are the
+ * frame pool, memory-mapped once at start of day, which is all of
+ * the frame memory there is.  Since frames are passed down the image
+ * processing and video encode pipeline without being copied, a
+ * buffer is not returned to the camera until the last consumer has
+ * called wCameraFrameRelease() on it, hence this needs to cover the
+ * frames that may be in flight in the pipeline at any one time: one
+ * per image processing pipeline slot, the video encode queue, the
+ * one being encoded and one for the camera to be filling.  The
+ * default is expressed in terms of W_IMAGE_PROCESSING_PIPELINE_SLOT_NUM
+ * and W_VIDEO_ENCODE_MSG_QUEUE_MAX_SIZE, hence where this is used
+ * w_image_processing.h and w_video_encode.h must be included.
+ * libcamera may adjust the number and W_CAMERA_FRAME_POOL_MAX_BYTES
+ * may reduce it.
+ */
+# define W_CAMERA_BUFFER_COUNT (W_IMAGE_PROCESSING_PIPELINE_SLOT_NUM + \
+                                W_VIDEO_ENCODE_MSG_QUEUE_MAX_SIZE + 2)
+#endif
+
+#ifndef W_CAMERA_FRAME_POOL_MAX_BYTES
+/** An upper limit on the memory of the frame pool, video plus
+ * analysis stream buffers, e.g. for the smaller-memory Pis: if
+ * W_CAMERA_BUFFER_COUNT buffers at the configured geometry would
+ * exceed this, fewer are asked for (but never less than two).
+ * This is the default for a single camera; where there is more
+ * than one the caller of wCameraInit() divides it between them.
+ */
+# define W_CAMERA_FRAME_POOL_MAX_BYTES (32 * 1024 * 1024)
+#endif
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
 
+/** The state of the camera frame pool, as returned by
+ * wCameraFramePoolGet().
+ */
+typedef struct {
+    unsigned int count; // The number of frame buffers in the pool
+    unsigned int bytes; // The memory of the pool, video plus analysis stream buffers
+    unsigned int inUse; // The number of frame buffers currently held by consumers
+    unsigned int inUseMax; // The largest inUse has been
+    uint64_t starvedCount; // Frames the camera could not deliver, since it had no buffer to put them in
+} wCameraFramePool_t;
+
 /* ----------------------------------------------------------------
  * FUNCTIONS
  * -------------------------------------------------------------- */
 
-/** Initialise the camera.
+/** Initialise the camera of a pipeline.  If the camera of the
+ * pipeline is already initialised this function will do nothing
+ * and return success.
  *
- * @return zero on success else negative error code.
+ * @param pipeline          the pipeline, from 0 to
+ *                          W_COMMON_PIPELINE_MAX_NUM - 1; the
+ *                          camera with this index is acquired.
+ * @param framePoolMaxBytes the upper limit on the memory of the
+ *                          frame pool of this camera.
+ * @return                  zero on success, -ENXIO if there is no
+ *                          camera for the pipeline, else negative
+ *                          error code.
  */
-int wCameraInit();
+int wCameraInit(unsigned int pipeline,
+                unsigned int framePoolMaxBytes = W_CAMERA_FRAME_POOL_MAX_BYTES);
 
-/** Start the camera; this will cause video frames to be sent
- * to the callback function provided.
+/** Start the camera of a pipeline; this will cause video frames to
+ * be sent to the callback function provided.
  *
+ * @param pipeline        the pipeline.
  * @param outputCallback  the (e.g. image processing) function that
  *                        will be called when a frame is available
  *                        from the camera.  The function should queue
  *                        the image for processing and return as
- *                        quickly as possible.
+ *                        quickly as possible; see
+ *                        wCameraFrameRelease() for how the frame
+ *                        buffer must be handled.
  * @return                zero on success else negative error code.
  */
-int wCameraStart(wCommonFrameFunction_t *outputCallback);
+int wCameraStart(unsigned int pipeline, wCommonFrameFunction_t *outputCallback);
+
+/** Add a reference to a frame buffer that has been passed to the
+ * callback given to wCameraStart(); each call to this function must
+ * be matched by a call to wCameraFrameRelease().  This function is
+ * thread-safe; the frame buffer data pointers of all of the cameras
+ * are distinct, hence there is no need to say which pipeline the
+ * frame came from.
+ *
+ * @param data a pointer to the frame data, as passed to the callback.
+ * @return     the number of references now held on the frame buffer,
+ *             else negative error code.
+ */
+int wCameraFrameAddRef(uint8_t *data);
+
+/** Release a reference to a frame buffer that has been passed to
+ * the callback given to wCameraStart(), or one added with
+ * wCameraFrameAddRef(); when the last reference is released the
+ * buffer is returned to the camera to be filled once more, hence
+ * data must not be accessed after this function has been called.
+ * This function is thread-safe.
+ *
+ * @param data a pointer to the frame data, as passed to the callback.
+ * @return     the number of references remaining on the frame buffer,
+ *             else negative error code.
+ */
+int wCameraFrameRelease(uint8_t *data);
+
+/** Get the analysis stream version of a frame that has been passed
+ * to the callback given to wCameraStart(): this is the same image,
+ * captured at the same instant, but at the (lower) resolution of the
+ * analysis stream.  The analysis data is part of the same frame
+ * buffer as far as references are concerned, i.e. it remains valid
+ * for exactly as long as a reference is held on data.  This function
+ * is thread-safe.
+ *
+ * @param data         a pointer to the frame data, as passed to the
+ *                     callback.
+ * @param analysisData a place to put a pointer to the Y plane of the
+ *                     analysis stream version of the frame; cannot be
+ *                     nullptr.
+ * @param width        a place to put the width of the analysis
+ *                     image in pixels; may be nullptr.
+ * @param height       a place to put the height of the analysis
+ *                     image in pixels; may be nullptr.
+ * @param stride       a place to put the stride of the analysis
+ *                     image; may be nullptr.
+ * @return             zero on success, -ENOENT if there is no
+ *                     analysis version of the frame (e.g. because
+ *                     W_CAMERA_ANALYSIS_STREAM is 0) else negative
+ *                     error code.
+ */
+int wCameraFrameAnalysisGet(uint8_t *data, uint8_t **analysisData,
+                            unsigned int *width = nullptr,
+                            unsigned int *height = nullptr,
+                            unsigned int *stride = nullptr);
 
-/** Get the current frame count of the camera.
+/** Get the state of the frame pool of the camera of a pipeline.
+ * This function is thread-safe.
  *
- * @return  the frame count; zero if the camera is not running.
+ * @param pipeline  the pipeline.
+ * @param pool      a place to put the state of the frame pool;
+ *                  cannot be nullptr.
+ * @param resetMax  if true, inUseMax is reset to the current
+ *                  number in use after being read.
+ * @return          zero on success else negative error code.
  */
-uint64_t wCameraFrameCountGet();
+int wCameraFramePoolGet(unsigned int pipeline, wCameraFramePool_t *pool,
+                        bool resetMax = false);
 
-/** Stop the camera; there is no need to call this, unless you want
- * to call wCameraStart() again to change callback function;
- * wCameraDeinit() will perform all necessary clean-up.
+/** Get the current frame count of the camera of a pipeline.
  *
- * @return zero on success else negative error code.
+ * @param pipeline the pipeline.
+ * @return         the frame count; zero if the camera is not running.
  */
-int wCameraStop();
+uint64_t wCameraFrameCountGet(unsigned int pipeline);
 
-/** Deinitialise the camera.
+/** Stop the camera of a pipeline; there is no need to call this,
+ * unless you want to call wCameraStart() again to change callback
+ * function; wCameraDeinit() will perform all necessary clean-up.
+ *
+ * @param pipeline the pipeline.
+ * @return         zero on success else negative error code.
+ */
+int wCameraStop(unsigned int pipeline);
+
+/** Deinitialise the camera of a pipeline; the camera manager is
+ * stopped when the last camera is deinitialised.
+ *
+ * @param pipeline the pipeline.
  */
-void wCameraDeinit();
+void wCameraDeinit(unsigned int pipeline);
 
 /** List the available cameras and their properties; this should
- * be called while the camera is NOT initialised to print useful
+ * be called while no camera is initialised to print useful
  * information about the available camera hardware.
  *
  * @return the number of cameras found (hopefully at least one)
@@ -25,14 +25,17 @@
 #include <cstring>
 #include <string>
 #include <mutex>
+#include <atomic>
 #include <vector>
-#include <algorithm>  // For std::sort()
+#include <algorithm>  // For std::stable_sort() and std::upper_bound()
 
 // The Linux/Posix stuff.
 #include <unistd.h>
 #include <fcntl.h>   // For the file flags O_RDWR etc.
 #include <time.h>
+#include <limits.h>   // For NAME_MAX
 #include <sys/stat.h> // For chmod()
+#include <sys/inotify.h>
 
 // The cJSON stuff.
 #include <cJSON.h>
@@ -64,47 +67,71 @@
 # define W_CFG_TIME_UNIX_MIN 1736553600
 #endif
 
+#ifndef W_CFG_VERDICT_MAX_AGE_SECONDS
+/** The longest that a verdict from wCfgMotorsOn()/wCfgLightsOn()
+ * is re-used for before it is worked out again, even if the next
+ * switch time is further away, so that a change of daylight saving
+ * time or of the clock is picked up.
+ */
+# define W_CFG_VERDICT_MAX_AGE_SECONDS 60
+#endif
+
+// The number of seconds in a week.
+#define W_CFG_SECONDS_PER_WEEK (7 * 24 * 60 * 60)
+
+// The size of buffer needed to read at least one inotify event.
+#define W_CFG_INOTIFY_BUFFER_SIZE (sizeof(struct inotify_event) + NAME_MAX + 1)
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
 
-/** Structure to contain all of the possible outcomes from parsing
- * the configuration file.
+/** The things that the configuration file can switch off;
+ * values are important, they are used as indexes into arrays.
  */
-typedef struct {
-    bool motorsOff;
-    bool lightsOff;
-} wCfg_t;
+typedef enum {
+    W_CFG_THING_MOTORS = 0,
+    W_CFG_THING_LIGHTS = 1,
+    W_CFG_THING_NUM
+} wCfgThingType_t;
 
-/** A structure to hold a JSON key and where its "off" entry is
- * stored in wCfg_t.
+/** A structure to hold a JSON key that can appear on a day of the
+ * week or in an override for the motors or the lights, and
+ * what it means in terms of the offNotOn state of that thing.
  *
  * Note: everything in here uses "offNotOn" rather than the more
  * conventional "onNotOff" since the motors are by default on;
  * creating a variable left at zero will give it the default state
  * of "on" automatically, "off" is the exceptional state.
  */
-typedef struct {
-    const char *key;
-    bool *offNotOn;
-} wCfgThingOff_t;
-
-/** A structure to hold a JSON key that can appear on a day of the
- * week or in an override for the motors or the lights, and
- * what it means in terms of the offNotOn state of that thing.
- */
 typedef struct {
     const char *key;
     bool offNotOn;
 } wCfgOffOnItem_t;
 
-/** A structure to hold an on or off time.
+/** A structure to hold an on or off time in the weekly schedule.
  */
 typedef struct {
-    time_t time;
+    int secondOfWeek; // Since midnight at the start of Monday, local time.
     bool offNotOn;
 } wCfgSwitchTime_t;
 
+/** Everything the configuration file says about one thing,
+ * compiled so that the state of the thing at any time can be
+ * looked up without going back to the JSON.
+ */
+typedef struct {
+    time_t until[2];                       // Of each gUntilItem, -1 if not present.
+    std::vector<wCfgSwitchTime_t> week;    // Sorted in ascending order of time.
+} wCfgThing_t;
+
+/** Structure to contain all of the possible outcomes from parsing
+ * the configuration file.
+ */
+typedef struct {
+    wCfgThing_t thing[W_CFG_THING_NUM];
+} wCfg_t;
+
 /* ----------------------------------------------------------------
  * VARIABLES
  * -------------------------------------------------------------- */
@@ -115,15 +142,26 @@ static std::mutex gMutex;
 // The configuration file handle.
 static int gCfgFd = -1;
 
+// The path of the configuration file and just its name.
+static std::string gFilePath;
+static std::string gFileName;
+
+// The inotify handle watching the directory that the configuration
+// file is in, -1 if there is none, in which case the configuration
+// file is parsed on every call to wCfgRefresh().
+static int gInotifyFd = -1;
+
 // Storage for the outcome of parsing the configuration file.
-static wCfg_t gCfg = {};
+static wCfg_t gCfg;
 
-// The JSON elements to switch things off: their JSON keys and where
-// the offNotOn values are stored in wCfg_t.
-static const wCfgThingOff_t gThingOff[] = {{.key = "motors",
-                                            .offNotOn = &(gCfg.motorsOff)},
-                                           {.key = "lights",
-                                            .offNotOn = &(gCfg.lightsOff)}};
+// The current verdict for each thing, so that wCfgMotorsOn() and
+// wCfgLightsOn() don't usually need to lock gMutex: the Unix time
+// until which the verdict holds shifted left by one, ORed with 1 if
+// the thing is off; zero means that the verdict must be worked out.
+static std::atomic<int64_t> gVerdict[W_CFG_THING_NUM];
+
+// The JSON keys of the things, in the order of wCfgThingType_t.
+static const char *gThingKey[] = {"motors", "lights"};
 
 // The days of the week, as they would appear in the configuration
 // file; in this array they must be in the order of the days of the
@@ -165,32 +203,25 @@ static int openFile(const char *filePath, int flags = O_RDONLY)
     return fdOrErrorCode;
 }
 
-// Get the Unix local time that represents the start of the
-// current week, i.e. midnight of the previous Sunday.
-static time_t startOfWeekDateTime(time_t timeNow)
+// Get the local time as the number of seconds since midnight at
+// the start of Monday.
+static int secondOfWeek(time_t timeNow)
 {
-    time_t dateTimeOrErrorCode = -EINVAL;
-
-    if (timeNow > W_CFG_TIME_UNIX_MIN) {
-        struct tm t = {};
-        if (localtime_r(&timeNow, &t)) {
-            // Now have the current local time in a tm struct,
-            // work out how far we are from midnight on
-            // Sunday; tm_wday is the zero-based number
-            // of days since midnight on Saturday (i.e.
-            // Sunday is day 0), so we need to shift it
-            time_t time = ((t.tm_wday + 6) % 7) * (60 * 60 * 24);
-            time += t.tm_hour * (60 * 60);
-            time += t.tm_min * 60;
-            time += t.tm_sec;
-            // Subtract that from the time now to get the answer
-            dateTimeOrErrorCode = timeNow - time;
-        } else {
-            dateTimeOrErrorCode = -errno;
-        }
+    int secondOrErrorCode = -EINVAL;
+    struct tm t = {};
+
+    if (localtime_r(&timeNow, &t)) {
+        // tm_wday is the zero-based number of days since midnight
+        // on Saturday (i.e. Sunday is day 0), so we need to shift it
+        secondOrErrorCode = ((t.tm_wday + 6) % 7) * (60 * 60 * 24);
+        secondOrErrorCode += t.tm_hour * (60 * 60);
+        secondOrErrorCode += t.tm_min * 60;
+        secondOrErrorCode += t.tm_sec;
+    } else {
+        secondOrErrorCode = -errno;
     }
 
-    return dateTimeOrErrorCode;
+    return secondOrErrorCode;
 }
 
 // Parse a string in HH:MM:SS format and return the number of
@@ -235,100 +266,91 @@ static time_t parseJsonDateTime(const cJSON *objectJson, const char *dateTimeKey
     return timeOrErrorCode;
 }
 
-
-// Sort switch times in ascending order, used only by the sort()
-// function in parseJson().
+// Sort switch times in ascending order, used by the sort()
+// function in parseJson() and the search in verdictWork().
 static bool compareSwitchTime(wCfgSwitchTime_t switchTimeA,
                               wCfgSwitchTime_t switchTimeB) {
-    return switchTimeA.time < switchTimeB.time;
+    return switchTimeA.secondOfWeek < switchTimeB.secondOfWeek;
 }
 
-// Parse a buffer of JSON into our configuration.
+// Parse a buffer of JSON into a configuration, compiling the
+// weekly schedule into a sorted table of switch times; nothing
+// here depends on the time now, so this need only be done when
+// the configuration file has changed.
 // NOTE: this function will fail if the real time clock
 // has not yet been set to a valid time.
-// IMPORTANT: gMutex should be locked before this is called.
-static int parseJson(const char *buffer, unsigned int sizeBytes)
+static int parseJson(const char *buffer, unsigned int sizeBytes,
+                     wCfg_t *cfg)
 {
     int errorCode = -EINVAL;
     time_t timeNow = 0;
 
-    if (buffer && (time(&timeNow) >= 0) && (timeNow > W_CFG_TIME_UNIX_MIN)) {
+    (void) sizeBytes;
+    if (buffer && cfg && (time(&timeNow) >= 0) && (timeNow > W_CFG_TIME_UNIX_MIN)) {
         errorCode = -EPROTO;
         // Get cJSON to parse the buffer
         cJSON *json = cJSON_Parse(buffer);
         if (json) {
             // If the JSON is parseable, we're good as far as errors are concerned
             errorCode = 0;
-            // Reset gCfg in case it was previously set
-            memset(&gCfg, 0, sizeof(gCfg));
             // Get the first "week" item, if present, in case we need to use it
             const cJSON *weekJson = cJSON_GetObjectItemCaseSensitive(json, "week");
             // Get the first "override" item, if present, in case we need to use it
             const cJSON *overrideJson = cJSON_GetObjectItemCaseSensitive(json, "override");
-            // And work out the Unix time that corresponds to the start of this week
-            time_t startOfWeek = startOfWeekDateTime(timeNow);
-            if (startOfWeek >= 0) {
-                // Check for on/off date/times for the motors and the lights
-                for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gThingOff); x++) {
-                    const wCfgThingOff_t *thing = &(gThingOff[x]);
-                    const cJSON *thingJson = nullptr;
-                    // Check for an "override" for this thing
-                    bool overridden = false;
-                    if (cJSON_IsObject(overrideJson)) {
-                        thingJson = cJSON_GetObjectItemCaseSensitive(overrideJson, thing->key);
-                        // Note: cJSON_GetArraySize() also returns the number of items in an object
-                        if (cJSON_IsObject(thingJson) && (cJSON_GetArraySize(thingJson) > 0)) {
-                            for (unsigned int until = 0; (until < W_UTIL_ARRAY_COUNT(gUntilItem)) &&
-                                                         !overridden; until++) {
-                                // Get the first xxxUntil item for this thing
-                                const wCfgOffOnItem_t *untilItem = &(gUntilItem[until]);
-                                time_t time = parseJsonDateTime(thingJson, untilItem->key);
-                                if (time > timeNow) {
-                                    // There is an "offUntil"/"onUntil" date/time and it is
-                                    // greater than the time now, so set the thing's state
-                                    *(thing->offNotOn) = untilItem->offNotOn;
-                                    overridden = true;
-                                }
-                            }
+            // Compile the on/off date/times for the motors and the lights
+            for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(cfg->thing); x++) {
+                wCfgThing_t *thing = &(cfg->thing[x]);
+                const cJSON *thingJson = nullptr;
+                thing->week.clear();
+                for (unsigned int until = 0; until < W_UTIL_ARRAY_COUNT(thing->until); until++) {
+                    thing->until[until] = -1;
+                }
+                // Check for an "override" for this thing
+                if (cJSON_IsObject(overrideJson)) {
+                    thingJson = cJSON_GetObjectItemCaseSensitive(overrideJson, gThingKey[x]);
+                    // Note: cJSON_GetArraySize() also returns the number of items in an object
+                    if (cJSON_IsObject(thingJson) && (cJSON_GetArraySize(thingJson) > 0)) {
+                        for (unsigned int until = 0; until < W_UTIL_ARRAY_COUNT(gUntilItem); until++) {
+                            // Get the first xxxUntil item for this thing
+                            thing->until[until] = parseJsonDateTime(thingJson,
+                                                                    gUntilItem[until].key);
                         }
                     }
-                    if (!overridden && weekJson) {
-                        // If there was no override for the thing, make a list of the
-                        // times of every off/on entry for the same thing during the week
-                        std::vector<wCfgSwitchTime_t> switchTimeList;
-                        for (unsigned int day = 0; day < W_UTIL_ARRAY_COUNT(gDaysOfWeek); day++) {
-                            // Find the first occurrence of this day in the week
-                            const cJSON *dayJson = cJSON_GetObjectItemCaseSensitive(weekJson,
-                                                                                    gDaysOfWeek[day]);
-                            if (cJSON_IsObject(dayJson)) {
-                                time_t startOfDay = startOfWeek + (day * (24 * 60 * 60));
-                                // Get the first motors/lights item (== thing) within this day
-                                thingJson = cJSON_GetObjectItemCaseSensitive(dayJson, thing->key);
-                                if (cJSON_IsObject(thingJson)) {
-                                    // For each array type we understand ("off"/"on")...
-                                    for (unsigned int arrayType = 0;
-                                         arrayType < W_UTIL_ARRAY_COUNT(gOffOnItem);
-                                         arrayType++) {
-                                        const wCfgOffOnItem_t *offOnItem = &(gOffOnItem[arrayType]);
-                                        // ...look for the first item of that type in the thing and
-                                        // check that it is an array
-                                        const cJSON *arrayJson = cJSON_GetObjectItemCaseSensitive(thingJson,
-                                                                                                  offOnItem->key);
-                                        if (cJSON_IsArray(arrayJson) && (cJSON_GetArraySize(arrayJson) > 0)) {
-                                            int size = cJSON_GetArraySize(arrayJson);
-                                            wCfgSwitchTime_t switchTime = {};
-                                            switchTime.time = -1;
-                                            // Iterate over the items in the array, which should
-                                            // be strings representing times
-                                            for (int index = 0; index < size; index++) {
-                                                const cJSON *timeJson = cJSON_GetArrayItem(arrayJson, index);
-                                                if (cJSON_IsString(timeJson) && (timeJson->valuestring != nullptr)) {
-                                                    switchTime.offNotOn = offOnItem->offNotOn;
-                                                    switchTime.time = parseTime(timeJson->valuestring);
-                                                    if (switchTime.time >= 0) {
-                                                        switchTime.time += startOfDay;
-                                                        switchTimeList.push_back(switchTime);
-                                                    }
+                }
+                if (weekJson) {
+                    // Make a list of the times of every off/on entry for
+                    // the same thing during the week
+                    for (unsigned int day = 0; day < W_UTIL_ARRAY_COUNT(gDaysOfWeek); day++) {
+                        // Find the first occurrence of this day in the week
+                        const cJSON *dayJson = cJSON_GetObjectItemCaseSensitive(weekJson,
+                                                                                gDaysOfWeek[day]);
+                        if (cJSON_IsObject(dayJson)) {
+                            int startOfDay = day * (24 * 60 * 60);
+                            // Get the first motors/lights item (== thing) within this day
+                            thingJson = cJSON_GetObjectItemCaseSensitive(dayJson, gThingKey[x]);
+                            if (cJSON_IsObject(thingJson)) {
+                                // For each array type we understand ("off"/"on")...
+                                for (unsigned int arrayType = 0;
+                                     arrayType < W_UTIL_ARRAY_COUNT(gOffOnItem);
+                                     arrayType++) {
+                                    const wCfgOffOnItem_t *offOnItem = &(gOffOnItem[arrayType]);
+                                    // ...look for the first item of that type in the thing and
+                                    // check that it is an array
+                                    const cJSON *arrayJson = cJSON_GetObjectItemCaseSensitive(thingJson,
+                                                                                              offOnItem->key);
+                                    if (cJSON_IsArray(arrayJson) && (cJSON_GetArraySize(arrayJson) > 0)) {
+                                        int size = cJSON_GetArraySize(arrayJson);
+                                        wCfgSwitchTime_t switchTime = {};
+                                        // Iterate over the items in the array, which should
+                                        // be strings representing times
+                                        for (int index = 0; index < size; index++) {
+                                            const cJSON *timeJson = cJSON_GetArrayItem(arrayJson, index);
+                                            if (cJSON_IsString(timeJson) && (timeJson->valuestring != nullptr)) {
+                                                switchTime.offNotOn = offOnItem->offNotOn;
+                                                switchTime.secondOfWeek = parseTime(timeJson->valuestring);
+                                                if (switchTime.secondOfWeek >= 0) {
+                                                    switchTime.secondOfWeek += startOfDay;
+                                                    thing->week.push_back(switchTime);
                                                 }
                                             }
                                         }
@@ -336,20 +358,12 @@ static int parseJson(const char *buffer, unsigned int sizeBytes)
                                 }
                             }
                         }
-                        // We now have a list of off/on switch times: sort the list in ascending
-                        // order of time
-                        std::sort(switchTimeList.begin(), switchTimeList.end(), compareSwitchTime);
-                        // Walk through the list up to the current time to determine the
-                        // off state now
-                        for (auto switchTime = switchTimeList.begin();
-                             (switchTime != switchTimeList.end()) && (switchTime->time <= timeNow);
-                             switchTime++) {
-                            *(thing->offNotOn) = switchTime->offNotOn;
-                        }
                     }
+                    // We now have a list of off/on switch times: sort the list in
+                    // ascending order of time, keeping the file order for switch
+                    // times that are the same so that the outcome is predictable
+                    std::stable_sort(thing->week.begin(), thing->week.end(), compareSwitchTime);
                 }
-            } else {
-                errorCode = (int) startOfWeek;
             }
 
             // Free memory
@@ -367,9 +381,8 @@ static int parseJson(const char *buffer, unsigned int sizeBytes)
     return errorCode;
 }
 
-// Parse the given configuration file into our configuration.
-// IMPORTANT: gMutex should be locked before this is called.
-static int parseFile(int fd)
+// Parse the given configuration file into a configuration.
+static int parseFile(int fd, wCfg_t *cfg)
 {
     int errorCode = -EBADF;
 
@@ -382,7 +395,8 @@ static int parseFile(int fd)
             // written to the file while we were thinking
             int sizeBytes = errorCode + W_CFG_FILE_EXTRA_SIZE_BYTES;
             errorCode = -ENOMEM;
-            char *buffer = (char *) malloc(sizeBytes);
+            // (plus one for a terminator, cJSON_Parse() needs it)
+            char *buffer = (char *) malloc(sizeBytes + 1);
             if (buffer) {
                 // Move to the start of the file
                 errorCode = lseek(fd, 0, SEEK_SET);
@@ -398,7 +412,8 @@ static int parseFile(int fd)
                     } while ((errorCode > 0) && (sizeBytes >= 0));
                     if (errorCode == 0) {
                         // Parse the JSON that should be in the buffer
-                        errorCode = parseJson(buffer, totalRead);
+                        buffer[totalRead] = 0;
+                        errorCode = parseJson(buffer, totalRead, cfg);
                     } else if (errorCode > 0) {
                         // Still stuff to read, not enough buffer space
                         errorCode = -ENOBUFS;
@@ -425,6 +440,137 @@ static int parseFile(int fd)
     return errorCode;
 }
 
+// Make a configuration the current one and throw away the
+// current verdicts so that they are worked out again.
+// IMPORTANT: gMutex should be locked before this is called.
+static void cfgSet(wCfg_t *cfg)
+{
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gCfg.thing); x++) {
+        gCfg.thing[x].week.swap(cfg->thing[x].week);
+        memcpy(gCfg.thing[x].until, cfg->thing[x].until, sizeof(gCfg.thing[x].until));
+        gVerdict[x] = 0;
+    }
+}
+
+// Work out whether a thing is off or on at the given time, and
+// until when that holds, returning the result in the form stored
+// in gVerdict.
+// IMPORTANT: gMutex should be locked before this is called.
+static int64_t verdictWork(const wCfgThing_t *thing, time_t timeNow)
+{
+    bool offNotOn = false;
+    time_t timeNext = 0;
+    bool overridden = false;
+
+    if (timeNow > W_CFG_TIME_UNIX_MIN) {
+        // An override holds until its date/time
+        for (unsigned int until = 0; (until < W_UTIL_ARRAY_COUNT(gUntilItem)) &&
+                                     !overridden; until++) {
+            if (thing->until[until] > timeNow) {
+                offNotOn = gUntilItem[until].offNotOn;
+                timeNext = thing->until[until];
+                overridden = true;
+            }
+        }
+        if (!overridden) {
+            // The schedule: on at the start of the week, then the switch
+            // time before now applies until the one after now, or until
+            // the start of next week if there isn't one
+            wCfgSwitchTime_t now = {};
+            now.secondOfWeek = secondOfWeek(timeNow);
+            timeNext = timeNow + (W_CFG_SECONDS_PER_WEEK - now.secondOfWeek);
+            if ((now.secondOfWeek >= 0) && !thing->week.empty()) {
+                auto next = std::upper_bound(thing->week.begin(), thing->week.end(),
+                                             now, compareSwitchTime);
+                if (next != thing->week.begin()) {
+                    offNotOn = (next - 1)->offNotOn;
+                }
+                if (next != thing->week.end()) {
+                    timeNext = timeNow + (next->secondOfWeek - now.secondOfWeek);
+                }
+            }
+        }
+        if (timeNext > timeNow + W_CFG_VERDICT_MAX_AGE_SECONDS) {
+            timeNext = timeNow + W_CFG_VERDICT_MAX_AGE_SECONDS;
+        }
+    }
+
+    // If the clock isn't valid, timeNext is left at zero so that
+    // the verdict is worked out again next time
+    return (((int64_t) timeNext) << 1) | (offNotOn ? 1 : 0);
+}
+
+// Get whether a thing is on, working the verdict out again only if
+// it might have changed.
+static bool thingOn(wCfgThingType_t type)
+{
+    time_t timeNow = time(nullptr);
+    int64_t verdict = gVerdict[type];
+    time_t timeNext = (time_t) (verdict >> 1);
+
+    if ((timeNow >= timeNext) ||
+        (timeNow + W_CFG_VERDICT_MAX_AGE_SECONDS < timeNext)) {
+        // Expired, or the clock has gone backwards
+        gMutex.lock();
+
+        verdict = verdictWork(&(gCfg.thing[type]), timeNow);
+        gVerdict[type] = verdict;
+
+        gMutex.unlock();
+    }
+
+    return (verdict & 1) == 0;
+}
+
+// Read whatever inotify events there are, without blocking, and
+// return true if any of them might mean that the configuration
+// file has changed.
+static bool fileChanged(int inotifyFd, const std::string &fileName)
+{
+    bool changed = false;
+    char buffer[W_CFG_INOTIFY_BUFFER_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int length;
+
+    while ((length = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+        const struct inotify_event *event;
+        for (char *pEvent = buffer; pEvent < buffer + length;
+             pEvent += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) pEvent;
+            if ((event->mask & IN_Q_OVERFLOW) ||
+                ((event->len > 0) && (fileName == event->name))) {
+                changed = true;
+            }
+        }
+    }
+
+    return changed;
+}
+
+// Start watching the directory the configuration file is in:
+// a change of the file's contents or an atomic rename of another
+// file onto it are both seen.
+static int watchStart(const std::string &filePath)
+{
+    int fdOrErrorCode = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fdOrErrorCode >= 0) {
+        std::string directory = wUtilDirectoryPathGet(filePath);
+        if (directory.empty()) {
+            directory = std::string(W_UTIL_DIR_SEPARATOR);
+        }
+        if (inotify_add_watch(fdOrErrorCode, directory.c_str(),
+                              IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            int errorCode = -errno;
+            close(fdOrErrorCode);
+            fdOrErrorCode = errorCode;
+        }
+    } else {
+        fdOrErrorCode = -errno;
+    }
+
+    return fdOrErrorCode;
+}
+
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -505,10 +651,22 @@ int wCfgInit(std::string filePath, std::string defaultContents)
 
             if (fd >= 0) {
                 // Parse the file into our configuration
-                errorCode = parseFile(fd);
+                wCfg_t cfg = {};
+                errorCode = parseFile(fd, &cfg);
                 if (errorCode == 0) {
-                    // Remember the file handle
+                    cfgSet(&cfg);
+                    // Remember the file handle and where it is
                     gCfgFd = fd;
+                    gFilePath = filePath;
+                    gFileName = filePath.substr(filePath.find_last_of(W_UTIL_DIR_SEPARATOR) + 1);
+                    // Watch for changes; if that's not possible
+                    // the file is simply parsed on every refresh
+                    gInotifyFd = watchStart(filePath);
+                    if (gInotifyFd < 0) {
+                        W_LOG_WARN("unable to watch cfg file for changes (%d),"
+                                   " it will be re-read on every refresh.",
+                                   gInotifyFd);
+                    }
                 } else {
                     // Clean up on error
                     close(fd);
@@ -529,13 +687,36 @@ int wCfgRefresh()
 {
     int errorCode = -EBADF;
 
-    gMutex.lock();
-
     if (gCfgFd >= 0) {
-        errorCode = parseFile(gCfgFd);
-    }
+        errorCode = 0;
+        // Without an inotify handle all we can do is assume
+        // that the file has changed
+        if ((gInotifyFd < 0) || fileChanged(gInotifyFd, gFileName)) {
+            // The configuration file may have been replaced by
+            // another, e.g. by an atomic rename, so open it afresh;
+            // if it isn't there at the moment carry on with what
+            // we have
+            errorCode = openFile(gFilePath.c_str());
+            if (errorCode >= 0) {
+                int fd = errorCode;
+                wCfg_t cfg = {};
+                // Parse the file outside the lock, only swapping
+                // the outcome in
+                errorCode = parseFile(fd, &cfg);
+                if (errorCode == 0) {
+                    gMutex.lock();
 
-    gMutex.unlock();
+                    cfgSet(&cfg);
+                    close(gCfgFd);
+                    gCfgFd = fd;
+
+                    gMutex.unlock();
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
 
     return errorCode;
 }
@@ -543,29 +724,13 @@ int wCfgRefresh()
 // Get whether the motors should be on or off.
 bool wCfgMotorsOn()
 {
-    bool isOn;
-
-    gMutex.lock();
-
-    isOn = !gCfg.motorsOff;
-
-    gMutex.unlock();
-
-    return isOn;
+    return thingOn(W_CFG_THING_MOTORS);
 }
 
 // Get whether the lights should be on or off.
 bool wCfgLightsOn()
 {
-    bool isOn;
-
-    gMutex.lock();
-
-    isOn = !gCfg.lightsOff;
-
-    gMutex.unlock();
-
-    return isOn;
+    return thingOn(W_CFG_THING_LIGHTS);
 }
 
 // Close the configuration file and free resources.
@@ -574,12 +739,17 @@ void wCfgDeinit()
     gMutex.lock();
 
     if (gCfgFd >= 0) {
+        if (gInotifyFd >= 0) {
+            close(gInotifyFd);
+            gInotifyFd = -1;
+        }
         close(gCfgFd);
         gCfgFd = -1;
         // Set gCfg back to defaults, in case one of
         // the wCfgXxxOn() APIs get called while we
         // are deinitialised
-        memset(&gCfg, 0, sizeof(gCfg));
+        wCfg_t cfg = {};
+        cfgSet(&cfg);
     }
 
     gMutex.unlock();
@@ -205,7 +205,12 @@ int wCfgInit(std::string filePath,
 
 /** Refresh our understanding of the configuration file, in case
  * something (e.g. a web interface or other controlling entity)
- * has changed its contents.
+ * has changed its contents.  The directory the file is in is
+ * watched with inotify, so this is cheap: the file is only read
+ * and parsed again if it has been written to or something has
+ * been renamed onto it (which is how the file should be replaced,
+ * so that it is never seen half-written).  If the new contents
+ * can't be parsed the previous configuration is kept.
  *
  * @return zero on success, else negative error code.
  */
@@ -214,8 +219,11 @@ int wCfgRefresh();
 /** Get whether the configuration file says that the motors
  * should currently be on or off.  If there is no configuration
  * file entry of this nature, or wCfgOpen()/wCfgCreate() have
- * not been called, this will return true.  Call wCfgRefresh()
- * first to get an up-to-date verdict.
+ * not been called, this will return true.  The weekly schedule is
+ * compiled when the configuration file is parsed and the verdict
+ * is only worked out again when it might have changed, so this
+ * is cheap enough to call from anywhere; call wCfgRefresh() to
+ * pick up changes to the configuration file.
  *
  * @return true if the motors should be on, else false.
  */
@@ -224,8 +232,11 @@ bool wCfgMotorsOn();
 /** Get whether the configuration file says that the lights
  * should currently be on or off.  If there is no configuration
  * file entry of this nature, or wCfgOpen()/wCfgCreate() have
- * not been called, this will return true.  Call wCfgRefresh()
- * first to get an up-to-date verdict.
+ * not been called, this will return true.  The weekly schedule is
+ * compiled when the configuration file is parsed and the verdict
+ * is only worked out again when it might have changed, so this
+ * is cheap enough to call from anywhere; call wCfgRefresh() to
+ * pick up changes to the configuration file.
  *
  * @return true if the lights should be on, else false.
  */
@@ -27,6 +27,11 @@
 #include <w_log.h>
 #include <w_hls.h>
 #include <w_cfg.h>
+#include <w_video_encode.h>
+#include <w_image_processing.h>
+#include <w_http.h>
+#include <w_record.h>
+#include <w_motor.h>
 
 // Us.
 #include <w_command_line.h>
@@ -107,6 +112,40 @@ static int getInteger(std::string str, int *value)
     return errorCode;
 }
 
+// Get a rectangle, "x,y,width,height", from a command-line parameter.
+static int getRect(std::string str, cv::Rect *rect)
+{
+    int errorCode = -EINVAL;
+    int value[4];
+    size_t start = 0;
+    unsigned int count = 0;
+
+    if (rect) {
+        errorCode = 0;
+        while ((count < W_UTIL_ARRAY_COUNT(value)) && (errorCode == 0)) {
+            size_t end = str.find(',', start);
+            if ((end == std::string::npos) && (count < W_UTIL_ARRAY_COUNT(value) - 1)) {
+                errorCode = -EINVAL;
+            } else {
+                errorCode = getPositiveInteger(str.substr(start, end - start));
+                if (errorCode >= 0) {
+                    value[count] = errorCode;
+                    errorCode = 0;
+                    count++;
+                    start = end + 1;
+                }
+            }
+        }
+        if ((errorCode == 0) && (value[2] > 0) && (value[3] > 0)) {
+            *rect = cv::Rect(value[0], value[1], value[2], value[3]);
+        } else {
+            errorCode = -EINVAL;
+        }
+    }
+
+    return errorCode;
+}
+
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -125,6 +164,13 @@ int wCommandLineParse(int argc, char *argv[],
         parameters->outputDirectory = std::string(W_HLS_OUTPUT_DIRECTORY_DEFAULT);
         parameters->outputFileName = std::string(W_HLS_FILE_NAME_ROOT_DEFAULT);
         parameters->cfgFilePath = std::string(W_CFG_FILE_PATH_DEFAULT);
+        parameters->motorCalibrationFilePath = std::string(W_MOTOR_CALIBRATION_FILE_PATH_DEFAULT);
+        parameters->motionDetectorName = std::string(W_IMAGE_PROCESSING_DETECTOR_NAME_DEFAULT);
+        parameters->videoEncodeCodecCfg.name = std::string(W_VIDEO_ENCODE_CODEC_NAME_DEFAULT);
+        parameters->videoEncodeCodecCfg.crf = -1;
+        parameters->hlsMode = W_HLS_MODE_DEFAULT;
+        parameters->httpPort = W_HTTP_PORT_DEFAULT;
+        parameters->pipelineNum = 1;
         if ((argc > 0) && (argv)) {
             // Find the program name in the first argument
             parameters->programName = getFileName(argv[x]);
@@ -173,6 +219,39 @@ int wCommandLineParse(int argc, char *argv[],
                             errorCode = 0;
                         }
                     }
+                // Test for motion detector option
+                } else if (std::string(argv[x]) == "-md") {
+                    x++;
+                    if ((x < argc) && wImageProcessingDetectorGet(argv[x])) {
+                        errorCode = 0;
+                        parameters->motionDetectorName = std::string(argv[x]);
+                    }
+                // Test for motion detection pyramid levels option
+                } else if (std::string(argv[x]) == "-mp") {
+                    x++;
+                    if (x < argc) {
+                        errorCode = getPositiveInteger(std::string(argv[x]));
+                        if ((errorCode >= 0) &&
+                            (errorCode <= W_IMAGE_PROCESSING_PYRAMID_LEVELS_MAX)) {
+                            parameters->motionPyramidLevels = errorCode;
+                            errorCode = 0;
+                        } else {
+                            errorCode = -EINVAL;
+                        }
+                    }
+                // Test for motion detection include/exclude region options
+                } else if ((std::string(argv[x]) == "-mi") ||
+                           (std::string(argv[x]) == "-me")) {
+                    wImageProcessingRegion_t region = {};
+                    region.exclude = (std::string(argv[x]) == "-me");
+                    x++;
+                    if ((x < argc) &&
+                        (parameters->motionRegions.size() < W_IMAGE_PROCESSING_REGION_MAX_NUM)) {
+                        errorCode = getRect(std::string(argv[x]), &(region.rectFrame));
+                        if (errorCode == 0) {
+                            parameters->motionRegions.push_back(region);
+                        }
+                    }
                 // Test for vertical rest option
                 } else if (std::string(argv[x]) == "-rv") {
                     x++;
@@ -215,10 +294,112 @@ int wCommandLineParse(int argc, char *argv[],
                         errorCode = getInteger(std::string(argv[x]),
                                                &(parameters->lookLeftLimitSteps));
                     }
+                // Test for video encoder option
+                } else if (std::string(argv[x]) == "-e") {
+                    x++;
+                    if (x < argc) {
+                        errorCode = 0;
+                        std::string str = std::string(argv[x]);
+                        if (!str.empty()) {
+                            parameters->videoEncodeCodecCfg.name = str;
+                        }
+                    }
+                // Test for video encoder preset option
+                } else if (std::string(argv[x]) == "-ep") {
+                    x++;
+                    if (x < argc) {
+                        errorCode = 0;
+                        parameters->videoEncodeCodecCfg.preset = std::string(argv[x]);
+                    }
+                // Test for video encoder threads option
+                } else if (std::string(argv[x]) == "-et") {
+                    x++;
+                    if (x < argc) {
+                        errorCode = getPositiveInteger(std::string(argv[x]));
+                        if (errorCode >= 0) {
+                            parameters->videoEncodeCodecCfg.threads = errorCode;
+                            errorCode = 0;
+                        }
+                    }
+                // Test for video encoder slice threads option
+                } else if (std::string(argv[x]) == "-es") {
+                    parameters->videoEncodeCodecCfg.sliceThreads = true;
+                    errorCode = 0;
+                // Test for video encoder bit rate option
+                } else if (std::string(argv[x]) == "-eb") {
+                    x++;
+                    if (x < argc) {
+                        errorCode = getPositiveInteger(std::string(argv[x]));
+                        if (errorCode >= 0) {
+                            parameters->videoEncodeCodecCfg.bitRateKbps = errorCode;
+                            errorCode = 0;
+                        }
+                    }
+                // Test for video encoder CRF option
+                } else if (std::string(argv[x]) == "-eq") {
+                    x++;
+                    if (x < argc) {
+                        errorCode = getPositiveInteger(std::string(argv[x]));
+                        if ((errorCode >= 0) && (errorCode <= 51)) {
+                            parameters->videoEncodeCodecCfg.crf = errorCode;
+                            errorCode = 0;
+                        } else {
+                            errorCode = -EINVAL;
+                        }
+                    }
+                // Test for video encoder options option
+                } else if (std::string(argv[x]) == "-eo") {
+                    x++;
+                    if (x < argc) {
+                        errorCode = 0;
+                        parameters->videoEncodeCodecCfg.options = std::string(argv[x]);
+                    }
+                // Test for low-latency HLS option
+                } else if (std::string(argv[x]) == "-hl") {
+                    parameters->hlsMode = W_HLS_MODE_LOW_LATENCY;
+                    errorCode = 0;
+                // Test for HTTP server port option
+                } else if (std::string(argv[x]) == "-hp") {
+                    x++;
+                    if (x < argc) {
+                        errorCode = getPositiveInteger(std::string(argv[x]));
+                        if ((errorCode >= 0) && (errorCode <= 0xFFFF)) {
+                            parameters->httpPort = errorCode;
+                            errorCode = 0;
+                        } else {
+                            errorCode = -EINVAL;
+                        }
+                    }
+                // Test for event recording option
+                } else if (std::string(argv[x]) == "-vr") {
+                    x++;
+                    if (x < argc) {
+                        errorCode = 0;
+                        parameters->recordDirectory = std::string(argv[x]);
+                    }
+                // Test for number of cameras option
+                } else if (std::string(argv[x]) == "-n") {
+                    x++;
+                    if (x < argc) {
+                        errorCode = getPositiveInteger(std::string(argv[x]));
+                        if ((errorCode > 0) && (errorCode <= W_COMMON_PIPELINE_MAX_NUM)) {
+                            parameters->pipelineNum = errorCode;
+                            errorCode = 0;
+                        } else {
+                            errorCode = -EINVAL;
+                        }
+                    }
                 // Test for flagStaticCamera
                 } else if (std::string(argv[x]) == "-s") {
                     parameters->flagStaticCamera = true;
                     errorCode = 0;
+                // Test for motor calibration file path option
+                } else if (std::string(argv[x]) == "-mc") {
+                    x++;
+                    if (x < argc) {
+                        errorCode = 0;
+                        parameters->motorCalibrationFilePath = std::string(argv[x]);
+                    }
                 // Test for doNotOperateMotors
                 } else if (std::string(argv[x]) == "-z") {
                     parameters->doNotOperateMotors = true;
@@ -243,15 +424,32 @@ void wCommandLinePrintChoices(wCommandLineParameters_t *choices)
     std::cout << programName;
     if (choices) {
         std::cout << ", putting output files ("
-                  << W_HLS_PLAYLIST_FILE_EXTENSION << " and "
-                  << W_HLS_SEGMENT_FILE_EXTENSION << ") in ";
-        if (choices->outputDirectory != std::string(W_UTIL_DIR_THIS)) {
-            std::cout << choices->outputDirectory;
+                  << W_HLS_PLAYLIST_FILE_EXTENSION << " and ";
+        if (choices->hlsMode == W_HLS_MODE_LOW_LATENCY) {
+            std::cout << W_HLS_LOW_LATENCY_SEGMENT_FILE_EXTENSION
+                      << ", low-latency HLS";
         } else {
-            std::cout << "this directory";
+            std::cout << W_HLS_SEGMENT_FILE_EXTENSION;
+        }
+        std::cout << ") ";
+        if (choices->httpPort > 0) {
+            std::cout << "in memory, served over HTTP on port "
+                      << choices->httpPort;
+        } else {
+            std::cout << "in ";
+            if (choices->outputDirectory != std::string(W_UTIL_DIR_THIS)) {
+                std::cout << choices->outputDirectory;
+            } else {
+                std::cout << "this directory";
+            }
         }
         std::cout << ", output files will be named "
                   << choices->outputFileName;
+        if (choices->pipelineNum > 1) {
+            std::cout << " for the first of " << choices->pipelineNum
+                      << " cameras, " << choices->outputFileName
+                      << "_1 etc. for the others";
+        }
         std::cout << ", the JSON configuration file will be "
                   << choices->cfgFilePath;
         if (choices->motionContinuousSeconds > 0) {
@@ -259,6 +457,19 @@ void wCommandLinePrintChoices(wCommandLineParameters_t *choices)
                       <<  choices->motionContinuousSeconds
                       << " second(s)";
         }
+        std::cout << ", motion detector is " << choices->motionDetectorName;
+        if (choices->motionPyramidLevels > 0) {
+            std::cout << ", motion detection is downscaled by "
+                      << choices->motionPyramidLevels
+                      << " pyramid level(s)";
+        }
+        for (auto &region: choices->motionRegions) {
+            std::cout << ", motion is "
+                      << (region.exclude ? "ignored" : "detected")
+                      << " in " << region.rectFrame.width << "x"
+                      << region.rectFrame.height << " at "
+                      << region.rectFrame.x << "," << region.rectFrame.y;
+        }
         if (choices->restVerticalSteps != 0) {
             std::cout << ", vertical rest position is "
                       <<  choices->restVerticalSteps
@@ -289,9 +500,39 @@ void wCommandLinePrintChoices(wCommandLineParameters_t *choices)
                       <<  choices->lookLeftLimitSteps
                       << " steps(s) relative to centre";
         }
+        std::cout << ", video encoder " << choices->videoEncodeCodecCfg.name;
+        if (!choices->videoEncodeCodecCfg.preset.empty()) {
+            std::cout << " preset " << choices->videoEncodeCodecCfg.preset;
+        }
+        if (choices->videoEncodeCodecCfg.threads > 0) {
+            std::cout << " with " << choices->videoEncodeCodecCfg.threads
+                      << " thread(s)";
+        }
+        if (choices->videoEncodeCodecCfg.sliceThreads) {
+            std::cout << " (slice threads)";
+        }
+        if (choices->videoEncodeCodecCfg.bitRateKbps > 0) {
+            std::cout << " at " << choices->videoEncodeCodecCfg.bitRateKbps
+                      << " kbits/s";
+        }
+        if (choices->videoEncodeCodecCfg.crf >= 0) {
+            std::cout << " CRF " << choices->videoEncodeCodecCfg.crf;
+        }
+        if (!choices->videoEncodeCodecCfg.options.empty()) {
+            std::cout << " options \"" << choices->videoEncodeCodecCfg.options
+                      << "\"";
+        }
+        if (!choices->recordDirectory.empty()) {
+            std::cout << ", motion events will be recorded to "
+                      << choices->recordDirectory;
+        }
         if (choices->flagStaticCamera) {
             std::cout << ", head will not track";
         }
+        if (!choices->motorCalibrationFilePath.empty()) {
+            std::cout << ", motor calibration will be kept in "
+                      << choices->motorCalibrationFilePath;
+        }
         if (choices->doNotOperateMotors) {
             std::cout << ", motors will not move";
         }
@@ -348,6 +589,87 @@ void wCommandLinePrintHelp(wCommandLineParameters_t *defaults)
     }
     std::cout << ")." << std::endl;
 
+    std::cout << "  -md mog2|diff the motion detector: mog2 is the OpenCV MOG2"
+              << " background subtractor, diff a much cheaper running-average"
+              << " frame difference that suits a mostly static scene (default ";
+    if (defaults && !defaults->motionDetectorName.empty()) {
+        std::cout << defaults->motionDetectorName;
+    } else {
+        std::cout << W_IMAGE_PROCESSING_DETECTOR_NAME_DEFAULT;
+    }
+    std::cout << ")." << std::endl;
+    std::cout << "  -mp <integer> the number of times, up to "
+              << W_IMAGE_PROCESSING_PYRAMID_LEVELS_MAX << ", to halve the"
+              << " size of the image that motion detection is performed on"
+              << " (default ";
+    if (defaults && (defaults->motionPyramidLevels > 0)) {
+        std::cout << defaults->motionPyramidLevels;
+    } else {
+        std::cout << "zero";
+    }
+    std::cout << ")." << std::endl;
+    std::cout << "  -mx <x,y,width,height>, where x is i or e: only detect motion"
+              << " inside (i) or never detect motion inside (e) this rectangle,"
+              << " in pixels of the video with the origin top-left;" << std::endl;
+    std::cout << "      may be given up to " << W_IMAGE_PROCESSING_REGION_MAX_NUM
+              << " times in total (default detect motion everywhere)." << std::endl;
+
+    std::cout << "  -e  <name[,name...]> the FFmpeg video encoder to use, tried in"
+              << " order until one opens, or \"" << W_VIDEO_ENCODE_CODEC_NAME_AUTO
+              << "\" for " << W_VIDEO_ENCODE_CODEC_NAME_AUTO_LIST << " (default ";
+    if (defaults && !defaults->videoEncodeCodecCfg.name.empty()) {
+        std::cout << defaults->videoEncodeCodecCfg.name;
+    } else {
+        std::cout << W_VIDEO_ENCODE_CODEC_NAME_DEFAULT;
+    }
+    std::cout << ")." << std::endl;
+    std::cout << "  -ep <preset> the libx264 preset, e.g. ultrafast or veryfast"
+              << " (default leave to the encoder)." << std::endl;
+    std::cout << "  -et <integer> the number of encoder threads (default leave"
+              << " to the encoder)." << std::endl;
+    std::cout << "  -es use slice rather than frame threading in the encoder,"
+              << " lower latency at a small cost in compression." << std::endl;
+    std::cout << "  -eb <integer> the encoder bit rate in kbits/s (default leave"
+              << " to the encoder, " << W_VIDEO_ENCODE_CODEC_BIT_RATE_KBPS_HARDWARE_DEFAULT
+              << " for hardware encoders)." << std::endl;
+    std::cout << "  -eq <integer> the libx264 CRF, 0 to 51 (default leave to the"
+              << " encoder)." << std::endl;
+    std::cout << "  -eo <key=value[:key=value...]> any other encoder options,"
+              << " passed to the encoder as they are." << std::endl;
+    std::cout << "  -hl low-latency HLS: fMP4 segments made of "
+              << W_HLS_LOW_LATENCY_PART_DURATION_MS << " ms partial segments"
+              << " (" << W_HLS_LOW_LATENCY_SEGMENT_FILE_EXTENSION << " files),"
+              << " for hls.js lowLatencyMode (default ";
+    if (defaults && (defaults->hlsMode == W_HLS_MODE_LOW_LATENCY)) {
+        std::cout << "low-latency";
+    } else {
+        std::cout << "standard, MPEG-TS segments";
+    }
+    std::cout << ")." << std::endl;
+    std::cout << "  -hp <integer> serve the web interface and video from an"
+              << " embedded HTTP server on this port, keeping the video in"
+              << " memory (allowing" << std::endl;
+    std::cout << "      blocking playlist reload in low-latency mode) rather than"
+              << " writing it to the output directory, 0 for none (default ";
+    if (defaults && (defaults->httpPort > 0)) {
+        std::cout << defaults->httpPort;
+    } else {
+        std::cout << "none, use something like Apache";
+    }
+    std::cout << ")." << std::endl;
+    std::cout << "  -vr <directory path> record motion events, as "
+              << W_RECORD_FILE_EXTENSION << " files, to this directory: "
+              << W_RECORD_PRE_ROLL_SECONDS << " seconds before the motion"
+              << " until " << W_RECORD_TAIL_SECONDS << " seconds after it"
+              << std::endl;
+    std::cout << "      (default ";
+    if (defaults && !defaults->recordDirectory.empty()) {
+        std::cout << defaults->recordDirectory;
+    } else {
+        std::cout << "no recording";
+    }
+    std::cout << ")." << std::endl;
+
     std::cout << "  -rx <integer>, where x is v or h: override the rest position,"
               << " either vertically or horizontally in steps;" << std::endl;
     std::cout << "      values can be positive or negative, relative to the centre"
@@ -395,6 +717,30 @@ void wCommandLinePrintHelp(wCommandLineParameters_t *defaults)
     }
     std::cout << ")." << std::endl;
 
+    std::cout << "  -mc <file path> keep the motor calibration in this file over"
+              << " a clean restart, so that on start-up it need only be checked"
+              << " against one limit switch" << std::endl;
+    std::cout << "      rather than done again, \"\" to always calibrate (default ";
+    if (defaults && !defaults->motorCalibrationFilePath.empty()) {
+        std::cout << defaults->motorCalibrationFilePath;
+    } else {
+        std::cout << "always calibrate";
+    }
+    std::cout << ")." << std::endl;
+
+    std::cout << "  -n  <integer> the number of cameras, up to "
+              << W_COMMON_PIPELINE_MAX_NUM << ", each with its own pipeline"
+              << " and HLS output, \"_1\" etc. being appended to the file"
+              << " name of" << std::endl;
+    std::cout << "      all but the first; motor control, recording and events"
+              << " are driven by the first camera only (default ";
+    if (defaults && (defaults->pipelineNum > 1)) {
+        std::cout << defaults->pipelineNum;
+    } else {
+        std::cout << "one";
+    }
+    std::cout << ")." << std::endl;
+
     std::cout << "  -s  static camera (head will move for calibration but not thereafter)";
     if (defaults) {
         std::cout << " (default " << (defaults->flagStaticCamera ? "on)" : "off)");
@@ -17,8 +17,14 @@
 #ifndef _W_COMMAND_LINE_H_
 #define _W_COMMAND_LINE_H_
 
-// This API is dependent on std::string.
+// This API is dependent on std::string, std::vector, w_video_encode.h
+// (for wVideoEncodeCodecCfg_t), w_hls.h (for wHlsMode_t) and
+// w_image_processing.h (for wImageProcessingRegion_t).
 #include <string>
+#include <vector>
+#include <w_video_encode.h>
+#include <w_hls.h>
+#include <w_image_processing.h>
 
 /** @file
  * @brief The command-line API for the watchdog application;
@@ -42,13 +48,22 @@ typedef struct {
     std::string cfgFilePath;
     bool flagStaticCamera;
     bool doNotOperateMotors;
+    std::string motorCalibrationFilePath; // Empty if the motor calibration is not kept
     int motionContinuousSeconds;
+    std::string motionDetectorName;
+    unsigned int motionPyramidLevels;
+    std::vector<wImageProcessingRegion_t> motionRegions;
     int restVerticalSteps;
     int restHorizontalSteps;
     int lookUpLimitSteps;
     int lookDownLimitSteps;
     int lookRightLimitSteps;
     int lookLeftLimitSteps;
+    wVideoEncodeCodecCfg_t videoEncodeCodecCfg;
+    wHlsMode_t hlsMode;
+    unsigned int httpPort; // Zero if there is no HTTP server
+    std::string recordDirectory; // Empty if there is no event recording
+    unsigned int pipelineNum; // The number of cameras, each with its own pipeline
 } wCommandLineParameters_t;
 
 /* ----------------------------------------------------------------
@@ -46,6 +46,24 @@
 # define W_COMMON_FRAME_RATE_HERTZ 15
 #endif
 
+#ifndef W_COMMON_PIPELINE_MAX_NUM
+/** The maximum number of pipelines, camera to image processing to
+ * video encode, that may run at once, one per camera.  Each pipeline
+ * has its own contexts, message queues, HLS output and statistics,
+ * the message queue threads of pipelines other than
+ * W_COMMON_PIPELINE_MAIN having " <pipeline>" appended to their
+ * names.
+ */
+# define W_COMMON_PIPELINE_MAX_NUM 2
+#endif
+
+/** The pipeline of the camera that the motors move: control (and
+ * hence the LEDs), event recording, the event index, low-latency
+ * HLS and the in-memory HLS store follow this pipeline only, the
+ * others being static cameras with plain HLS output to files.
+ */
+#define W_COMMON_PIPELINE_MAIN 0
+
 #ifndef W_COMMON_THREAD_REAL_TIME_PRIORITY_MAX
 /** The maximum real-time priority to use for any of the threads,
  * where Linux/Posix defines 100 as the maximum real-time
@@ -58,6 +76,35 @@
 # define W_COMMON_THREAD_REAL_TIME_PRIORITY_MAX 50
 #endif
 
+#ifndef W_COMMON_CPU_LIST_REAL_TIME
+/** The CPUs, as a Linux CPU list (e.g. "3" or "2-3"), that the
+ * timing-critical threads (GPIO read, software PWM and the motor
+ * stepper, see W_COMMON_THREAD_PLACEMENT_REAL_TIME) are confined
+ * to.  The default, "", means the CPUs isolated with "isolcpus="
+ * on the kernel command-line, if there are any, else the
+ * highest-numbered online CPU, provided there is more than one.
+ */
+# define W_COMMON_CPU_LIST_REAL_TIME ""
+#endif
+
+#ifndef W_COMMON_CPU_LIST_MEDIA
+/** The CPUs, as a Linux CPU list, that the heavy media threads
+ * (see W_COMMON_THREAD_PLACEMENT_MEDIA) are confined to.  The
+ * default, "", means all of the online CPUs that are not real-time
+ * CPUs, or all of the online CPUs if that leaves none.
+ */
+# define W_COMMON_CPU_LIST_MEDIA ""
+#endif
+
+#ifndef W_COMMON_CPU_LIST_HOUSEKEEPING
+/** The CPUs, as a Linux CPU list, that everything else (see
+ * W_COMMON_THREAD_PLACEMENT_HOUSEKEEPING) is confined to; the
+ * default, "", means the same CPUs as the default for
+ * W_COMMON_CPU_LIST_MEDIA.
+ */
+# define W_COMMON_CPU_LIST_HOUSEKEEPING ""
+#endif
+
 /** Macro to obtain a real-time thread priority that can be used
  * with sched_setscheduler().  The priority parameter should be
  * a value from wCommonThreadPriority_t.
@@ -78,18 +125,41 @@
  */
 typedef enum {
     W_COMMON_THREAD_PRIORITY_GPIO_READ = 0,
-    W_COMMON_THREAD_PRIORITY_GPIO_PWM = -1,
-    W_COMMON_THREAD_PRIORITY_LED = -2,
-    W_COMMON_THREAD_PRIORITY_CONTROL = -3,
-    W_COMMON_THREAD_PRIORITY_MSG = -4
+    W_COMMON_THREAD_PRIORITY_MOTOR = -1,
+    W_COMMON_THREAD_PRIORITY_GPIO_PWM = -2,
+    W_COMMON_THREAD_PRIORITY_LED = -3,
+    W_COMMON_THREAD_PRIORITY_CONTROL = -4,
+    W_COMMON_THREAD_PRIORITY_MSG = -5,
+    W_COMMON_THREAD_PRIORITY_STATS = -6
 } wCommonThreadPriority_t;
 
+/** The classes of CPU placement of the threads, each class having
+ * the set of CPUs given by the corresponding W_COMMON_CPU_LIST_xxx
+ * macro; which thread is in which class is decided, by thread
+ * name, in wUtilThreadPlacementSet().
+ */
+typedef enum {
+    W_COMMON_THREAD_PLACEMENT_REAL_TIME,    // GPIO read, software PWM, motor stepper
+    W_COMMON_THREAD_PLACEMENT_MEDIA,        // main() (hence the camera and encoder threads
+                                            // that it creates), image processing, video
+                                            // encode, event recording
+    W_COMMON_THREAD_PLACEMENT_HOUSEKEEPING, // control, LEDs, stats, logging, HTTP
+    W_COMMON_THREAD_PLACEMENT_MAX_NUM
+} wCommonThreadPlacement_t;
+
 /** Function signature of something that processes a frame, used
  * by the camera and image processing APIs.
  *
- * @param data         a pointer to the image data; this data will
- *                     have been malloc()'ed and should be free()'ed
- *                     by the frame processing function.
+ * @param pipeline     the pipeline the frame belongs to, 0 to
+ *                     W_COMMON_PIPELINE_MAX_NUM - 1.
+ * @param data         a pointer to the image data; this is the
+ *                     camera's own (memory-mapped) buffer, it is NOT
+ *                     a copy.  The frame processing function is
+ *                     handed one reference to the buffer and must
+ *                     give it up with wCameraFrameRelease() when done,
+ *                     even in a failure case, or pass it on to
+ *                     something that will.  Further references may
+ *                     be taken with wCameraFrameAddRef().
  * @param length       the amount of memory pointed to by data.
  * @param sequence     a monotonically-increasing sequence number.
  * @param width        the width of the image in pixels.
@@ -99,7 +169,8 @@ typedef enum {
  * @return             the number of frames now in the queue for
  *                     processing (i.e. the backlog).
  */
-typedef int (wCommonFrameFunction_t)(uint8_t *data,
+typedef int (wCommonFrameFunction_t)(unsigned int pipeline,
+                                     uint8_t *data,
                                      unsigned int length,
                                      unsigned int sequence,
                                      unsigned int width,
@@ -20,10 +20,12 @@
  */
 
 // The CPP stuff.
+#include <climits>
+#include <cmath>
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <atomic>
-#include <list>
 
 // The Linux/Posix stuff.
 #include <assert.h>
@@ -41,6 +43,7 @@
 #include <w_video_encode.h>
 #include <w_led.h>
 #include <w_motor.h>
+#include <w_stats.h>
 
 // Us.
 #include <w_control.h>
@@ -49,6 +52,19 @@
  * COMPILE-TIME MACROS
  * -------------------------------------------------------------- */
 
+// The guard period after moving before focus changes are believed
+// again: much shorter when tracking.
+#if W_CONTROL_TRACK
+# define W_CONTROL_GUARD_MS W_CONTROL_TRACK_SETTLE_MS
+#else
+# define W_CONTROL_GUARD_MS W_CONTROL_MOTOR_MOVE_GUARD_MS
+#endif
+
+// The number of ticks of motor position kept for the tracker, enough
+// to go back W_CONTROL_TRACK_CAPTURE_LATENCY_MS with some to spare.
+#define W_CONTROL_TRACK_HISTORY_LENGTH ((W_CONTROL_TRACK_CAPTURE_LATENCY_MS / \
+                                         W_CONTROL_TICK_TIMER_PERIOD_MS) + 10)
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
@@ -64,12 +80,43 @@ typedef struct {
     cv::Point averagePointView;
 } wControlPointView_t;
 
-/** Storage for a sequence of steps.
+/** The latest focus point, for the tracker.
  */
 typedef struct {
-    int stepUnit; // +1 for positive, -1 for negative
-    std::list<int64_t> durationTicksList; // Duration is signed as we use negative values in a count-down
-} wControlSteps_t;
+    cv::Point pointView;
+    unsigned int sequence; // Incremented with each new point
+    std::chrono::steady_clock::time_point time; // When the frame it was found in was captured
+} wControlTrackPoint_t;
+
+/** The position of the motors at a tick of the control loop, kept
+ * so that the tracker can find where the motors were when the frame
+ * of a focus point was captured; the array is in the same order as
+ * wMotorType_t.
+ */
+typedef struct {
+    bool valid;
+    std::chrono::steady_clock::time_point time;
+    int position[W_MOTOR_TYPE_MAX_NUM];
+} wControlPositionSample_t;
+
+/** The recent history of the position of the motors, a ring.
+ */
+typedef struct {
+    wControlPositionSample_t sample[W_CONTROL_TRACK_HISTORY_LENGTH];
+    unsigned int next; // The entry of sample[] to write next
+} wControlPositionHistory_t;
+
+/** An alpha-beta tracker of the focus, in motor steps from the
+ * centre of the calibrated range of each motor; the arrays are in
+ * the same order as wMotorType_t.
+ */
+typedef struct {
+    bool valid;
+    unsigned int sequence; // Of the last focus point used
+    std::chrono::steady_clock::time_point time; // Of the last focus point used
+    double position[W_MOTOR_TYPE_MAX_NUM];
+    double velocity[W_MOTOR_TYPE_MAX_NUM]; // Steps per second
+} wControlTrack_t;
 
 /** Context for control message handlers.
  */
@@ -81,11 +128,13 @@ typedef struct {
     std::atomic<bool> cfgIgnore;
     std::atomic<int> motionContinuousSeconds;
     std::atomic<bool> moving;
+    std::atomic<bool> moveLarge; // True if the motors must settle after the current move
     std::atomic<int64_t> intervalCountTicks;
     std::atomic<int> motionCount;
     std::atomic<int> motionContinuousThresholdSeconds;
     std::atomic<int> motionContinuousCountSeconds;
     wControlPointView_t focus;
+    wControlTrackPoint_t trackPoint;
 } wControlContext_t;
 
 /** Control message types.
@@ -208,10 +257,9 @@ static bool lightsAllowed()
 }
 
 // Switch all motors off, e.g. because we've been told to.
-// This will also return them to the rest position.
-// steps, if present, must be a pointer to an array
-// of size W_MOTOR_TYPE_MAX_NUM.
-static int motorsOff(wControlSteps_t *steps = nullptr)
+// This will also return them to the rest position, once any
+// movement in progress is done.
+static int motorsOff()
 {
     int errorCode = 0;
 
@@ -222,18 +270,40 @@ static int motorsOff(wControlSteps_t *steps = nullptr)
         if (x != 0) {
             errorCode = x;
         }
-        // Clear any steps that might be on-going
-        if (steps) {
-            (steps + m)->durationTicksList.clear();
-        }
     }
 
     return errorCode;
 }
 
+// Return true if any motor is moving.
+static bool motorsMoving()
+{
+    bool moving = false;
+
+    for (unsigned int m = 0; (m < W_MOTOR_TYPE_MAX_NUM) && !moving; m++) {
+        moving = wMotorIsMoving((wMotorType_t) m);
+    }
+
+    return moving;
+}
+
+// Return the coordinate of a point that a motor moves along.
+static int coordinateGet(const cv::Point *point, unsigned int m)
+{
+    int coordinate = 0;
+
+    if ((wMotorType_t) m == W_MOTOR_TYPE_VERTICAL) {
+        coordinate = point->y;
+    } else if ((wMotorType_t) m == W_MOTOR_TYPE_ROTATE) {
+        coordinate = point->x;
+    }
+
+    return coordinate;
+}
+
 // Calibrate a motor and return it to the rest position; used by
 // timedMotorMove() for periodic re-calibration and
-// step() if stepping results in the need for calibration.
+// moveProgress() if moving results in the need for calibration.
 static int motorCalibrateAndMoveToRest(wMotorType_t type,
                                        unsigned int *calibrationAttemptFailureCount)
 {
@@ -330,15 +400,73 @@ static int stepsPerPixelX100Set(unsigned int *stepsPerPixelX100)
     return errorCode;
 }
 
-// Create an array of steps; stepsPerPixelX100 and steps must be
-// pointers to arrays of size W_MOTOR_TYPE_MAX_NUM.
-static bool stepListSet(const cv::Point *focus,
-                        const unsigned int *stepsPerPixelX100,
-                        wControlSteps_t *steps)
+// Add the current position of the motors to the history; a motor
+// that is not calibrated makes the sample invalid.
+static void positionHistoryAdd(wControlPositionHistory_t *history)
 {
-    bool stepping = false;
+    wControlPositionSample_t *sample = &(history->sample[history->next]);
 
-    if (focus && stepsPerPixelX100 && steps) {
+    sample->valid = true;
+    sample->time = std::chrono::steady_clock::now();
+    for (unsigned int m = 0; m < W_MOTOR_TYPE_MAX_NUM; m++) {
+        if (wMotorPositionGet((wMotorType_t) m, &(sample->position[m])) != 0) {
+            sample->valid = false;
+        }
+    }
+    history->next++;
+    if (history->next >= W_UTIL_ARRAY_COUNT(history->sample)) {
+        history->next = 0;
+    }
+}
+
+// Get the position of a motor at the given time from the history:
+// that of the last sample at or before the time or, if the time is
+// older than the history, that of the oldest sample; if there is no
+// history the current position is returned.
+static int positionHistoryGet(const wControlPositionHistory_t *history,
+                              std::chrono::steady_clock::time_point time,
+                              unsigned int m, int *position)
+{
+    int errorCode = 0;
+    const wControlPositionSample_t *found = nullptr;
+    const wControlPositionSample_t *oldest = nullptr;
+
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(history->sample); x++) {
+        const wControlPositionSample_t *sample = &(history->sample[x]);
+        if (sample->valid) {
+            if ((sample->time <= time) && (!found || (sample->time > found->time))) {
+                found = sample;
+            }
+            if (!oldest || (sample->time < oldest->time)) {
+                oldest = sample;
+            }
+        }
+    }
+    if (!found) {
+        found = oldest;
+    }
+    if (found) {
+        *position = found->position[m];
+    } else {
+        errorCode = wMotorPositionGet((wMotorType_t) m, position);
+    }
+
+    return errorCode;
+}
+
+// Start moving towards a focus point, if it is far enough from the
+// origin; stepsPerPixelX100 and movingLast must be pointers to arrays
+// of size W_MOTOR_TYPE_MAX_NUM, the entry in movingLast being set
+// for each motor that is sent somewhere.  The motors do their own
+// ramping (see w_motor.h) so all that is needed here is the number
+// of steps.
+static bool moveStart(const cv::Point *focus,
+                      const unsigned int *stepsPerPixelX100,
+                      bool staticCamera, bool *movingLast)
+{
+    bool moving = false;
+
+    if (focus && stepsPerPixelX100 && movingLast) {
         // The centre of our point of view is 0, 0, with +Y upwards,
         // -Y downwards, +X to the right, -X to the left, like a
         // conventional X/Y graph.
@@ -354,185 +482,201 @@ static bool stepListSet(const cv::Point *focus,
         // put our 0, 0 point at the new focus.
         if (distanceSquared(focus) > W_COMMON_FOCUS_CHANGE_THRESHOLD_PIXELS *
                                      W_COMMON_FOCUS_CHANGE_THRESHOLD_PIXELS) {
-            W_LOG_DEBUG_START("focus %d, %d is more than %d pixels from the"
-                              " origin so create a step list:",
-                              focus->x, focus->y,
-                              W_COMMON_FOCUS_CHANGE_THRESHOLD_PIXELS);
             // Work out what the distance in pixels means in terms of
             // steps of the rotate and vertical motors
-            // These two arrays MUST have the same dimension and
-            // it must be W_MOTOR_TYPE_MAX_NUM
-            int stepUnit[W_MOTOR_TYPE_MAX_NUM];
-            unsigned int numberOfSteps[W_MOTOR_TYPE_MAX_NUM];
-            for (unsigned int m = 0; m < W_UTIL_ARRAY_COUNT(numberOfSteps); m++) {
-                int coordinate = 0;
-                if ((wMotorType_t) m == W_MOTOR_TYPE_VERTICAL) {
-                    coordinate = focus->y;
-                } else if ((wMotorType_t) m == W_MOTOR_TYPE_ROTATE) {
-                    coordinate = focus->x;
-                }
+            int steps[W_MOTOR_TYPE_MAX_NUM];
+            for (unsigned int m = 0; m < W_UTIL_ARRAY_COUNT(steps); m++) {
                 // This just to avoid two stars in the same line of maths just below
                 int multiplier = *(stepsPerPixelX100 + m);
-                int s = (coordinate * multiplier) / 100;
-                stepUnit[m] = 1;
-                if (s < 0) {
-                    stepUnit[m] = -1;
+                steps[m] = (coordinateGet(focus, m) * multiplier) / 100;
+            }
+            W_LOG_DEBUG("focus %d, %d is more than %d pixels from the"
+                        " origin, moving %+d vertical, %+d rotate.",
+                        focus->x, focus->y,
+                        W_COMMON_FOCUS_CHANGE_THRESHOLD_PIXELS,
+                        steps[W_MOTOR_TYPE_VERTICAL],
+                        steps[W_MOTOR_TYPE_ROTATE]);
+            for (unsigned int m = 0; m < W_UTIL_ARRAY_COUNT(steps); m++) {
+                if (steps[m] != 0) {
+                    if (!staticCamera) {
+                        wMotorMove((wMotorType_t) m, steps[m]);
+                    }
+                    *(movingLast + m) = true;
+                    moving = true;
                 }
-                numberOfSteps[m] = s * stepUnit[m];
-                if (m == 0) {
-                    W_LOG_DEBUG_MORE(" %+d vertical", s);
+            }
+        }
+    }
+
+    return moving;
+}
+
+// Update the tracker with any new focus point and send the motors to
+// where it predicts the focus will be W_CONTROL_TRACK_LEAD_MS from
+// now, which changes the target of a move that is in progress;
+// stepsPerPixelX100 and movingLast must be pointers to arrays of size
+// W_MOTOR_TYPE_MAX_NUM, the entry in movingLast being set for each
+// motor that is sent somewhere.  A move of more than
+// W_CONTROL_TRACK_RETARGET_SMALL_PIXELS sets moveLarge.  Returns true
+// if a motor was sent somewhere.
+static bool trackUpdate(wControlTrack_t *track,
+                        const wControlPositionHistory_t *history,
+                        const unsigned int *stepsPerPixelX100,
+                        bool staticCamera, bool *movingLast,
+                        std::atomic<bool> *moveLarge)
+{
+    bool moving = false;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    gContext.mutex.lock();
+    wControlTrackPoint_t point = gContext.trackPoint;
+    gContext.mutex.unlock();
+
+    if (point.sequence != track->sequence) {
+        // A new focus point: put it in motor steps, which needs
+        // to know where the motors were when its frame was captured
+        // (they may be making a small correction, see
+        // msgHandlerControlFocusChange()), and update the tracker
+        double dt = std::chrono::duration<double>(point.time - track->time).count();
+        bool valid = true;
+        for (unsigned int m = 0; m < W_MOTOR_TYPE_MAX_NUM; m++) {
+            int position = 0;
+            if (positionHistoryGet(history, point.time, m, &position) == 0) {
+                double measured = position + ((double) coordinateGet(&(point.pointView), m) *
+                                              *(stepsPerPixelX100 + m)) / 100;
+                if (!track->valid || (dt <= 0)) {
+                    // Start tracking
+                    track->position[m] = measured;
+                    track->velocity[m] = 0;
                 } else {
-                    W_LOG_DEBUG_MORE(", %+d rotate", s);
+                    // Predict, then correct by the residual
+                    track->position[m] += track->velocity[m] * dt;
+                    double residual = measured - track->position[m];
+                    track->position[m] += W_CONTROL_TRACK_ALPHA * residual;
+                    track->velocity[m] += W_CONTROL_TRACK_BETA * residual / dt;
                 }
+            } else {
+                valid = false;
             }
+        }
+        if (valid && !track->valid) {
+            W_LOG_DEBUG("tracking focus from %d, %d.",
+                        point.pointView.x, point.pointView.y);
+        }
+        track->valid = valid;
+        track->sequence = point.sequence;
+        track->time = point.time;
+    }
 
-            // Assemble the step list for each motor
-            for (unsigned int m = 0; m < W_UTIL_ARRAY_COUNT(stepUnit); m++) {
-                // Set the direction for all steps
-                (steps + m)->stepUnit = stepUnit[m];
-                // For each step, create a duration, ramping up at the
-                // start and down at the end
-                unsigned int rampUpDownSteps = ((numberOfSteps[m] * W_CONTROL_MOVE_RAMP_PERCENT) / 100) >> 1;
-                int64_t durationAdderTicks = msToTicks(W_CONTROL_STEP_INTERVAL_MAX_MS) / rampUpDownSteps;
-                unsigned int rampUpStopStep = rampUpDownSteps;
-                unsigned int rampDownStartStep = numberOfSteps[m] - rampUpDownSteps;
-                // Clear the list
-                (steps + m)->durationTicksList.clear();
-                for (unsigned int s = 0; s < numberOfSteps[m]; s++) {
-                    // Work out the duration of this step
-                    int64_t durationTicks = 1;
-                    if (s < rampUpStopStep) {
-                        durationTicks += durationAdderTicks * (rampUpStopStep - s);
-                    } else if (s > rampDownStartStep) {
-                        durationTicks += durationAdderTicks * (s - rampDownStartStep);
+    if (track->valid) {
+        double ageSeconds = std::chrono::duration<double>(now - track->time).count();
+        if (ageSeconds * 1000 > W_CONTROL_TRACK_TIMEOUT_MS) {
+            track->valid = false;
+            W_LOG_DEBUG("lost track of focus.");
+        } else {
+            for (unsigned int m = 0; m < W_MOTOR_TYPE_MAX_NUM; m++) {
+                int target = 0;
+                if (wMotorPositionGet((wMotorType_t) m, nullptr, &target) == 0) {
+                    double setPoint = track->position[m] + track->velocity[m] *
+                                      (ageSeconds + (W_CONTROL_TRACK_LEAD_MS / 1000.0));
+                    int steps = (int) std::lround(setPoint) - target;
+                    // Don't bother with changes smaller than would be
+                    // noticed without tracking
+                    if (std::abs(steps) > (int) ((W_COMMON_FOCUS_CHANGE_THRESHOLD_PIXELS *
+                                                  *(stepsPerPixelX100 + m)) / 100)) {
+                        if (std::abs(steps) > (int) ((W_CONTROL_TRACK_RETARGET_SMALL_PIXELS *
+                                                      *(stepsPerPixelX100 + m)) / 100)) {
+                            *moveLarge = true;
+                        }
+                        if (!staticCamera) {
+                            wMotorMove((wMotorType_t) m, steps);
+                        }
+                        *(movingLast + m) = true;
+                        moving = true;
                     }
-                    // Add the new step to the list
-                    (steps + m)->durationTicksList.push_back(durationTicks);
-                    stepping = true;
-                }
-                if (m == 0) {
-                    W_LOG_DEBUG_MORE(", ramp/mid/ramp");
-                } else {
-                    W_LOG_DEBUG_MORE(" vertical,");
-                }
-                W_LOG_DEBUG_MORE(" %+d/%+d/%+d", rampUpStopStep * stepUnit[m],
-                                 (rampDownStartStep - rampUpStopStep) * stepUnit[m],
-                                 (numberOfSteps[m] - rampDownStartStep) * stepUnit[m]);
-                if (m == 1) {
-                    W_LOG_DEBUG_MORE(" rotate");
                 }
             }
-
-            W_LOG_DEBUG_MORE(".");
-            W_LOG_DEBUG_END;
         }
     }
 
-    return stepping;
+    return moving;
 }
 
-// Perform a step: steps must be a pointer to an array
-// of size W_MOTOR_TYPE_MAX_NUM.
-static bool step(wControlSteps_t *steps, bool staticCamera,
-                 std::atomic<int64_t> *intervalCountTicks,
-                 int64_t *motorRecalibrateCountTicks,
-                 unsigned int *calibrationAttemptFailureCount)
+// Keep an eye on the motors while they move: if a motor has stopped
+// and now needs calibration, do that.  movingLast must be a pointer
+// to an array of size W_MOTOR_TYPE_MAX_NUM, the moving state of each
+// motor when this was last called.  When the motors stop the
+// interval counter is restarted, unless tracking and moveLarge is
+// not set, i.e. the tracker has only been making small corrections;
+// moveLarge is then cleared.  Returns true while any motor is
+// moving.
+static bool moveProgress(bool *movingLast,
+                         std::atomic<bool> *moveLarge,
+                         std::atomic<int64_t> *intervalCountTicks,
+                         int64_t *motorRecalibrateCountTicks,
+                         unsigned int *calibrationAttemptFailureCount)
 {
     bool movingAtStart = false;
     bool movingAtEnd = false;
 
-    if (steps) {
+    if (movingLast) {
         for (unsigned int m = 0; m < W_MOTOR_TYPE_MAX_NUM; m++) {
-            wControlSteps_t *item = steps + m;
-            if (!item->durationTicksList.empty()) {
+            bool moving = wMotorIsMoving((wMotorType_t) m);
+            if (*(movingLast + m)) {
                 movingAtStart = true;
-                // Get the duration of the next step
-                int64_t durationTicks = item->durationTicksList.front();
-                item->durationTicksList.pop_front();
-                // If the duration is positive, perform the step
-                if (durationTicks > 0) {
-                    bool motorNeedsCalibration = false;
-                    if (!staticCamera) {
-                        wMotorMove((wMotorType_t) m, item->stepUnit);
-                        motorNeedsCalibration = wMotorNeedsCalibration((wMotorType_t) m);
-                    }
-                    // If the movement resulted in the motor needing
-                    // calibration, clear all of the steps for this
-                    // motor and do that
-                    if (motorNeedsCalibration) {
-                        item->durationTicksList.clear();
-                        if ((motorCalibrateAndMoveToRest((wMotorType_t) m,
-                                                         calibrationAttemptFailureCount) == 0) &&
-                            motorRecalibrateCountTicks) {
-                            // Reset the timed recalibration counter
-                            // as we've done that
-                            *motorRecalibrateCountTicks = 0;
-                        }
-                    } else {
-                        // Set the duration to minus its value in order
-                        // to start the count-down
-                        durationTicks = -durationTicks;
-                    }
-                }
-                // Increment the duration and if it is negative, i.e.
-                // there is a wait of more than one tick, push it back
-                // on the front of the queue to be dealt with on the
-                // next tick
-                durationTicks++;
-                if (durationTicks < 0) {
-                    item->durationTicksList.push_front(durationTicks);
-                    movingAtEnd = true;
-                } else if (!item->durationTicksList.empty()) {
-                    // If this duration had hit zero but the duration
-                    // tick list is not empty we haven't stopped moving
-                    movingAtEnd = true;
+                // If the movement resulted in the motor needing
+                // calibration, do that
+                if (!moving && wMotorNeedsCalibration((wMotorType_t) m) &&
+                    (motorCalibrateAndMoveToRest((wMotorType_t) m,
+                                                 calibrationAttemptFailureCount) == 0) &&
+                    motorRecalibrateCountTicks) {
+                    // Reset the timed recalibration counter
+                    // as we've done that
+                    *motorRecalibrateCountTicks = 0;
                 }
             }
+            *(movingLast + m) = moving;
+            if (moving) {
+                movingAtEnd = true;
+            }
         }
 
         if (movingAtStart && !movingAtEnd) {
             W_LOG_DEBUG_START("movement completed");
-            if (intervalCountTicks) {
+            if (intervalCountTicks && (!W_CONTROL_TRACK || *moveLarge)) {
                 W_LOG_DEBUG_MORE(", waiting at least %d ms",
-                                 W_CONTROL_MOTOR_MOVE_INTERVAL_MS);
-                // If there was something on either list when we were called
-                // but there is nothing on either list anymore then start
-                // the interval counter
+                                 W_CONTROL_TRACK ? W_CONTROL_GUARD_MS :
+                                                   W_CONTROL_MOTOR_MOVE_INTERVAL_MS);
+                // If a motor was moving when we were called but
+                // none are anymore then start the interval counter
                 *intervalCountTicks = 0;
             }
             W_LOG_DEBUG_MORE(".");
             W_LOG_DEBUG_END;
+            *moveLarge = false;
         }
     }
 
-    return movingAtStart && movingAtEnd;
+    return movingAtEnd;
 }
 
 // Perform a motor movement (e.g. motorMoveToRest() or
 // motorCalibrateAndMoveToRest()) on the basis of a counter and
-// a limit. steps, if present, must be a pointer to an array
-// of size W_MOTOR_TYPE_MAX_NUM.
+// a limit; if waitForMoves is true nothing is done while a
+// motor is moving.
 static bool timedMotorMove(int64_t *tickCount, int64_t limitTicks,
                            int (*function)(wMotorType_t, unsigned int *),
                            unsigned int *calibrationAttemptFailureCount = nullptr,
                            std::atomic<int64_t> *intervalCountTicks = nullptr,
-                           wControlSteps_t *steps = nullptr)
+                           bool waitForMoves = false)
 {
     bool called = false;
 
     if (tickCount && (limitTicks > 0)) {
         (*tickCount)++;
-        bool notYet = false;
-        if (steps) {
-            // Check if we are currently stepping, only rest after
-            // those are done
-            for (unsigned int m = 0; (m < W_MOTOR_TYPE_MAX_NUM) &&
-                                     !notYet; m++) {
-                if (!(steps + m)->durationTicksList.empty()) {
-                    notYet = true;
-                }
-            }
-        }
+        // Check if we are currently moving, only rest after
+        // that is done
+        bool notYet = waitForMoves && motorsMoving();
         // Check if we are in an interval; only rest after it is done
         if (!notYet && intervalCountTicks &&
             (*intervalCountTicks < msToTicks(W_CONTROL_MOTOR_MOVE_INTERVAL_MS))) {
@@ -554,10 +698,6 @@ static bool timedMotorMove(int64_t *tickCount, int64_t limitTicks,
                 for (unsigned int m = 0; m < W_MOTOR_TYPE_MAX_NUM; m++) {
                     // Don't care about errors here, best effort
                     function((wMotorType_t) m, calibrationAttemptFailureCount);
-                    // Clear any steps that might be on-going
-                    if (steps) {
-                        (steps + m)->durationTicksList.clear();
-                    }
                 }
             }
             *tickCount = 0;
@@ -583,9 +723,11 @@ static void controlLoop(int timerFd, bool *keepGoing, void *context)
         int64_t motorRecalibrateCountTicks = 0;
         bool activityFlag = false;
         unsigned int calibrationAttemptFailureCount = 0;
+        wControlTrack_t track = {};
+        wControlPositionHistory_t positionHistory = {};
         // These arrays have the same order as wMotorType_t, i.e.
         // 0 -> vertical/y, 1 -> horizontal/x
-        wControlSteps_t steps[W_MOTOR_TYPE_MAX_NUM];
+        bool movingLast[W_MOTOR_TYPE_MAX_NUM] = {};
         unsigned int stepsPerPixelX100[W_MOTOR_TYPE_MAX_NUM] = {};
 
         // Populate the steps per pixel from the motors, making
@@ -611,7 +753,8 @@ static void controlLoop(int timerFd, bool *keepGoing, void *context)
                 if (refreshCfgTicks >= msToTicks(W_CONTROL_CFG_REFRESH_SECONDS * 1000)) {
                     wCfgRefresh();
                     if (!motorsAllowed()) {
-                        motorsOff(steps);
+                        motorsOff();
+                        gContext.moveLarge = true;
                     }
                     if (!lightsAllowed()) {
                         wLedModeConstantSet(W_LED_BOTH, 0, 0, W_CONTROL_LED_RAMP_DOWN_RATE_MS);
@@ -631,18 +774,36 @@ static void controlLoop(int timerFd, bool *keepGoing, void *context)
                                                            msToTicks(W_CONTROL_MOTOR_RECALIBRATE_SECONDS * 1000),
                                                            motorCalibrateAndMoveToRest,
                                                            &calibrationAttemptFailureCount,
-                                                           &(gContext.intervalCountTicks), steps);
+                                                           &(gContext.intervalCountTicks), true);
                     bool returnToRest = timedMotorMove(&returnToRestCountTicks,
                                                        msToTicks(W_CONTROL_RETURN_TO_REST_SECONDS * 1000),
                                                        motorMoveToRest,
                                                        &calibrationAttemptFailureCount,
-                                                       &(gContext.intervalCountTicks), steps);
+                                                       &(gContext.intervalCountTicks), true);
+                    if (motorRecalibrate || returnToRest) {
+                        gContext.moveLarge = true;
+                    }
+                    if (W_CONTROL_TRACK) {
+                        positionHistoryAdd(&positionHistory);
+                    }
                     if (!motorRecalibrate && !returnToRest) {
-                        // No enforced rest/calibration: if there are steps to complete, do them.
-                        gContext.moving = step(steps, gContext.staticCamera,
-                                               &(gContext.intervalCountTicks),
-                                               &motorRecalibrateCountTicks,
-                                               &calibrationAttemptFailureCount);
+                        // No enforced rest/calibration: if tracking, send the
+                        // motors to where the focus is predicted to be
+                        if (W_CONTROL_TRACK &&
+                            trackUpdate(&track, &positionHistory, stepsPerPixelX100,
+                                        gContext.staticCamera, movingLast,
+                                        &(gContext.moveLarge)) &&
+                            lightsAllowed()) {
+                            wLedModeConstantSet(W_LED_BOTH, 0,
+                                                W_CONTROL_LED_ACTIVE_PERCENT,
+                                                W_CONTROL_LED_RAMP_UP_RATE_MS);
+                        }
+                        // Keep an eye on any movement
+                        gContext.moving = moveProgress(movingLast,
+                                                       &(gContext.moveLarge),
+                                                       &(gContext.intervalCountTicks),
+                                                       &motorRecalibrateCountTicks,
+                                                       &calibrationAttemptFailureCount);
                         if (motorRecalibrateCountTicks == 0) {
                             // If stepping resulted in a recalibration (i.e.
                             // motorRecalibrateCountTicks has been reset to zero),
@@ -652,7 +813,7 @@ static void controlLoop(int timerFd, bool *keepGoing, void *context)
                         }
                         if (gContext.moving) {
                             // Remove the focus point from the image while we move
-                            wImageProcessingFocusSet(nullptr);
+                            wImageProcessingFocusSet(W_COMMON_PIPELINE_MAIN, nullptr);
                             inactivityReturnToRestCountTicks = 0;
                             activityFlag = true;
                         } else {
@@ -663,7 +824,8 @@ static void controlLoop(int timerFd, bool *keepGoing, void *context)
                                                    msToTicks(W_CONTROL_INACTIVITY_RETURN_TO_REST_SECONDS * 1000),
                                                    motorMoveToRest,
                                                    &calibrationAttemptFailureCount,
-                                                   &(gContext.intervalCountTicks), steps)) {
+                                                   &(gContext.intervalCountTicks), true)) {
+                                    gContext.moveLarge = true;
                                     activityFlag = false;
                                 }
                             }
@@ -711,18 +873,22 @@ static void controlLoop(int timerFd, bool *keepGoing, void *context)
 
                             // Not moving, check the interval counter
                             if (gContext.intervalCountTicks >= msToTicks(W_CONTROL_MOTOR_MOVE_INTERVAL_MS)) {
-                                // If there is no interval to wait,
-                                // create a new step list if required
-                                if (stepListSet(&focusPointView, stepsPerPixelX100, steps) &&
-                                    lightsAllowed()) {
-                                    wLedModeConstantSet(W_LED_BOTH, 0,
-                                                        W_CONTROL_LED_ACTIVE_PERCENT,
-                                                        W_CONTROL_LED_RAMP_UP_RATE_MS);
+                                // If there is no interval to wait, and
+                                // we're not tracking, move if required
+                                if (!W_CONTROL_TRACK &&
+                                    moveStart(&focusPointView, stepsPerPixelX100,
+                                              gContext.staticCamera, movingLast)) {
+                                    gContext.moveLarge = true;
+                                    if (lightsAllowed()) {
+                                        wLedModeConstantSet(W_LED_BOTH, 0,
+                                                            W_CONTROL_LED_ACTIVE_PERCENT,
+                                                            W_CONTROL_LED_RAMP_UP_RATE_MS);
+                                    }
                                 }
                             } else {
-                                if (gContext.intervalCountTicks == msToTicks(W_CONTROL_MOTOR_MOVE_GUARD_MS)) {
+                                if (gContext.intervalCountTicks == msToTicks(W_CONTROL_GUARD_MS)) {
                                     // Reset the motion detection in the image processing code
-                                    wImageProcessingResetMotionDetect();
+                                    wImageProcessingResetMotionDetect(W_COMMON_PIPELINE_MAIN);
                                     // Restart averaging, otherwise we
                                     // will end up moving towards something
                                     // we have already moved towards, IYSWIM
@@ -747,7 +913,7 @@ static void controlLoop(int timerFd, bool *keepGoing, void *context)
                             }
 
                             // Write the focus point on the image
-                            wImageProcessingFocusSet(&focusPointView);
+                            wImageProcessingFocusSet(W_COMMON_PIPELINE_MAIN, &focusPointView);
                         }
                     } else {
                         // Returning to rest or recalibrating counts as activity
@@ -758,7 +924,10 @@ static void controlLoop(int timerFd, bool *keepGoing, void *context)
                     // above it is possible that stepsPerPixelX100Get(), and
                     // hence stepsPerPixelX100Set(), will fail, so make sure
                     // that all is good
-                    motorRecalibrate |= motorEnsureCalibration(&calibrationAttemptFailureCount);
+                    if (motorEnsureCalibration(&calibrationAttemptFailureCount)) {
+                        gContext.moveLarge = true;
+                        motorRecalibrate = true;
+                    }
 
                     if (motorRecalibrate) {
                         // If a motor was recalibrated, re-compute the step to pixel ratio
@@ -775,11 +944,6 @@ static void controlLoop(int timerFd, bool *keepGoing, void *context)
             W_LOG_WARN("motor recalibration failed %d time(s) during operation.",
                        calibrationAttemptFailureCount);
         }
-
-        // Not sure if this is necessary
-        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(steps); x++) {
-            steps[x].durationTicksList.clear();
-        }
     }
 
     W_LOG_DEBUG("control loop has exited.");
@@ -809,10 +973,11 @@ static void msgHandlerControlFocusChange(void *msgBody,
 
     assert(bodySize == sizeof(*msg));
 
-    if (!controlContext->moving &&
-        (controlContext->intervalCountTicks > msToTicks(W_CONTROL_MOTOR_MOVE_GUARD_MS)) &&
+    if ((!controlContext->moving || (W_CONTROL_TRACK && !controlContext->moveLarge)) &&
+        (controlContext->intervalCountTicks > msToTicks(W_CONTROL_GUARD_MS)) &&
         (msg->areaPixels >= W_CONTROL_FOCUS_AREA_THRESHOLD_PIXELS)) {
-        // We're not moving, have been stationary for more than the guard
+        // We're not moving (or, when tracking, are only making small
+        // corrections), have been settled for more than the guard
         // period, and the new point is big enough to be added to our
         // focus data
         controlContext->mutex.lock();
@@ -824,6 +989,11 @@ static void msgHandlerControlFocusChange(void *msgBody,
         // include the focus change in our average
         if (controlContext->motionContinuousCountSeconds >= controlContext->motionContinuousThresholdSeconds) {
             cv::Point *pointView = &(msg->pointView);
+            // Give the point to the tracker
+            controlContext->trackPoint.pointView = *pointView;
+            controlContext->trackPoint.time = std::chrono::steady_clock::now() -
+                                              std::chrono::milliseconds(W_CONTROL_TRACK_CAPTURE_LATENCY_MS);
+            controlContext->trackPoint.sequence++;
             // Calculate the new total, and hence the average
             if (focus->oldestPointView == nullptr) {
                 // Haven't yet filled the buffer up, just add the
@@ -891,6 +1061,13 @@ int wControlInit()
                                                 handler->msgType,
                                                 handler->function);
             }
+            if (errorCode == 0) {
+                errorCode = wMsgQueueOverflowSet(gMsgQueueId,
+                                                 W_CONTROL_MSG_QUEUE_OVERFLOW);
+            }
+            if (errorCode == 0) {
+                errorCode = wStatsQueueAdd(gMsgQueueId);
+            }
         }
         if (errorCode == 0) {
             // Set up the thread and tick-timer to drive controlLoop()
@@ -925,15 +1102,17 @@ int wControlStart(bool staticCamera, int motionContinuousSeconds,
         gContext.staticCamera = staticCamera;
         gContext.cfgIgnore = cfgIgnore;
         gContext.intervalCountTicks = INT_MAX;
+        gContext.moveLarge = false;
         gContext.motionContinuousSeconds = motionContinuousSeconds;
         gContext.motionContinuousThresholdSeconds = motionContinuousSeconds;
         gContext.motionCount = 0;
         gContext.motionContinuousCountSeconds = 0;
         // Set ourselves up as a consumer of focus from the image processing
-        errorCode = wImageProcessingFocusConsume(focusCallback, &gContext);
+        errorCode = wImageProcessingFocusConsume(W_COMMON_PIPELINE_MAIN,
+                                                 focusCallback, &gContext);
         if (errorCode == 0) {
             // Start video encoding
-            errorCode = wVideoEncodeStart();
+            errorCode = wVideoEncodeStart(W_COMMON_PIPELINE_MAIN);
             if (errorCode == 0) {
                 // We're up
                 if (lightsAllowed()) {
@@ -943,7 +1122,7 @@ int wControlStart(bool staticCamera, int motionContinuousSeconds,
                     wLedOverlayRandomBlinkSet(W_CONTROL_LED_RANDOM_BLINK_RATE_PER_MINUTE);
                 }
             } else {
-                 wImageProcessingFocusConsume(nullptr);
+                 wImageProcessingFocusConsume(W_COMMON_PIPELINE_MAIN, nullptr);
             }
         }
     }
@@ -958,8 +1137,8 @@ int wControlStop()
 
     if (gTimerFd >= 0) {
         gContext.staticCamera = false;
-        wImageProcessingFocusConsume(nullptr);
-        errorCode = wVideoEncodeStop();
+        wImageProcessingFocusConsume(W_COMMON_PIPELINE_MAIN, nullptr);
+        errorCode = wVideoEncodeStop(W_COMMON_PIPELINE_MAIN);
     }
 
     return errorCode;
@@ -36,13 +36,19 @@
 # define W_CONTROL_MSG_QUEUE_MAX_SIZE 100
 #endif
 
+#ifndef W_CONTROL_MSG_QUEUE_OVERFLOW
+/** What to do when the control queue is full, a value from
+ * wMsgQueueOverflow_t (see w_msg.h): by default the oldest focus
+ * change is dropped since it is the least relevant.
+ */
+# define W_CONTROL_MSG_QUEUE_OVERFLOW W_MSG_QUEUE_OVERFLOW_DROP_OLDEST
+#endif
+
 #ifndef W_CONTROL_TICK_TIMER_PERIOD_MS
-/** The control tick-timer period in milliseconds.  If you change
- * this you may also need to change
- * W_CONTROL_FOCUS_MOVE_INTERVAL_TICKS below.  Cannot be too
- * fast as we will be stepping the motors forward in the
- * control loop that this tick drives, can't be too slow as we
- * want to move fairly smarly: 10 ms is good.
+/** The control tick-timer period in milliseconds.  The motors
+ * are stepped by wMotor, not by the control loop that this tick
+ * drives, but it is how often a move can be started or, when
+ * tracking, corrected: 10 ms is good.
  */
 # define W_CONTROL_TICK_TIMER_PERIOD_MS 10
 #endif
@@ -95,12 +101,77 @@
                                            ((W_CONTROL_FOCUS_AVERAGE_LENGTH * 1000) / W_COMMON_FRAME_RATE_HERTZ))
 #endif
 
-#ifndef W_CONTROL_MOVE_RAMP_PERCENT
-/** The percentage of a move that should be spent in speeding
- * up at the start and down at the end; 30% is a good value
- * (15% at the start, 15% at the end).
+#ifndef W_CONTROL_TRACK
+/** Set this to 1 to follow the focus with an alpha-beta tracker
+ * rather than moving to the average focus once every
+ * W_CONTROL_MOTOR_MOVE_INTERVAL_MS: the tracker estimates the
+ * position and velocity of the focus, in motor steps, from each
+ * focus change that arrives once the motors have settled for
+ * W_CONTROL_TRACK_SETTLE_MS after a large move, and the motors are
+ * sent continuously to where it predicts the focus will be,
+ * corrected as they move.  The small corrections, see
+ * W_CONTROL_TRACK_RETARGET_SMALL_PIXELS, do not stop focus changes
+ * being believed, otherwise a moving subject would starve the
+ * tracker of them.
+ */
+# define W_CONTROL_TRACK 0
+#endif
+
+#ifndef W_CONTROL_TRACK_ALPHA
+/** The alpha (position) gain of the tracker, between 0 and 1:
+ * higher believes each new focus position more.
+ */
+# define W_CONTROL_TRACK_ALPHA 0.5
+#endif
+
+#ifndef W_CONTROL_TRACK_BETA
+/** The beta (velocity) gain of the tracker, between 0 and 1,
+ * usually well below W_CONTROL_TRACK_ALPHA: higher lets the
+ * velocity estimate change faster.
  */
-# define W_CONTROL_MOVE_RAMP_PERCENT 30
+# define W_CONTROL_TRACK_BETA 0.1
+#endif
+
+#ifndef W_CONTROL_TRACK_SETTLE_MS
+/** When tracking, how long the motors must have been still before
+ * focus changes are believed again; this is much shorter than
+ * W_CONTROL_MOTOR_MOVE_GUARD_MS since the tracker, unlike the
+ * average, is not thrown by the odd stale point.
+ */
+# define W_CONTROL_TRACK_SETTLE_MS 500
+#endif
+
+#ifndef W_CONTROL_TRACK_LEAD_MS
+/** When tracking, how far ahead of the predicted focus to aim,
+ * to make up for the time it takes the motors to get there.
+ */
+# define W_CONTROL_TRACK_LEAD_MS 200
+#endif
+
+#ifndef W_CONTROL_TRACK_TIMEOUT_MS
+/** When tracking, how long the prediction is followed without a
+ * new focus change before the focus is forgotten.
+ */
+# define W_CONTROL_TRACK_TIMEOUT_MS 2000
+#endif
+
+#ifndef W_CONTROL_TRACK_RETARGET_SMALL_PIXELS
+/** When tracking, a move of the motors by the tracker of no more
+ * than this many pixels, on either axis, is a small correction:
+ * focus changes continue to be believed while it is made and the
+ * motors need not settle for W_CONTROL_TRACK_SETTLE_MS after it.
+ */
+# define W_CONTROL_TRACK_RETARGET_SMALL_PIXELS (W_COMMON_FOCUS_CHANGE_THRESHOLD_PIXELS * 4)
+#endif
+
+#ifndef W_CONTROL_TRACK_CAPTURE_LATENCY_MS
+/** When tracking, how long before a focus change arrives the frame
+ * it was found in was captured: the camera and the first two stages
+ * of image processing, about a frame period.  Since the motors may
+ * be moving, a focus change is converted into motor steps with the
+ * position the motors were at when the frame was captured.
+ */
+# define W_CONTROL_TRACK_CAPTURE_LATENCY_MS (1000 / W_COMMON_FRAME_RATE_HERTZ)
 #endif
 
 #ifndef W_CONTROL_LED_RAMP_UP_RATE_MS
@@ -139,14 +210,6 @@
 # define W_CONTROL_LED_RANDOM_BLINK_RATE_PER_MINUTE 5
 #endif
 
-#ifndef W_CONTROL_STEP_INTERVAL_MAX_MS
-/** The maximum interval between steps, applied at the start
- * of the ramping period (will be zero by the end of the ramping
- * period).
- */
-# define W_CONTROL_STEP_INTERVAL_MAX_MS 100
-#endif
-
 #ifndef W_CONTROL_INACTIVITY_RETURN_TO_REST_SECONDS
 /** After how many seconds to return to the "rest" position
  * due to inactivity; use 0 for no inactivity rest.
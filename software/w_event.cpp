@@ -0,0 +1,633 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief The implementation of the motion event index API for the
+ * watchdog application.
+ *
+ * This code makes use of opencv and cJSON, hence must be linked with
+ * opencv4 and libcjson.
+ */
+
+// The CPP stuff.
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <sys/stat.h>
+#include <dirent.h>
+
+// The OpenCV stuff.
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+// The cJSON stuff.
+#include <cJSON.h>
+
+// Other parts of watchdog.
+#include <w_common.h>
+#include <w_util.h>
+#include <w_log.h>
+#include <w_msg.h>
+#include <w_hls.h>
+
+// Us.
+#include <w_event.h>
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// The maximum number of frames of motion that are held waiting to
+// find out which segment they are in: they only wait for the video
+// encoder to catch up with image processing, a second is plenty.
+#define W_EVENT_PENDING_MAX_NUM W_COMMON_FRAME_RATE_HERTZ
+
+// How long wEventStop() waits for the messages already queued to be
+// dealt with before giving up on them.
+#define W_EVENT_STOP_DRAIN_TIMEOUT_MS 2000
+
+// The number of segments, counting back from the one just begun,
+// that a thumbnail is kept for.
+#define W_EVENT_THUMBNAIL_KEEP_SEGMENTS (W_HLS_LIST_SIZE + W_EVENT_THUMBNAIL_KEEP_MARGIN_SEGMENTS)
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** A frame of motion: what image processing found and a thumbnail
+ * of the frame, owned by whoever has the frame.
+ */
+typedef struct {
+    wEventActivity_t activity;
+    std::vector<uint8_t> *thumbnail; // W_EVENT_THUMBNAIL_WIDTH_PIXELS by W_EVENT_THUMBNAIL_HEIGHT_PIXELS
+} wEventFrame_t;
+
+/** The segment being put together on the message queue thread.
+ */
+typedef struct {
+    bool valid; // False until the first segment has begun
+    int64_t segment;
+    int64_t pts;
+    int64_t timeUnixMs;
+    unsigned int frameCount; // Frames of motion in the segment
+    wEventFrame_t peak; // Valid if frameCount is not zero
+} wEventSegment_t;
+
+/** Context for the event index, only touched by the message queue
+ * thread once it is started.
+ */
+typedef struct {
+    std::string outputDirectory;
+    std::string outputFileName;
+    std::string indexPath;
+    std::deque<wEventFrame_t> pending; // Frames not yet known to be in a segment, in order
+    wEventSegment_t segment;
+    uint64_t entryCount;
+    uint64_t indexLineCount; // The number of lines in the index file
+} wEventContext_t;
+
+/** Event index message types.
+ */
+typedef enum {
+    W_EVENT_MSG_TYPE_FRAME, // wEventMsgBodyFrame_t
+    W_EVENT_MSG_TYPE_SEGMENT // wEventMsgBodySegment_t
+} wEventMsgType_t;
+
+/** The message body for W_EVENT_MSG_TYPE_FRAME: a frame of motion,
+ * the thumbnail owned by the message.
+ */
+typedef wEventFrame_t wEventMsgBodyFrame_t;
+
+/** The message body for W_EVENT_MSG_TYPE_SEGMENT: the start of an
+ * HLS segment.
+ */
+typedef struct {
+    int64_t segment;
+    int64_t pts;
+    int64_t timeUnixMs;
+} wEventMsgBodySegment_t;
+
+/** Union of message bodies; if you add a member here you must add
+ * a type for it in wEventMsgType_t.
+ */
+typedef union {
+    wEventMsgBodyFrame_t frame;     // W_EVENT_MSG_TYPE_FRAME
+    wEventMsgBodySegment_t segment; // W_EVENT_MSG_TYPE_SEGMENT
+} wEventMsgBody_t;
+
+/** A structure containing the message handling/freeing function
+ * and the message type they handle, for use in gMsgHandler[].
+ */
+typedef struct {
+    wEventMsgType_t msgType;
+    wMsgHandlerFunction_t *function;
+    wMsgHandlerFunctionFree_t *functionFree;
+} wEventMsgHandler_t;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// NOTE: there are more messaging-related variables below
+// the definition of the message handling functions.
+
+// The ID of the event index message queue.
+static int gMsgQueueId = -1;
+
+// Context for the event index.
+static wEventContext_t *gContext = nullptr;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: FILES
+ * -------------------------------------------------------------- */
+
+// Write a whole file, via a temporary file which is then renamed,
+// so that whoever is reading it never sees half a file.
+static int fileWrite(std::string path, const void *data, size_t size)
+{
+    int errorCode = -EIO;
+    std::string pathTemporary = path + ".tmp";
+    FILE *file = fopen(pathTemporary.c_str(), "wb");
+
+    if (file) {
+        bool written = (fwrite(data, 1, size, file) == size);
+        if ((fclose(file) == 0) && written &&
+            (rename(pathTemporary.c_str(), path.c_str()) == 0)) {
+            errorCode = 0;
+        } else {
+            remove(pathTemporary.c_str());
+        }
+    }
+
+    return errorCode;
+}
+
+// Read a whole file; a file that does not exist is empty.
+static int fileRead(std::string path, std::string *text)
+{
+    int errorCode = 0;
+    struct stat status;
+
+    text->clear();
+    if (stat(path.c_str(), &status) == 0) {
+        errorCode = -EIO;
+        FILE *file = fopen(path.c_str(), "r");
+        if (file) {
+            text->resize(status.st_size);
+            text->resize(fread(&((*text)[0]), 1, text->size(), file));
+            if (ferror(file) == 0) {
+                errorCode = 0;
+            }
+            fclose(file);
+        }
+    }
+
+    return errorCode;
+}
+
+// Return the name of the thumbnail of a segment.
+static std::string thumbnailName(const wEventContext_t *context, int64_t segment)
+{
+    return context->outputFileName + std::to_string(segment) +
+           std::string(W_EVENT_THUMBNAIL_FILE_EXTENSION);
+}
+
+// Delete every thumbnail in the output directory, e.g. those left
+// over from a previous run, i.e. any file that is the HLS output file
+// name followed by nothing but digits and the thumbnail extension.
+static void thumbnailRemoveAll(const wEventContext_t *context)
+{
+    std::string extension = std::string(W_EVENT_THUMBNAIL_FILE_EXTENSION);
+    unsigned int count = 0;
+    DIR *directory = opendir(context->outputDirectory.c_str());
+
+    if (directory) {
+        struct dirent *entry;
+        while ((entry = readdir(directory)) != nullptr) {
+            std::string name = std::string(entry->d_name);
+            size_t prefixLength = context->outputFileName.length();
+            if ((name.length() > prefixLength + extension.length()) &&
+                (name.compare(0, prefixLength, context->outputFileName) == 0) &&
+                (name.compare(name.length() - extension.length(),
+                              extension.length(), extension) == 0) &&
+                (name.find_first_not_of("0123456789", prefixLength) ==
+                 name.length() - extension.length()) &&
+                (remove((context->outputDirectory + std::string(W_UTIL_DIR_SEPARATOR) +
+                         name).c_str()) == 0)) {
+                count++;
+            }
+        }
+        closedir(directory);
+    }
+    if (count > 0) {
+        W_LOG_INFO("deleted %u motion event thumbnail(s) left over from before.",
+                   count);
+    }
+}
+
+// Trim the index file to its last W_EVENT_INDEX_ENTRY_MAX_NUM lines,
+// if it is longer than that.
+static int indexTrim(wEventContext_t *context)
+{
+    std::string text;
+    int errorCode = fileRead(context->indexPath, &text);
+
+    if (errorCode == 0) {
+        uint64_t lineCount = 0;
+        for (auto c: text) {
+            if (c == '\n') {
+                lineCount++;
+            }
+        }
+        context->indexLineCount = lineCount;
+        if (lineCount > W_EVENT_INDEX_ENTRY_MAX_NUM) {
+            // Find the start of the lines to keep
+            size_t start = 0;
+            for (uint64_t x = 0; x < lineCount - W_EVENT_INDEX_ENTRY_MAX_NUM; x++) {
+                start = text.find('\n', start) + 1;
+            }
+            errorCode = fileWrite(context->indexPath, text.data() + start,
+                                  text.length() - start);
+            if (errorCode == 0) {
+                context->indexLineCount = W_EVENT_INDEX_ENTRY_MAX_NUM;
+                W_LOG_DEBUG("event index trimmed to %d line(s).",
+                            W_EVENT_INDEX_ENTRY_MAX_NUM);
+            }
+        }
+    }
+    if (errorCode != 0) {
+        W_LOG_ERROR("unable to trim event index \"%s\" (%d)!",
+                    context->indexPath.c_str(), errorCode);
+    }
+
+    return errorCode;
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: ON THE MESSAGE QUEUE THREAD
+ * -------------------------------------------------------------- */
+
+// Return true if the camera sequence number a comes before the
+// presentation time-stamp b, allowing for a wrap of the sequence
+// number.
+static bool sequenceBefore(unsigned int a, int64_t b)
+{
+    return ((int32_t) (a - (uint32_t) b)) < 0;
+}
+
+// Write a thumbnail as a JPEG file.
+static int thumbnailWrite(std::string path, const std::vector<uint8_t> *thumbnail)
+{
+    int errorCode = -ENOMEM;
+    std::vector<uint8_t> jpeg;
+    cv::Mat image(W_EVENT_THUMBNAIL_HEIGHT_PIXELS, W_EVENT_THUMBNAIL_WIDTH_PIXELS,
+                  CV_8UC1, (void *) thumbnail->data());
+
+    if (cv::imencode(W_EVENT_THUMBNAIL_FILE_EXTENSION, image, jpeg,
+                     {cv::IMWRITE_JPEG_QUALITY, W_EVENT_THUMBNAIL_JPEG_QUALITY})) {
+        errorCode = fileWrite(path, jpeg.data(), jpeg.size());
+    }
+
+    return errorCode;
+}
+
+// Append the entry for a segment to the index file, writing its
+// thumbnail first, so that anything the index refers to exists,
+// and trim the index if it has become too long.
+static int entryWrite(wEventContext_t *context, const wEventSegment_t *segment)
+{
+    int errorCode = -ENOMEM;
+    const wEventActivity_t *peak = &(segment->peak.activity);
+    std::string name = thumbnailName(context, segment->segment);
+    // The peak is the same distance into the segment in wall-clock
+    // time as it is in frames
+    int64_t peakTimeUnixMs = segment->timeUnixMs +
+                             ((((int64_t) peak->sequence) - segment->pts) * 1000) /
+                             W_COMMON_FRAME_RATE_HERTZ;
+    int focus[] = {peak->focusX, peak->focusY};
+    int box[] = {peak->boxX, peak->boxY, peak->boxWidth, peak->boxHeight};
+
+    bool thumbnail = segment->peak.thumbnail &&
+                     (thumbnailWrite(context->outputDirectory + std::string(W_UTIL_DIR_SEPARATOR) +
+                                     name, segment->peak.thumbnail) == 0);
+    if (!thumbnail) {
+        W_LOG_DEBUG("unable to write event thumbnail \"%s\".", name.c_str());
+    }
+
+    cJSON *json = cJSON_CreateObject();
+    if (json) {
+        cJSON_AddNumberToObject(json, "segment", (double) segment->segment);
+        cJSON_AddNumberToObject(json, "pts", (double) segment->pts);
+        cJSON_AddNumberToObject(json, "timeUnixMs", (double) segment->timeUnixMs);
+        cJSON_AddNumberToObject(json, "frames", segment->frameCount);
+        cJSON_AddNumberToObject(json, "areaPixels", peak->areaPixels);
+        cJSON_AddNumberToObject(json, "peakPts", peak->sequence);
+        cJSON_AddNumberToObject(json, "peakTimeUnixMs", (double) peakTimeUnixMs);
+        cJSON_AddItemToObject(json, "focus", cJSON_CreateIntArray(focus, W_UTIL_ARRAY_COUNT(focus)));
+        cJSON_AddItemToObject(json, "box", cJSON_CreateIntArray(box, W_UTIL_ARRAY_COUNT(box)));
+        if (thumbnail) {
+            cJSON_AddStringToObject(json, "thumbnail", name.c_str());
+        }
+        char *text = cJSON_PrintUnformatted(json);
+        if (text) {
+            errorCode = -EIO;
+            FILE *file = fopen(context->indexPath.c_str(), "a");
+            if (file) {
+                bool written = (fputs(text, file) >= 0) && (fputc('\n', file) != EOF);
+                if ((fclose(file) == 0) && written) {
+                    errorCode = 0;
+                }
+            }
+            free(text);
+        }
+        cJSON_Delete(json);
+    }
+
+    if (errorCode == 0) {
+        context->entryCount++;
+        context->indexLineCount++;
+        W_LOG_DEBUG("event index: segment %lld, %u frame(s) of motion, peak"
+                    " %d pixel(s).", (long long) segment->segment,
+                    segment->frameCount, peak->areaPixels);
+        if (context->indexLineCount > W_EVENT_INDEX_ENTRY_MAX_NUM +
+                                      W_EVENT_INDEX_TRIM_MARGIN_NUM) {
+            indexTrim(context);
+        }
+    } else {
+        W_LOG_ERROR("unable to write to event index \"%s\" (%d)!",
+                    context->indexPath.c_str(), errorCode);
+    }
+
+    return errorCode;
+}
+
+// Add a frame of motion to the segment being put together, taking
+// ownership of its thumbnail: if the frame is the new peak of the
+// segment its thumbnail is kept, else it is freed.
+static void segmentAdd(wEventSegment_t *segment, wEventFrame_t *frame)
+{
+    if (segment->valid &&
+        ((segment->frameCount == 0) ||
+         (frame->activity.areaPixels > segment->peak.activity.areaPixels))) {
+        delete segment->peak.thumbnail;
+        segment->peak = *frame;
+    } else {
+        delete frame->thumbnail;
+    }
+    if (segment->valid) {
+        segment->frameCount++;
+    }
+    frame->thumbnail = nullptr;
+}
+
+// End the segment being put together, writing its entry to the
+// index if there was any motion in it.
+static void segmentEnd(wEventContext_t *context)
+{
+    wEventSegment_t *segment = &(context->segment);
+
+    if (segment->valid && (segment->frameCount > 0)) {
+        entryWrite(context, segment);
+    }
+    delete segment->peak.thumbnail;
+    segment->peak.thumbnail = nullptr;
+    segment->frameCount = 0;
+    segment->valid = false;
+}
+
+// Add the oldest pending frame to the segment being put together.
+static void pendingPop(wEventContext_t *context)
+{
+    segmentAdd(&(context->segment), &(context->pending.front()));
+    context->pending.pop_front();
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MESSAGE HANDLERS
+ * -------------------------------------------------------------- */
+
+// Message handler for W_EVENT_MSG_TYPE_FRAME: the frame waits until
+// the video encoder has said which segment it is in; since image
+// processing is ahead of the video encoder the segment cannot be
+// known yet.
+static void msgHandlerEventFrame(void *msgBody, unsigned int bodySize,
+                                 void *context)
+{
+    wEventMsgBodyFrame_t *msg = &(((wEventMsgBody_t *) msgBody)->frame);
+    wEventContext_t *eventContext = (wEventContext_t *) context;
+
+    assert(bodySize == sizeof(*msg));
+
+    eventContext->pending.push_back(*msg);
+    msg->thumbnail = nullptr;
+    while (eventContext->pending.size() > W_EVENT_PENDING_MAX_NUM) {
+        // The video encoder isn't keeping up (or has stopped),
+        // best guess is that this is still the same segment
+        pendingPop(eventContext);
+    }
+}
+
+// Message handler free() function for W_EVENT_MSG_TYPE_FRAME.
+static void msgHandlerEventFrameFree(void *msgBody, void *context)
+{
+    wEventMsgBodyFrame_t *msg = &(((wEventMsgBody_t *) msgBody)->frame);
+
+    // This handler doesn't use any context
+    (void) context;
+
+    delete msg->thumbnail;
+    msg->thumbnail = nullptr;
+}
+
+// Message handler for W_EVENT_MSG_TYPE_SEGMENT: every pending frame
+// before the start of this segment is in the previous one, which
+// is now complete.
+static void msgHandlerEventSegment(void *msgBody, unsigned int bodySize,
+                                   void *context)
+{
+    wEventMsgBodySegment_t *msg = &(((wEventMsgBody_t *) msgBody)->segment);
+    wEventContext_t *eventContext = (wEventContext_t *) context;
+    wEventSegment_t *segment = &(eventContext->segment);
+
+    assert(bodySize == sizeof(*msg));
+
+    while (!eventContext->pending.empty() &&
+           sequenceBefore(eventContext->pending.front().activity.sequence, msg->pts)) {
+        pendingPop(eventContext);
+    }
+    segmentEnd(eventContext);
+    if (msg->segment >= W_EVENT_THUMBNAIL_KEEP_SEGMENTS) {
+        // The thumbnail of a segment that has long gone from the
+        // playlist is of no use to anyone (and most segments
+        // don't have one, hence no complaint if this fails)
+        remove((eventContext->outputDirectory + std::string(W_UTIL_DIR_SEPARATOR) +
+                thumbnailName(eventContext,
+                              msg->segment - W_EVENT_THUMBNAIL_KEEP_SEGMENTS)).c_str());
+    }
+    segment->valid = true;
+    segment->segment = msg->segment;
+    segment->pts = msg->pts;
+    segment->timeUnixMs = msg->timeUnixMs;
+}
+
+/* ----------------------------------------------------------------
+ * MORE VARIABLES: THE MESSAGES WITH THEIR MESSAGE HANDLERS
+ * -------------------------------------------------------------- */
+
+// Array of message handlers with the message type they handle.
+static wEventMsgHandler_t gMsgHandler[] = {{.msgType = W_EVENT_MSG_TYPE_FRAME,
+                                            .function = msgHandlerEventFrame,
+                                            .functionFree = msgHandlerEventFrameFree},
+                                           {.msgType = W_EVENT_MSG_TYPE_SEGMENT,
+                                            .function = msgHandlerEventSegment,
+                                            .functionFree = nullptr}};
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MISC
+ * -------------------------------------------------------------- */
+
+// Free the context, writing the entry of the last segment.
+static void cleanUp()
+{
+    if (gMsgQueueId >= 0) {
+        wMsgQueueStop(gMsgQueueId);
+        gMsgQueueId = -1;
+    }
+
+    if (gContext) {
+        // The message queue thread is gone, safe to do this here;
+        // with no more segments coming, whatever is pending is
+        // in the last one
+        while (!gContext->pending.empty()) {
+            pendingPop(gContext);
+        }
+        segmentEnd(gContext);
+        delete gContext;
+        gContext = nullptr;
+    }
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Start the event index.
+int wEventStart(std::string outputDirectory, std::string outputFileName)
+{
+    int errorCode = 0;
+
+    if (!gContext) {
+        gContext = new wEventContext_t();
+        gContext->outputDirectory = outputDirectory;
+        gContext->outputFileName = outputFileName;
+        gContext->indexPath = outputDirectory + std::string(W_UTIL_DIR_SEPARATOR) +
+                              outputFileName + std::string(W_EVENT_FILE_NAME_SUFFIX) +
+                              std::string(W_EVENT_FILE_EXTENSION);
+        // Nothing else is touching the files yet: get rid of the
+        // old thumbnails and get the index down to size
+        thumbnailRemoveAll(gContext);
+        indexTrim(gContext);
+        // Both image processing and the video encoder push to this
+        // queue, so it has to be a list
+        errorCode = wMsgQueueStart(gContext, W_EVENT_MSG_QUEUE_MAX_SIZE, "event");
+        if (errorCode >= 0) {
+            gMsgQueueId = errorCode;
+            errorCode = 0;
+            // Register the message handlers
+            for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gMsgHandler)) &&
+                                     (errorCode == 0); x++) {
+                wEventMsgHandler_t *handler = &(gMsgHandler[x]);
+                errorCode = wMsgQueueHandlerAdd(gMsgQueueId,
+                                                handler->msgType,
+                                                handler->function,
+                                                handler->functionFree);
+            }
+        }
+        if (errorCode == 0) {
+            W_LOG_INFO("motion event index will be written to \"%s\".",
+                       gContext->indexPath.c_str());
+        } else {
+            cleanUp();
+        }
+    }
+
+    return errorCode;
+}
+
+// Determine whether the event index is started.
+bool wEventIsStarted()
+{
+    return (gContext != nullptr);
+}
+
+// Report the motion in a frame.
+void wEventActivity(const wEventActivity_t *activity, const uint8_t *image,
+                    unsigned int width, unsigned int height,
+                    unsigned int stride)
+{
+    if (gContext && (activity->areaPixels >= W_EVENT_ACTIVITY_AREA_PIXELS_MIN)) {
+        wEventMsgBodyFrame_t frame = {.activity = *activity,
+                                      .thumbnail = nullptr};
+        if (image && (width > 0) && (height > 0)) {
+            // Scaling down here, while the frame is still held,
+            // means only the thumbnail need be copied
+            frame.thumbnail = new std::vector<uint8_t>(W_EVENT_THUMBNAIL_WIDTH_PIXELS *
+                                                       W_EVENT_THUMBNAIL_HEIGHT_PIXELS);
+            cv::Mat source(height, width, CV_8UC1, (void *) image, stride);
+            cv::Mat thumbnail(W_EVENT_THUMBNAIL_HEIGHT_PIXELS, W_EVENT_THUMBNAIL_WIDTH_PIXELS,
+                              CV_8UC1, frame.thumbnail->data());
+            cv::resize(source, thumbnail, thumbnail.size(), 0, 0, cv::INTER_AREA);
+        }
+        if (wMsgPush(gMsgQueueId, W_EVENT_MSG_TYPE_FRAME,
+                     &frame, sizeof(frame)) < 0) {
+            delete frame.thumbnail;
+        }
+    }
+}
+
+// Report the start of an HLS segment.
+void wEventSegment(int64_t segment, int64_t pts)
+{
+    if (gContext) {
+        wEventMsgBodySegment_t msg = {.segment = segment,
+                                      .pts = pts,
+                                      .timeUnixMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()};
+        wMsgPush(gMsgQueueId, W_EVENT_MSG_TYPE_SEGMENT, &msg, sizeof(msg));
+    }
+}
+
+// Stop the event index.
+void wEventStop()
+{
+    if (gContext) {
+        // Give what is already queued a chance to be dealt with
+        wUtilTimeoutStart_t start = wUtilTimeoutStart();
+        while ((gMsgQueueId >= 0) && (wMsgQueueLengthGet(gMsgQueueId) > 0) &&
+               !wUtilTimeoutExpired(start, std::chrono::milliseconds(W_EVENT_STOP_DRAIN_TIMEOUT_MS))) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        W_LOG_INFO("%llu segment(s) with motion written to the motion"
+                   " event index.", (unsigned long long) gContext->entryCount);
+        cleanUp();
+    }
+}
+
+// End of file
@@ -0,0 +1,228 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _W_EVENT_H_
+#define _W_EVENT_H_
+
+// This API is dependent on std::string, int64_t and w_common.h (for
+// W_COMMON_WIDTH_PIXELS etc.).
+#include <cstdint>
+#include <string>
+#include <w_common.h>
+
+/** @file
+ * @brief The motion event index API for the watchdog application:
+ * image processing reports the motion it finds in each frame and the
+ * video encoder reports where each HLS segment begins; for every
+ * segment in which there was motion of at least
+ * W_EVENT_ACTIVITY_AREA_PIXELS_MIN a line of JSON is appended to an
+ * index file next to the HLS output and a small JPEG thumbnail, taken
+ * from the analysis stream at the peak of the motion, is written
+ * with the same name as the segment, e.g. "watchdog12.jpg" for
+ * "watchdog12.ts".  A line of the index looks like:
+ *
+ * ```
+ * {"segment":12,"pts":300,"timeUnixMs":1748785812345,"frames":17,"areaPixels":41000,
+ *  "peakPts":311,"peakTimeUnixMs":1748785812785,"focus":[820,400],
+ *  "box":[700,310,260,190],"thumbnail":"watchdog12.jpg"}
+ * ```
+ *
+ * ...where "segment" is the media sequence number of the segment in
+ * the playlist, "pts" the presentation time-stamp, in frames, at
+ * which the segment begins, "timeUnixMs" the wall-clock time at
+ * which the encoder began it, "frames" the number of frames with
+ * motion in it, "areaPixels" the peak area of motion, "peakPts" and
+ * "peakTimeUnixMs" when that was, and "focus" and "box" the focus
+ * point and the bounding box of the moving objects at the peak,
+ * in video frame coordinates.  The index, and the thumbnails,
+ * are written by a message queue thread of this API, so neither
+ * image processing nor the video encoder waits for the disk.
+ *
+ * Neither grows without bound: a thumbnail is deleted once its
+ * segment is W_EVENT_THUMBNAIL_KEEP_MARGIN_SEGMENTS beyond leaving the
+ * playlist (the "thumbnail" of its line in the index then refers to
+ * a file that is gone) and, when the index has grown to
+ * W_EVENT_INDEX_TRIM_MARGIN_NUM lines more than
+ * W_EVENT_INDEX_ENTRY_MAX_NUM, it is rewritten with only the last
+ * W_EVENT_INDEX_ENTRY_MAX_NUM lines; a reader that keeps track of
+ * how far into the index it has read will find the index shorter
+ * than that when this happens.
+ *
+ * wEventActivity() should only be called from the image processing
+ * thread that finds the moving objects and wEventSegment() only from
+ * the video encode thread.
+ */
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+#ifndef W_EVENT_FILE_NAME_SUFFIX
+/** What to append to the HLS output file name to make the name
+ * of the event index file.
+ */
+# define W_EVENT_FILE_NAME_SUFFIX "_events"
+#endif
+
+#ifndef W_EVENT_FILE_EXTENSION
+/** Event index file extension: one JSON object per line.
+ */
+# define W_EVENT_FILE_EXTENSION ".jsonl"
+#endif
+
+#ifndef W_EVENT_THUMBNAIL_FILE_EXTENSION
+/** Event thumbnail file extension.
+ */
+# define W_EVENT_THUMBNAIL_FILE_EXTENSION ".jpg"
+#endif
+
+#ifndef W_EVENT_THUMBNAIL_WIDTH_PIXELS
+/** The width of an event thumbnail; the height follows from the
+ * aspect ratio of the video.
+ */
+# define W_EVENT_THUMBNAIL_WIDTH_PIXELS 160
+#endif
+
+/** The height of an event thumbnail.
+ */
+#define W_EVENT_THUMBNAIL_HEIGHT_PIXELS ((W_EVENT_THUMBNAIL_WIDTH_PIXELS * W_COMMON_HEIGHT_PIXELS) / W_COMMON_WIDTH_PIXELS)
+
+#ifndef W_EVENT_THUMBNAIL_JPEG_QUALITY
+/** The JPEG quality of an event thumbnail, 0 to 100.
+ */
+# define W_EVENT_THUMBNAIL_JPEG_QUALITY 75
+#endif
+
+#ifndef W_EVENT_ACTIVITY_AREA_PIXELS_MIN
+/** The area of motion, in pixels, that puts a frame into the event
+ * index; the same as event recording uses by default.
+ */
+# define W_EVENT_ACTIVITY_AREA_PIXELS_MIN ((W_COMMON_WIDTH_PIXELS * W_COMMON_HEIGHT_PIXELS) / 200)
+#endif
+
+#ifndef W_EVENT_MSG_QUEUE_MAX_SIZE
+/** The maximum number of messages waiting for the event index
+ * thread: a frame of motion is a message, as is each segment, so
+ * this is a little over a second of everything moving.
+ */
+# define W_EVENT_MSG_QUEUE_MAX_SIZE (W_COMMON_FRAME_RATE_HERTZ + 10)
+#endif
+
+#ifndef W_EVENT_THUMBNAIL_KEEP_MARGIN_SEGMENTS
+/** How many segments beyond W_HLS_LIST_SIZE to keep the thumbnail of
+ * a segment for, so that a client showing a playlist it read a
+ * little while ago can still fetch the thumbnails of it.
+ */
+# define W_EVENT_THUMBNAIL_KEEP_MARGIN_SEGMENTS 5
+#endif
+
+#ifndef W_EVENT_INDEX_ENTRY_MAX_NUM
+/** The number of lines kept in the index when it is trimmed: a bit
+ * over 2 Mbytes, a day of something moving in one segment in four.
+ */
+# define W_EVENT_INDEX_ENTRY_MAX_NUM 10000
+#endif
+
+#ifndef W_EVENT_INDEX_TRIM_MARGIN_NUM
+/** How many lines the index may grow beyond
+ * W_EVENT_INDEX_ENTRY_MAX_NUM before it is trimmed, so that the
+ * rewriting of it is done only once in a while.
+ */
+# define W_EVENT_INDEX_TRIM_MARGIN_NUM (W_EVENT_INDEX_ENTRY_MAX_NUM / 10)
+#endif
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** The motion found in a frame, as reported to wEventActivity();
+ * coordinates are those of the video frame, origin top left.
+ */
+typedef struct {
+    unsigned int sequence; // The camera sequence number, which is the presentation time-stamp
+    int areaPixels; // As returned by image processing, zero if there was no motion
+    int focusX; // The focus point
+    int focusY;
+    int boxX; // The box bounding all of the moving objects
+    int boxY;
+    int boxWidth;
+    int boxHeight;
+} wEventActivity_t;
+
+/* ----------------------------------------------------------------
+ * FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/** Start the event index; any existing index file of the same name
+ * is appended to, having been trimmed if it is too long, and any
+ * thumbnails left over from before are deleted, since the segments
+ * they belong to are gone.  wMsgInit() must have returned
+ * successfully before this is called.  If the event index is
+ * already started this function will do nothing and return success.
+ *
+ * @param outputDirectory the directory to write the index and the
+ *                        thumbnails to, which must exist; should not
+ *                        end in a "/".
+ * @param outputFileName  the HLS output file name, to which
+ *                        W_EVENT_FILE_NAME_SUFFIX and
+ *                        W_EVENT_FILE_EXTENSION are appended to make
+ *                        the name of the index file.
+ * @return                zero on success else negative error code.
+ */
+int wEventStart(std::string outputDirectory, std::string outputFileName);
+
+/** Determine whether the event index is started.
+ *
+ * @return true if wEventStart() has been called successfully.
+ */
+bool wEventIsStarted();
+
+/** Report the motion in a frame; called by image processing for
+ * every frame on which motion detection is performed.  Nothing is
+ * done unless the event index is started and the area of motion is
+ * at least W_EVENT_ACTIVITY_AREA_PIXELS_MIN, in which case the image
+ * is scaled down to a thumbnail, which is kept in case this frame
+ * turns out to be the peak of its segment.
+ *
+ * @param activity the motion in the frame; cannot be nullptr.
+ * @param image    the luma of the frame, or of a smaller copy of it
+ *                 (e.g. the analysis stream), for the thumbnail.
+ * @param width    the width of image in pixels.
+ * @param height   the height of image in pixels.
+ * @param stride   the number of bytes between rows of image.
+ */
+void wEventActivity(const wEventActivity_t *activity, const uint8_t *image,
+                    unsigned int width, unsigned int height,
+                    unsigned int stride);
+
+/** Report the start of an HLS segment; called by the video encoder
+ * for the packet that begins each segment, before the packet is
+ * written to the HLS output.  Segments must be reported in order.
+ *
+ * @param segment the media sequence number of the segment, which
+ *                is also the number in its file name.
+ * @param pts     the presentation time-stamp of the packet that
+ *                begins the segment.
+ */
+void wEventSegment(int64_t segment, int64_t pts);
+
+/** Stop the event index, writing the entry for the last segment.
+ */
+void wEventStop();
+
+#endif // _W_EVENT_H_
+
+// End of file
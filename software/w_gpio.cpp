@@ -18,19 +18,26 @@
  * @brief The implementation of the GPIO portion of the watchdog application.
  *
  * This code makes use of libgpiod to read/write GPIO pins, hence must
- * be linked with libgpiod.
+ * be linked with libgpiod; PWM pins are driven by the sysfs interface
+ * to the hardware PWM chip where there is one.
  */
 
 // The CPP stuff.
 #include <cstring>
+#include <string>
 #include <memory>
 #include <thread>
 #include <atomic>
 
 // The Linux/Posix stuff.
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <gpiod.h>
 
 // Other parts of watchdog.
@@ -45,6 +52,15 @@
  * COMPILE-TIME MACROS
  * -------------------------------------------------------------- */
 
+// An edge event timestamp further from the time now than this is
+// assumed to be from a different clock (older kernels use
+// CLOCK_REALTIME) and is not included in the latency statistics.
+#define W_GPIO_EVENT_LATENCY_SANE_MAX_NS 1000000000LL
+
+// How long to wait, in milliseconds, for the files of a newly
+// exported hardware PWM channel to become writeable.
+#define W_GPIO_PWM_EXPORT_WAIT_MS 100
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
@@ -52,7 +68,7 @@
 // Storage for debouncing a GPIO.
 typedef struct {
     struct gpiod_line *line;
-    unsigned int notLevelCount;
+    int64_t lockoutEndNs; // CLOCK_MONOTONIC, zero if not locked out.
 } wGpioDebounce_t;
 
 // The possible bias for a GPIO input; if you change the order
@@ -68,7 +84,9 @@ typedef struct {
     unsigned int pin;
     const char *name;
     wGpioBias_t bias;
-    unsigned int level;
+    // Atomic since it is written by the GPIO read thread and can
+    // be read by anyone
+    std::atomic<unsigned int> level;
     wGpioDebounce_t debounce;
 } wGpioInput_t;
 
@@ -93,13 +111,17 @@ typedef struct {
     unsigned int initialLevel;
 } wGpioOutput_t;
 
-// An output pin that is a PWM pin.
+// An output pin that is a PWM pin: driven by a channel of the
+// hardware PWM chip if dutyCycleFd is not negative, else by
+// pwmLoop() if line is not nullptr.
 typedef struct {
     unsigned int pin;
+    unsigned int channel;
     // Atomic since it is read from the PWM thread and can be
     // written by anyone
     std::atomic<unsigned int> levelPercent;
     struct gpiod_line *line;
+    int dutyCycleFd;
 } wGpioPwm_t;
 
 /* ----------------------------------------------------------------
@@ -112,10 +134,17 @@ static bool gKeepGoing = false;
 // Our GPIO chip.
 static gpiod_chip *gChip = nullptr;
 
-// The file handle of the timer that drives the GPIO read loop for
-// debouncing.
+// The file handle of the one-shot timer that ends the debounce
+// lockout of an input pin.
 static int gTimerReadFd = -1;
 
+// The file handle of the event that tells the GPIO read thread
+// to stop.
+static int gEventReadStopFd = -1;
+
+// A local keep-going flag for the GPIO read thread.
+static std::atomic<bool> gReadKeepGoing(false);
+
 // The file handle of the timer that drives the GPIO PWM loop.
 static int gTimerPwmFd = -1;
 
@@ -174,25 +203,53 @@ static wGpioOutput_t gOutputPin[] = {{.pin = W_GPIO_PIN_OUTPUT_ROTATE_DISABLE,
                                       .driveStrength = W_GPIO_OUTPUT_DRIVE_STRENGTH_16_MA,
                                       .initialLevel = 0}};
 
-// Array of PWM output pins (which must also be in gOutputPin[]).
-static wGpioPwm_t gPwmPin[] = {{.pin = W_GPIO_PIN_OUTPUT_EYE_LEFT},
-                               {.pin = W_GPIO_PIN_OUTPUT_EYE_RIGHT}};
+// Array of PWM output pins (which must also be in gOutputPin[])
+// with the hardware PWM channel each is connected to.
+static wGpioPwm_t gPwmPin[] = {{.pin = W_GPIO_PIN_OUTPUT_EYE_LEFT,
+                                .channel = W_GPIO_PWM_CHANNEL_EYE_LEFT,
+                                .levelPercent = {0},
+                                .line = nullptr,
+                                .dutyCycleFd = -1},
+                               {.pin = W_GPIO_PIN_OUTPUT_EYE_RIGHT,
+                                .channel = W_GPIO_PWM_CHANNEL_EYE_RIGHT,
+                                .levelPercent = {0},
+                                .line = nullptr,
+                                .dutyCycleFd = -1}};
 
 // Array of names for the bias types, just for printing; must be in the same
 // order as wGpioBias_t.
 static const char *gBiasStr[] = {"none", "pull down", "pull up"};
 
-// Monitor the number of times we've read GPIOs, purely for information.
-static uint64_t gInputReadCount = 0;
+// Monitor the number of edge events on the input pins, purely
+// for information.
+static uint64_t gInputEventCount = 0;
+
+// Monitor the number of times the debounced level of an input pin
+// has changed, purely for information.
+static uint64_t gInputChangeCount = 0;
+
+// Monitor the number of edge events ignored as bounce, purely for
+// information.
+static uint64_t gInputBounceCount = 0;
+
+// Monitor the number of times the level of an input pin read at the
+// end of a debounce lockout was not what the edge said, i.e. the
+// edge was noise or the switch bounced back, purely for information.
+static uint64_t gInputSettleCorrectionCount = 0;
+
+// Monitor the number of times the input pins could not be read at
+// the end of a debounce lockout, purely for information.
+static uint64_t gInputSettleReadFailCount = 0;
+
+// Monitor the worst time in nanoseconds from the kernel timestamping
+// an edge to the debounced level being updated, purely for
+// information.
+static int64_t gInputLatencyMaxNs = 0;
 
 // Monitor the start and stop time of GPIO reading, purely for information.
 static std::chrono::system_clock::time_point gInputReadStart = {};
 static std::chrono::system_clock::time_point gInputReadStop = {};
 
-// Remember the number of times the GPIO read thread has not been called
-// dead on time, purely for information.
-static uint64_t gInputReadSlipCount = 0;
-
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -295,9 +352,10 @@ static int cfg(unsigned int pin, bool isOutput,
                 default:
                     break;
             }
-            errorCode = gpiod_line_request_input_flags(line,
-                                                       W_GPIO_CONSUMER_NAME,
-                                                       flags);
+            // Inputs are read on edge events, see readLoop()
+            errorCode = gpiod_line_request_both_edges_events_flags(line,
+                                                                   W_GPIO_CONSUMER_NAME,
+                                                                   flags);
         }
     }
 
@@ -317,62 +375,158 @@ static int rawGet(unsigned int pin)
     return levelOrErrorCode;
 }
 
+// Get the monotonic time in nanoseconds.
+static int64_t timeNowNs()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((int64_t) now.tv_sec) * 1000000000LL + now.tv_nsec;
+}
+
+// Set the one-shot debounce timer to go off at the given
+// CLOCK_MONOTONIC time, or disarm it if the time is zero.
+static void debounceTimerSet(int timerFd, int64_t timeNs)
+{
+    struct itimerspec timerSpec = {};
+
+    timerSpec.it_value.tv_sec = timeNs / 1000000000LL;
+    timerSpec.it_value.tv_nsec = timeNs % 1000000000LL;
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timerSpec, nullptr);
+}
+
+// Handle an edge event on an input pin: the first edge is believed
+// straight away, any more are ignored until the lockout ends.
+static void edgeHandle(wGpioInput_t *gpioInput, int64_t timeNowNs)
+{
+    struct gpiod_line_event event;
+
+    if (gpiod_line_event_read(gpioInput->debounce.line, &event) == 0) {
+        gInputEventCount++;
+        if (gpioInput->debounce.lockoutEndNs == 0) {
+            unsigned int level = (event.event_type == GPIOD_LINE_EVENT_RISING_EDGE) ? 1 : 0;
+            if (gpioInput->level != level) {
+                gpioInput->level = level;
+                gInputChangeCount++;
+            }
+            gpioInput->debounce.lockoutEndNs = timeNowNs + ((int64_t) W_GPIO_DEBOUNCE_MS) * 1000000LL;
+            int64_t latencyNs = timeNowNs - (((int64_t) event.ts.tv_sec) * 1000000000LL + event.ts.tv_nsec);
+            if ((latencyNs >= 0) && (latencyNs < W_GPIO_EVENT_LATENCY_SANE_MAX_NS) &&
+                (latencyNs > gInputLatencyMaxNs)) {
+                gInputLatencyMaxNs = latencyNs;
+            }
+        } else {
+            gInputBounceCount++;
+        }
+    }
+}
+
+// End the lockout of any input pins whose time has come, reading
+// them together to get the levels they have settled at, and return
+// when the next lockout ends, zero if there are none.  If the pins
+// cannot be read their lockouts are ended anyway, keeping the level
+// that the edge gave, since otherwise nothing would end them and
+// every edge from then on would be ignored as bounce.
+static int64_t lockoutsEnd(int64_t timeNowNs)
+{
+    struct gpiod_line_bulk bulk;
+    wGpioInput_t *gpioInputEnded[W_UTIL_ARRAY_COUNT(gInputPin)];
+    int values[W_UTIL_ARRAY_COUNT(gInputPin)] = {};
+    unsigned int numEnded = 0;
+    int64_t nextNs = 0;
+
+    gpiod_line_bulk_init(&bulk);
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gInputPin); x++) {
+        wGpioInput_t *gpioInput = &(gInputPin[x]);
+        if (gpioInput->debounce.lockoutEndNs > 0) {
+            if (gpioInput->debounce.lockoutEndNs <= timeNowNs) {
+                gpiod_line_bulk_add(&bulk, gpioInput->debounce.line);
+                gpioInputEnded[numEnded] = gpioInput;
+                numEnded++;
+            } else if ((nextNs == 0) || (gpioInput->debounce.lockoutEndNs < nextNs)) {
+                nextNs = gpioInput->debounce.lockoutEndNs;
+            }
+        }
+    }
+
+    if (numEnded > 0) {
+        bool readOk = (gpiod_line_get_value_bulk(&bulk, values) == 0);
+        if (!readOk) {
+            gInputSettleReadFailCount++;
+            W_LOG_ERROR("unable to read %d GPIO input pin(s) at the end of"
+                        " debounce (%d), keeping the level from the edge!",
+                        numEnded, errno);
+        }
+        for (unsigned int x = 0; x < numEnded; x++) {
+            wGpioInput_t *gpioInput = gpioInputEnded[x];
+            if (readOk && (gpioInput->level != (unsigned int) values[x])) {
+                gpioInput->level = values[x];
+                gInputChangeCount++;
+                gInputSettleCorrectionCount++;
+            }
+            gpioInput->debounce.lockoutEndNs = 0;
+        }
+    }
+
+    return nextNs;
+}
+
 // GPIO task/thread/thing to debounce inputs and provide a stable
 // input level in gInputPin[].
 //
 // Note: it would have been nice to read the GPIOs in a signal handler
 // directly but the libgpiod functions are not async-safe (brgl,
-// author of libgpiod, confirmed this), hence we use a timer and read
-// the GPIOs in this thread, triggered from that timer.  This loop
-// should be run at max priority; any timer ticks that are missed are
-// monitored in gInputReadSlipCount.
-static void readLoop(int timerFd, bool *keepGoing, void *context)
+// author of libgpiod, confirmed this).  Originally this loop was
+// driven by a 1 ms tick-timer, reading one pin per tick and needing
+// several consistent reads to believe a change, so a limit switch
+// took well over 10 ms to be seen and the thread woke 1000 times a
+// second whatever was going on.  Now the input pins are requested
+// for edge events and this thread blocks on their file descriptors,
+// plus a one-shot timer that ends a debounce lockout and an event
+// that tells it to stop, so it only wakes when something happens.
+// This loop should be run at max priority.
+static void readLoop()
 {
-    unsigned int x = 0;
-    unsigned int level;
-    int numExpiriesSaved = 0;
-    int numExpiriesPassed;
-
-    (void) context;
+    struct pollfd pollFd[W_UTIL_ARRAY_COUNT(gInputPin) + 2] = {};
+    unsigned int numPollFds = 0;
+    uint64_t value;
+
+    pollFd[numPollFds].fd = gEventReadStopFd;
+    pollFd[numPollFds].events = POLLIN;
+    numPollFds++;
+    pollFd[numPollFds].fd = gTimerReadFd;
+    pollFd[numPollFds].events = POLLIN;
+    numPollFds++;
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gInputPin); x++) {
+        pollFd[numPollFds].fd = gpiod_line_event_get_fd(gInputPin[x].debounce.line);
+        pollFd[numPollFds].events = POLLIN;
+        numPollFds++;
+    }
 
     gInputReadStart = std::chrono::system_clock::now();
     W_LOG_DEBUG("GPIO read loop has started");
-    while (*keepGoing && wUtilKeepGoing()) {
-
-        // Block waiting for the tick-timer to go off for up to a time,
-        // or for CTRL-C to land
-        int numExpiries = wUtilBlockTimer(timerFd);
-        if (numExpiries > 0) {
-            // Track the number of times we've missed a timer
-            // expiry, for debug purposes.
-            numExpiriesPassed = numExpiries - numExpiriesSaved;
-            if (numExpiriesPassed > 1) {
-                gInputReadSlipCount += numExpiriesPassed - 1;
+    while (gReadKeepGoing) {
+        if (poll(pollFd, numPollFds, -1) > 0) {
+            int64_t nowNs = timeNowNs();
+            if (pollFd[0].revents & POLLIN) {
+                // Told to stop
+                gReadKeepGoing = false;
             }
-            gInputReadCount++;
-            // Read the level from the next input pin in the array
-            wGpioInput_t *gpioInput = &(gInputPin[x]);
-            level = gpiod_line_get_value(gpioInput->debounce.line);
-            if (gpioInput->level != level) {
-                // Level is different to the last stable level, increment count
-                gpioInput->debounce.notLevelCount++;
-                if (gpioInput->debounce.notLevelCount > W_GPIO_DEBOUNCE_THRESHOLD) {
-                    // Count is big enough that we're sure, set the level and
-                    // reset the count
-                    gpioInput->level = level;
-                    gpioInput->debounce.notLevelCount = 0;
+            if (pollFd[1].revents & POLLIN) {
+                // Just need to clear the timer, lockoutsEnd() works
+                // out which lockouts have ended
+                if (read(gTimerReadFd, &value, sizeof(value)) != sizeof(value)) {
+                    W_LOG_DEBUG("GPIO read loop: unable to read timer (%d).", errno);
                 }
-            } else {
-                // Current level is the same as the stable level, zero the change count
-                gpioInput->debounce.notLevelCount = 0;
             }
-
-            // Next input pin next time
-            x++;
-            if (x >= W_UTIL_ARRAY_COUNT(gInputPin)) {
-                x = 0;
+            for (unsigned int x = 2; x < numPollFds; x++) {
+                if (pollFd[x].revents & POLLIN) {
+                    edgeHandle(&(gInputPin[x - 2]), nowNs);
+                }
             }
-            numExpiriesSaved = numExpiries;
+            // Re-arm the timer for whatever lockout ends next
+            debounceTimerSet(gTimerReadFd, lockoutsEnd(nowNs));
         }
     }
     gInputReadStop = std::chrono::system_clock::now();
@@ -380,57 +534,253 @@ static void readLoop(int timerFd, bool *keepGoing, void *context)
     W_LOG_DEBUG("GPIO read loop has exited");
 }
 
-// Task/thread/thing to drive the PWM output of the pins in gPwmPin[].
+// Start the GPIO read thread, and the timer and event it needs;
+// returns zero on success else negative error code.
+static int readStart()
+{
+    int errorCode = 0;
+
+    gTimerReadFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (gTimerReadFd >= 0) {
+        gEventReadStopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    if ((gTimerReadFd < 0) || (gEventReadStopFd < 0)) {
+        errorCode = -errno;
+        W_LOG_ERROR("unable to create GPIO read timer/event (%d)!", errorCode);
+    }
+    if (errorCode == 0) {
+        gReadKeepGoing = true;
+        try {
+            gThreadRead = std::thread(readLoop);
+        }
+        catch (std::exception &e) {
+            gReadKeepGoing = false;
+            errorCode = -ENOMEM;
+            W_LOG_ERROR("unable to start GPIO read thread (%s)!", e.what());
+        }
+        if (errorCode == 0) {
+            // Set the required priority and name
+            struct sched_param scheduling;
+            scheduling.sched_priority = W_COMMON_THREAD_REAL_TIME_PRIORITY(W_COMMON_THREAD_PRIORITY_GPIO_READ);
+            errorCode = -pthread_setschedparam(gThreadRead.native_handle(),
+                                               SCHED_FIFO, &scheduling);
+            if (errorCode == 0) {
+                pthread_setname_np(gThreadRead.native_handle(), "readLoop");
+                wUtilThreadPlacementSet(gThreadRead.native_handle(), "readLoop");
+            } else {
+                W_LOG_ERROR("unable to set schedule of GPIO read thread (%d)!",
+                            errorCode);
+            }
+        }
+    }
+
+    return errorCode;
+}
+
+// Stop the GPIO read thread, and free the timer and event it needs.
+static void readStop()
+{
+    if (gThreadRead.joinable()) {
+        uint64_t value = 1;
+        if (write(gEventReadStopFd, &value, sizeof(value)) != sizeof(value)) {
+            // Fall back to the flag, the thread will see it
+            // on the next edge
+            gReadKeepGoing = false;
+        }
+        gThreadRead.join();
+    }
+    if (gEventReadStopFd >= 0) {
+        close(gEventReadStopFd);
+        gEventReadStopFd = -1;
+    }
+    if (gTimerReadFd >= 0) {
+        close(gTimerReadFd);
+        gTimerReadFd = -1;
+    }
+}
+
+// Task/thread/thing to drive the PWM output of the pins in gPwmPin[]
+// that do not have a hardware PWM channel.
 static void pwmLoop(int timerFd, bool *keepGoing, void *context)
 {
     unsigned int pwmCount = 0;
-    wGpioPwm_t *gpioPwmPinCopy = (wGpioPwm_t *) malloc(sizeof(gPwmPin));
+    unsigned int levelPercent[W_UTIL_ARRAY_COUNT(gPwmPin)] = {};
 
     (void) context;
 
-    if (gpioPwmPinCopy) {
-        W_LOG_DEBUG("GPIO PWM loop has started");
-        while (*keepGoing && wUtilKeepGoing()) {
-            // Block waiting for the PWM timer to go off for up to a time,
-            // or for CTRL-C to land
-            // Allow the commanded level of a PWM pin to change only at the
-            // end of a PWM count period
-            memcpy((void *) gpioPwmPinCopy, gPwmPin, sizeof(gPwmPin));
-            int numExpiries = wUtilBlockTimer(timerFd);
-            for (int x = 0; x < numExpiries; x++) {
-                // Progress all of the PWM pins
-                wGpioPwm_t *gpioPwm = gpioPwmPinCopy;
-                for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gPwmPin); x++) {
+    W_LOG_DEBUG("GPIO PWM loop has started");
+    while (*keepGoing && wUtilKeepGoing()) {
+        // Block waiting for the PWM timer to go off for up to a time,
+        // or for CTRL-C to land
+        int numExpiries = wUtilBlockTimer(timerFd);
+        for (int y = 0; y < numExpiries; y++) {
+            // Progress all of the PWM pins
+            for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gPwmPin); x++) {
+                wGpioPwm_t *gpioPwm = &(gPwmPin[x]);
+                if (gpioPwm->line) {
                     // If the "percentage" count has passed beyond the value
                     // for this pin, set the output low, otherwise if we're
                     // starting the count again and the percentage is non-zero,
-                    // set the output pin high
+                    // set the output pin high; the commanded level of a PWM
+                    // pin is allowed to change only at the start of a PWM
+                    // count period
                     if (pwmCount == 0) {
-                        if (gpioPwm->levelPercent > 0) {
+                        levelPercent[x] = gpioPwm->levelPercent;
+                        if (levelPercent[x] > 0) {
                             gpiod_line_set_value(gpioPwm->line, 1);
                         }
-                    } else if (pwmCount >= gpioPwm->levelPercent * W_GPIO_PWM_MAX_COUNT / 100) {
+                    } else if (pwmCount >= levelPercent[x] * W_GPIO_PWM_MAX_COUNT / 100) {
                         gpiod_line_set_value(gpioPwm->line, 0);
                     }
-                    gpioPwm++;
-                }
-                pwmCount++;
-                if (pwmCount >= W_GPIO_PWM_MAX_COUNT) {
-                    pwmCount = 0;
-                    gpioPwm = gpioPwmPinCopy;
-                    // Take a new copy of the pin levels
-                    memcpy((void *) gpioPwmPinCopy, gPwmPin, sizeof(gPwmPin));
                 }
             }
+            pwmCount++;
+            if (pwmCount >= W_GPIO_PWM_MAX_COUNT) {
+                pwmCount = 0;
+            }
         }
+    }
+
+    W_LOG_DEBUG("GPIO PWM loop has exited.");
+}
 
-        // Free memory
-        free(gpioPwmPinCopy);
+// Write a value to a file of the hardware PWM chip, returning zero
+// on success else negative error code.
+static int pwmChipWrite(std::string path, std::string value)
+{
+    int errorCode = 0;
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+
+    if (fd >= 0) {
+        if (write(fd, value.c_str(), value.length()) != (ssize_t) value.length()) {
+            errorCode = -errno;
+        }
+        close(fd);
     } else {
-        W_LOG_ERROR("unable to allocate %d byte(s) for gpioPwmPin!");
+        errorCode = -errno;
     }
 
-    W_LOG_DEBUG("GPIO PWM loop has exited.");
+    return errorCode;
+}
+
+// Write the duty cycle for a level to the open duty_cycle file of a
+// hardware PWM channel, returning zero on success else negative
+// error code.
+static int pwmDutyCycleWrite(int fd, unsigned int levelPercent)
+{
+    int errorCode = 0;
+    char buffer[32];
+
+    if (levelPercent > 100) {
+        levelPercent = 100;
+    }
+    int length = snprintf(buffer, sizeof(buffer), "%lld",
+                          ((long long) W_GPIO_PWM_HARDWARE_PERIOD_NS) * levelPercent / 100);
+    if (pwrite(fd, buffer, length, 0) != length) {
+        errorCode = -errno;
+    }
+
+    return errorCode;
+}
+
+// Return the sysfs directory of a hardware PWM channel.
+static std::string pwmChannelPath(const wGpioPwm_t *gpioPwm)
+{
+    return std::string(W_GPIO_PWM_CHIP_PATH) + "/pwm" + std::to_string(gpioPwm->channel);
+}
+
+// Stop driving a PWM pin from its hardware PWM channel, if it was;
+// the output is left off.
+static void pwmHardwareClose(wGpioPwm_t *gpioPwm)
+{
+    if (gpioPwm->dutyCycleFd >= 0) {
+        std::string channelPath = pwmChannelPath(gpioPwm);
+        pwmDutyCycleWrite(gpioPwm->dutyCycleFd, 0);
+        close(gpioPwm->dutyCycleFd);
+        gpioPwm->dutyCycleFd = -1;
+        pwmChipWrite(channelPath + "/enable", "0");
+        pwmChipWrite(std::string(W_GPIO_PWM_CHIP_PATH) + "/unexport",
+                     std::to_string(gpioPwm->channel));
+    }
+}
+
+// Start driving a PWM pin, at its current level, from its hardware
+// PWM channel, returning zero on success else negative error code,
+// in which case the pin is left for pwmLoop().
+static int pwmHardwareOpen(wGpioPwm_t *gpioPwm)
+{
+    int errorCode = -ENODEV;
+    std::string chipPath = W_GPIO_PWM_CHIP_PATH;
+
+    if (!chipPath.empty() && (access(chipPath.c_str(), F_OK) == 0)) {
+        std::string channelPath = pwmChannelPath(gpioPwm);
+        bool exported = false;
+        errorCode = 0;
+        if (access(channelPath.c_str(), F_OK) != 0) {
+            errorCode = pwmChipWrite(chipPath + "/export",
+                                     std::to_string(gpioPwm->channel));
+            exported = (errorCode == 0);
+            // udev may take a moment to give us permission to
+            // write to the files of the new channel
+            for (unsigned int x = 0; (errorCode == 0) &&
+                                     (access((channelPath + "/enable").c_str(), W_OK) != 0) &&
+                                     (x < W_GPIO_PWM_EXPORT_WAIT_MS); x++) {
+                usleep(1000);
+            }
+        }
+        if (errorCode == 0) {
+            // Zero the duty cycle first since it may not be set
+            // greater than the period
+            errorCode = pwmChipWrite(channelPath + "/duty_cycle", "0");
+        }
+        if (errorCode == 0) {
+            errorCode = pwmChipWrite(channelPath + "/period",
+                                     std::to_string(W_GPIO_PWM_HARDWARE_PERIOD_NS));
+        }
+        if (errorCode == 0) {
+            // Keep the duty cycle file open as wGpioPwmSet() writes to it
+            gpioPwm->dutyCycleFd = open((channelPath + "/duty_cycle").c_str(),
+                                        O_WRONLY | O_CLOEXEC);
+            if (gpioPwm->dutyCycleFd >= 0) {
+                errorCode = pwmDutyCycleWrite(gpioPwm->dutyCycleFd,
+                                              gpioPwm->levelPercent);
+            } else {
+                errorCode = -errno;
+            }
+        }
+        if (errorCode == 0) {
+            errorCode = pwmChipWrite(channelPath + "/enable", "1");
+        }
+        if (errorCode != 0) {
+            W_LOG_WARN("unable to use channel %d of hardware PWM chip %s"
+                       " for pin %d (%d), will use software PWM.",
+                       gpioPwm->channel, chipPath.c_str(),
+                       gpioPwm->pin, errorCode);
+            if (gpioPwm->dutyCycleFd >= 0) {
+                close(gpioPwm->dutyCycleFd);
+                gpioPwm->dutyCycleFd = -1;
+            }
+            if (exported) {
+                pwmChipWrite(chipPath + "/unexport",
+                             std::to_string(gpioPwm->channel));
+            }
+        }
+    }
+
+    return errorCode;
+}
+
+// Return true if a pin is driven by a hardware PWM channel.
+static bool pwmHardwareHas(unsigned int pin)
+{
+    bool hasHardware = false;
+
+    for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gPwmPin)) &&
+                             !hasHardware; x++) {
+        hasHardware = (gPwmPin[x].pin == pin) && (gPwmPin[x].dutyCycleFd >= 0);
+    }
+
+    return hasHardware;
 }
 
 /* ----------------------------------------------------------------
@@ -441,8 +791,9 @@ static void pwmLoop(int timerFd, bool *keepGoing, void *context)
 int wGpioInit()
 {
     int errorCode = 0;
+    unsigned int numPwmSoftware = 0;
 
-    if ((gTimerReadFd < 0) && (gTimerPwmFd < 0)) {
+    if (!gThreadRead.joinable() && (gTimerPwmFd < 0)) {
         gKeepGoing = true;
         // Configure all of the input pins and get their initial states
         for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gInputPin)) &&
@@ -452,7 +803,7 @@ int wGpioInit()
             if (errorCode == 0) {
                 gpioInput->level = rawGet(gpioInput->pin);
                 gpioInput->debounce.line = lineGet(gpioInput->pin);
-                gpioInput->debounce.notLevelCount = 0;
+                gpioInput->debounce.lockoutEndNs = 0;
             } else {
                 W_LOG_ERROR("unable to set pin %d as an input with bias %s!",
                             gpioInput->pin,
@@ -460,54 +811,65 @@ int wGpioInit()
             }
         }
 
-        // Configure all of the output pins to their initial states
-        for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gOutputPin)) &&
+        // Drive each PWM pin from its hardware PWM channel if
+        // possible, else from pwmLoop()
+        for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gPwmPin)) &&
                                  (errorCode == 0); x++) {
-            wGpioOutput_t *gpioOutput = &(gOutputPin[x]);
-            errorCode = cfg(gpioOutput->pin, true, W_GPIO_BIAS_NONE,
-                            gpioOutput->initialLevel,
-                            gpioOutput->driveStrength);
-            if (errorCode != 0) {
-                W_LOG_ERROR("unable to set pin %d as an output,"
-                            " drive strength %d and %s!",
-                            gpioOutput->pin,
-                            gpioOutput->driveStrength,
-                            gpioOutput->initialLevel ? "high" : "low");
+            wGpioPwm_t *gpioPwm = &(gPwmPin[x]);
+            gpioPwm->levelPercent = 0;
+            for (unsigned int y = 0; y < W_UTIL_ARRAY_COUNT(gOutputPin); y++) {
+                wGpioOutput_t *gpioOutput = &(gOutputPin[y]);
+                if (gpioPwm->pin == gpioOutput->pin) {
+                    gpioPwm->levelPercent = gpioOutput->initialLevel * 100;
+                    break;
+                }
             }
-        }
-
-        if (errorCode == 0) {
-            // Populate gPwmPin
-            for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gPwmPin); x++) {
-                wGpioPwm_t *gpioPwm = &(gPwmPin[x]);
+            gpioPwm->line = nullptr;
+            if (pwmHardwareOpen(gpioPwm) == 0) {
+                W_LOG_DEBUG("GPIO pin %d is driven by channel %d of"
+                            " hardware PWM chip %s.", gpioPwm->pin,
+                            gpioPwm->channel, W_GPIO_PWM_CHIP_PATH);
+            } else {
                 gpioPwm->line = lineGet(gpioPwm->pin);
-                gpioPwm->levelPercent = 0;
-                for (unsigned int y = 0; y < W_UTIL_ARRAY_COUNT(gOutputPin); y++) {
-                    wGpioOutput_t *gpioOutput = &(gOutputPin[y]);
-                    if (gpioPwm->pin == gpioOutput->pin) {
-                        gpioPwm->levelPercent = gpioOutput->initialLevel * 100;
-                        break;
-                    }
+                if (gpioPwm->line) {
+                    numPwmSoftware++;
+                } else {
+                    errorCode = -ENODEV;
+                    W_LOG_ERROR("unable to get GPIO pin %d for PWM!",
+                                gpioPwm->pin);
                 }
             }
         }
 
-        if (errorCode == 0) {
-            // Set up the thread and tick-timer to drive readLoop()
-            errorCode = wUtilThreadTickedStart(W_COMMON_THREAD_PRIORITY_GPIO_READ,
-                                               W_GPIO_PWM_TICK_TIMER_PERIOD_MS,
-                                               &gKeepGoing,
-                                               readLoop, "readLoop",
-                                               &gThreadRead);
-            if (errorCode >= 0) {
-                gTimerReadFd = errorCode;
-                errorCode = 0;
+        // Configure all of the output pins to their initial states,
+        // leaving alone those that have a hardware PWM channel since
+        // taking them as GPIOs would take them from the PWM chip
+        for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gOutputPin)) &&
+                                 (errorCode == 0); x++) {
+            wGpioOutput_t *gpioOutput = &(gOutputPin[x]);
+            if (!pwmHardwareHas(gpioOutput->pin)) {
+                errorCode = cfg(gpioOutput->pin, true, W_GPIO_BIAS_NONE,
+                                gpioOutput->initialLevel,
+                                gpioOutput->driveStrength);
+                if (errorCode != 0) {
+                    W_LOG_ERROR("unable to set pin %d as an output,"
+                                " drive strength %d and %s!",
+                                gpioOutput->pin,
+                                gpioOutput->driveStrength,
+                                gpioOutput->initialLevel ? "high" : "low");
+                }
             }
         }
+
         if (errorCode == 0) {
-            // Set up the thread and tick-timer to drive pwmLoop()
-            errorCode = wUtilThreadTickedStart(W_COMMON_THREAD_PRIORITY_GPIO_READ,
-                                              W_GPIO_READ_TICK_TIMER_PERIOD_MS,
+            // Set up the thread, timer and event for readLoop()
+            errorCode = readStart();
+        }
+        if ((errorCode == 0) && (numPwmSoftware > 0)) {
+            // Set up the thread and tick-timer to drive pwmLoop(),
+            // only needed if there are pins without hardware PWM
+            errorCode = wUtilThreadTickedStart(W_COMMON_THREAD_PRIORITY_GPIO_PWM,
+                                              W_GPIO_PWM_TICK_TIMER_PERIOD_MS,
                                               &gKeepGoing,
                                               pwmLoop, "pwmLoop",
                                               &gThreadPwm);
@@ -571,8 +933,13 @@ int wGpioPwmSet(unsigned int pin, unsigned int levelPercent)
                              (errorCode < 0); x++) {
         wGpioPwm_t *gpioPwm = &(gPwmPin[x]);
         if (gpioPwm->pin == pin) {
-            gpioPwm->levelPercent = levelPercent;
             errorCode = 0;
+            if ((gpioPwm->levelPercent.exchange(levelPercent) != levelPercent) &&
+                (gpioPwm->dutyCycleFd >= 0)) {
+                // Only bother the PWM chip if there is a change
+                errorCode = pwmDutyCycleWrite(gpioPwm->dutyCycleFd,
+                                              levelPercent);
+            }
         }
     }
 
@@ -585,34 +952,48 @@ void wGpioDeinit()
     struct gpiod_line *line;
 
     // Stop the threads and their timers
-    wUtilThreadTickedStop(&gTimerReadFd, &gThreadRead, &gKeepGoing);
+    readStop();
     wUtilThreadTickedStop(&gTimerPwmFd, &gThreadPwm, &gKeepGoing);
 
     // If we have run, print some diagnostic info
-    uint64_t gpioReadsPerInput = gInputReadCount / W_UTIL_ARRAY_COUNT(gInputPin);
-    if (gpioReadsPerInput > 0) {
-        W_LOG_INFO_START("each GPIO input read (and debounced) every %lld ms",
-                         (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds> (gInputReadStop - gInputReadStart).count() *
-                         W_GPIO_DEBOUNCE_THRESHOLD / gpioReadsPerInput);
-        if (gInputReadSlipCount > 0) {
-            W_LOG_INFO_MORE(", GPIO input read thread was not called on schedule %lld time(s).",
-                            gInputReadSlipCount);
-        }
-        W_LOG_INFO_MORE(".");
+    if (gInputEventCount > 0) {
+        W_LOG_INFO_START("%lld GPIO input edge(s) in %lld second(s), %lld level change(s)",
+                         gInputEventCount,
+                         (uint64_t) std::chrono::duration_cast<std::chrono::seconds> (gInputReadStop - gInputReadStart).count(),
+                         gInputChangeCount);
+        if (gInputBounceCount > 0) {
+            W_LOG_INFO_MORE(", %lld edge(s) ignored as bounce", gInputBounceCount);
+        }
+        if (gInputSettleCorrectionCount > 0) {
+            W_LOG_INFO_MORE(", %lld level(s) corrected after settling",
+                            gInputSettleCorrectionCount);
+        }
+        if (gInputSettleReadFailCount > 0) {
+            W_LOG_INFO_MORE(", %lld failure(s) to read after settling",
+                            gInputSettleReadFailCount);
+        }
+        W_LOG_INFO_MORE(", worst edge to level latency %lld us.",
+                        gInputLatencyMaxNs / 1000);
         W_LOG_INFO_END;
     }
     for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gInputPin); x++) {
-        line = lineGet(x);
+        line = lineGet(gInputPin[x].pin);
         if (line) {
             release(line);
         }
     }
     for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gOutputPin); x++) {
-        line = lineGet(x);
-        if (line) {
-            release(line);
+        if (!pwmHardwareHas(gOutputPin[x].pin)) {
+            line = lineGet(gOutputPin[x].pin);
+            if (line) {
+                release(line);
+            }
         }
     }
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gPwmPin); x++) {
+        pwmHardwareClose(&(gPwmPin[x]));
+        gPwmPin[x].line = nullptr;
+    }
 }
 
 // End of file
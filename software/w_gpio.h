@@ -134,27 +134,15 @@
 # define W_GPIO_CONSUMER_NAME "watchdog"
 #endif
 
-#ifndef W_GPIO_DEBOUNCE_THRESHOLD
-/** The number of times an input pin must have read a consistently
- * different level to the current level for us to believe that it
- * really has changed state.  With a GPIO tick-timer of 1 ms and
- * four input pins, a value of 3 here means that the pin must have
- * read the same level for a full 12 milliseconds before we believe
- * it.
+#ifndef W_GPIO_DEBOUNCE_MS
+/** The debounce period for the input pins in milliseconds.  The
+ * input pins are read on edge events: the first edge on a pin is
+ * believed straight away, so a limit switch is seen with next to
+ * no delay, further edges on that pin are then ignored for this
+ * long, after which the pin is read again to get the level it has
+ * settled at.
  */
-# define W_GPIO_DEBOUNCE_THRESHOLD 3
-#endif
-
-#ifndef W_GPIO_READ_TICK_TIMER_PERIOD_MS
-/** The GPIO tick-timer period in milliseconds: this is used to
- * debounce the input pins, reading one each time, so will
- * run around the four inputs once every fourth period, so using
- * 1 millisecond here would mean an input line is read every
- * 4 milliseconds and so a W_GPIO_DEBOUNCE_THRESHOLD of 3 would
- * mean that a GPIO would need to have read a consistent level
- * for 12 milliseconds.
- */
-# define W_GPIO_READ_TICK_TIMER_PERIOD_MS 1
+# define W_GPIO_DEBOUNCE_MS 10
 #endif
 
 #ifndef W_GPIO_PWM_TICK_TIMER_PERIOD_MS
@@ -173,6 +161,39 @@
 # define W_GPIO_PWM_MAX_COUNT 20
 #endif
 
+#ifndef W_GPIO_PWM_CHIP_PATH
+/** The sysfs directory of the hardware PWM chip that can drive
+ * the PWM pins; if the chip, or a channel of it, is not there
+ * (e.g. the pwm-2chan overlay has not been loaded) the pin falls
+ * back to the software PWM of W_GPIO_PWM_TICK_TIMER_PERIOD_MS and
+ * W_GPIO_PWM_MAX_COUNT.  Define this to "" to always use software
+ * PWM.
+ */
+# define W_GPIO_PWM_CHIP_PATH "/sys/class/pwm/pwmchip0"
+#endif
+
+#ifndef W_GPIO_PWM_CHANNEL_EYE_LEFT
+/** The channel of the hardware PWM chip that W_GPIO_PIN_OUTPUT_EYE_LEFT
+ * is connected to.
+ */
+# define W_GPIO_PWM_CHANNEL_EYE_LEFT 0
+#endif
+
+#ifndef W_GPIO_PWM_CHANNEL_EYE_RIGHT
+/** The channel of the hardware PWM chip that W_GPIO_PIN_OUTPUT_EYE_RIGHT
+ * is connected to.
+ */
+# define W_GPIO_PWM_CHANNEL_EYE_RIGHT 1
+#endif
+
+#ifndef W_GPIO_PWM_HARDWARE_PERIOD_NS
+/** The period of hardware PWM in nanoseconds: 10 kHz is well
+ * beyond visible flicker while still leaving thousands of steps
+ * of duty cycle from the PWM clock.
+ */
+# define W_GPIO_PWM_HARDWARE_PERIOD_NS 100000
+#endif
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
@@ -188,7 +209,9 @@
  */
 int wGpioInit();
 
-/** Get the state of a GPIO pin after debouncing.
+/** Get the state of a GPIO input pin after debouncing; this is
+ * updated by the GPIO read thread as soon as an edge event arrives,
+ * so it is always current, there is no need to poll it any faster.
  *
  * @param pin the GPIO pin number to get the state of.
  * @return    the level of the GPIO pin else negative error code.
@@ -203,7 +226,10 @@ int wGpioGet(unsigned int pin);
  */
 int wGpioSet(unsigned int pin, unsigned int level);
 
-/** Set the state of a GPIO PWM pin.
+/** Set the state of a GPIO PWM pin.  If the pin is driven by a
+ * hardware PWM channel the duty cycle is changed straight away,
+ * else the software PWM loop picks up the new level at the start
+ * of its next period.
  *
  * @param pin          the GPIO pin number to set the state of.
  * @param levelPercent the level to set, as a percentage.
@@ -0,0 +1,607 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief The implementation of the HLS API for the watchdog
+ * application: the low-latency HLS output and the in-memory store
+ * of HLS files.
+ */
+
+// The CPP stuff.
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <deque>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+// The Linux/Posix stuff.
+#include <time.h>
+
+// Other parts of watchdog.
+#include <w_common.h>
+#include <w_util.h>
+#include <w_log.h>
+
+// Us.
+#include <w_hls.h>
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// The HLS version the low-latency playlist conforms to.
+#define W_HLS_LOW_LATENCY_PLAYLIST_VERSION 9
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** A partial segment in the low-latency playlist.
+ */
+typedef struct {
+    double durationSeconds;
+    bool independent;
+} wHlsPart_t;
+
+/** A segment in the low-latency playlist.
+ */
+typedef struct {
+    uint64_t sequence; // The media sequence number
+    std::string programDateTime; // The wall-clock time at the start of the segment, ISO8601
+    std::vector<wHlsPart_t> parts;
+    double durationSeconds;
+    bool complete; // True once the next segment has begun
+    bool partFilesDeleted;
+} wHlsSegment_t;
+
+/** Context for low-latency HLS output.
+ */
+typedef struct {
+    std::string outputDirectory;
+    std::string outputFileName;
+    std::deque<wHlsSegment_t> segment; // Oldest first, the last may be in progress
+    uint64_t sequenceNext; // The media sequence number of the next segment
+    std::vector<uint8_t> segmentData; // The segment in progress, written out when complete
+    bool initWritten;
+} wHlsContext_t;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// Context for low-latency HLS output.
+static wHlsContext_t *gContext = nullptr;
+
+// True if HLS files are being kept in memory, see wHlsMemoryStart().
+static std::atomic<bool> gMemoryStarted(false);
+
+// Mutex protecting the in-memory store, i.e. all of the gMemory
+// variables below.
+static std::mutex gMemoryMutex;
+
+// The in-memory store of HLS files, by name.
+static std::map<std::string, wHlsMemoryFile_t> gMemoryFile;
+
+// The names of the files in gMemoryFile that were written with
+// ring set, oldest first.
+static std::deque<std::string> gMemoryRing;
+
+// The function to call when the store changes, and its context.
+static wHlsMemoryNotifyFunction_t *gMemoryNotify = nullptr;
+static void *gMemoryNotifyContext = nullptr;
+
+// Low-latency mode only: the media sequence number and the number
+// of parts of the last segment in the playlist in memory, and the
+// name of the part the playlist hints will come next.
+static bool gMemoryPlaylistValid = false;
+static uint64_t gMemoryPlaylistSequence = 0;
+static size_t gMemoryPlaylistPartCount = 0;
+static std::string gMemoryPreloadHint;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: FILE NAMES
+ * -------------------------------------------------------------- */
+
+// The file name (without the directory) of the initialisation segment.
+static std::string initFileName(const wHlsContext_t *context)
+{
+    return context->outputFileName +
+           std::string(W_HLS_LOW_LATENCY_INIT_FILE_NAME_SUFFIX) +
+           std::string(W_HLS_LOW_LATENCY_INIT_FILE_EXTENSION);
+}
+
+// The file name (without the directory) of a segment, of the same
+// form as that used by the FFmpeg hls muxer.
+static std::string segmentFileName(const wHlsContext_t *context,
+                                   uint64_t sequence)
+{
+    return context->outputFileName + std::to_string(sequence) +
+           std::string(W_HLS_LOW_LATENCY_SEGMENT_FILE_EXTENSION);
+}
+
+// The file name (without the directory) of a partial segment.
+static std::string partFileName(const wHlsContext_t *context,
+                                uint64_t sequence, size_t part)
+{
+    return context->outputFileName + std::to_string(sequence) + "." +
+           std::to_string(part) +
+           std::string(W_HLS_LOW_LATENCY_SEGMENT_FILE_EXTENSION);
+}
+
+// The full path to a file in the output directory.
+static std::string filePath(const wHlsContext_t *context, std::string fileName)
+{
+    return context->outputDirectory + std::string(W_UTIL_DIR_SEPARATOR) +
+           fileName;
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: THE IN-MEMORY STORE
+ * -------------------------------------------------------------- */
+
+// Call the notify function, if there is one; gMemoryMutex must NOT
+// be locked.
+static void memoryNotify()
+{
+    gMemoryMutex.lock();
+    wHlsMemoryNotifyFunction_t *notify = gMemoryNotify;
+    void *context = gMemoryNotifyContext;
+    gMemoryMutex.unlock();
+
+    if (notify) {
+        notify(context);
+    }
+}
+
+// Put a file in the in-memory store, replacing any of the same name;
+// if ring is true the oldest files written with ring set are deleted
+// so that there are no more than W_HLS_MEMORY_RING_SIZE of them.
+static void memoryFileWrite(std::string name, const uint8_t *data,
+                            size_t length, bool ring)
+{
+    wHlsMemoryFile_t file;
+
+    // The copy is made outside the lock
+    file.data = std::make_shared<const std::vector<uint8_t>>(data, data + length);
+    file.timeUnix = time(nullptr);
+
+    gMemoryMutex.lock();
+    bool isNew = (gMemoryFile.find(name) == gMemoryFile.end());
+    gMemoryFile[name] = file;
+    if (ring && isNew) {
+        gMemoryRing.push_back(name);
+        while (gMemoryRing.size() > W_HLS_MEMORY_RING_SIZE) {
+            gMemoryFile.erase(gMemoryRing.front());
+            gMemoryRing.pop_front();
+        }
+    }
+    gMemoryMutex.unlock();
+
+    memoryNotify();
+}
+
+// Delete a file from the in-memory store.
+static void memoryFileDelete(std::string name)
+{
+    gMemoryMutex.lock();
+    gMemoryFile.erase(name);
+    gMemoryMutex.unlock();
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: OUTPUT
+ * -------------------------------------------------------------- */
+
+// Write a whole file, via a temporary file which is renamed so that
+// whoever is reading it never sees half a file.
+static int fileWrite(std::string path, const void *data, size_t length)
+{
+    int errorCode = -EIO;
+    std::string pathTemporary = path + ".tmp";
+
+    FILE *file = fopen(pathTemporary.c_str(), "w");
+    if (file) {
+        bool written = (fwrite(data, 1, length, file) == length);
+        if ((fclose(file) == 0) && written &&
+            (rename(pathTemporary.c_str(), path.c_str()) == 0)) {
+            errorCode = 0;
+        }
+    }
+    if (errorCode != 0) {
+        W_LOG_ERROR("unable to write \"%s\"!", path.c_str());
+    }
+
+    return errorCode;
+}
+
+// Write a low-latency HLS output file, to memory if the in-memory
+// store is in use, else to the output directory.
+static int outputWrite(const wHlsContext_t *context, std::string fileName,
+                       const uint8_t *data, size_t length)
+{
+    int errorCode = 0;
+
+    if (gMemoryStarted) {
+        memoryFileWrite(fileName, data, length, false);
+    } else {
+        errorCode = fileWrite(filePath(context, fileName), data, length);
+    }
+
+    return errorCode;
+}
+
+// Delete a low-latency HLS output file.
+static void outputDelete(const wHlsContext_t *context, std::string fileName)
+{
+    if (gMemoryStarted) {
+        memoryFileDelete(fileName);
+    } else {
+        remove(filePath(context, fileName).c_str());
+    }
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MISC
+ * -------------------------------------------------------------- */
+
+// Get the wall-clock time now in ISO8601 format with milliseconds,
+// as #EXT-X-PROGRAM-DATE-TIME wants it.
+static std::string programDateTimeNow()
+{
+    char textBuffer[64] = {};
+    struct timespec now = {};
+    struct tm utc = {};
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &utc);
+    size_t length = strftime(textBuffer, sizeof(textBuffer),
+                             "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(textBuffer + length, sizeof(textBuffer) - length, ".%03dZ",
+             (int) (now.tv_nsec / 1000000));
+
+    return std::string(textBuffer);
+}
+
+// Write out the segment in progress, marking it as complete.
+static void segmentComplete(wHlsContext_t *context)
+{
+    if (!context->segment.empty() && !context->segment.back().complete) {
+        wHlsSegment_t *segment = &(context->segment.back());
+        outputWrite(context, segmentFileName(context, segment->sequence),
+                    context->segmentData.data(), context->segmentData.size());
+        segment->complete = true;
+    }
+    // Keeps its capacity for the next segment
+    context->segmentData.clear();
+}
+
+// Begin a new segment, deleting any that have fallen off the end of
+// the list and the part files of any that have fallen out of the
+// part window.
+static void segmentBegin(wHlsContext_t *context)
+{
+    wHlsSegment_t segment;
+
+    segmentComplete(context);
+
+    segment.sequence = context->sequenceNext;
+    segment.programDateTime = programDateTimeNow();
+    segment.durationSeconds = 0;
+    segment.complete = false;
+    segment.partFilesDeleted = false;
+    context->segment.push_back(segment);
+    context->sequenceNext++;
+
+    // The part files of a segment are kept for one segment beyond the
+    // part window, in case a client is still fetching them
+    size_t count = context->segment.size();
+    if (count > W_HLS_LOW_LATENCY_PART_SEGMENT_COUNT + 1) {
+        wHlsSegment_t *old = &(context->segment[count - W_HLS_LOW_LATENCY_PART_SEGMENT_COUNT - 2]);
+        if (!old->partFilesDeleted) {
+            for (size_t x = 0; x < old->parts.size(); x++) {
+                outputDelete(context, partFileName(context, old->sequence, x));
+            }
+            old->partFilesDeleted = true;
+        }
+    }
+    while (context->segment.size() > W_HLS_LIST_SIZE) {
+        const wHlsSegment_t *oldest = &(context->segment.front());
+        outputDelete(context, segmentFileName(context, oldest->sequence));
+        context->segment.pop_front();
+    }
+}
+
+// Write the playlist; if ended is true no more segments will follow.
+static int playlistWrite(const wHlsContext_t *context, bool ended)
+{
+    int errorCode = 0;
+    char textBuffer[256];
+    std::string playlist;
+    double partTargetSeconds = ((double) W_HLS_LOW_LATENCY_PART_DURATION_FRAMES) /
+                               W_COMMON_FRAME_RATE_HERTZ;
+
+    // The target duration is an integer which each segment duration,
+    // rounded to the nearest integer, must not exceed
+    int targetDurationSeconds = W_HLS_SEGMENT_DURATION_SECONDS;
+    for (auto &segment: context->segment) {
+        int durationSeconds = (int) std::lround(segment.durationSeconds);
+        if (durationSeconds > targetDurationSeconds) {
+            targetDurationSeconds = durationSeconds;
+        }
+    }
+
+    snprintf(textBuffer, sizeof(textBuffer),
+             "#EXTM3U\n"
+             "#EXT-X-VERSION:%d\n"
+             "#EXT-X-TARGETDURATION:%d\n"
+             "#EXT-X-SERVER-CONTROL:%sPART-HOLD-BACK=%.3f\n"
+             "#EXT-X-PART-INF:PART-TARGET=%.3f\n"
+             "#EXT-X-MEDIA-SEQUENCE:%llu\n"
+             "#EXT-X-MAP:URI=\"%s\"\n",
+             W_HLS_LOW_LATENCY_PLAYLIST_VERSION, targetDurationSeconds,
+             // Only when served from memory is there an HTTP server
+             // that can hold a playlist request until it is ready
+             gMemoryStarted ? "CAN-BLOCK-RELOAD=YES," : "",
+             partTargetSeconds * W_HLS_LOW_LATENCY_PART_HOLD_BACK_PARTS,
+             partTargetSeconds,
+             context->segment.empty() ? 0ULL :
+                                        (unsigned long long) context->segment.front().sequence,
+             initFileName(context).c_str());
+    playlist += textBuffer;
+
+    size_t count = context->segment.size();
+    for (size_t x = 0; x < count; x++) {
+        const wHlsSegment_t *segment = &(context->segment[x]);
+        playlist += "#EXT-X-PROGRAM-DATE-TIME:" + segment->programDateTime + "\n";
+        if (x + W_HLS_LOW_LATENCY_PART_SEGMENT_COUNT >= count) {
+            // Within the part window, list the parts
+            for (size_t y = 0; y < segment->parts.size(); y++) {
+                snprintf(textBuffer, sizeof(textBuffer),
+                         "#EXT-X-PART:DURATION=%.3f,URI=\"%s\"%s\n",
+                         segment->parts[y].durationSeconds,
+                         partFileName(context, segment->sequence, y).c_str(),
+                         segment->parts[y].independent ? ",INDEPENDENT=YES" : "");
+                playlist += textBuffer;
+            }
+        }
+        if (segment->complete) {
+            snprintf(textBuffer, sizeof(textBuffer), "#EXTINF:%.3f,\n%s\n",
+                     segment->durationSeconds,
+                     segmentFileName(context, segment->sequence).c_str());
+            playlist += textBuffer;
+        } else if (!ended) {
+            // Tell the client where the next part will be so that it
+            // can ask for it before it exists
+            playlist += "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"" +
+                        partFileName(context, segment->sequence,
+                                     segment->parts.size()) + "\"\n";
+        }
+    }
+    if (ended) {
+        playlist += "#EXT-X-ENDLIST\n";
+    }
+
+    errorCode = outputWrite(context, context->outputFileName +
+                            std::string(W_HLS_PLAYLIST_FILE_EXTENSION),
+                            (const uint8_t *) playlist.c_str(), playlist.length());
+
+    if ((errorCode == 0) && gMemoryStarted && !context->segment.empty()) {
+        // Let anyone blocked on the playlist know how far it has got
+        const wHlsSegment_t *segment = &(context->segment.back());
+        gMemoryMutex.lock();
+        gMemoryPlaylistValid = true;
+        gMemoryPlaylistSequence = segment->sequence;
+        gMemoryPlaylistPartCount = segment->parts.size();
+        gMemoryPreloadHint.clear();
+        if (segment->complete) {
+            // The next part will begin the next segment
+            gMemoryPlaylistSequence++;
+            gMemoryPlaylistPartCount = 0;
+        } else if (!ended) {
+            gMemoryPreloadHint = partFileName(context, segment->sequence,
+                                              segment->parts.size());
+        }
+        gMemoryMutex.unlock();
+        memoryNotify();
+    }
+
+    return errorCode;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Start low-latency HLS output.
+int wHlsLowLatencyStart(std::string outputDirectory, std::string outputFileName)
+{
+    if (!gContext) {
+        gContext = new wHlsContext_t();
+        gContext->outputDirectory = outputDirectory;
+        gContext->outputFileName = outputFileName;
+        gContext->sequenceNext = 0;
+        gContext->initWritten = false;
+        W_LOG_INFO("low-latency HLS, %d ms parts.",
+                   (W_HLS_LOW_LATENCY_PART_DURATION_FRAMES * 1000) /
+                   W_COMMON_FRAME_RATE_HERTZ);
+    }
+
+    return 0;
+}
+
+// Write the initialisation segment.
+int wHlsLowLatencyInitWrite(const uint8_t *data, size_t length)
+{
+    int errorCode = -EBADF;
+
+    if (gContext) {
+        errorCode = outputWrite(gContext, initFileName(gContext),
+                                data, length);
+        if (errorCode == 0) {
+            gContext->initWritten = true;
+        }
+    }
+
+    return errorCode;
+}
+
+// Write a partial segment and update the playlist.
+int wHlsLowLatencyPartWrite(const uint8_t *data, size_t length,
+                            double durationSeconds, bool independent,
+                            bool segmentStart)
+{
+    int errorCode = -EBADF;
+
+    if (gContext && gContext->initWritten) {
+        if (segmentStart || gContext->segment.empty() ||
+            gContext->segment.back().complete) {
+            segmentBegin(gContext);
+        }
+        wHlsSegment_t *segment = &(gContext->segment.back());
+        // The part first, since the playlist will say the part is
+        // there, then add it to the segment, which only appears in
+        // the playlist once it is complete
+        errorCode = outputWrite(gContext, partFileName(gContext, segment->sequence,
+                                                       segment->parts.size()),
+                                data, length);
+        if (errorCode == 0) {
+            gContext->segmentData.insert(gContext->segmentData.end(),
+                                         data, data + length);
+            wHlsPart_t part = {.durationSeconds = durationSeconds,
+                               .independent = independent};
+            segment->parts.push_back(part);
+            segment->durationSeconds += durationSeconds;
+            errorCode = playlistWrite(gContext, false);
+        }
+    }
+
+    return errorCode;
+}
+
+// Stop low-latency HLS output.
+void wHlsLowLatencyStop()
+{
+    if (gContext) {
+        segmentComplete(gContext);
+        if (!gContext->segment.empty()) {
+            playlistWrite(gContext, true);
+        }
+        delete gContext;
+        gContext = nullptr;
+    }
+}
+
+// Start keeping HLS files in memory.
+int wHlsMemoryStart(wHlsMemoryNotifyFunction_t *notify, void *context)
+{
+    if (!gMemoryStarted) {
+        gMemoryMutex.lock();
+        gMemoryNotify = notify;
+        gMemoryNotifyContext = context;
+        gMemoryPlaylistValid = false;
+        gMemoryMutex.unlock();
+        gMemoryStarted = true;
+        W_LOG_INFO("HLS files will be kept in memory.");
+    }
+
+    return 0;
+}
+
+// Determine whether HLS files are being kept in memory.
+bool wHlsMemoryIsStarted()
+{
+    return gMemoryStarted;
+}
+
+// Put a file in the in-memory store.
+int wHlsMemoryFileWrite(std::string name, const uint8_t *data,
+                        size_t length, bool ring)
+{
+    int errorCode = -EBADF;
+
+    if (gMemoryStarted) {
+        memoryFileWrite(name, data, length, ring);
+        errorCode = 0;
+    }
+
+    return errorCode;
+}
+
+// Get a file from the in-memory store.
+int wHlsMemoryFileGet(std::string name, wHlsMemoryFile_t *file)
+{
+    int errorCode = -ENOENT;
+
+    gMemoryMutex.lock();
+    auto found = gMemoryFile.find(name);
+    if (found != gMemoryFile.end()) {
+        *file = found->second;
+        errorCode = 0;
+    }
+    gMemoryMutex.unlock();
+
+    return errorCode;
+}
+
+// Determine whether the low-latency playlist has reached a position.
+bool wHlsMemoryPlaylistHas(uint64_t sequence, int part)
+{
+    bool has = false;
+
+    gMemoryMutex.lock();
+    if (gMemoryPlaylistValid) {
+        if (sequence < gMemoryPlaylistSequence) {
+            has = true;
+        } else if ((sequence == gMemoryPlaylistSequence) && (part >= 0)) {
+            has = ((size_t) part < gMemoryPlaylistPartCount);
+        }
+    }
+    gMemoryMutex.unlock();
+
+    return has;
+}
+
+// Determine whether a file is the one hinted to come next.
+bool wHlsMemoryFileExpected(std::string name)
+{
+    bool expected;
+
+    gMemoryMutex.lock();
+    expected = !gMemoryPreloadHint.empty() && (name == gMemoryPreloadHint);
+    gMemoryMutex.unlock();
+
+    return expected;
+}
+
+// Stop keeping HLS files in memory.
+void wHlsMemoryStop()
+{
+    gMemoryStarted = false;
+    gMemoryMutex.lock();
+    gMemoryFile.clear();
+    gMemoryRing.clear();
+    gMemoryNotify = nullptr;
+    gMemoryNotifyContext = nullptr;
+    gMemoryPlaylistValid = false;
+    gMemoryPreloadHint.clear();
+    gMemoryMutex.unlock();
+}
+
+// End of file
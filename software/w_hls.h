@@ -17,11 +17,35 @@
 #ifndef _W_HLS_H_
 #define _W_HLS_H_
 
-// This API is dependent on w_util.h.
+// This API is dependent on std::string, std::vector, std::shared_ptr,
+// time_t, w_util.h and w_common.h (for W_COMMON_FRAME_RATE_HERTZ).
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <memory>
 #include <w_util.h>
+#include <w_common.h>
 
 /** @file
  * @brief The HLS (HTTP Live Stream) API for the watchdog application.
+ *
+ * In the standard mode (W_HLS_MODE_STANDARD) the FFmpeg hls muxer
+ * writes the playlist and MPEG-TS segments itself.  In low-latency
+ * mode (W_HLS_MODE_LOW_LATENCY) the video encoder instead muxes
+ * fragmented MP4, one fragment per partial segment, and hands each
+ * fragment to this API, which writes the fMP4 part and segment files
+ * and maintains an LL-HLS playlist, with #EXT-X-PART and
+ * #EXT-X-PRELOAD-HINT, to go with them.
+ *
+ * The wHlsLowLatency*() functions are not thread-safe: they should
+ * all be called from the video encode thread.
+ *
+ * Either mode may instead keep its files in memory, in a store
+ * provided by the wHlsMemory*() functions, which are thread-safe,
+ * from where they can be served by an embedded HTTP server (see
+ * w_http.h) without touching the SD card.
  */
 
 /* ----------------------------------------------------------------
@@ -65,14 +89,206 @@
 # define W_HLS_LIST_SIZE 15
 #endif
 
+#ifndef W_HLS_MODE_DEFAULT
+/** The HLS output mode to use if not told otherwise, see wHlsMode_t.
+ */
+# define W_HLS_MODE_DEFAULT W_HLS_MODE_STANDARD
+#endif
+
+#ifndef W_HLS_LOW_LATENCY_SEGMENT_FILE_EXTENSION
+/** Segment (and partial segment) file extension in low-latency mode.
+ */
+# define W_HLS_LOW_LATENCY_SEGMENT_FILE_EXTENSION ".m4s"
+#endif
+
+#ifndef W_HLS_LOW_LATENCY_INIT_FILE_NAME_SUFFIX
+/** What to append to the HLS output file name to make the name of
+ * the fMP4 initialisation segment in low-latency mode.
+ */
+# define W_HLS_LOW_LATENCY_INIT_FILE_NAME_SUFFIX "_init"
+#endif
+
+#ifndef W_HLS_LOW_LATENCY_INIT_FILE_EXTENSION
+/** Initialisation segment file extension in low-latency mode.
+ */
+# define W_HLS_LOW_LATENCY_INIT_FILE_EXTENSION ".mp4"
+#endif
+
+#ifndef W_HLS_LOW_LATENCY_PART_DURATION_MS
+/** The target duration of a partial segment in low-latency mode;
+ * this is rounded up to a whole number of frames.
+ */
+# define W_HLS_LOW_LATENCY_PART_DURATION_MS 200
+#endif
+
+/** W_HLS_LOW_LATENCY_PART_DURATION_MS in frames.
+ */
+#define W_HLS_LOW_LATENCY_PART_DURATION_FRAMES (((W_HLS_LOW_LATENCY_PART_DURATION_MS * \
+                                                  W_COMMON_FRAME_RATE_HERTZ) + 999) / 1000)
+
+#ifndef W_HLS_LOW_LATENCY_PART_SEGMENT_COUNT
+/** The number of most recent segments for which partial segments
+ * are listed in the low-latency playlist; the playlist should list
+ * parts for at least the last three target durations.
+ */
+# define W_HLS_LOW_LATENCY_PART_SEGMENT_COUNT 3
+#endif
+
+#ifndef W_HLS_LOW_LATENCY_PART_HOLD_BACK_PARTS
+/** How many part target durations from live the client should stay
+ * in low-latency mode; must be at least two, three is recommended.
+ */
+# define W_HLS_LOW_LATENCY_PART_HOLD_BACK_PARTS 3
+#endif
+
+#ifndef W_HLS_MEMORY_RING_SIZE
+/** The number of segment files kept in the in-memory store when
+ * written with ring set, see wHlsMemoryFileWrite(); a little more
+ * than W_HLS_LIST_SIZE so that a client that has just read the
+ * playlist can still fetch the oldest segment in it.
+ */
+# define W_HLS_MEMORY_RING_SIZE (W_HLS_LIST_SIZE + 3)
+#endif
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
 
+/** The HLS output modes.
+ */
+typedef enum {
+    W_HLS_MODE_STANDARD, // MPEG-TS segments of W_HLS_SEGMENT_DURATION_SECONDS
+    W_HLS_MODE_LOW_LATENCY // fMP4 segments made of W_HLS_LOW_LATENCY_PART_DURATION_MS parts
+} wHlsMode_t;
+
+/** A file in the in-memory store; the contents are never modified
+ * once written, a write replaces them, so a reader can keep hold
+ * of data for as long as it needs with no lock.
+ */
+typedef struct {
+    std::shared_ptr<const std::vector<uint8_t>> data;
+    time_t timeUnix; // When the file was written
+} wHlsMemoryFile_t;
+
+/** The function called when the in-memory store changes; it is
+ * called from whichever thread made the change so should do no
+ * more than wake someone up.
+ */
+typedef void (wHlsMemoryNotifyFunction_t)(void *context);
+
 /* ----------------------------------------------------------------
  * FUNCTIONS
  * -------------------------------------------------------------- */
 
+/** Start low-latency HLS output; if it is already started this
+ * function will do nothing and return success.
+ *
+ * @param outputDirectory the output directory (with no trailing
+ *                        slash).
+ * @param outputFileName  the output file name, with no extension.
+ * @return                zero on success else negative error code.
+ */
+int wHlsLowLatencyStart(std::string outputDirectory, std::string outputFileName);
+
+/** Write the fMP4 initialisation segment (the ftyp and moov boxes);
+ * must be called before the first call to wHlsLowLatencyPartWrite().
+ *
+ * @param data   the initialisation segment.
+ * @param length the number of bytes at data.
+ * @return       zero on success else negative error code.
+ */
+int wHlsLowLatencyInitWrite(const uint8_t *data, size_t length);
+
+/** Write a partial segment (a moof and mdat box pair) and update
+ * the playlist to include it.  The first part is always the start
+ * of a segment.
+ *
+ * @param data            the partial segment.
+ * @param length          the number of bytes at data.
+ * @param durationSeconds the duration of the partial segment.
+ * @param independent     true if the partial segment begins with
+ *                        a key frame.
+ * @param segmentStart    true if the partial segment should begin
+ *                        a new segment, which it must then also be
+ *                        independent.
+ * @return                zero on success else negative error code.
+ */
+int wHlsLowLatencyPartWrite(const uint8_t *data, size_t length,
+                            double durationSeconds, bool independent,
+                            bool segmentStart);
+
+/** Stop low-latency HLS output, completing the last segment and
+ * ending the playlist.
+ */
+void wHlsLowLatencyStop();
+
+/** Start keeping HLS files in memory rather than writing them to
+ * the output directory; must be called before wHlsLowLatencyStart()
+ * or the video encoder is initialised.  If the store is already
+ * started this function will do nothing and return success.
+ *
+ * @param notify  a function to be called whenever the store
+ *                changes; may be nullptr.
+ * @param context a context pointer to pass to notify; may be nullptr.
+ * @return        zero on success else negative error code.
+ */
+int wHlsMemoryStart(wHlsMemoryNotifyFunction_t *notify, void *context);
+
+/** Determine whether HLS files are being kept in memory.
+ *
+ * @return true if wHlsMemoryStart() has been called.
+ */
+bool wHlsMemoryIsStarted();
+
+/** Put a file in the in-memory store, replacing any of the same name.
+ *
+ * @param name   the file name, without a directory.
+ * @param data   the contents, which are copied.
+ * @param length the number of bytes at data.
+ * @param ring   if true the file is one of a ring of files, of which
+ *               the oldest are deleted when there are more than
+ *               W_HLS_MEMORY_RING_SIZE; use this for the segments
+ *               of a muxer that would otherwise delete them itself.
+ * @return       zero on success else negative error code.
+ */
+int wHlsMemoryFileWrite(std::string name, const uint8_t *data,
+                        size_t length, bool ring);
+
+/** Get a file from the in-memory store.
+ *
+ * @param name the file name, without a directory.
+ * @param file a place to put the file, cannot be nullptr.
+ * @return     zero on success, -ENOENT if there is no such file,
+ *             else negative error code.
+ */
+int wHlsMemoryFileGet(std::string name, wHlsMemoryFile_t *file);
+
+/** Determine whether the low-latency playlist in the in-memory store
+ * has reached a given position, as a client blocking on a playlist
+ * reload with _HLS_msn and _HLS_part would want.
+ *
+ * @param sequence the media sequence number.
+ * @param part     the part index in that segment, -1 for the whole
+ *                 segment.
+ * @return         true if the playlist contains the given segment
+ *                 or part.
+ */
+bool wHlsMemoryPlaylistHas(uint64_t sequence, int part);
+
+/** Determine whether a file not yet in the in-memory store is the
+ * one the low-latency playlist has hinted will come next, i.e.
+ * whether a request for it is worth holding on to.
+ *
+ * @param name the file name, without a directory.
+ * @return     true if name is that of the preload hint.
+ */
+bool wHlsMemoryFileExpected(std::string name);
+
+/** Stop keeping HLS files in memory, throwing away the contents
+ * of the store.
+ */
+void wHlsMemoryStop();
+
 #endif // _W_HLS_H_
 
 // End of file
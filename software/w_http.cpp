@@ -0,0 +1,893 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief The implementation of the HTTP server API for the watchdog
+ * application.
+ */
+
+// The CPP stuff.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+// The Linux/Posix stuff.
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+// Other parts of watchdog.
+#include <w_util.h>
+#include <w_log.h>
+#include <w_hls.h>
+#include <w_event.h>
+
+// Us.
+#include <w_http.h>
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// How often the server loop wakes up when a request is being held,
+// to check whether it has timed out.
+#define W_HTTP_BLOCK_POLL_MS 100
+
+// The max-age for the Cache-Control header of a segment: it will
+// never change and will be gone once it has left the playlist.
+#define W_HTTP_SEGMENT_MAX_AGE_SECONDS (W_HLS_SEGMENT_DURATION_SECONDS * W_HLS_LIST_SIZE)
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** A parsed HTTP request.
+ */
+typedef struct {
+    std::string method;
+    std::string path; // Decoded, without the query
+    std::string query;
+    std::string body;
+    bool keepAlive;
+    long long rangeStart; // The first byte of a "Range: bytes=" header, -1 if there was none
+    long long rangeEnd; // The last byte of the range, -1 for the end of the file
+} wHttpRequest_t;
+
+/** A client connection.
+ */
+typedef struct {
+    int fd;
+    std::string received; // Received but not yet handled
+    wHttpRequest_t request; // The request being held, if blocked is true
+    bool blocked;
+    wUtilTimeoutStart_t blockedStart;
+    std::string responseHead;
+    std::shared_ptr<const std::vector<uint8_t>> responseBody; // May be nullptr
+    size_t sent; // Of responseHead followed by responseBody
+    bool closeAfterSend;
+    wUtilTimeoutStart_t activity; // The last time anything happened
+} wHttpClient_t;
+
+/** Context for the HTTP server.
+ */
+typedef struct {
+    std::string documentRoot;
+    std::string cfgFilePath;
+    std::string cfgUrlPath; // "/" plus the file name of cfgFilePath
+    int listenFd;
+    int eventFd; // Written to wake the server loop
+    std::vector<wHttpClient_t> client;
+    std::thread thread;
+} wHttpContext_t;
+
+/** A file extension and the content type to go with it.
+ */
+typedef struct {
+    const char *extension;
+    const char *contentType;
+} wHttpContentType_t;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// Context for the HTTP server.
+static wHttpContext_t *gContext = nullptr;
+
+// Flag to keep the server loop running.
+static std::atomic<bool> gKeepGoing(false);
+
+// The content types we know about; anything else is served as
+// application/octet-stream.
+static const wHttpContentType_t gContentType[] = {{W_HLS_PLAYLIST_FILE_EXTENSION, "application/vnd.apple.mpegurl"},
+                                                  {W_HLS_SEGMENT_FILE_EXTENSION, "video/mp2t"},
+                                                  {W_HLS_LOW_LATENCY_SEGMENT_FILE_EXTENSION, "video/iso.segment"},
+                                                  {W_HLS_LOW_LATENCY_INIT_FILE_EXTENSION, "video/mp4"},
+                                                  {".html", "text/html; charset=utf-8"},
+                                                  {".js", "text/javascript; charset=utf-8"},
+                                                  {".css", "text/css; charset=utf-8"},
+                                                  {".json", "application/json"},
+                                                  {".cfg", "application/json"},
+                                                  {W_EVENT_FILE_EXTENSION, "application/x-ndjson"},
+                                                  {W_EVENT_THUMBNAIL_FILE_EXTENSION, "image/jpeg"},
+                                                  {".png", "image/png"},
+                                                  {".ico", "image/x-icon"}};
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MISC
+ * -------------------------------------------------------------- */
+
+// Return true if str ends with suffix.
+static bool endsWith(const std::string &str, const char *suffix)
+{
+    size_t length = strlen(suffix);
+
+    return (str.length() >= length) &&
+           (str.compare(str.length() - length, length, suffix) == 0);
+}
+
+// Return the content type for a file name.
+static const char *contentTypeGet(const std::string &name)
+{
+    const char *contentType = "application/octet-stream";
+
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gContentType); x++) {
+        if (endsWith(name, gContentType[x].extension)) {
+            contentType = gContentType[x].contentType;
+            break;
+        }
+    }
+
+    return contentType;
+}
+
+// Return the file name portion of a path.
+static std::string baseName(const std::string &path)
+{
+    size_t pos = path.find_last_of(W_UTIL_DIR_SEPARATOR);
+
+    return (pos == std::string::npos) ? path : path.substr(pos + 1);
+}
+
+// Decode the %XX escapes in a URL path; returns false if the path
+// is broken.
+static bool urlDecode(const std::string &in, std::string *out)
+{
+    bool success = true;
+
+    out->clear();
+    for (size_t x = 0; (x < in.length()) && success; x++) {
+        if (in[x] == '%') {
+            if ((x + 2 < in.length()) && isxdigit(in[x + 1]) && isxdigit(in[x + 2])) {
+                out->push_back((char) strtol(in.substr(x + 1, 2).c_str(), nullptr, 16));
+                x += 2;
+            } else {
+                success = false;
+            }
+        } else {
+            out->push_back(in[x]);
+        }
+    }
+
+    return success && (out->find('\0') == std::string::npos);
+}
+
+// Get the integer value of a key in a query string, returning false
+// if it is not there.
+static bool queryIntegerGet(const std::string &query, const char *key,
+                            long long *value)
+{
+    bool found = false;
+    std::string keyEquals = std::string(key) + "=";
+    size_t start = 0;
+
+    while (!found && (start < query.length())) {
+        size_t end = query.find('&', start);
+        if (end == std::string::npos) {
+            end = query.length();
+        }
+        if (query.compare(start, keyEquals.length(), keyEquals) == 0) {
+            std::string str = query.substr(start + keyEquals.length(),
+                                           end - start - keyEquals.length());
+            char *endPtr = nullptr;
+            *value = strtoll(str.c_str(), &endPtr, 10);
+            found = !str.empty() && (*endPtr == 0) && (*value >= 0);
+        }
+        start = end + 1;
+    }
+
+    return found;
+}
+
+// Read a whole file.
+static int fileRead(std::string path,
+                    std::shared_ptr<const std::vector<uint8_t>> *data)
+{
+    int errorCode = -ENOENT;
+    struct stat status;
+
+    if ((stat(path.c_str(), &status) == 0) && S_ISREG(status.st_mode)) {
+        errorCode = -EIO;
+        FILE *file = fopen(path.c_str(), "r");
+        if (file) {
+            std::shared_ptr<std::vector<uint8_t>> contents = std::make_shared<std::vector<uint8_t>>(status.st_size);
+            if (fread(contents->data(), 1, contents->size(), file) == contents->size()) {
+                *data = contents;
+                errorCode = 0;
+            }
+            fclose(file);
+        }
+    }
+
+    return errorCode;
+}
+
+// Write a whole file, via a temporary file which is renamed so that
+// whoever is reading it never sees half a file.
+static int fileWrite(std::string path, const std::string &data)
+{
+    int errorCode = -EIO;
+    std::string pathTemporary = path + ".tmp";
+
+    FILE *file = fopen(pathTemporary.c_str(), "w");
+    if (file) {
+        bool written = (fwrite(data.c_str(), 1, data.length(), file) == data.length());
+        if ((fclose(file) == 0) && written &&
+            (rename(pathTemporary.c_str(), path.c_str()) == 0)) {
+            errorCode = 0;
+        }
+    }
+    if (errorCode != 0) {
+        W_LOG_ERROR("unable to write \"%s\"!", path.c_str());
+    }
+
+    return errorCode;
+}
+
+// The function called by the HLS API when the in-memory store
+// changes: wake up the server loop.
+static void hlsMemoryNotify(void *context)
+{
+    int eventFd = *((int *) context);
+    uint64_t value = 1;
+
+    if (eventFd >= 0) {
+        // Nothing to be done about an error here, the loop will
+        // still wake up when its guard time expires
+        if (write(eventFd, &value, sizeof(value)) != sizeof(value)) {
+            W_LOG_DEBUG("unable to signal HTTP server (%d).", -errno);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: RESPONSES
+ * -------------------------------------------------------------- */
+
+// Set up a response; body may be nullptr, headers, if not empty,
+// are any further header lines, each ending with "\r\n".
+static void responseSet(wHttpClient_t *client, const wHttpRequest_t *request,
+                        int status, const char *reason,
+                        const char *contentType, std::string cacheControl,
+                        std::shared_ptr<const std::vector<uint8_t>> body,
+                        std::string headers = "")
+{
+    size_t length = body ? body->size() : 0;
+
+    client->responseHead = "HTTP/1.1 " + std::to_string(status) + " " + reason +
+                           "\r\n" + headers +
+                           "Content-Type: " + contentType +
+                           "\r\nContent-Length: " + std::to_string(length) +
+                           "\r\nCache-Control: " + cacheControl +
+                           // So that the page can be served from elsewhere
+                           "\r\nAccess-Control-Allow-Origin: *" +
+                           "\r\nConnection: " +
+                           (request->keepAlive ? "keep-alive" : "close") +
+                           "\r\n\r\n";
+    client->responseBody = nullptr;
+    if (request->method != "HEAD") {
+        client->responseBody = body;
+    }
+    client->sent = 0;
+    client->closeAfterSend = !request->keepAlive;
+}
+
+// Set up a plain-text response, e.g. an error.
+static void responseTextSet(wHttpClient_t *client, const wHttpRequest_t *request,
+                            int status, const char *reason)
+{
+    std::string text = std::string(reason) + "\n";
+
+    responseSet(client, request, status, reason, "text/plain", "no-cache",
+                std::make_shared<const std::vector<uint8_t>>(text.begin(), text.end()));
+}
+
+// Set up the response for a static file, sending only the range of
+// it that was asked for, if one was; a range that starts beyond the
+// end of the file gets a 416, so that the client can tell that the
+// file is now shorter, e.g. the motion event index after a trim.
+static void responseFileSet(wHttpClient_t *client, const wHttpRequest_t *request,
+                            const std::string &path,
+                            std::shared_ptr<const std::vector<uint8_t>> data)
+{
+    long long size = (long long) data->size();
+
+    if (request->rangeStart < 0) {
+        responseSet(client, request, 200, "OK", contentTypeGet(path),
+                    "no-cache", data);
+    } else if (request->rangeStart < size) {
+        long long end = size - 1;
+        if ((request->rangeEnd >= 0) && (request->rangeEnd < end)) {
+            end = request->rangeEnd;
+        }
+        responseSet(client, request, 206, "Partial Content", contentTypeGet(path),
+                    "no-cache",
+                    std::make_shared<const std::vector<uint8_t>>(data->begin() + request->rangeStart,
+                                                                 data->begin() + end + 1),
+                    "Content-Range: bytes " + std::to_string(request->rangeStart) +
+                    "-" + std::to_string(end) + "/" + std::to_string(size) + "\r\n");
+    } else {
+        responseSet(client, request, 416, "Range Not Satisfiable", "text/plain",
+                    "no-cache", nullptr,
+                    "Content-Range: bytes */" + std::to_string(size) + "\r\n");
+    }
+}
+
+// Handle a request for something in the in-memory store of the HLS
+// API; returns false if the request should be held until the store
+// changes.
+static bool requestHandleHls(wHttpClient_t *client, const wHttpRequest_t *request,
+                             const std::string &name, bool timedOut)
+{
+    bool handled = true;
+    bool isPlaylist = endsWith(name, W_HLS_PLAYLIST_FILE_EXTENSION);
+    wHlsMemoryFile_t file;
+    long long sequence = 0;
+    long long part = -1;
+
+    if (isPlaylist && queryIntegerGet(request->query, "_HLS_msn", &sequence)) {
+        // A blocking playlist reload: hold it until the playlist
+        // contains the asked-for segment or part
+        queryIntegerGet(request->query, "_HLS_part", &part);
+        if (!wHlsMemoryPlaylistHas(sequence, part)) {
+            handled = false;
+        }
+    }
+
+    if (!handled) {
+        if (timedOut) {
+            responseTextSet(client, request, 503, "Service Unavailable");
+            handled = true;
+        }
+    } else {
+        if (wHlsMemoryFileGet(name, &file) == 0) {
+            responseSet(client, request, 200, "OK", contentTypeGet(name),
+                        isPlaylist ? std::string("no-cache") :
+                        "max-age=" + std::to_string(W_HTTP_SEGMENT_MAX_AGE_SECONDS),
+                        file.data);
+        } else if (wHlsMemoryFileExpected(name) && !timedOut) {
+            // The part the playlist has hinted will come next: hold
+            // the request until it does
+            handled = false;
+        } else {
+            responseTextSet(client, request, 404, "Not Found");
+        }
+    }
+
+    return handled;
+}
+
+// Handle a request for the configuration file, in the same way as
+// cfg.wsgi does.
+static void requestHandleCfg(wHttpClient_t *client, const wHttpRequest_t *request)
+{
+    std::shared_ptr<const std::vector<uint8_t>> data;
+
+    if ((request->method == "GET") || (request->method == "HEAD")) {
+        if (fileRead(gContext->cfgFilePath, &data) == 0) {
+            responseSet(client, request, 200, "OK", "application/json", "no-cache", data);
+        } else {
+            responseTextSet(client, request, 404, "Not Found");
+        }
+    } else if (request->method == "POST") {
+        if (fileWrite(gContext->cfgFilePath, request->body) == 0) {
+            responseTextSet(client, request, 200, "OK");
+        } else {
+            responseTextSet(client, request, 500, "Internal Server Error");
+        }
+    } else {
+        responseTextSet(client, request, 405, "Method Not Allowed");
+    }
+}
+
+// Handle a request; returns false if the request should be held
+// until the in-memory store changes.
+static bool requestHandle(wHttpClient_t *client, const wHttpRequest_t *request,
+                          bool timedOut)
+{
+    bool handled = true;
+    std::string name = baseName(request->path);
+    wHlsMemoryFile_t file;
+    std::shared_ptr<const std::vector<uint8_t>> data;
+
+    client->responseHead.clear();
+    if (request->path.find("..") != std::string::npos) {
+        responseTextSet(client, request, 403, "Forbidden");
+    } else if (request->path == gContext->cfgUrlPath) {
+        requestHandleCfg(client, request);
+    } else if ((request->method != "GET") && (request->method != "HEAD")) {
+        responseTextSet(client, request, 405, "Method Not Allowed");
+    } else if (!name.empty() &&
+               ((wHlsMemoryFileGet(name, &file) == 0) ||
+                wHlsMemoryFileExpected(name))) {
+        handled = requestHandleHls(client, request, name, timedOut);
+    } else {
+        // A static file, from wherever the document root is
+        std::string path = request->path;
+        if (endsWith(path, W_UTIL_DIR_SEPARATOR)) {
+            path += "index.html";
+        }
+        if (fileRead(gContext->documentRoot + path, &data) == 0) {
+            responseFileSet(client, request, path, data);
+        } else {
+            responseTextSet(client, request, 404, "Not Found");
+        }
+    }
+
+    return handled;
+}
+
+// Parse a request out of what the client has sent; returns 1 if
+// a complete request was parsed, 0 if more is needed, else negative
+// error code, in which case request is populated enough to send an
+// error response.
+static int requestParse(wHttpClient_t *client, wHttpRequest_t *request)
+{
+    int errorCodeOrParsed = 0;
+    size_t headerEnd = client->received.find("\r\n\r\n");
+
+    if (headerEnd == std::string::npos) {
+        if (client->received.length() > W_HTTP_REQUEST_HEADER_MAX_SIZE) {
+            errorCodeOrParsed = -E2BIG;
+        }
+    } else {
+        std::string header = client->received.substr(0, headerEnd + 2);
+        std::string target;
+        size_t contentLength = 0;
+        // The request line: method, target, version
+        size_t lineEnd = header.find("\r\n");
+        std::string line = header.substr(0, lineEnd);
+        size_t space1 = line.find(' ');
+        size_t space2 = line.rfind(' ');
+        errorCodeOrParsed = -EINVAL;
+        request->keepAlive = false;
+        request->rangeStart = -1;
+        request->rangeEnd = -1;
+        if ((space1 != std::string::npos) && (space2 > space1)) {
+            request->method = line.substr(0, space1);
+            target = line.substr(space1 + 1, space2 - space1 - 1);
+            // Keep-alive is the HTTP/1.1 default
+            request->keepAlive = (line.compare(space2 + 1, std::string::npos, "HTTP/1.1") == 0);
+            size_t queryStart = target.find('?');
+            request->query.clear();
+            if (queryStart != std::string::npos) {
+                request->query = target.substr(queryStart + 1);
+                target.resize(queryStart);
+            }
+            if (!target.empty() && (target[0] == '/') &&
+                urlDecode(target, &(request->path))) {
+                errorCodeOrParsed = 1;
+            }
+        }
+        // The headers we care about
+        while ((errorCodeOrParsed == 1) && (lineEnd + 2 < header.length())) {
+            size_t start = lineEnd + 2;
+            lineEnd = header.find("\r\n", start);
+            line = header.substr(start, lineEnd - start);
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+                std::string key = line.substr(0, colon);
+                std::string value = line.substr(colon + 1);
+                value.erase(0, value.find_first_not_of(" \t"));
+                for (auto &c: key) {
+                    c = tolower(c);
+                }
+                for (auto &c: value) {
+                    c = tolower(c);
+                }
+                if (key == "content-length") {
+                    char *endPtr = nullptr;
+                    contentLength = strtoul(value.c_str(), &endPtr, 10);
+                    if (value.empty() || (*endPtr != 0)) {
+                        errorCodeOrParsed = -EINVAL;
+                    } else if (contentLength > W_HTTP_REQUEST_BODY_MAX_SIZE) {
+                        errorCodeOrParsed = -E2BIG;
+                    }
+                } else if (key == "connection") {
+                    if (value.find("close") != std::string::npos) {
+                        request->keepAlive = false;
+                    } else if (value.find("keep-alive") != std::string::npos) {
+                        request->keepAlive = true;
+                    }
+                } else if ((key == "range") && (value.compare(0, 6, "bytes=") == 0) &&
+                           (value.find(',') == std::string::npos)) {
+                    // A single range with a start, all that is needed to
+                    // read the new end of a growing file; anything else
+                    // (e.g. a suffix range) gets the whole file, which
+                    // is allowed
+                    char *endPtr = nullptr;
+                    long long start = strtoll(value.c_str() + 6, &endPtr, 10);
+                    if ((endPtr != value.c_str() + 6) && (start >= 0) && (*endPtr == '-')) {
+                        const char *endStart = endPtr + 1;
+                        long long end = -1;
+                        endPtr = (char *) endStart;
+                        if (*endStart != 0) {
+                            end = strtoll(endStart, &endPtr, 10);
+                        }
+                        // A range that ends before it starts is invalid
+                        // and so, like any other, is ignored
+                        if ((*endPtr == 0) && ((*endStart == 0) || (end >= start))) {
+                            request->rangeStart = start;
+                            request->rangeEnd = end;
+                        }
+                    }
+                } else if (key == "transfer-encoding") {
+                    // Chunked uploads are not something a browser
+                    // will do for a small JSON file
+                    errorCodeOrParsed = -ENOSYS;
+                }
+            }
+        }
+        if (errorCodeOrParsed == 1) {
+            if (client->received.length() >= headerEnd + 4 + contentLength) {
+                request->body = client->received.substr(headerEnd + 4, contentLength);
+                client->received.erase(0, headerEnd + 4 + contentLength);
+            } else {
+                // Wait for the rest of the body
+                errorCodeOrParsed = 0;
+            }
+        }
+        if (errorCodeOrParsed < 0) {
+            request->keepAlive = false;
+        }
+    }
+
+    return errorCodeOrParsed;
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: CONNECTIONS
+ * -------------------------------------------------------------- */
+
+// Send as much of a response as the socket will take; returns
+// false if the client should be closed.
+static bool clientSend(wHttpClient_t *client)
+{
+    bool keep = true;
+    size_t headLength = client->responseHead.length();
+    size_t bodyLength = client->responseBody ? client->responseBody->size() : 0;
+
+    while (keep && (client->sent < headLength + bodyLength)) {
+        const uint8_t *data;
+        size_t length;
+        if (client->sent < headLength) {
+            data = (const uint8_t *) client->responseHead.c_str() + client->sent;
+            length = headLength - client->sent;
+        } else {
+            data = client->responseBody->data() + client->sent - headLength;
+            length = bodyLength - (client->sent - headLength);
+        }
+        ssize_t sent = send(client->fd, data, length, MSG_NOSIGNAL);
+        if (sent > 0) {
+            client->sent += sent;
+        } else {
+            // Come back when the socket has room, unless it's broken
+            keep = (sent < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+            break;
+        }
+    }
+
+    if (keep && (client->sent >= headLength + bodyLength) &&
+        !client->responseHead.empty()) {
+        // Done with this response
+        client->responseHead.clear();
+        client->responseBody = nullptr;
+        client->sent = 0;
+        keep = !client->closeAfterSend;
+    }
+
+    return keep;
+}
+
+// Handle whatever requests the client has sent, or has had held;
+// returns false if the client should be closed.
+static bool clientService(wHttpClient_t *client)
+{
+    bool keep = true;
+
+    // One response at a time, pipelined requests wait their turn
+    while (keep && client->responseHead.empty()) {
+        if (client->blocked) {
+            bool timedOut = wUtilTimeoutExpired(client->blockedStart,
+                                                std::chrono::milliseconds(W_HTTP_BLOCK_TIMEOUT_MS));
+            if (requestHandle(client, &(client->request), timedOut)) {
+                client->blocked = false;
+            } else {
+                break;
+            }
+        } else {
+            wHttpRequest_t request;
+            int parsed = requestParse(client, &request);
+            if (parsed > 0) {
+                if (!requestHandle(client, &request, false)) {
+                    client->request = request;
+                    client->blocked = true;
+                    client->blockedStart = wUtilTimeoutStart();
+                    break;
+                }
+            } else if (parsed < 0) {
+                responseTextSet(client, &request,
+                                (parsed == -E2BIG) ? 413 : (parsed == -ENOSYS) ? 501 : 400,
+                                (parsed == -E2BIG) ? "Payload Too Large" :
+                                (parsed == -ENOSYS) ? "Not Implemented" : "Bad Request");
+                client->received.clear();
+            } else {
+                break;
+            }
+        }
+        if (!client->responseHead.empty()) {
+            client->activity = wUtilTimeoutStart();
+            keep = clientSend(client);
+        }
+    }
+
+    return keep;
+}
+
+// Read what a client has sent; returns false if the client should
+// be closed.
+static bool clientReceive(wHttpClient_t *client)
+{
+    bool keep = true;
+    char buffer[4096];
+    ssize_t received;
+
+    do {
+        received = recv(client->fd, buffer, sizeof(buffer), 0);
+        if (received > 0) {
+            client->received.append(buffer, received);
+        } else if ((received == 0) ||
+                   ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+            // Closed or broken
+            keep = false;
+        }
+    } while (keep && (received == sizeof(buffer)) &&
+             (client->received.length() <= W_HTTP_REQUEST_HEADER_MAX_SIZE +
+                                           W_HTTP_REQUEST_BODY_MAX_SIZE));
+
+    if (keep) {
+        client->activity = wUtilTimeoutStart();
+    }
+
+    return keep;
+}
+
+// The server loop.
+static void serverLoop(wHttpContext_t *context)
+{
+    std::vector<struct pollfd> pollFd;
+
+    W_LOG_DEBUG("HTTP server loop has started.");
+
+    while (gKeepGoing && wUtilKeepGoing()) {
+        bool anyBlocked = false;
+        pollFd.clear();
+        pollFd.push_back({.fd = context->eventFd, .events = POLLIN, .revents = 0});
+        // Stop accepting when full, new connections wait in the backlog
+        pollFd.push_back({.fd = (context->client.size() < W_HTTP_CLIENT_MAX_NUM) ?
+                                context->listenFd : -1,
+                          .events = POLLIN, .revents = 0});
+        for (auto &client: context->client) {
+            // A held request doesn't read any more from its client,
+            // but poll() will still report a hang-up
+            short events = 0;
+            if (!client.responseHead.empty()) {
+                events = POLLOUT;
+            } else if (!client.blocked) {
+                events = POLLIN;
+            }
+            anyBlocked = anyBlocked || client.blocked;
+            pollFd.push_back({.fd = client.fd, .events = events, .revents = 0});
+        }
+
+        int numEvents = poll(pollFd.data(), pollFd.size(),
+                             anyBlocked ? W_HTTP_BLOCK_POLL_MS : W_UTIL_POLL_TIMER_GUARD_MS);
+        if (numEvents >= 0) {
+            uint64_t value;
+            if (pollFd[0].revents & POLLIN) {
+                // The in-memory store has changed, or we're stopping
+                if (read(context->eventFd, &value, sizeof(value)) != sizeof(value)) {
+                    W_LOG_DEBUG("HTTP server: unable to read event (%d).", errno);
+                }
+            }
+            // Service the existing clients, in reverse order so that
+            // they can be removed as we go
+            for (size_t x = context->client.size(); x > 0; x--) {
+                wHttpClient_t *client = &(context->client[x - 1]);
+                short revents = pollFd[x - 1 + 2].revents;
+                bool keep = !(revents & (POLLERR | POLLNVAL));
+                if (keep && (revents & POLLIN)) {
+                    keep = clientReceive(client);
+                } else if (keep && (revents & POLLHUP) && client->responseHead.empty()) {
+                    keep = false;
+                }
+                if (keep && (revents & POLLOUT)) {
+                    keep = clientSend(client);
+                }
+                if (keep) {
+                    keep = clientService(client);
+                }
+                if (keep && !client->blocked && client->responseHead.empty() &&
+                    wUtilTimeoutExpired(client->activity,
+                                        std::chrono::seconds(W_HTTP_IDLE_TIMEOUT_SECONDS))) {
+                    keep = false;
+                }
+                if (!keep) {
+                    close(client->fd);
+                    context->client.erase(context->client.begin() + x - 1);
+                }
+            }
+            // Accept the new ones
+            if (pollFd[1].revents & POLLIN) {
+                int fd;
+                while ((context->client.size() < W_HTTP_CLIENT_MAX_NUM) &&
+                       ((fd = accept4(context->listenFd, nullptr, nullptr,
+                                      SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)) {
+                    wHttpClient_t client;
+                    client.fd = fd;
+                    client.blocked = false;
+                    client.sent = 0;
+                    client.closeAfterSend = false;
+                    client.activity = wUtilTimeoutStart();
+                    context->client.push_back(client);
+                }
+            }
+        } else if (errno != EINTR) {
+            W_LOG_ERROR("HTTP server poll() failed, error code %d!", -errno);
+            break;
+        }
+    }
+
+    W_LOG_DEBUG("HTTP server loop has ended.");
+}
+
+// Close everything.
+static void cleanUp()
+{
+    if (gContext) {
+        if (gContext->thread.joinable()) {
+            gKeepGoing = false;
+            hlsMemoryNotify(&(gContext->eventFd));
+            gContext->thread.join();
+        }
+        for (auto &client: gContext->client) {
+            close(client.fd);
+        }
+        if (gContext->listenFd >= 0) {
+            close(gContext->listenFd);
+        }
+        if (gContext->eventFd >= 0) {
+            close(gContext->eventFd);
+        }
+        delete gContext;
+        gContext = nullptr;
+    }
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Start the HTTP server.
+int wHttpStart(unsigned int port, std::string documentRoot,
+               std::string cfgFilePath)
+{
+    int errorCode = 0;
+
+    if (!gContext) {
+        errorCode = -EINVAL;
+        if ((port > 0) && (port <= 0xFFFF)) {
+            gContext = new wHttpContext_t();
+            gContext->documentRoot = documentRoot;
+            gContext->cfgFilePath = cfgFilePath;
+            gContext->cfgUrlPath = std::string(W_UTIL_DIR_SEPARATOR) + baseName(cfgFilePath);
+            gContext->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            gContext->listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            errorCode = 0;
+            if ((gContext->eventFd < 0) || (gContext->listenFd < 0)) {
+                errorCode = -errno;
+                W_LOG_ERROR("unable to create HTTP server socket or event,"
+                            " error code %d!", errorCode);
+            }
+            if (errorCode == 0) {
+                int reuse = 1;
+                struct sockaddr_in address = {};
+                address.sin_family = AF_INET;
+                address.sin_addr.s_addr = htonl(INADDR_ANY);
+                address.sin_port = htons(port);
+                setsockopt(gContext->listenFd, SOL_SOCKET, SO_REUSEADDR,
+                           &reuse, sizeof(reuse));
+                if ((bind(gContext->listenFd, (struct sockaddr *) &address,
+                          sizeof(address)) != 0) ||
+                    (listen(gContext->listenFd, W_HTTP_CLIENT_MAX_NUM) != 0)) {
+                    errorCode = -errno;
+                    W_LOG_ERROR("unable to listen on port %d, error code %d!",
+                                port, errorCode);
+                }
+            }
+            if (errorCode == 0) {
+                errorCode = wHlsMemoryStart(hlsMemoryNotify, &(gContext->eventFd));
+            }
+            if (errorCode == 0) {
+                try {
+                    // This will go bang if the thread cannot be created;
+                    // not real-time, serving pages can wait
+                    gKeepGoing = true;
+                    gContext->thread = std::thread(serverLoop, gContext);
+                    // Best effort, add the name so that it is displayed when debugging
+                    pthread_setname_np(gContext->thread.native_handle(), "http");
+                    wUtilThreadPlacementSet(gContext->thread.native_handle(), "http");
+                }
+                catch (int x) {
+                    errorCode = -x;
+                    W_LOG_ERROR("unable to start HTTP server thread, error code %d.",
+                                errorCode);
+                }
+            }
+            if (errorCode == 0) {
+                W_LOG_INFO("HTTP server listening on port %d, document root \"%s\".",
+                           port, documentRoot.c_str());
+            } else {
+                wHlsMemoryStop();
+                cleanUp();
+            }
+        }
+    }
+
+    return errorCode;
+}
+
+// Stop the HTTP server.
+void wHttpStop()
+{
+    if (gContext) {
+        // Stop the store first so that nothing notifies us as we go
+        wHlsMemoryStop();
+        cleanUp();
+    }
+}
+
+// End of file
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _W_HTTP_H_
+#define _W_HTTP_H_
+
+// This API is dependent on std::string and w_hls.h (for
+// W_HLS_SEGMENT_DURATION_SECONDS).
+#include <string>
+#include <w_hls.h>
+
+/** @file
+ * @brief The HTTP server API for the watchdog application: a small
+ * embedded HTTP/1.1 server, on a single thread, that serves the
+ * HLS playlist and segments straight from the in-memory store of
+ * the HLS API (see wHlsMemoryStart()), holds low-latency playlist
+ * and preload-hint requests until what they ask for exists
+ * (making blocking playlist reload possible), GETs and POSTs the
+ * JSON configuration file, as cfg.wsgi does under Apache, and
+ * serves everything else as static files from a document root.
+ *
+ * wHttpStart() and wHttpStop() should not be called at the same
+ * time as each other.
+ */
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+#ifndef W_HTTP_PORT_DEFAULT
+/** The default port for the HTTP server, zero meaning that there
+ * is no HTTP server and the HLS files are written to the output
+ * directory for something else, e.g. Apache, to serve.
+ */
+# define W_HTTP_PORT_DEFAULT 0
+#endif
+
+#ifndef W_HTTP_CLIENT_MAX_NUM
+/** The maximum number of simultaneous client connections; any more
+ * are left waiting in the listen backlog.
+ */
+# define W_HTTP_CLIENT_MAX_NUM 16
+#endif
+
+#ifndef W_HTTP_REQUEST_HEADER_MAX_SIZE
+/** The maximum size of the request line plus headers of a request;
+ * a client that sends more is disconnected.
+ */
+# define W_HTTP_REQUEST_HEADER_MAX_SIZE (8 * 1024)
+#endif
+
+#ifndef W_HTTP_REQUEST_BODY_MAX_SIZE
+/** The maximum size of the body of a request, which need only be
+ * large enough for a POST of the JSON configuration file.
+ */
+# define W_HTTP_REQUEST_BODY_MAX_SIZE (64 * 1024)
+#endif
+
+#ifndef W_HTTP_BLOCK_TIMEOUT_MS
+/** How long a blocking playlist reload or a request for a hinted
+ * part is held before giving up; the HLS specification says three
+ * times the target duration.
+ */
+# define W_HTTP_BLOCK_TIMEOUT_MS (W_HLS_SEGMENT_DURATION_SECONDS * 3 * 1000)
+#endif
+
+#ifndef W_HTTP_IDLE_TIMEOUT_SECONDS
+/** How long a keep-alive connection with nothing going on is kept
+ * open.
+ */
+# define W_HTTP_IDLE_TIMEOUT_SECONDS 30
+#endif
+
+/* ----------------------------------------------------------------
+ * FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/** Start the HTTP server; this also starts the in-memory store of
+ * the HLS API, hence it must be called before the video encoder
+ * is initialised.  If the HTTP server is already started this
+ * function will do nothing and return success.
+ *
+ * @param port         the TCP port to listen on, must be non-zero.
+ * @param documentRoot the directory from which to serve static
+ *                     files, e.g. index.html; should not end in
+ *                     a "/".
+ * @param cfgFilePath  the path to the JSON configuration file,
+ *                     which is served, and may be POSTed to, as
+ *                     "/" followed by its file name.
+ * @return             zero on success else negative error code.
+ */
+int wHttpStart(unsigned int port, std::string documentRoot,
+               std::string cfgFilePath);
+
+/** Stop the HTTP server, closing all connections, and stop the
+ * in-memory store of the HLS API; should be called after the video
+ * encoder has been deinitialised.
+ */
+void wHttpStop();
+
+#endif // _W_HTTP_H_
+
+// End of file
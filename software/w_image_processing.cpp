@@ -23,12 +23,21 @@
 
 // The CPP stuff.
 #include <string>
+#include <cstring>
 #include <memory>
 #include <mutex>
 #include <atomic>
 #include <vector>
 #include <algorithm>  // For std::sort()
 
+// The Linux/Posix stuff.
+#include <time.h>
+
+#ifdef __ARM_NEON
+// For the vectorised "diff" motion detector
+# include <arm_neon.h>
+#endif
+
 // The OpenCV stuff.
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
@@ -42,6 +51,9 @@
 #include <w_log.h>
 #include <w_msg.h>
 #include <w_camera.h>
+#include <w_stats.h>
+#include <w_record.h>
+#include <w_event.h>
 
 // Us.
 #include <w_image_processing.h>
@@ -79,6 +91,45 @@
 #define W_POINT_INVALID cv::Point{W_POINT_COORDINATE_INVALID, \
                                   W_POINT_COORDINATE_INVALID}
 
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS: MOTION DETECTION RELATED
+ * -------------------------------------------------------------- */
+
+#ifndef W_MOTION_CONTOUR_AREA_MIN_PIXELS
+// The area, in pixels of the video frame (i.e. regardless of
+// whether motion detection is performed on the smaller analysis
+// stream), which the contour around a moving object must exceed
+// for it to be taken notice of.
+# define W_MOTION_CONTOUR_AREA_MIN_PIXELS 500
+#endif
+
+// The number of consecutive frames without motion after which
+// motion detection becomes idle.
+#define W_MOTION_IDLE_FRAMES (W_IMAGE_PROCESSING_IDLE_SECONDS * W_CAMERA_FRAME_RATE_HERTZ)
+
+#ifndef W_MOTION_DIFF_THRESHOLD
+// The amount, in levels of luma, by which a pixel must differ from
+// the background for the "diff" motion detector to consider it a
+// moving pixel.
+# define W_MOTION_DIFF_THRESHOLD 25
+#endif
+
+#ifndef W_MOTION_DIFF_LEARNING_SHIFT
+// How quickly the background of the "diff" motion detector follows
+// the image: each frame the background moves by the difference
+// divided by two to the power of this, so 6 means something that
+// stops moving becomes background in a few seconds.
+# define W_MOTION_DIFF_LEARNING_SHIFT 6
+#endif
+
+#ifndef W_MOTION_DIFF_FRACTION_BITS
+// The number of fractional bits in the background of the "diff"
+// motion detector: must leave room for 8 bits of luma in an int16_t,
+// and be enough that the background can follow the image closely
+// (within (1 << W_MOTION_DIFF_LEARNING_SHIFT) >> this levels).
+# define W_MOTION_DIFF_FRACTION_BITS 4
+#endif
+
 /* ----------------------------------------------------------------
  * COMPILE-TIME MACROS: DRAWING RELATED
  * -------------------------------------------------------------- */
@@ -200,6 +251,9 @@
 # define W_DRAWING_DATE_TIME_ALPHA 0.7
 #endif
 
+// W_DRAWING_DATE_TIME_ALPHA in 256ths, for the integer blend.
+#define W_DRAWING_DATE_TIME_ALPHA_256 ((int) ((W_DRAWING_DATE_TIME_ALPHA * 256) + 0.5))
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
@@ -223,26 +277,114 @@ typedef struct {
     cv::Point centreFrame; // The centre in frame coordinates
 } wRectInfo_t;
 
-/** Context needed by the image processing message handler.
+/** The state of the "mog2" motion detector.
  */
 typedef struct {
     std::shared_ptr<cv::BackgroundSubtractor> backgroundSubtractor;
+    // Kept from frame to frame so that they are only allocated if
+    // the size of the image changes
     cv::Mat maskForeground;
+    cv::Mat maskThreshold;
+    cv::Mat element; // The structuring element used to remove small blobs
+} wMotionDetectorMog2_t;
+
+/** The state of the "diff" motion detector.
+ */
+typedef struct {
+    int width;
+    int height;
+    std::vector<int16_t> background; // In units of one level >> W_MOTION_DIFF_FRACTION_BITS
+    bool backgroundValid;
+    std::vector<uint8_t> rowThreshold[3]; // A ring, indexed by row modulo 3, padded
+    std::vector<uint8_t> rowEroded[3]; // A ring, indexed by row modulo 3, padded
+    std::vector<uint8_t> rowOnes; // For rows outside the image, padded
+    std::vector<uint8_t> rowZeros; // For rows outside the image, padded
+} wMotionDetectorDiff_t;
+
+/** The stages of image processing, each a message queue thread of
+ * its own, in the order that a frame passes through them.
+ */
+typedef enum {
+    W_IMAGE_PROCESSING_STAGE_DETECT,  // Pyramid, the motion detector
+    W_IMAGE_PROCESSING_STAGE_MOTION,  // Regions, contours, focus
+    W_IMAGE_PROCESSING_STAGE_OVERLAY, // Drawing, output
+    W_IMAGE_PROCESSING_STAGE_MAX_NUM
+} wImageProcessingStage_t;
+
+/** The results of motion detection on a frame, handed from the
+ * motion detection stage to the overlay stage with the frame; there
+ * are W_IMAGE_PROCESSING_PIPELINE_SLOT_NUM of these, used in turn,
+ * and the buffers in them are kept from frame to frame so that they
+ * are only allocated if the size of the image changes.  Aside from
+ * inUse, a slot is only touched by the stage that has the frame.
+ */
+typedef struct {
+    std::atomic<bool> inUse; // Set by the detect stage, cleared when the frame leaves the overlay stage
+    bool motionForced; // True if full-rate motion detection is needed for a reason other than motion
+    bool maskValid; // True if the detector produced maskMotion
+    cv::Size sizeFrame; // The size of the frame
+    cv::Size sizeDetect; // The size of the detection image
+    cv::Rect rectDetect; // As in the context when the frame was detected
+    cv::Mat maskRegion; // Likewise, a reference since the context makes a new one when it changes
+    cv::Mat maskMotion; // The output of the detector
+    std::vector<std::vector<cv::Point>> contours;
+    std::vector<cv::Vec4i> hierarchy;
+    std::vector<cv::Rect> largeRects; // The moving objects, in frame coordinates
+} wImageProcessingSlot_t;
+
+/** Context needed by the image processing message handlers, one
+ * per pipeline, the comments saying which stage owns what.
+ */
+typedef struct {
+    unsigned int pipeline; // The index of this context in gContext[]
+    int msgQueueId[W_IMAGE_PROCESSING_STAGE_MAX_NUM]; // The message queues of the stages
+    // Detect stage
+    const wImageProcessingDetector_t *detector;
+    void *detectorState; // As returned by the open function of detector
+    std::atomic<const wImageProcessingDetector_t *> detectorRequested;
+    // The buffers below are kept from frame to frame so that they
+    // are only allocated if the size of the image changes
+    std::vector<cv::Mat> pyramid; // One per pyramid level, each half the size of the last
+    // The region stuff, in detection image coordinates, re-made when
+    // the detection configuration or the size of the detection image
+    // changes
+    cv::Size sizeDetect; // The size of the detection image that the two below are for
+    cv::Rect rectDetect; // The part of the detection image that motion detection is performed on
+    cv::Mat maskRegion; // Same size as rectDetect, empty if there are no regions
+    // The detection configuration, as set by wImageProcessingDetectCfgSet()
+    std::mutex detectCfgMutex;
+    unsigned int pyramidLevels;
+    std::vector<wImageProcessingRegion_t> regions;
+    std::atomic<bool> detectCfgChanged;
     wPointProtected_t focusPointView;
-    std::atomic<bool> resetBackgroundSubtractor;
+    std::atomic<bool> resetMotionDetect;
+    unsigned int idleSkipCount; // Frames to skip before motion detection is next performed
+    wImageProcessingSlot_t slot[W_IMAGE_PROCESSING_PIPELINE_SLOT_NUM];
+    unsigned int slotNext; // The slot to try next
+    // Motion stage: the idle state, written only by the motion stage
+    std::atomic<bool> idle;
+    unsigned int noMotionFrameCount; // Consecutive analysed frames without motion
+    // Overlay stage: the overlay cache: the date/time box is only rendered when the
+    // second changes, the result being kept as its contribution to
+    // the integer blend, (256 - alpha) * box, plus rounding
+    time_t overlayTime; // The second overlayDateTime is for, -1 if none
+    std::vector<uint16_t> overlayDateTime;
+    cv::Mat overlayDateTimeBox; // Where the box is rendered, kept between renders
     wCommonFrameFunction_t *outputCallback;
     wImageProcessingFocusFunction_t *focusCallback;
     void *focusCallbackContext;
 } wImageProcessingContext_t;
 
-/** Image processing message types; just the one.
+/** Image processing message types, one per stage, all carrying a
+ * frame.
  */
 typedef enum {
-    W_IMAGE_PROCESSING_MSG_TYPE_IMAGE_BUFFER // wImageProcessingMsgBodyImageBuffer_t
+    W_IMAGE_PROCESSING_MSG_TYPE_IMAGE_BUFFER, // wImageProcessingMsgBodyImageBuffer_t, to the detect stage
+    W_IMAGE_PROCESSING_MSG_TYPE_MOTION,       // wImageProcessingMsgBodyImageBuffer_t, to the motion stage
+    W_IMAGE_PROCESSING_MSG_TYPE_OVERLAY       // wImageProcessingMsgBodyImageBuffer_t, to the overlay stage
 } wImageProcessingMsgType_t;
 
-/** The message body structure corresponding to our one message:
- * W_IMAGE_PROCESSING_MSG_TYPE_IMAGE_BUFFER.
+/** The message body structure of all of our messages.
  */
 typedef struct {
     uint8_t *data;
@@ -251,19 +393,22 @@ typedef struct {
     unsigned int width;
     unsigned int height;
     unsigned int stride;
+    int slot; // Index into the slots of the context, -1 if motion detection was not performed
 } wImageProcessingMsgBodyImageBuffer_t;
 
 /** Union of message bodies; if you add a member here you must add a type for it in
  * wImageProcessingMsgType_t.
  */
 typedef union {
-    wImageProcessingMsgBodyImageBuffer_t imageBuffer;   // W_IMAGE_PROCESSING_MSG_TYPE_IMAGE_BUFFER
+    wImageProcessingMsgBodyImageBuffer_t imageBuffer;   // All message types
 } wImageProcessingMsgBody_t;
 
-/** A structure containing the message handling/freeing function
- * and the message type they handle, for use in gMsgHandler[].
+/** A structure containing the message handling/freeing function,
+ * the message type they handle and the stage whose queue they are
+ * for, for use in gMsgHandler[].
  */
 typedef struct {
+    wImageProcessingStage_t stage;
     wImageProcessingMsgType_t msgType;
     wMsgHandlerFunction_t *function;
     wMsgHandlerFunctionFree_t *functionFree;
@@ -276,11 +421,17 @@ typedef struct {
 // NOTE: there are more messaging-related variables below
 // the definition of the message handling functions.
 
-// The ID of the image processing message queue
-static int gMsgQueueId = -1;
+// The names of the message queues of the image processing stages;
+// these are also the names of the threads, see
+// wUtilThreadPlacementSet(), and have the pipeline appended, see
+// wUtilPipelineName().
+static const char *gMsgQueueName[] = {"image process", "image motion", "image overlay"};
+
+// Image processing contexts, one per pipeline.
+static wImageProcessingContext_t *gContext[W_COMMON_PIPELINE_MAX_NUM] = {};
 
-// Image processing context.
-static wImageProcessingContext_t *gContext = nullptr;
+// NOTE: the built-in motion detectors are defined below the
+// definition of their functions.
 
 // NOTE: there are more messaging-related variables below
 // the definition of the message handling functions.
@@ -422,6 +573,22 @@ static bool rectGetInfoAndLimit(const cv::Rect *rect, wRectInfo_t *rectInfo)
     return !isLimited;
 }
 
+// Scale a rectangle from a frame of size "from" to a frame of
+// size "to", e.g. from the analysis stream to the video stream.
+static cv::Rect rectScale(const cv::Rect *rect, cv::Size from, cv::Size to)
+{
+    cv::Rect scaled = *rect;
+
+    if ((from != to) && (from.width > 0) && (from.height > 0)) {
+        scaled.x = (rect->x * to.width) / from.width;
+        scaled.y = (rect->y * to.height) / from.height;
+        scaled.width = (rect->width * to.width) / from.width;
+        scaled.height = (rect->height * to.height) / from.height;
+    }
+
+    return scaled;
+}
+
 // Sorting function for findFocusFrame().
 static bool compareRectInfo(wRectInfo_t rectInfoA,
                             wRectInfo_t rectInfoB) {
@@ -429,12 +596,13 @@ static bool compareRectInfo(wRectInfo_t rectInfoA,
 }
 
 // Find where the focus should be, in frame coordinates,
-// given a set of contours in frame coordinates.  The return
+// given the rectangles bounding a set of contours in frame
+// coordinates.  The return
 // value is the total area of all rectangles in pixels and,
 // since rectangles can overlap, it may be large than the
 // area of the frame; think of it as a kind of "magnitude
 // of activity" measurement, rather than a literal area.
-static int findFocusFrame(const std::vector<std::vector<cv::Point>> contours,
+static int findFocusFrame(const std::vector<cv::Rect> rects,
                           cv::Point *pointFrame)
 {
     int areaPixels = 0;
@@ -442,11 +610,10 @@ static int findFocusFrame(const std::vector<std::vector<cv::Point>> contours,
 
     if (pointFrame) {
         *pointFrame = W_POINT_INVALID;
-        if (!contours.empty()) {
+        if (!rects.empty()) {
             // Create a vector of the size and centre of the rectangles that
             // bound each contour and sort them in descending order of size
-            for (auto contour: contours) {
-                cv::Rect rect = boundingRect(contour);
+            for (auto rect: rects) {
                 wRectInfo_t rectInfo;
                 rectGetInfoAndLimit(&rect, &rectInfo);
                 rectInfos.push_back(rectInfo);
@@ -505,139 +672,706 @@ static cv::Point pointProtectedGet(wPointProtected_t *pointProtected)
 }
 
 /* ----------------------------------------------------------------
- * STATIC FUNCTIONS: MISC
+ * STATIC FUNCTIONS: MOTION DETECTOR "mog2"
  * -------------------------------------------------------------- */
 
-// Release the queue, context, etc.
-static void cleanUp()
+// Open function of the "mog2" motion detector.
+static int detectorMog2Open(void **state)
 {
-    // Release the message queue
-    if (gMsgQueueId >= 0) {
-        wMsgQueueStop(gMsgQueueId);
-        gMsgQueueId = -1;
-    }
+    int errorCode = -ENOMEM;
+    wMotionDetectorMog2_t *mog2 = nullptr;
 
-    if (gContext) {
-        delete gContext;
-        gContext = nullptr;
+    try {
+        mog2 = new wMotionDetectorMog2_t;
+    }
+    catch (int x) {
+        errorCode = -x;
+    }
+    if (mog2) {
+        mog2->backgroundSubtractor = cv::createBackgroundSubtractorMOG2();
+        mog2->element = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3, 3));
+        if (mog2->backgroundSubtractor) {
+            *state = mog2;
+            errorCode = 0;
+        } else {
+            delete mog2;
+        }
     }
-}
 
-/* ----------------------------------------------------------------
- * STATIC FUNCTIONS: MESSAGE HANDLER wImageProcessingMsgBodyImageBuffer_t
- * -------------------------------------------------------------- */
+    return errorCode;
+}
 
-// Message handler for wImageProcessingMsgBodyImageBuffer_t.
-static void msgHandlerImageProcessingImageBuffer(void *msgBody,
-                                                 unsigned int bodySize,
-                                                 void *context)
+// Reset function of the "mog2" motion detector.
+static void detectorMog2Reset(void *state)
 {
-    wImageProcessingMsgBodyImageBuffer_t *msg = &(((wImageProcessingMsgBody_t *) msgBody)->imageBuffer);
-    wImageProcessingContext_t *imageProcessingContext = (wImageProcessingContext_t *) context;
-    cv::Point point;
+    wMotionDetectorMog2_t *mog2 = (wMotionDetectorMog2_t *) state;
 
-    assert(bodySize == sizeof(*msg));
-
-    // Do the OpenCV things.  From the comment on this post:
-    // https://stackoverflow.com/questions/44517828/transform-a-yuv420p-qvideoframe-into-grayscale-opencv-mat
-    // ...we can bring in just the Y portion of the frame as, effectively,
-    // a gray-scale image using CV_8UC1, which can be processed
-    // quickly. Note that OpenCV is operating in-place on the
-    // data, it does not perform a copy
-    cv::Mat frameOpenCvGray(msg->height, msg->width, CV_8UC1,
-                            msg->data, msg->stride);
-
-    // Reset the background model if requested
-    if (imageProcessingContext->resetBackgroundSubtractor) {
-        gContext->backgroundSubtractor->clear();
-        imageProcessingContext->resetBackgroundSubtractor = false;
+    // clear() does nothing for MOG2, the only way to make it forget
+    // the background is to begin again
+    std::shared_ptr<cv::BackgroundSubtractor> backgroundSubtractor = cv::createBackgroundSubtractorMOG2();
+    if (backgroundSubtractor) {
+        mog2->backgroundSubtractor = backgroundSubtractor;
     }
+}
+
+// Apply function of the "mog2" motion detector.
+static int detectorMog2Apply(void *state, const cv::Mat *image, cv::Mat *mask)
+{
+    wMotionDetectorMog2_t *mog2 = (wMotionDetectorMog2_t *) state;
 
     // Update the background model: this will cause moving areas to
     // appear as pixels with value 255, stationary areas to appear
-    // as pixels with value 0
-    imageProcessingContext->backgroundSubtractor->apply(frameOpenCvGray,
-                                                        imageProcessingContext->maskForeground);
+    // as pixels with value 0 and shadows as 127
+    mog2->backgroundSubtractor->apply(*image, mog2->maskForeground);
 
     // Apply thresholding to the foreground mask to remove shadows:
     // anything below the first number becomes zero, anything above
     // the first number becomes the second number
-    cv::Mat maskThreshold(msg->height, msg->width, CV_8UC1);
-    cv::threshold(imageProcessingContext->maskForeground, maskThreshold,
+    cv::threshold(mog2->maskForeground, mog2->maskThreshold,
                   25, 255, cv::THRESH_BINARY);
     // Perform erosions and dilations on the mask that will remove
     // any small blobs
-    cv::Mat element = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3, 3));
-    cv::Mat maskDeblobbed(msg->height, msg->width, CV_8UC1);
-    cv::morphologyEx(maskThreshold, maskDeblobbed, cv::MORPH_OPEN, element);
+    cv::morphologyEx(mog2->maskThreshold, *mask, cv::MORPH_OPEN, mog2->element);
 
-    // Find the edges of the moving areas, the ones with pixel value 255
-    // in the thresholded/deblobbed mask
-    std::vector<std::vector<cv::Point>> contours;
-    std::vector<cv::Vec4i> hierarchy;
-    cv::findContours(maskDeblobbed, contours, hierarchy,
-                     cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+    return 0;
+}
+
+// Close function of the "mog2" motion detector.
+static void detectorMog2Close(void *state)
+{
+    delete (wMotionDetectorMog2_t *) state;
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MOTION DETECTOR "diff"
+ * -------------------------------------------------------------- */
+
+// The "diff" detector makes one pass over the image, row by row:
+// each row is compared with the running-average background (which
+// is updated as it goes) and thresholded into a ring of three rows,
+// the row above that is then eroded, from the three thresholded rows
+// around it, into a ring of three eroded rows and the row above
+// that is dilated, from the three eroded rows around it, straight
+// into the output.  Hence the output lags the input by two rows and
+// nothing larger than a few rows need be kept.  Outside the image,
+// erosion sees 255 and dilation sees 0, as for an OpenCV
+// morphological open, hence the padding either side of each row.
+
+// Get the thresholded row at y, a row of 255 if y is outside the
+// image.
+static const uint8_t *detectorDiffRowThreshold(wMotionDetectorDiff_t *diff, int y)
+{
+    const uint8_t *row = diff->rowOnes.data() + 1;
+
+    if ((y >= 0) && (y < diff->height)) {
+        row = diff->rowThreshold[y % 3].data() + 1;
+    }
+
+    return row;
+}
+
+// Get the eroded row at y, a row of 0 if y is outside the image.
+static const uint8_t *detectorDiffRowEroded(wMotionDetectorDiff_t *diff, int y)
+{
+    const uint8_t *row = diff->rowZeros.data() + 1;
+
+    if ((y >= 0) && (y < diff->height)) {
+        row = diff->rowEroded[y % 3].data() + 1;
+    }
+
+    return row;
+}
+
+// Start again with an image of the given size, the first image of
+// that size becoming the background.
+static void detectorDiffSizeSet(wMotionDetectorDiff_t *diff, int width, int height)
+{
+    diff->width = width;
+    diff->height = height;
+    diff->background.assign(width * height, 0);
+    // The rows have one pixel of padding at each end, for the
+    // neighbours at the edge of the image
+    diff->rowOnes.assign(width + 2, 0xff);
+    diff->rowZeros.assign(width + 2, 0);
+    for (unsigned int x = 0; x < 3; x++) {
+        diff->rowThreshold[x].assign(width + 2, 0xff);
+        diff->rowEroded[x].assign(width + 2, 0);
+    }
+    diff->backgroundValid = false;
+}
+
+// Update the background with a row of the image, writing the
+// thresholded absolute difference between the two to output.
+static void detectorDiffThreshold(const uint8_t *input, int16_t *background,
+                                  uint8_t *output, int width)
+{
+    int x = 0;
+
+#ifdef __ARM_NEON
+    uint8x16_t threshold = vdupq_n_u8(W_MOTION_DIFF_THRESHOLD);
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t pixels = vld1q_u8(input + x);
+        int16x8_t backgroundLow = vld1q_s16(background + x);
+        int16x8_t backgroundHigh = vld1q_s16(background + x + 8);
+        // Difference from the background, as it was, in whole levels
+        uint8x16_t level = vcombine_u8(vshrn_n_u16(vreinterpretq_u16_s16(backgroundLow),
+                                                   W_MOTION_DIFF_FRACTION_BITS),
+                                       vshrn_n_u16(vreinterpretq_u16_s16(backgroundHigh),
+                                                   W_MOTION_DIFF_FRACTION_BITS));
+        vst1q_u8(output + x, vcgtq_u8(vabdq_u8(pixels, level), threshold));
+        // Move the background towards the pixels
+        int16x8_t pixelsLow = vreinterpretq_s16_u16(vshll_n_u8(vget_low_u8(pixels),
+                                                               W_MOTION_DIFF_FRACTION_BITS));
+        int16x8_t pixelsHigh = vreinterpretq_s16_u16(vshll_n_u8(vget_high_u8(pixels),
+                                                                W_MOTION_DIFF_FRACTION_BITS));
+        vst1q_s16(background + x, vsraq_n_s16(backgroundLow,
+                                              vsubq_s16(pixelsLow, backgroundLow),
+                                              W_MOTION_DIFF_LEARNING_SHIFT));
+        vst1q_s16(background + x + 8, vsraq_n_s16(backgroundHigh,
+                                                  vsubq_s16(pixelsHigh, backgroundHigh),
+                                                  W_MOTION_DIFF_LEARNING_SHIFT));
+    }
+#endif
+
+    // The remainder, or everything if there is no NEON, exactly
+    // as above
+    for (; x < width; x++) {
+        int level = background[x] >> W_MOTION_DIFF_FRACTION_BITS;
+        int difference = input[x] - level;
+        if (difference < 0) {
+            difference = -difference;
+        }
+        output[x] = (difference > W_MOTION_DIFF_THRESHOLD) ? 0xff : 0;
+        background[x] += (int16_t) (((input[x] << W_MOTION_DIFF_FRACTION_BITS) -
+                                     background[x]) >> W_MOTION_DIFF_LEARNING_SHIFT);
+    }
+}
+
+// Write to output the minimum (if isErode is true, else the
+// maximum) of the 3x3 neighbourhood of each pixel across the three
+// rows given, each of which must have a pixel of padding at either
+// end.
+static void detectorDiffMorph(const uint8_t *rowAbove, const uint8_t *row,
+                              const uint8_t *rowBelow, uint8_t *output,
+                              int width, bool isErode)
+{
+    int x = 0;
+
+#ifdef __ARM_NEON
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t value;
+        if (isErode) {
+            value = vminq_u8(vminq_u8(vminq_u8(vld1q_u8(rowAbove + x - 1), vld1q_u8(rowAbove + x)),
+                                      vminq_u8(vld1q_u8(rowAbove + x + 1), vld1q_u8(row + x - 1))),
+                             vminq_u8(vminq_u8(vld1q_u8(row + x), vld1q_u8(row + x + 1)),
+                                      vminq_u8(vld1q_u8(rowBelow + x - 1), vld1q_u8(rowBelow + x))));
+            value = vminq_u8(value, vld1q_u8(rowBelow + x + 1));
+        } else {
+            value = vmaxq_u8(vmaxq_u8(vmaxq_u8(vld1q_u8(rowAbove + x - 1), vld1q_u8(rowAbove + x)),
+                                      vmaxq_u8(vld1q_u8(rowAbove + x + 1), vld1q_u8(row + x - 1))),
+                             vmaxq_u8(vmaxq_u8(vld1q_u8(row + x), vld1q_u8(row + x + 1)),
+                                      vmaxq_u8(vld1q_u8(rowBelow + x - 1), vld1q_u8(rowBelow + x))));
+            value = vmaxq_u8(value, vld1q_u8(rowBelow + x + 1));
+        }
+        vst1q_u8(output + x, value);
+    }
+#endif
+
+    for (; x < width; x++) {
+        uint8_t value = rowAbove[x - 1];
+        const uint8_t *rows[] = {rowAbove, row, rowBelow};
+        for (unsigned int y = 0; y < W_UTIL_ARRAY_COUNT(rows); y++) {
+            for (int z = -1; z <= 1; z++) {
+                if (isErode ? (rows[y][x + z] < value) : (rows[y][x + z] > value)) {
+                    value = rows[y][x + z];
+                }
+            }
+        }
+        output[x] = value;
+    }
+}
+
+// Open function of the "diff" motion detector.
+static int detectorDiffOpen(void **state)
+{
+    int errorCode = -ENOMEM;
+    wMotionDetectorDiff_t *diff = nullptr;
+
+    try {
+        diff = new wMotionDetectorDiff_t;
+    }
+    catch (int x) {
+        errorCode = -x;
+    }
+    if (diff) {
+        detectorDiffSizeSet(diff, 0, 0);
+        *state = diff;
+        errorCode = 0;
+    }
+
+    return errorCode;
+}
+
+// Reset function of the "diff" motion detector.
+static void detectorDiffReset(void *state)
+{
+    ((wMotionDetectorDiff_t *) state)->backgroundValid = false;
+}
+
+// Apply function of the "diff" motion detector.
+static int detectorDiffApply(void *state, const cv::Mat *image, cv::Mat *mask)
+{
+    int errorCode = -EINVAL;
+    wMotionDetectorDiff_t *diff = (wMotionDetectorDiff_t *) state;
+
+    if (image->type() == CV_8UC1) {
+        errorCode = 0;
+        if ((image->cols != diff->width) || (image->rows != diff->height)) {
+            detectorDiffSizeSet(diff, image->cols, image->rows);
+        }
+        mask->create(image->rows, image->cols, CV_8UC1);
+        if (!diff->backgroundValid) {
+            // This image becomes the background, nothing is moving
+            for (int y = 0; y < diff->height; y++) {
+                const uint8_t *input = image->ptr<uint8_t>(y);
+                int16_t *background = diff->background.data() + (y * diff->width);
+                for (int x = 0; x < diff->width; x++) {
+                    background[x] = (int16_t) (input[x] << W_MOTION_DIFF_FRACTION_BITS);
+                }
+            }
+            mask->setTo(cv::Scalar(0));
+            diff->backgroundValid = true;
+        } else {
+            // Two rows beyond the end to flush out the erosion
+            // and dilation
+            for (int y = 0; y < diff->height + 2; y++) {
+                if (y < diff->height) {
+                    detectorDiffThreshold(image->ptr<uint8_t>(y),
+                                          diff->background.data() + (y * diff->width),
+                                          diff->rowThreshold[y % 3].data() + 1,
+                                          diff->width);
+                }
+                int yEroded = y - 1;
+                if ((yEroded >= 0) && (yEroded < diff->height)) {
+                    detectorDiffMorph(detectorDiffRowThreshold(diff, yEroded - 1),
+                                      detectorDiffRowThreshold(diff, yEroded),
+                                      detectorDiffRowThreshold(diff, yEroded + 1),
+                                      diff->rowEroded[yEroded % 3].data() + 1,
+                                      diff->width, true);
+                }
+                int yDilated = y - 2;
+                if (yDilated >= 0) {
+                    detectorDiffMorph(detectorDiffRowEroded(diff, yDilated - 1),
+                                      detectorDiffRowEroded(diff, yDilated),
+                                      detectorDiffRowEroded(diff, yDilated + 1),
+                                      mask->ptr<uint8_t>(yDilated),
+                                      diff->width, false);
+                }
+            }
+        }
+    }
+
+    return errorCode;
+}
+
+// Close function of the "diff" motion detector.
+static void detectorDiffClose(void *state)
+{
+    delete (wMotionDetectorDiff_t *) state;
+}
+
+/* ----------------------------------------------------------------
+ * MORE VARIABLES: THE BUILT-IN MOTION DETECTORS
+ * -------------------------------------------------------------- */
+
+// The built-in motion detectors, see wImageProcessingDetectorGet().
+static const wImageProcessingDetector_t gDetector[] = {{.name = "mog2",
+                                                         .open = detectorMog2Open,
+                                                         .reset = detectorMog2Reset,
+                                                         .apply = detectorMog2Apply,
+                                                         .close = detectorMog2Close},
+                                                        {.name = "diff",
+                                                         .open = detectorDiffOpen,
+                                                         .reset = detectorDiffReset,
+                                                         .apply = detectorDiffApply,
+                                                         .close = detectorDiffClose}};
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MOTION DETECTION RELATED
+ * -------------------------------------------------------------- */
+
+// Switch to the requested motion detector, if it has changed;
+// called from the message handler.
+static void detectorUpdate(wImageProcessingContext_t *context)
+{
+    const wImageProcessingDetector_t *detector = context->detectorRequested;
+
+    if (detector && (detector != context->detector)) {
+        void *state = nullptr;
+        int errorCode = detector->open(&state);
+        if (errorCode == 0) {
+            if (context->detector) {
+                context->detector->close(context->detectorState);
+            }
+            context->detector = detector;
+            context->detectorState = state;
+            W_LOG_INFO("motion detector is now \"%s\".", detector->name);
+        } else {
+            W_LOG_ERROR("unable to open motion detector \"%s\" (%d)!",
+                        detector->name, errorCode);
+            // Don't keep trying
+            context->detectorRequested = context->detector;
+        }
+    }
+}
+
+// Pick up a new detection configuration, if there is one, setting
+// the number of pyramid levels; called from the message handler
+// before the pyramid is built.
+static void detectCfgUpdate(wImageProcessingContext_t *context)
+{
+    if (context->detectCfgChanged) {
+        context->detectCfgMutex.lock();
+        context->pyramid.resize(context->pyramidLevels);
+        context->detectCfgChanged = false;
+        context->detectCfgMutex.unlock();
+        // Force the regions to be worked out again
+        context->sizeDetect = cv::Size();
+        context->resetMotionDetect = true;
+    }
+}
+
+// Work out the part of the detection image that motion detection
+// is to be performed on and the mask of ignored areas inside it,
+// from the regions, which are in the coordinates of a frame of
+// size sizeFrame.
+static void detectRegionsApply(wImageProcessingContext_t *context,
+                               cv::Size sizeFrame, cv::Size sizeDetect)
+{
+    cv::Rect rectBounds(cv::Point(0, 0), sizeDetect);
+    cv::Rect rectInclude;
+    bool includeFound = false;
+
+    context->detectCfgMutex.lock();
+
+    // Motion detection need only be performed on the area that
+    // bounds all of the included regions
+    for (auto &region: context->regions) {
+        if (!region.exclude) {
+            cv::Rect rect = rectScale(&(region.rectFrame), sizeFrame, sizeDetect) & rectBounds;
+            rectInclude = includeFound ? (rectInclude | rect) : rect;
+            includeFound = true;
+        }
+    }
+    context->rectDetect = rectBounds;
+    if (includeFound && (rectInclude.area() > 0)) {
+        context->rectDetect = rectInclude;
+    }
+
+    // Within that, mask out what is not included and what is excluded
+    context->maskRegion.release();
+    if (!context->regions.empty()) {
+        context->maskRegion = cv::Mat(context->rectDetect.size(), CV_8UC1,
+                                      cv::Scalar(includeFound ? 0 : 255));
+        for (unsigned int pass = 0; pass < 2; pass++) {
+            // Includes first, then excludes, so that excludes win
+            for (auto &region: context->regions) {
+                if (region.exclude == (pass > 0)) {
+                    cv::Rect rect = (rectScale(&(region.rectFrame), sizeFrame, sizeDetect) &
+                                     context->rectDetect) - context->rectDetect.tl();
+                    if (rect.area() > 0) {
+                        context->maskRegion(rect).setTo(cv::Scalar(region.exclude ? 0 : 255));
+                    }
+                }
+            }
+        }
+    }
+
+    context->detectCfgMutex.unlock();
+
+    context->sizeDetect = sizeDetect;
+    W_LOG_DEBUG("motion detection on %dx%d at %d,%d of %dx%d image, %s.",
+                context->rectDetect.width, context->rectDetect.height,
+                context->rectDetect.x, context->rectDetect.y,
+                sizeDetect.width, sizeDetect.height,
+                context->maskRegion.empty() ? "no mask" : "masked");
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MISC
+ * -------------------------------------------------------------- */
+
+// Get the context of a pipeline, nullptr if there isn't one.
+static wImageProcessingContext_t *contextGet(unsigned int pipeline)
+{
+    wImageProcessingContext_t *context = nullptr;
+
+    if (pipeline < W_UTIL_ARRAY_COUNT(gContext)) {
+        context = gContext[pipeline];
+    }
+
+    return context;
+}
 
-    // Filter the edges to keep just the major ones
-    std::vector<std::vector<cv::Point>> largeContours;
-    for (auto contour: contours) {
-        if (contourArea(contour) > 500) {
-            largeContours.push_back(contour);
+// Release the queues, context, etc. of a pipeline.
+static void cleanUp(unsigned int pipeline)
+{
+    wImageProcessingContext_t *context = contextGet(pipeline);
+
+    if (context) {
+        // Release the message queues, in stage order, so that
+        // no stage is pushing to a queue that has gone
+        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(context->msgQueueId); x++) {
+            if (context->msgQueueId[x] >= 0) {
+                wMsgQueueStop(context->msgQueueId[x]);
+                context->msgQueueId[x] = -1;
+            }
+        }
+        if (context->detector) {
+            context->detector->close(context->detectorState);
+        }
+        delete context;
+        gContext[pipeline] = nullptr;
+    }
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MOTION DETECTION
+ * -------------------------------------------------------------- */
+
+// Run the motion detector on a frame, from the detect stage: the
+// result, and whatever else the motion stage needs to make sense of
+// it, is put into slot.
+static void motionDetect(wImageProcessingContext_t *imageProcessingContext,
+                         uint8_t *data, const cv::Mat *frameOpenCvGray,
+                         wImageProcessingSlot_t *slot)
+{
+    // Motion detection is performed on the analysis stream version
+    // of the frame, which is the same image at a lower resolution
+    // (again, just the Y portion, in-place), if there is one, else
+    // on the frame itself; anything found is scaled up to the frame
+    uint8_t *analysisData = nullptr;
+    unsigned int analysisWidth;
+    unsigned int analysisHeight;
+    unsigned int analysisStride;
+    cv::Mat frameOpenCvAnalysis = *frameOpenCvGray;
+    if (wCameraFrameAnalysisGet(data, &analysisData, &analysisWidth,
+                                &analysisHeight, &analysisStride) == 0) {
+        frameOpenCvAnalysis = cv::Mat(analysisHeight, analysisWidth, CV_8UC1,
+                                      analysisData, analysisStride);
+    }
+
+    // Downscale that by the configured number of pyramid levels, into
+    // buffers that are kept between frames, to get the image that
+    // motion detection is actually performed on
+    detectCfgUpdate(imageProcessingContext);
+    cv::Mat frameOpenCvDetect = frameOpenCvAnalysis;
+    for (auto &level: imageProcessingContext->pyramid) {
+        cv::pyrDown(frameOpenCvDetect, level);
+        frameOpenCvDetect = level;
+    }
+    if (frameOpenCvDetect.size() != imageProcessingContext->sizeDetect) {
+        detectRegionsApply(imageProcessingContext, frameOpenCvGray->size(),
+                           frameOpenCvDetect.size());
+    }
+    // Only the part of the image that bounds the regions of interest,
+    // which is the whole image if there are none, is examined
+    cv::Mat frameOpenCvDetectRegion = frameOpenCvDetect(imageProcessingContext->rectDetect);
+    slot->sizeFrame = frameOpenCvGray->size();
+    slot->sizeDetect = frameOpenCvDetect.size();
+    slot->rectDetect = imageProcessingContext->rectDetect;
+    slot->maskRegion = imageProcessingContext->maskRegion;
+
+    // Switch motion detector, or reset the one we have, if requested
+    detectorUpdate(imageProcessingContext);
+    const wImageProcessingDetector_t *detector = imageProcessingContext->detector;
+    if (detector && imageProcessingContext->resetMotionDetect) {
+        detector->reset(imageProcessingContext->detectorState);
+        imageProcessingContext->resetMotionDetect = false;
+    }
+
+    // Run the motion detector: this will cause moving areas to
+    // appear in the mask as pixels with value 255, everything else
+    // (including shadows) as pixels with value 0, small blobs having
+    // been removed
+    slot->maskValid = detector && (detector->apply(imageProcessingContext->detectorState,
+                                                   &frameOpenCvDetectRegion,
+                                                   &(slot->maskMotion)) == 0);
+}
+
+// Find the moving objects in what motion detection put into slot,
+// from the motion stage, calling the focus callback if there is
+// something to focus on; the bounding rectangles of the moving
+// objects, in frame coordinates, are put in the largeRects of slot
+// and, if there was motion, point will be set to the focus point, in
+// view coordinates. Returns the area of motion, zero if there was none.
+static int motionFind(wImageProcessingContext_t *imageProcessingContext,
+                      wImageProcessingSlot_t *slot, cv::Point *point)
+{
+    int areaPixels = 0;
+    double areaScale = slot->sizeFrame.area() / (double) slot->sizeDetect.area();
+    std::vector<std::vector<cv::Point>> &contours = slot->contours;
+
+    contours.clear();
+    slot->largeRects.clear();
+    if (slot->maskValid) {
+        // Remove anything outside the regions of interest or inside
+        // an excluded region
+        if (!slot->maskRegion.empty()) {
+            cv::bitwise_and(slot->maskMotion, slot->maskRegion, slot->maskMotion);
+        }
+
+        // Find the edges of the moving areas, the ones with pixel value 255
+        // in the mask, offsetting them back to detection image coordinates
+        cv::findContours(slot->maskMotion, contours, slot->hierarchy,
+                         cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE,
+                         slot->rectDetect.tl());
+    }
+
+    // Filter the edges to keep just the major ones, keeping the
+    // rectangles that bound them, scaled to frame coordinates
+    for (auto &contour: contours) {
+        if (contourArea(contour) * areaScale > W_MOTION_CONTOUR_AREA_MIN_PIXELS) {
+            cv::Rect rect = boundingRect(contour);
+            slot->largeRects.push_back(rectScale(&rect, slot->sizeDetect,
+                                                 slot->sizeFrame));
         }
     }
 
     // Find the place we should focus on the frame,
     // if there is one
-    int areaPixels = findFocusFrame(largeContours, &point);
-    if ((areaPixels > 0) && (frameToViewAndLimit(&point, &point) == 0) &&
+    areaPixels = findFocusFrame(slot->largeRects, point);
+    if ((areaPixels > 0) && (frameToViewAndLimit(point, point) == 0) &&
         imageProcessingContext->focusCallback) {
-        imageProcessingContext->focusCallback(point, areaPixels,
+        imageProcessingContext->focusCallback(*point, areaPixels,
                                               imageProcessingContext->focusCallbackContext);
     }
 
-#if 1
-    // Draw bounding boxes
-    for (auto contour: largeContours) {
-        cv::Rect rect = boundingRect(contour);
-        rectangle(frameOpenCvGray, rect,
-                  W_DRAWING_SHADE_MOVING_OBJECTS,
-                  W_DRAWING_LINE_THICKNESS_MOVING_OBJECTS);
+    return areaPixels;
+}
+
+// Report what motionFind() found in a frame, from the motion stage,
+// to the event index: the focus point, given in view coordinates,
+// and the box bounding the moving objects, in frame coordinates,
+// along with the analysis stream version of the frame (or, if there
+// isn't one, the frame itself) for a thumbnail.
+static void eventReport(wImageProcessingMsgBodyImageBuffer_t *msg,
+                        const wImageProcessingSlot_t *slot,
+                        int areaPixels, const cv::Point *pointView)
+{
+    if ((areaPixels >= W_EVENT_ACTIVITY_AREA_PIXELS_MIN) && wEventIsStarted()) {
+        wEventActivity_t activity = {};
+        cv::Point pointFrame;
+        cv::Rect box;
+        activity.sequence = msg->sequence;
+        activity.areaPixels = areaPixels;
+        if (viewToFrameAndLimit(pointView, &pointFrame) == 0) {
+            activity.focusX = pointFrame.x;
+            activity.focusY = pointFrame.y;
+        }
+        for (auto &rect: slot->largeRects) {
+            box = box.empty() ? rect : (box | rect);
+        }
+        activity.boxX = box.x;
+        activity.boxY = box.y;
+        activity.boxWidth = box.width;
+        activity.boxHeight = box.height;
+        uint8_t *image = nullptr;
+        unsigned int width;
+        unsigned int height;
+        unsigned int stride;
+        if (wCameraFrameAnalysisGet(msg->data, &image, &width,
+                                    &height, &stride) != 0) {
+            image = msg->data;
+            width = msg->width;
+            height = msg->height;
+            stride = msg->stride;
+        }
+        wEventActivity(&activity, image, width, height, stride);
     }
-#else
-    // Draw the wiggly edges
-    cv::drawContours(frameOpenCvGray, largeContours, 0,
-                     W_DRAWING_SHADE_MOVING_OBJECTS,
-                     W_DRAWING_LINE_THICKNESS_MOVING_OBJECTS,
-                     LINE_8, hierarchy, 0);
-#endif
+}
 
-    // Draw the current focus onto the gray OpenCV frame
-    point = pointProtectedGet(&(imageProcessingContext->focusPointView));
-    if (viewToFrameAndLimit(&point, &point) == 0) {
-        cv::circle(frameOpenCvGray, point,
-                   W_DRAWING_RADIUS_FOCUS_CIRCLE,
-                   W_DRAWING_SHADE_FOCUS_CIRCLE,
-                   W_DRAWING_LINE_THICKNESS_FOCUS_CIRCLE);
+// Update the idle state, from the motion stage, given whether motion
+// was just seen (or full-rate motion detection is needed for some
+// other reason); the detect stage picks up the change on the frames
+// that follow.
+static void idleUpdate(wImageProcessingContext_t *context, bool motion)
+{
+    if (motion) {
+        // Back to full rate immediately
+        context->noMotionFrameCount = 0;
+        if (context->idle) {
+            context->idle = false;
+            W_LOG_DEBUG("image processing: leaving idle, motion detection"
+                        " is at full rate.");
+        }
+    } else if ((W_MOTION_IDLE_FRAMES > 0) && !context->idle) {
+        // When not idle every frame is examined, so counting
+        // frames without motion is counting time
+        context->noMotionFrameCount++;
+        if (context->noMotionFrameCount >= W_MOTION_IDLE_FRAMES) {
+            context->idle = true;
+            W_LOG_DEBUG("image processing: no motion for %d second(s), idle,"
+                        " motion detection on one frame in %d.",
+                        W_IMAGE_PROCESSING_IDLE_SECONDS,
+                        W_IMAGE_PROCESSING_IDLE_ANALYSIS_INTERVAL_FRAMES);
+        }
+    }
+}
+
+// Take the next slot for a frame, from the detect stage, returning
+// its index or -1 if the stages after detection still have all of
+// them.  Since the stages keep the frames in order, the slots are
+// given back in the order they were taken, so only the next one
+// need be checked.
+static int slotTake(wImageProcessingContext_t *context)
+{
+    int index = -1;
+    wImageProcessingSlot_t *slot = &(context->slot[context->slotNext]);
+
+    if (!slot->inUse.load(std::memory_order_acquire)) {
+        index = (int) context->slotNext;
+        slot->inUse.store(true, std::memory_order_relaxed);
+        context->slotNext++;
+        if (context->slotNext >= W_UTIL_ARRAY_COUNT(context->slot)) {
+            context->slotNext = 0;
+        }
     }
 
-    // Finally, write the current local time onto the frame
-    // First get the time as a string
+    return index;
+}
+
+// Give a slot back, from whichever stage has the frame; index may
+// be -1, in which case this does nothing.
+static void slotGive(wImageProcessingContext_t *context, int index)
+{
+    if ((index >= 0) && (index < (int) W_UTIL_ARRAY_COUNT(context->slot))) {
+        context->slot[index].inUse.store(false, std::memory_order_release);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: OVERLAY
+ * -------------------------------------------------------------- */
+
+// Render the date/time box for the given time into the overlay cache.
+static void overlayDateTimeRender(wImageProcessingContext_t *context,
+                                  time_t rawTime)
+{
     char textBuffer[64];
-    time_t rawTime;
-    time(&rawTime);
-    const auto localTime = localtime(&rawTime);
+    struct tm localTime = {};
+
     // %F %T is pretty much ISO8601 format, Chinese format,
     // descending order of magnitude
-    strftime(textBuffer, sizeof(textBuffer), "%F %T", localTime);
-    std::string timeString(textBuffer);
-
-    // Create a frame, filled with its shade (white), of the
-    // size of the rectangle we want the time to fit inside
-    cv::Mat frameDateTime(W_DRAWING_DATE_TIME_HEIGHT_PIXELS,
-                          W_DRAWING_DATE_TIME_WIDTH_PIXELS, CV_8UC1,
-                          W_DRAWING_DATE_TIME_REGION_SHADE);
-    // Write the text to this frame in its shade (black)
-    cv::putText(frameDateTime, timeString,
+    localtime_r(&rawTime, &localTime);
+    strftime(textBuffer, sizeof(textBuffer), "%F %T", &localTime);
+
+    // Fill the box with its shade (white) and write the text onto
+    // it in its shade (black)
+    context->overlayDateTimeBox.create(W_DRAWING_DATE_TIME_HEIGHT_PIXELS,
+                                       W_DRAWING_DATE_TIME_WIDTH_PIXELS, CV_8UC1);
+    context->overlayDateTimeBox.setTo(W_DRAWING_DATE_TIME_REGION_SHADE);
+    cv::putText(context->overlayDateTimeBox, textBuffer,
                 cv::Point(W_DRAWING_DATE_TIME_MARGIN_PIXELS_X,
                           W_DRAWING_DATE_TIME_HEIGHT_PIXELS -
                           W_DRAWING_DATE_TIME_MARGIN_PIXELS_Y),
@@ -645,64 +1379,272 @@ static void msgHandlerImageProcessingImageBuffer(void *msgBody,
                 W_DRAWING_DATE_TIME_FONT_HEIGHT,
                 W_DRAWING_DATE_TIME_TEXT_SHADE,
                 W_DRAWING_DATE_TIME_TEXT_THICKNESS);
-    // Create a rectangle of the same size, positioned on the main image
+
+    // Keep the box's part of the blend, so that per frame just one
+    // multiply, add and shift per pixel remains
+    context->overlayDateTime.resize(W_DRAWING_DATE_TIME_WIDTH_PIXELS *
+                                    W_DRAWING_DATE_TIME_HEIGHT_PIXELS);
+    uint16_t *weighted = context->overlayDateTime.data();
+    for (int y = 0; y < context->overlayDateTimeBox.rows; y++) {
+        const uint8_t *box = context->overlayDateTimeBox.ptr<uint8_t>(y);
+        for (int x = 0; x < context->overlayDateTimeBox.cols; x++) {
+            *weighted = (uint16_t) (((256 - W_DRAWING_DATE_TIME_ALPHA_256) * box[x]) + 128);
+            weighted++;
+        }
+    }
+
+    context->overlayTime = rawTime;
+}
+
+// Blend the cached date/time box into a region of a frame, which
+// must be the size of the box: each pixel becomes
+// (alpha * pixel + (256 - alpha) * box + 128) / 256.
+static void overlayDateTimeBlend(const wImageProcessingContext_t *context,
+                                 cv::Mat *region)
+{
+    const uint16_t *weighted = context->overlayDateTime.data();
+
+    for (int y = 0; y < region->rows; y++) {
+        uint8_t *pixel = region->ptr<uint8_t>(y);
+        // Simple enough for the compiler to vectorise
+        for (int x = 0; x < region->cols; x++) {
+            pixel[x] = (uint8_t) (((W_DRAWING_DATE_TIME_ALPHA_256 * pixel[x]) +
+                                   weighted[x]) >> 8);
+        }
+        weighted += region->cols;
+    }
+}
+
+// Draw everything that goes on top of a frame: the bounding boxes
+// of the moving objects (rather than the wiggly edges, which would
+// be in analysis stream coordinates), the current focus and the
+// local time.
+static void overlayDraw(wImageProcessingContext_t *context,
+                        cv::Mat *frame,
+                        const std::vector<cv::Rect> *largeRects)
+{
+    for (auto rect: *largeRects) {
+        rectangle(*frame, rect,
+                  W_DRAWING_SHADE_MOVING_OBJECTS,
+                  W_DRAWING_LINE_THICKNESS_MOVING_OBJECTS);
+    }
+
+    cv::Point point = pointProtectedGet(&(context->focusPointView));
+    if (viewToFrameAndLimit(&point, &point) == 0) {
+        cv::circle(*frame, point,
+                   W_DRAWING_RADIUS_FOCUS_CIRCLE,
+                   W_DRAWING_SHADE_FOCUS_CIRCLE,
+                   W_DRAWING_LINE_THICKNESS_FOCUS_CIRCLE);
+    }
+
+    // The date/time box only needs rendering when the
+    // second ticks over
+    time_t rawTime = time(nullptr);
+    if (rawTime != context->overlayTime) {
+        overlayDateTimeRender(context, rawTime);
+    }
     cv::Rect dateTimeRegion = cv::Rect(W_DRAWING_DATE_TIME_REGION_OFFSET_PIXELS_X,
                                        W_DRAWING_DATE_TIME_HEIGHT_PIXELS +
                                        W_DRAWING_DATE_TIME_REGION_OFFSET_PIXELS_Y,
                                        W_DRAWING_DATE_TIME_WIDTH_PIXELS,
-                                       W_DRAWING_DATE_TIME_HEIGHT_PIXELS); 
-    // Add frameDateTime to frameOpenCvGray inside dateTimeRegion
-    cv::addWeighted(frameOpenCvGray(dateTimeRegion), W_DRAWING_DATE_TIME_ALPHA,
-                    frameDateTime, 1 - W_DRAWING_DATE_TIME_ALPHA, 0.0,
-                    frameOpenCvGray(dateTimeRegion));
+                                       W_DRAWING_DATE_TIME_HEIGHT_PIXELS);
+    if ((dateTimeRegion & cv::Rect(0, 0, frame->cols, frame->rows)) == dateTimeRegion) {
+        cv::Mat region = (*frame)(dateTimeRegion);
+        overlayDateTimeBlend(context, &region);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MESSAGE HANDLERS wImageProcessingMsgBodyImageBuffer_t
+ * -------------------------------------------------------------- */
+
+// Push a frame on to the next stage; if it cannot be pushed the
+// frame, and its slot, are given back.
+static void stagePush(wImageProcessingContext_t *context,
+                      wImageProcessingStage_t stage,
+                      wImageProcessingMsgType_t msgType,
+                      wImageProcessingMsgBodyImageBuffer_t *msg)
+{
+    int queueLengthOrErrorCode = -EBADF;
+
+    if (context->msgQueueId[stage] >= 0) {
+        // If the queue is full the message is dropped, which
+        // calls msgHandlerImageProcessingBufferFree()
+        queueLengthOrErrorCode = wMsgPush(context->msgQueueId[stage], msgType,
+                                          msg, sizeof(*msg));
+    }
+    if (queueLengthOrErrorCode < 0) {
+        slotGive(context, msg->slot);
+        wCameraFrameRelease(msg->data);
+    }
+}
+
+// Message handler of the detect stage: run the motion detector on
+// the frame, unless we are idle, in which case only every
+// W_IMAGE_PROCESSING_IDLE_ANALYSIS_INTERVAL_FRAMES frame is
+// examined, and pass the frame on to the motion stage regardless.
+static void msgHandlerImageProcessingImageBuffer(void *msgBody,
+                                                 unsigned int bodySize,
+                                                 void *context)
+{
+    wImageProcessingMsgBodyImageBuffer_t *msg = &(((wImageProcessingMsgBody_t *) msgBody)->imageBuffer);
+    wImageProcessingContext_t *imageProcessingContext = (wImageProcessingContext_t *) context;
+
+    assert(bodySize == sizeof(*msg));
+
+    wStatsTimestamp(imageProcessingContext->pipeline,
+                    W_STATS_POINT_IMAGE_PROCESSING_START, msg->sequence);
+
+    // Do the OpenCV things.  From the comment on this post:
+    // https://stackoverflow.com/questions/44517828/transform-a-yuv420p-qvideoframe-into-grayscale-opencv-mat
+    // ...we can bring in just the Y portion of the frame as, effectively,
+    // a gray-scale image using CV_8UC1, which can be processed
+    // quickly. Note that OpenCV is operating in-place on the
+    // data, it does not perform a copy
+    cv::Mat frameOpenCvGray(msg->height, msg->width, CV_8UC1,
+                            msg->data, msg->stride);
+
+    // A freshly reset motion detector needs every frame to learn from
+    bool motionForced = imageProcessingContext->resetMotionDetect;
+    if (motionForced || !imageProcessingContext->idle) {
+        imageProcessingContext->idleSkipCount = 0;
+    }
+    msg->slot = -1;
+    if (imageProcessingContext->idleSkipCount == 0) {
+        msg->slot = slotTake(imageProcessingContext);
+        if (msg->slot >= 0) {
+            wImageProcessingSlot_t *slot = &(imageProcessingContext->slot[msg->slot]);
+            slot->motionForced = motionForced;
+            motionDetect(imageProcessingContext, msg->data, &frameOpenCvGray, slot);
+            if (imageProcessingContext->idle &&
+                (W_IMAGE_PROCESSING_IDLE_ANALYSIS_INTERVAL_FRAMES > 1)) {
+                imageProcessingContext->idleSkipCount = W_IMAGE_PROCESSING_IDLE_ANALYSIS_INTERVAL_FRAMES - 1;
+            }
+        } else {
+            W_LOG_DEBUG("image processing: all %d slot(s) in use, no motion"
+                        " detection on frame %u.",
+                        W_IMAGE_PROCESSING_PIPELINE_SLOT_NUM, msg->sequence);
+        }
+    } else {
+        imageProcessingContext->idleSkipCount--;
+    }
+
+    stagePush(imageProcessingContext, W_IMAGE_PROCESSING_STAGE_MOTION,
+              W_IMAGE_PROCESSING_MSG_TYPE_MOTION, msg);
+}
+
+// Message handler of the motion stage: find the moving objects and
+// the focus point in what motion detection found, if it was
+// performed, and pass the frame on to the overlay stage.
+static void msgHandlerImageProcessingMotion(void *msgBody,
+                                            unsigned int bodySize,
+                                            void *context)
+{
+    wImageProcessingMsgBodyImageBuffer_t *msg = &(((wImageProcessingMsgBody_t *) msgBody)->imageBuffer);
+    wImageProcessingContext_t *imageProcessingContext = (wImageProcessingContext_t *) context;
+    cv::Point point;
+
+    assert(bodySize == sizeof(*msg));
+
+    if (msg->slot >= 0) {
+        wImageProcessingSlot_t *slot = &(imageProcessingContext->slot[msg->slot]);
+        int areaPixels = motionFind(imageProcessingContext, slot, &point);
+        idleUpdate(imageProcessingContext, (areaPixels > 0) || slot->motionForced);
+        if (imageProcessingContext->pipeline == W_COMMON_PIPELINE_MAIN) {
+            // Event recording and the event index are for the
+            // main pipeline only
+            wRecordActivity(areaPixels);
+            eventReport(msg, slot, areaPixels, &point);
+        }
+    }
+
+    stagePush(imageProcessingContext, W_IMAGE_PROCESSING_STAGE_OVERLAY,
+              W_IMAGE_PROCESSING_MSG_TYPE_OVERLAY, msg);
+}
+
+// Message handler of the overlay stage: draw the bounding boxes, the
+// focus and the date/time onto the frame and hand it on.
+static void msgHandlerImageProcessingOverlay(void *msgBody,
+                                             unsigned int bodySize,
+                                             void *context)
+{
+    wImageProcessingMsgBodyImageBuffer_t *msg = &(((wImageProcessingMsgBody_t *) msgBody)->imageBuffer);
+    wImageProcessingContext_t *imageProcessingContext = (wImageProcessingContext_t *) context;
+    static const std::vector<cv::Rect> noRects;
+
+    assert(bodySize == sizeof(*msg));
+
+    cv::Mat frameOpenCvGray(msg->height, msg->width, CV_8UC1,
+                            msg->data, msg->stride);
+    const std::vector<cv::Rect> *largeRects = &noRects;
+    if (msg->slot >= 0) {
+        largeRects = &(imageProcessingContext->slot[msg->slot].largeRects);
+    }
+    overlayDraw(imageProcessingContext, &frameOpenCvGray, largeRects);
+    slotGive(imageProcessingContext, msg->slot);
+
+    wStatsTimestamp(imageProcessingContext->pipeline,
+                    W_STATS_POINT_IMAGE_PROCESSING_END, msg->sequence);
 
     if (imageProcessingContext->outputCallback) {
         // Send the output to the output callback
-        int queueLength = imageProcessingContext->outputCallback(msg->data,
+        int queueLength = imageProcessingContext->outputCallback(imageProcessingContext->pipeline,
+                                                                 msg->data,
                                                                  msg->length,
                                                                  msg->sequence,
                                                                  msg->width,
                                                                  msg->height,
                                                                  msg->stride);
-        if ((wCameraFrameCountGet() % W_COMMON_FRAME_RATE_HERTZ == 0) &&
-            (queueLength != wMsgQueuePreviousSizeGet(gMsgQueueId))) {
+        int queueId = imageProcessingContext->msgQueueId[W_IMAGE_PROCESSING_STAGE_OVERLAY];
+        if ((wCameraFrameCountGet(imageProcessingContext->pipeline) % W_COMMON_FRAME_RATE_HERTZ == 0) &&
+            (queueLength != wMsgQueuePreviousSizeGet(queueId))) {
             // Print the size of the backlog once a second if it has changed
             W_LOG_DEBUG("video backlog %d frame(s).", queueLength);
-            wMsgQueuePreviousSizeSet(gMsgQueueId, queueLength);
+            wMsgQueuePreviousSizeSet(queueId, queueLength);
         }
     } else {
-        // If there is no output callback, free the image data.
-        free(msg->data);
+        // If there is no output callback, give the frame back
+        wCameraFrameRelease(msg->data);
     }
 }
 
-// Message handler free() function for wImageProcessingMsgBodyImageBuffer_t.
+// Message handler free() function for wImageProcessingMsgBodyImageBuffer_t,
+// for all of the stages.
 static void msgHandlerImageProcessingBufferFree(void *msgBody, void *context)
 {
     wImageProcessingMsgBodyImageBuffer_t *msg = &(((wImageProcessingMsgBody_t *) msgBody)->imageBuffer);
 
-    // This handler doesn't use any context
-    (void) context;
-
-    free(msg->data);
+    slotGive((wImageProcessingContext_t *) context, msg->slot);
+    wCameraFrameRelease(msg->data);
 }
 
 /* ----------------------------------------------------------------
  * MORE VARIABLES: THE MESSAGES WITH THEIR MESSAGE HANDLERS
  * -------------------------------------------------------------- */
 
-// Array of message handlers with the message type they handle.
-static wImageProcessingMsgHandler_t gMsgHandler[] = {{.msgType = W_IMAGE_PROCESSING_MSG_TYPE_IMAGE_BUFFER,
+// Array of message handlers with the stage and message type they handle.
+static wImageProcessingMsgHandler_t gMsgHandler[] = {{.stage = W_IMAGE_PROCESSING_STAGE_DETECT,
+                                                      .msgType = W_IMAGE_PROCESSING_MSG_TYPE_IMAGE_BUFFER,
                                                       .function = msgHandlerImageProcessingImageBuffer,
-                                                      .functionFree =msgHandlerImageProcessingBufferFree}};
+                                                      .functionFree = msgHandlerImageProcessingBufferFree},
+                                                     {.stage = W_IMAGE_PROCESSING_STAGE_MOTION,
+                                                      .msgType = W_IMAGE_PROCESSING_MSG_TYPE_MOTION,
+                                                      .function = msgHandlerImageProcessingMotion,
+                                                      .functionFree = msgHandlerImageProcessingBufferFree},
+                                                     {.stage = W_IMAGE_PROCESSING_STAGE_OVERLAY,
+                                                      .msgType = W_IMAGE_PROCESSING_MSG_TYPE_OVERLAY,
+                                                      .function = msgHandlerImageProcessingOverlay,
+                                                      .functionFree = msgHandlerImageProcessingBufferFree}};
 
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS: IMAGE PROCESSING CALLBACK
  * -------------------------------------------------------------- */
 
 // The image processing callback that is provided to the camera API;
-// populates our queue with an image buffer.
-static int imageProcessingCallback(uint8_t *data, unsigned int length,
+// populates the queue of the pipeline with an image buffer.  If the
+// buffer cannot be queued it is released back to the camera.
+static int imageProcessingCallback(unsigned int pipeline,
+                                   uint8_t *data, unsigned int length,
                                    unsigned int sequence,
                                    unsigned int width,
                                    unsigned int height,
@@ -714,20 +1656,30 @@ static int imageProcessingCallback(uint8_t *data, unsigned int length,
                                                 .sequence = sequence,
                                                 .width = width,
                                                 .height = height,
-                                                .stride = stride};
-    if (gMsgQueueId >= 0) {
-        queueLengthOrErrorCode = wMsgPush(gMsgQueueId,
+                                                .stride = stride,
+                                                .slot = -1};
+    wImageProcessingContext_t *context = contextGet(pipeline);
+    int queueId = -1;
+    if (context) {
+        queueId = context->msgQueueId[W_IMAGE_PROCESSING_STAGE_DETECT];
+    }
+    if (queueId >= 0) {
+        queueLengthOrErrorCode = wMsgPush(queueId,
                                           W_IMAGE_PROCESSING_MSG_TYPE_IMAGE_BUFFER,
                                           &msg, sizeof(msg));
-        if ((wCameraFrameCountGet() % W_COMMON_FRAME_RATE_HERTZ == 0) &&
-            (queueLengthOrErrorCode != wMsgQueuePreviousSizeGet(gMsgQueueId))) {
+        if ((wCameraFrameCountGet(pipeline) % W_COMMON_FRAME_RATE_HERTZ == 0) &&
+            (queueLengthOrErrorCode != wMsgQueuePreviousSizeGet(queueId))) {
             // Print the size of the backlog once a second if it has changed
             W_LOG_DEBUG("image processing backlog %d frame(s).",
                         queueLengthOrErrorCode);
-            wMsgQueuePreviousSizeSet(gMsgQueueId, queueLengthOrErrorCode);
+            wMsgQueuePreviousSizeSet(queueId, queueLengthOrErrorCode);
         }
     }
 
+    if (queueLengthOrErrorCode < 0) {
+        wCameraFrameRelease(data);
+    }
+
     return queueLengthOrErrorCode;
 }
 
@@ -736,37 +1688,80 @@ static int imageProcessingCallback(uint8_t *data, unsigned int length,
  * -------------------------------------------------------------- */
 
 // Initialise image processing.
-int wImageProcessingInit()
+int wImageProcessingInit(unsigned int pipeline)
 {
     int errorCode = 0;
 
-    if (!gContext) {
-        gContext = new wImageProcessingContext_t;
+    if (pipeline >= W_UTIL_ARRAY_COUNT(gContext)) {
+        errorCode = -EINVAL;
+    } else if (!gContext[pipeline]) {
+        wImageProcessingContext_t *context = new wImageProcessingContext_t;
+        gContext[pipeline] = context;
+        context->pipeline = pipeline;
+        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(context->msgQueueId); x++) {
+            context->msgQueueId[x] = -1;
+        }
         // Set the initial focus point to be invalid so that we don't
         // end up with a zero'd focus point on the image
-        gContext->focusPointView.point = W_POINT_INVALID;
-        errorCode = -ENOMEM;
-        // Set up the OpenCV background subtractor object
-        gContext->backgroundSubtractor = cv::createBackgroundSubtractorMOG2();
-        if (gContext->backgroundSubtractor) {
-            // Create our message queue
-            errorCode = wMsgQueueStart(gContext, W_IMAGE_PROCESSING_MSG_QUEUE_MAX_SIZE, "image process");
+        context->focusPointView.point = W_POINT_INVALID;
+        context->resetMotionDetect = false;
+        // Start out at full rate
+        context->idle = false;
+        context->noMotionFrameCount = 0;
+        context->idleSkipCount = 0;
+        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(context->slot); x++) {
+            context->slot[x].inUse = false;
+        }
+        context->slotNext = 0;
+        context->overlayTime = -1;
+        // By default, no downscaling beyond the analysis stream and
+        // no regions
+        context->pyramidLevels = 0;
+        context->detectCfgChanged = false;
+        // Open the default motion detector now, so that any failure
+        // is seen here; the message handler may switch it later
+        context->detector = wImageProcessingDetectorGet(W_IMAGE_PROCESSING_DETECTOR_NAME_DEFAULT);
+        context->detectorState = nullptr;
+        context->detectorRequested = context->detector;
+        errorCode = -ENODEV;
+        if (context->detector) {
+            errorCode = context->detector->open(&(context->detectorState));
+            if (errorCode != 0) {
+                context->detector = nullptr;
+            }
+        }
+        // Create the message queues of the stages: the only thing that
+        // pushes to the first is the libcamera thread, via
+        // imageProcessingCallback(), and the only thing that pushes to
+        // each of the others is the stage before, so they can all be
+        // single-producer rings, which avoids a heap allocation and
+        // a mutex per frame
+        for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(context->msgQueueId)) &&
+                                 (errorCode == 0); x++) {
+            errorCode = wMsgQueueStart(context, W_IMAGE_PROCESSING_MSG_QUEUE_MAX_SIZE,
+                                       wUtilPipelineName(gMsgQueueName[x], pipeline),
+                                       W_MSG_QUEUE_TYPE_RING_SPSC,
+                                       sizeof(wImageProcessingMsgBody_t));
             if (errorCode >= 0) {
-                gMsgQueueId = errorCode;
-                errorCode = 0;
-                // Register the message handler
-                for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gMsgHandler)) &&
-                                         (errorCode == 0); x++) {
-                    wImageProcessingMsgHandler_t *handler = &(gMsgHandler[x]);
-                    errorCode = wMsgQueueHandlerAdd(gMsgQueueId,
-                                                    handler->msgType,
-                                                    handler->function,
-                                                    handler->functionFree);
+                context->msgQueueId[x] = errorCode;
+                errorCode = wMsgQueueOverflowSet(context->msgQueueId[x],
+                                                 W_IMAGE_PROCESSING_MSG_QUEUE_OVERFLOW);
+                if (errorCode == 0) {
+                    errorCode = wStatsQueueAdd(context->msgQueueId[x], pipeline);
                 }
             }
         }
+        // Register the message handlers, each with the queue of its stage
+        for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gMsgHandler)) &&
+                                 (errorCode == 0); x++) {
+            wImageProcessingMsgHandler_t *handler = &(gMsgHandler[x]);
+            errorCode = wMsgQueueHandlerAdd(context->msgQueueId[handler->stage],
+                                            handler->msgType,
+                                            handler->function,
+                                            handler->functionFree);
+        }
         if (errorCode != 0) {
-            cleanUp();
+            cleanUp(pipeline);
         }
     }
 
@@ -774,14 +1769,16 @@ int wImageProcessingInit()
 }
 
 // Become a consumer of the focus point.
-int wImageProcessingFocusConsume(wImageProcessingFocusFunction_t *focusCallback,
+int wImageProcessingFocusConsume(unsigned int pipeline,
+                                 wImageProcessingFocusFunction_t *focusCallback,
                                  void *context)
 {
     int errorCode = -EBADF;
+    wImageProcessingContext_t *imageProcessingContext = contextGet(pipeline);
 
-    if (gContext) {
-        gContext->focusCallback = focusCallback;
-        gContext->focusCallbackContext = context;
+    if (imageProcessingContext) {
+        imageProcessingContext->focusCallback = focusCallback;
+        imageProcessingContext->focusCallbackContext = context;
         errorCode = 0;
     }
 
@@ -789,60 +1786,125 @@ int wImageProcessingFocusConsume(wImageProcessingFocusFunction_t *focusCallback,
 }
 
 // Set the focus point to be drawn on the processed image.
-int wImageProcessingFocusSet(const cv::Point *pointView)
+int wImageProcessingFocusSet(unsigned int pipeline, const cv::Point *pointView)
 {
     int errorCode = -EBADF;
+    wImageProcessingContext_t *context = contextGet(pipeline);
 
-    if (gContext) {
+    if (context) {
         // Set the focus point on the image
-        errorCode = pointProtectedSet(&(gContext->focusPointView), pointView);
+        errorCode = pointProtectedSet(&(context->focusPointView), pointView);
+    }
+
+    return errorCode;
+}
+
+// Get one of the built-in motion detectors by name.
+const wImageProcessingDetector_t *wImageProcessingDetectorGet(const char *name)
+{
+    const wImageProcessingDetector_t *detector = nullptr;
+
+    for (unsigned int x = 0; name && (x < W_UTIL_ARRAY_COUNT(gDetector)) &&
+                             (detector == nullptr); x++) {
+        if (strcmp(gDetector[x].name, name) == 0) {
+            detector = &(gDetector[x]);
+        }
+    }
+
+    return detector;
+}
+
+// Set the motion detector to use.
+int wImageProcessingDetectorSet(unsigned int pipeline,
+                                const wImageProcessingDetector_t *detector)
+{
+    int errorCode = -EBADF;
+    wImageProcessingContext_t *context = contextGet(pipeline);
+
+    if (context) {
+        errorCode = -EINVAL;
+        if (detector && detector->open && detector->reset &&
+            detector->apply && detector->close) {
+            context->detectorRequested = detector;
+            errorCode = 0;
+        }
+    }
+
+    return errorCode;
+}
+
+// Configure how motion detection is performed.
+int wImageProcessingDetectCfgSet(unsigned int pipeline,
+                                 unsigned int pyramidLevels,
+                                 const wImageProcessingRegion_t *regions,
+                                 unsigned int regionCount)
+{
+    int errorCode = -EBADF;
+    wImageProcessingContext_t *context = contextGet(pipeline);
+
+    if (context) {
+        errorCode = -EINVAL;
+        if ((pyramidLevels <= W_IMAGE_PROCESSING_PYRAMID_LEVELS_MAX) &&
+            (regionCount <= W_IMAGE_PROCESSING_REGION_MAX_NUM) &&
+            (regions || (regionCount == 0))) {
+            context->detectCfgMutex.lock();
+            context->pyramidLevels = pyramidLevels;
+            context->regions.assign(regions, regions + regionCount);
+            context->detectCfgChanged = true;
+            context->detectCfgMutex.unlock();
+            errorCode = 0;
+        }
     }
 
     return errorCode;
 }
 
 // Start image processing.
-int wImageProcessingStart(wCommonFrameFunction_t *outputCallback)
+int wImageProcessingStart(unsigned int pipeline, wCommonFrameFunction_t *outputCallback)
 {
     int errorCode = -EBADF;
+    wImageProcessingContext_t *context = contextGet(pipeline);
 
-    if (gContext) {
-        gContext->outputCallback = outputCallback;
-        errorCode = wCameraStart(imageProcessingCallback);
+    if (context) {
+        context->outputCallback = outputCallback;
+        errorCode = wCameraStart(pipeline, imageProcessingCallback);
     }
 
     return errorCode;
 }
 
 // Stop image processing.
-int wImageProcessingStop()
+int wImageProcessingStop(unsigned int pipeline)
 {
     int errorCode = -EBADF;
+    wImageProcessingContext_t *context = contextGet(pipeline);
 
-    if (gContext) {
-        errorCode = wCameraStop();
-        gContext->outputCallback = nullptr;
+    if (context) {
+        errorCode = wCameraStop(pipeline);
+        context->outputCallback = nullptr;
     }
 
     return errorCode;
 }
 
 // Reset the motion detector.
-void wImageProcessingResetMotionDetect()
+void wImageProcessingResetMotionDetect(unsigned int pipeline)
 {
-    if (gContext) {
-        gContext->resetBackgroundSubtractor = true;
+    wImageProcessingContext_t *context = contextGet(pipeline);
+
+    if (context) {
+        context->resetMotionDetect = true;
     }
 }
 
 
 // Deinitialise image processing.
-void wImageProcessingDeinit()
+void wImageProcessingDeinit(unsigned int pipeline)
 {
-    if (gContext) {
+    if (contextGet(pipeline)) {
         // Stop the camera first
-        wCameraStop();
-        cleanUp();
+        wCameraStop(pipeline);
+        cleanUp(pipeline);
     }
 }
 
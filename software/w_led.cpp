@@ -36,6 +36,7 @@
 #include <w_log.h>
 #include <w_msg.h>
 #include <w_gpio.h>
+#include <w_stats.h>
 
 // Us.
 #include <w_led.h>
@@ -1414,6 +1415,9 @@ int wLedInit()
                                                 handler->msgType,
                                                 handler->function);
             }
+            if (errorCode == 0) {
+                errorCode = wStatsQueueAdd(gMsgQueueId);
+            }
             if (errorCode != 0) {
                 // Tidy up on error
                  wMsgQueueStop(gMsgQueueId);
@@ -0,0 +1,427 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief Implementation of the logging API for the watchdog
+ * application: the per-thread rings and the writer thread that
+ * empties them.
+ */
+
+// The CPP stuff.
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <atomic>
+
+// The Linux/Posix stuff.
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+// Other parts of watchdog.
+#include <w_common.h>
+#include <w_util.h>
+
+// Us.
+#include <w_log.h>
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// The number of places in the code a thread keeps rate-limiting
+// counts for, must be a power of two; places that hash to the same
+// entry simply share it, or take it over from each other.
+#define W_LOG_RATE_LIMIT_TABLE_SIZE 16
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+// The states of a ring.
+typedef enum {
+    W_LOG_RING_STATE_FREE,     // Not owned by any thread.
+    W_LOG_RING_STATE_USED,     // Owned by a thread.
+    W_LOG_RING_STATE_RELEASED  // The owning thread has exited, can be
+                               // freed once the writer has emptied it.
+} wLogRingState_t;
+
+// A ring of log messages: single producer (the owning thread),
+// single consumer (the writer thread).  The indexes only ever
+// increase, wrapping at UINT_MAX, hence W_LOG_RING_LENGTH being
+// a power of two.
+typedef struct {
+    std::atomic<int> state;
+    std::atomic<unsigned int> writeIndex;
+    std::atomic<unsigned int> readIndex;
+    std::atomic<unsigned int> droppedNum;
+    wLogLine_t line[W_LOG_RING_LENGTH];
+} wLogRing_t;
+
+// A rate-limiting count for one place in the code.
+typedef struct {
+    const char *file;
+    unsigned int line;
+    int64_t periodStartMs;
+    unsigned int count;
+    unsigned int suppressedNum;
+} wLogRateLimit_t;
+
+// The logging state of a thread; the destructor gives the ring
+// of the thread back when it exits.
+struct wLogThread_t {
+    wLogRing_t *ring;
+    wLogLine_t *logLine;  // The log message in progress, NULL if none.
+    wLogLine_t scratch;   // For when a log message can't go in the ring.
+    wLogRateLimit_t rateLimit[W_LOG_RATE_LIMIT_TABLE_SIZE];
+    ~wLogThread_t();
+};
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// Array of log prefixes for the different log types, must be in
+// the same order as wLogType_t.
+static const char *gLogPrefixStr[] = {W_INFO, W_WARN, W_ERROR, W_DEBUG};
+
+// Array of log destinations for the different log types, must be in
+// the same order as wLogType_t.
+static FILE *gLogDestination[] = {stdout, stdout, stderr, stdout};
+
+// The rings, W_LOG_THREAD_MAX_NUM of them, allocated by the first
+// call to wLogWriterStart() and never freed, since a thread may be
+// part way through a log message when the writer is stopped.
+static std::atomic<wLogRing_t *> gRing(nullptr);
+
+// Whether the writer thread is running, i.e. whether log messages
+// should go into the rings.
+static std::atomic<bool> gWriterStarted(false);
+
+// Flag to tell the writer thread to stop.
+static std::atomic<bool> gWriterKeepGoing(false);
+
+// The writer thread.
+static std::thread *gWriterThread = nullptr;
+
+// The log messages dropped because W_LOG_THREAD_MAX_NUM threads
+// already had a ring.
+static std::atomic<unsigned int> gDroppedNoRingNum(0);
+
+// The logging state of this thread.
+static thread_local wLogThread_t gThread {};
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MISC
+ * -------------------------------------------------------------- */
+
+// Get the monotonic time in milliseconds, cheaply.
+static int64_t timeMs()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    return ((int64_t) now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+// Compare two times, returning true if a is before b.
+static bool timeBefore(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec < b->tv_sec) ||
+           ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+// Print a log message; the only place anything is printed.
+static void print(const wLogLine_t *logLine)
+{
+    FILE *destination = gLogDestination[logLine->type];
+    const char *prefix = gLogPrefixStr[logLine->type];
+    char buffer[32];
+    struct tm tmStruct;
+
+    strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S",
+             gmtime_r(&(logLine->time.tv_sec), &tmStruct));
+
+    fprintf(destination, "%s.%06ldZ ", buffer, logLine->time.tv_nsec / 1000);
+    fprintf(destination, "%s:%s[%4d]: ", prefix, logLine->file, logLine->line);
+    fprintf(destination, "%.*s", logLine->length, logLine->text);
+    if (logLine->suppressedNum > 0) {
+        fprintf(destination, " [%u similar message(s) suppressed]",
+                logLine->suppressedNum);
+    }
+    fprintf(destination, "\n");
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: THE RINGS
+ * -------------------------------------------------------------- */
+
+// Get a ring for this thread, NULL if there are none left.
+static wLogRing_t *ringClaim()
+{
+    wLogRing_t *ring = gRing.load();
+    wLogRing_t *claimed = nullptr;
+
+    for (unsigned int x = 0; (ring != nullptr) && (claimed == nullptr) &&
+                             (x < W_LOG_THREAD_MAX_NUM); x++) {
+        int expected = W_LOG_RING_STATE_FREE;
+        if (ring[x].state.compare_exchange_strong(expected,
+                                                  W_LOG_RING_STATE_USED)) {
+            claimed = &(ring[x]);
+        }
+    }
+
+    return claimed;
+}
+
+// Give the ring of this thread back when the thread exits.
+wLogThread_t::~wLogThread_t()
+{
+    if (ring != nullptr) {
+        ring->state = W_LOG_RING_STATE_RELEASED;
+        ring = nullptr;
+    }
+}
+
+// Print everything waiting in the rings, oldest first, freeing
+// any rings that have been released; returns the number of log
+// messages dropped across all of the rings so far.
+static unsigned int ringsEmpty()
+{
+    wLogRing_t *ring = gRing.load();
+    unsigned int droppedNum = gDroppedNoRingNum;
+    wLogRing_t *oldest;
+
+    if (ring != nullptr) {
+        do {
+            // Merge the rings: find the one with the oldest
+            // log message at its head and print that
+            oldest = nullptr;
+            for (unsigned int x = 0; x < W_LOG_THREAD_MAX_NUM; x++) {
+                unsigned int readIndex = ring[x].readIndex.load(std::memory_order_relaxed);
+                if (ring[x].writeIndex.load(std::memory_order_acquire) != readIndex) {
+                    wLogLine_t *logLine = &(ring[x].line[readIndex & (W_LOG_RING_LENGTH - 1)]);
+                    if ((oldest == nullptr) ||
+                        timeBefore(&(logLine->time),
+                                   &(oldest->line[oldest->readIndex.load(std::memory_order_relaxed) &
+                                                  (W_LOG_RING_LENGTH - 1)].time))) {
+                        oldest = &(ring[x]);
+                    }
+                }
+            }
+            if (oldest != nullptr) {
+                unsigned int readIndex = oldest->readIndex.load(std::memory_order_relaxed);
+                print(&(oldest->line[readIndex & (W_LOG_RING_LENGTH - 1)]));
+                oldest->readIndex.store(readIndex + 1, std::memory_order_release);
+            }
+        } while (oldest != nullptr);
+
+        for (unsigned int x = 0; x < W_LOG_THREAD_MAX_NUM; x++) {
+            // A released ring that is empty can now be re-used
+            if ((ring[x].state == W_LOG_RING_STATE_RELEASED) &&
+                (ring[x].writeIndex.load(std::memory_order_acquire) ==
+                 ring[x].readIndex.load(std::memory_order_relaxed))) {
+                ring[x].state = W_LOG_RING_STATE_FREE;
+            }
+            droppedNum += ring[x].droppedNum;
+        }
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    return droppedNum;
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: THE WRITER THREAD
+ * -------------------------------------------------------------- */
+
+// The writer thread: prints what is in the rings every
+// W_LOG_WRITER_PERIOD_MS and reports any drops.
+static void writerLoop()
+{
+    unsigned int droppedNumReported = 0;
+    unsigned int droppedNum;
+    bool keepGoing;
+
+    do {
+        keepGoing = gWriterKeepGoing;
+        droppedNum = ringsEmpty();
+        if (droppedNum != droppedNumReported) {
+            wLogLine_t logLine = {.type = W_LOG_TYPE_WARN,
+                                  .file = __FILE__,
+                                  .line = __LINE__};
+            clock_gettime(CLOCK_REALTIME, &(logLine.time));
+            wLogFormat(&logLine, "%u log message(s) dropped, %u in total.",
+                       droppedNum - droppedNumReported, droppedNum);
+            print(&logLine);
+            droppedNumReported = droppedNum;
+        }
+        if (keepGoing) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(W_LOG_WRITER_PERIOD_MS));
+        }
+    } while (keepGoing);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: NOT INTENDED TO BE CALLED DIRECTLY
+ * -------------------------------------------------------------- */
+
+// Begin a log message.
+wLogLine_t *wLogLineBegin(wLogType_t type, const char *file,
+                          unsigned int line)
+{
+    wLogThread_t *thread = &gThread;
+    wLogRateLimit_t *rateLimit = &(thread->rateLimit[(((uintptr_t) file) ^ line) &
+                                                     (W_LOG_RATE_LIMIT_TABLE_SIZE - 1)]);
+    int64_t nowMs = timeMs();
+    unsigned int suppressedNum = 0;
+    wLogLine_t *logLine = nullptr;
+
+    // Rate limit
+    if ((rateLimit->file != file) || (rateLimit->line != line) ||
+        (nowMs - rateLimit->periodStartMs >= W_LOG_RATE_LIMIT_PERIOD_MS)) {
+        if ((rateLimit->file == file) && (rateLimit->line == line)) {
+            suppressedNum = rateLimit->suppressedNum;
+        }
+        rateLimit->file = file;
+        rateLimit->line = line;
+        rateLimit->periodStartMs = nowMs;
+        rateLimit->count = 0;
+        rateLimit->suppressedNum = 0;
+    }
+    rateLimit->count++;
+    if (rateLimit->count > W_LOG_RATE_LIMIT_NUM) {
+        rateLimit->suppressedNum++;
+    } else {
+        logLine = &(thread->scratch);
+        if (gWriterStarted) {
+            if (thread->ring == nullptr) {
+                thread->ring = ringClaim();
+            }
+            if (thread->ring != nullptr) {
+                wLogRing_t *ring = thread->ring;
+                unsigned int writeIndex = ring->writeIndex.load(std::memory_order_relaxed);
+                if (writeIndex - ring->readIndex.load(std::memory_order_acquire) <
+                    W_LOG_RING_LENGTH) {
+                    // Format straight into the ring
+                    logLine = &(ring->line[writeIndex & (W_LOG_RING_LENGTH - 1)]);
+                }
+            }
+        }
+        logLine->type = type;
+        logLine->file = file;
+        logLine->line = line;
+        clock_gettime(CLOCK_REALTIME, &(logLine->time));
+        logLine->suppressedNum = suppressedNum;
+        logLine->length = 0;
+        logLine->text[0] = 0;
+    }
+
+    thread->logLine = logLine;
+
+    return logLine;
+}
+
+// Get the log message in progress.
+wLogLine_t *wLogLineGet()
+{
+    return gThread.logLine;
+}
+
+// End a log message.
+void wLogLineEnd()
+{
+    wLogThread_t *thread = &gThread;
+    wLogLine_t *logLine = thread->logLine;
+
+    if (logLine == &(thread->scratch)) {
+        if (gWriterStarted) {
+            // There was no room in the ring, or no ring
+            if (thread->ring != nullptr) {
+                thread->ring->droppedNum++;
+            } else {
+                gDroppedNoRingNum++;
+            }
+        } else {
+            print(logLine);
+        }
+    } else if (logLine != nullptr) {
+        // Hand the message to the writer thread
+        thread->ring->writeIndex.fetch_add(1, std::memory_order_release);
+    }
+
+    thread->logLine = nullptr;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Start the log writer thread.
+int wLogWriterStart()
+{
+    int errorCode = 0;
+
+    if (gWriterThread == nullptr) {
+        if (gRing == nullptr) {
+            // Zero-initialised, which touches the memory, so that the
+            // first log message of a thread doesn't take a page fault
+            gRing = new wLogRing_t[W_LOG_THREAD_MAX_NUM]();
+        }
+        gWriterKeepGoing = true;
+        try {
+            gWriterThread = new std::thread(writerLoop);
+            // The writer should be the lowest of the low, whatever
+            // the scheduling of the thread that started it
+            struct sched_param scheduling = {};
+            if (pthread_setschedparam(gWriterThread->native_handle(),
+                                      SCHED_OTHER, &scheduling) != 0) {
+                W_LOG_WARN("unable to set schedule of log writer thread.");
+            }
+            pthread_setname_np(gWriterThread->native_handle(), "log");
+            wUtilThreadPlacementSet(gWriterThread->native_handle(), "log");
+            gWriterStarted = true;
+        }
+        catch (std::exception &e) {
+            gWriterKeepGoing = false;
+            errorCode = -ENOMEM;
+            W_LOG_ERROR("unable to start log writer thread (%s)!", e.what());
+        }
+    }
+
+    return errorCode;
+}
+
+// Stop the log writer thread.
+void wLogWriterStop()
+{
+    if (gWriterThread != nullptr) {
+        // Log messages are printed directly from now on
+        gWriterStarted = false;
+        gWriterKeepGoing = false;
+        if (gWriterThread->joinable()) {
+            gWriterThread->join();
+        }
+        delete gWriterThread;
+        gWriterThread = nullptr;
+    }
+}
+
+// End of file
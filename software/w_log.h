@@ -14,23 +14,43 @@
  * limitations under the License.
  */
 
+#ifndef _W_LOG_H_
+#define _W_LOG_H_
+
 // The CPP stuff.
 #include <chrono>
+#include <cstdio>
 #include <string>
 #include <iomanip>
 #include <iostream>
 
 // The Linux/Posix stuff.
+#include <time.h>
 #include <sys/time.h>
 
 // Other parts of watchdog.
 #include <w_util.h>
 
 /** @file
- * @brief The logging API for the watchdog application; this stuff has to
- * be in header file because of the template stuff.  This API is
- * thread-safe, though note that there is no locking on prints and
- * hence debug logging from different threads may run into each other.
+ * @brief The logging API for the watchdog application; this stuff has
+ * to be in a header file because of the template stuff.  This API is
+ * thread-safe and each log message, however many W_LOG_XXX_MORE() calls
+ * it is made up of, is printed as a whole.
+ *
+ * Once wLogWriterStart() has been called a log message is formatted,
+ * with a single snprintf() per call, straight into an entry of a ring
+ * belonging to the calling thread and is then printed by a low-priority
+ * writer thread: a thread, e.g. a real-time one, that logs is never
+ * held up by stdout/stderr (or journald) being slow; if its ring is
+ * full the log message is dropped and counted rather than waited for.
+ * Before wLogWriterStart() has been called, and after wLogWriterStop()
+ * has been called, log messages are printed directly, so the command
+ * line and start-up/shut-down stuff is logged as normal.
+ *
+ * Log messages from the same place in the code are rate-limited to
+ * W_LOG_RATE_LIMIT_NUM per W_LOG_RATE_LIMIT_PERIOD_MS per thread, the
+ * number suppressed being added to the next one that gets through,
+ * and log types may be compiled out entirely with W_LOG_LEVEL.
  */
 
 /* ----------------------------------------------------------------
@@ -53,32 +73,118 @@
 #define W_ERROR W_ANSI_COLOUR_BRIGHT_RED "ERROR " W_ANSI_COLOUR_BRIGHT_WHITE W_LOG_TAG W_ANSI_COLOUR_RESET
 #define W_DEBUG W_ANSI_COLOUR_BRIGHT_MAGENTA "DEBUG " W_ANSI_COLOUR_BRIGHT_WHITE W_LOG_TAG W_ANSI_COLOUR_RESET
 
+#ifndef W_LOG_LEVEL
+/** The log types that are compiled in: 0 for errors only, 1 to add
+ * warnings, 2 to add information and 3 to add debug.  The arguments
+ * of a log type that is compiled out are not evaluated.
+ */
+# define W_LOG_LEVEL 3
+#endif
+
+#ifndef W_LOG_LINE_MAX_SIZE
+/** The maximum length of a log message, including the terminator
+ * but not including the time, type and file/line prefix; anything
+ * longer is truncated, ending with "...".
+ */
+# define W_LOG_LINE_MAX_SIZE 512
+#endif
+
+#ifndef W_LOG_RING_LENGTH
+/** The number of log messages a thread may have waiting to be
+ * printed; must be a power of two.
+ */
+# define W_LOG_RING_LENGTH 32
+#endif
+
+#ifndef W_LOG_THREAD_MAX_NUM
+/** The maximum number of threads that may have log messages waiting
+ * to be printed at any one time; a thread gives up its ring when it
+ * exits.  The log messages of any more threads are dropped.
+ */
+# define W_LOG_THREAD_MAX_NUM 32
+#endif
+
+#ifndef W_LOG_WRITER_PERIOD_MS
+/** How often the writer thread prints what is waiting in the rings.
+ */
+# define W_LOG_WRITER_PERIOD_MS 20
+#endif
+
+#ifndef W_LOG_RATE_LIMIT_PERIOD_MS
+/** The period over which log messages from the same place in the
+ * code are counted for rate limiting.
+ */
+# define W_LOG_RATE_LIMIT_PERIOD_MS 1000
+#endif
+
+#ifndef W_LOG_RATE_LIMIT_NUM
+/** The number of log messages from the same place in the code that
+ * a thread may emit in W_LOG_RATE_LIMIT_PERIOD_MS before the rest
+ * are suppressed.
+ */
+# define W_LOG_RATE_LIMIT_NUM 10
+#endif
+
 // Logging macros: one-call.
-#define W_LOG_INFO(...) wLog(W_LOG_TYPE_INFO, __FILE__, __LINE__, __VA_ARGS__)
-#define W_LOG_WARN(...) wLog(W_LOG_TYPE_WARN, __FILE__, __LINE__, __VA_ARGS__)
 #define W_LOG_ERROR(...) wLog(W_LOG_TYPE_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define W_LOG_DEBUG(...) wLog(W_LOG_TYPE_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
+#if W_LOG_LEVEL >= 1
+# define W_LOG_WARN(...) wLog(W_LOG_TYPE_WARN, __FILE__, __LINE__, __VA_ARGS__)
+#else
+# define W_LOG_WARN(...) ((void) 0)
+#endif
+#if W_LOG_LEVEL >= 2
+# define W_LOG_INFO(...) wLog(W_LOG_TYPE_INFO, __FILE__, __LINE__, __VA_ARGS__)
+#else
+# define W_LOG_INFO(...) ((void) 0)
+#endif
+#if W_LOG_LEVEL >= 3
+# define W_LOG_DEBUG(...) wLog(W_LOG_TYPE_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
+#else
+# define W_LOG_DEBUG(...) ((void) 0)
+#endif
 
 // Logging macros: multiple calls.
-#define W_LOG_INFO_START(...) wLogStart(W_LOG_TYPE_INFO, __FILE__, __LINE__, __VA_ARGS__)
-#define W_LOG_WARN_START(...) wLogStart(W_LOG_TYPE_WARN, __FILE__, __LINE__, __VA_ARGS__)
 #define W_LOG_ERROR_START(...) wLogStart(W_LOG_TYPE_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define W_LOG_DEBUG_START(...) wLogStart(W_LOG_TYPE_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define W_LOG_INFO_MORE(...) wLogMore(W_LOG_TYPE_INFO, __VA_ARGS__)
-#define W_LOG_WARN_MORE(...) wLogMore(W_LOG_TYPE_WARN, __VA_ARGS__)
 #define W_LOG_ERROR_MORE(...) wLogMore(W_LOG_TYPE_ERROR, __VA_ARGS__)
-#define W_LOG_DEBUG_MORE(...) wLogMore(W_LOG_TYPE_DEBUG, __VA_ARGS__)
-#define W_LOG_INFO_END wLogEnd(W_LOG_TYPE_INFO)
-#define W_LOG_WARN_END wLogEnd(W_LOG_TYPE_WARN)
 #define W_LOG_ERROR_END wLogEnd(W_LOG_TYPE_ERROR)
-#define W_LOG_DEBUG_END wLogEnd(W_LOG_TYPE_DEBUG)
+#if W_LOG_LEVEL >= 1
+# define W_LOG_WARN_START(...) wLogStart(W_LOG_TYPE_WARN, __FILE__, __LINE__, __VA_ARGS__)
+# define W_LOG_WARN_MORE(...) wLogMore(W_LOG_TYPE_WARN, __VA_ARGS__)
+# define W_LOG_WARN_END wLogEnd(W_LOG_TYPE_WARN)
+#else
+# define W_LOG_WARN_START(...) ((void) 0)
+# define W_LOG_WARN_MORE(...) ((void) 0)
+# define W_LOG_WARN_END ((void) 0)
+#endif
+#if W_LOG_LEVEL >= 2
+# define W_LOG_INFO_START(...) wLogStart(W_LOG_TYPE_INFO, __FILE__, __LINE__, __VA_ARGS__)
+# define W_LOG_INFO_MORE(...) wLogMore(W_LOG_TYPE_INFO, __VA_ARGS__)
+# define W_LOG_INFO_END wLogEnd(W_LOG_TYPE_INFO)
+#else
+# define W_LOG_INFO_START(...) ((void) 0)
+# define W_LOG_INFO_MORE(...) ((void) 0)
+# define W_LOG_INFO_END ((void) 0)
+#endif
+#if W_LOG_LEVEL >= 3
+# define W_LOG_DEBUG_START(...) wLogStart(W_LOG_TYPE_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
+# define W_LOG_DEBUG_MORE(...) wLogMore(W_LOG_TYPE_DEBUG, __VA_ARGS__)
+# define W_LOG_DEBUG_END wLogEnd(W_LOG_TYPE_DEBUG)
+#else
+# define W_LOG_DEBUG_START(...) ((void) 0)
+# define W_LOG_DEBUG_MORE(...) ((void) 0)
+# define W_LOG_DEBUG_END ((void) 0)
+#endif
 
 // Print the duration of an operation for debug purposes.
-#define W_LOG_DEBUG_DURATION(x) auto _t1 = std::chrono::high_resolution_clock::now();  \
-                                x;                                                     \
-                                auto _t2 = std::chrono::high_resolution_clock::now();  \
-                                W_LOG_DEBUG("%d ms to do \"" #x "\".",                 \
-                                            std::chrono::duration_cast<std::chrono::milliseconds>(_t2 - _t1))
+#if W_LOG_LEVEL >= 3
+# define W_LOG_DEBUG_DURATION(x) auto _t1 = std::chrono::high_resolution_clock::now();  \
+                                 x;                                                     \
+                                 auto _t2 = std::chrono::high_resolution_clock::now();  \
+                                 W_LOG_DEBUG("%d ms to do \"" #x "\".",                 \
+                                             std::chrono::duration_cast<std::chrono::milliseconds>(_t2 - _t1))
+#else
+# define W_LOG_DEBUG_DURATION(x) x
+#endif
 
 /* ----------------------------------------------------------------
  * TYPES
@@ -94,60 +200,108 @@ typedef enum {
     W_LOG_TYPE_DEBUG = 3
 } wLogType_t;
 
+/** A log message, as it sits in a ring waiting to be printed; this
+ * is not intended to be used directly.
+ */
+typedef struct {
+    wLogType_t type;
+    const char *file;
+    unsigned int line;
+    struct timespec time;       // CLOCK_REALTIME, when the message was started.
+    unsigned int suppressedNum; // Messages from the same place suppressed before this one.
+    unsigned int length;        // Of text, not including the terminator.
+    char text[W_LOG_LINE_MAX_SIZE];
+} wLogLine_t;
+
 /* ----------------------------------------------------------------
- * VARIABLES
+ * FUNCTIONS: NOT INTENDED TO BE CALLED DIRECTLY
  * -------------------------------------------------------------- */
 
-// Array of log prefixes for the different log types, must be in
-// the same order as wLogType_t.
-static const char *gLogPrefixStr[] = {W_INFO, W_WARN, W_ERROR, W_DEBUG};
+/** Begin a log message, returning where it should be formatted
+ * to; this is not intended to be called directly, please use
+ * W_LOG_XXX() or W_LOG_XXX_START() instead.
+ *
+ * @param type the type of log message.
+ * @param file the file that the log message is from.
+ * @param line the line in file that the log message is from.
+ * @return     where to format the log message, NULL if the log
+ *             message has been suppressed by rate limiting.
+ */
+wLogLine_t *wLogLineBegin(wLogType_t type, const char *file,
+                          unsigned int line);
+
+/** Get the log message begun by this thread with wLogLineBegin();
+ * this is not intended to be called directly, please use
+ * W_LOG_XXX_MORE() instead.
+ *
+ * @return where to format more of the log message, NULL if no log
+ *         message is in progress or it has been suppressed.
+ */
+wLogLine_t *wLogLineGet();
 
-// Array of log destinations for the different log types, must be in
-// the same order as wLogType_t.
-static FILE *gLogDestination[] = {stdout, stdout, stderr, stdout};
+/** End the log message begun by this thread with wLogLineBegin(),
+ * handing it to the writer thread or, if that is not running,
+ * printing it; this is not intended to be called directly,
+ * please use W_LOG_XXX() or W_LOG_XXX_END() instead.
+ */
+void wLogLineEnd();
 
 /* ----------------------------------------------------------------
  * FUNCTION IMPLEMENTATIONS
  * -------------------------------------------------------------- */
 
-// Print the start of a logging message.
+// Format into the end of a log message, truncating with "..." if
+// it won't fit.
 template<typename ... Args>
-void wLogStart(wLogType_t type, const char *file, unsigned int line, Args ... args)
+void wLogFormat(wLogLine_t *logLine, Args ... args)
 {
-    FILE *destination = gLogDestination[type];
-    const char *prefix = gLogPrefixStr[type];
-    char buffer[32];
-    timeval now;
+    unsigned int space = sizeof(logLine->text) - logLine->length;
 
-    gettimeofday(&now, NULL);
-    strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", gmtime(&(now.tv_sec)));
+    if (space > 1) {
+        int x = snprintf(logLine->text + logLine->length, space, args...);
+        if (x >= (int) space) {
+            logLine->length = sizeof(logLine->text) - 1;
+            snprintf(logLine->text + logLine->length - 3, 4, "...");
+        } else if (x > 0) {
+            logLine->length += x;
+        }
+    }
+}
 
-    fprintf(destination, "%s.%06ldZ ", buffer, now.tv_usec);
-    fprintf(destination, "%s:%s[%4d]: ", prefix, file, line);
-    fprintf(destination, args...);
+// Start a logging message.
+template<typename ... Args>
+void wLogStart(wLogType_t type, const char *file, unsigned int line, Args ... args)
+{
+    wLogLine_t *logLine = wLogLineBegin(type, file, line);
+
+    if (logLine != NULL) {
+        wLogFormat(logLine, args...);
+    }
 }
 
-// Print the middle of a logging message, after logStart()
+// Add to the middle of a logging message, after logStart()
 // has been called and before logEnd() is called.
 template<typename ... Args>
 void wLogMore(wLogType_t type, Args ... args)
 {
-    FILE *destination = gLogDestination[type];
+    wLogLine_t *logLine = wLogLineGet();
 
-    fprintf(destination, args...);
+    (void) type;
+    if (logLine != NULL) {
+        wLogFormat(logLine, args...);
+    }
 }
 
-// Print the end of a logging message, after logStart()
-// or logMore() has been called.
+// End a logging message, after logStart() or logMore() has
+// been called.
 template<typename ... Args>
 void wLogEnd(wLogType_t type)
 {
-    FILE *destination = gLogDestination[type];
-
-    fprintf(destination, "\n");
+    (void) type;
+    wLogLineEnd();
 }
 
-// Print a single-line logging message.
+// A single-line logging message.
 template<typename ... Args>
 void wLog(wLogType_t type, const char *file, unsigned int line, Args ... args)
 {
@@ -159,30 +313,49 @@ void wLog(wLogType_t type, const char *file, unsigned int line, Args ... args)
  * FUNCTIONS
  * -------------------------------------------------------------- */
 
-/** Print the start of a logging message; this is not intended
- * to be called directly, please use W_LOG_XXX_START() instead.
+/** Start a logging message; this is not intended to be called
+ * directly, please use W_LOG_XXX_START() instead.
  */
 template<typename ... Args>
-void wLogStart(wLogType_t type, unsigned int line, Args ... args);
+void wLogStart(wLogType_t type, const char *file, unsigned int line, Args ... args);
 
-/** Print the middle of a logging message, after logStart()
+/** Add to the middle of a logging message, after logStart()
  * has been called and before logEnd() is called; this is not intended
  * to be called directly, please use W_LOG_XXX_MORE() instead.
  */
 template<typename ... Args>
 void wLogMore(wLogType_t type, Args ... args);
 
-/** Print the end of a logging message, after logStart()
- * or logMore() has been called; this is not intended
- * to be called directly, please use W_LOG_XXX_END() instead.
+/** End a logging message, after logStart() or logMore() has
+ * been called; this is not intended to be called directly,
+ * please use W_LOG_XXX_END() instead.
  */
 template<typename ... Args>
 void wLogEnd(wLogType_t type);
 
-/** Print a single-line logging message; this is not intended
- * to be called directly, please use W_LOG_XXX() instead.
+/** A single-line logging message; this is not intended to be
+ * called directly, please use W_LOG_XXX() instead.
  */
 template<typename ... Args>
-void wLog(wLogType_t type, unsigned int line, Args ... args);
+void wLog(wLogType_t type, const char *file, unsigned int line, Args ... args);
+
+/** Start the log writer thread: from then on log messages are
+ * printed by it rather than by the thread that logs them.  Should
+ * be called at start of day, before any real-time threads are
+ * started; if the writer thread is already started this function
+ * will do nothing and return success.
+ *
+ * @return zero on success else negative error code.
+ */
+int wLogWriterStart();
+
+/** Stop the log writer thread, printing anything still waiting
+ * to be printed; log messages are printed directly from then on.
+ * Should be called at end of day, after all of the other threads
+ * have been stopped.
+ */
+void wLogWriterStop();
+
+#endif // _W_LOG_H_
 
 // End of file
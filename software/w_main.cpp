@@ -47,8 +47,17 @@
  * information, warning and errors from libcamera, but not pure debug.
  */
 
+// The CPP stuff.
+#include <string>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <algorithm> // For std::sort()
+
 // The Linux/Posix stuff.
 #include <unistd.h> // For sleep()
+#include <pthread.h> // For pthread_self()
 
 // The watchdog stuff.
 #include <w_util.h>
@@ -61,22 +70,262 @@
 #include <w_led.h>
 #include <w_motor.h>
 #include <w_hls.h>
+#include <w_http.h>
+#include <w_record.h>
+#include <w_event.h>
 #include <w_camera.h>
 #include <w_image_processing.h>
 #include <w_video_encode.h>
+#include <w_stats.h>
 
 /* ----------------------------------------------------------------
  * COMPILE-TIME MACROS
  * -------------------------------------------------------------- */
 
+#ifndef W_MAIN_STARTUP_PHASE_MAX_NUM
+// The maximum number of phases of start-up that can be recorded
+// for the start-up timeline.
+# define W_MAIN_STARTUP_PHASE_MAX_NUM 16
+#endif
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
 
+/** A phase of start-up, for the start-up timeline; times are in
+ * milliseconds from the start of main().
+ */
+typedef struct {
+    const char *name;
+    int64_t startMs;
+    int64_t endMs;
+    int errorCode;
+} wMainStartupPhase_t;
+
 /* ----------------------------------------------------------------
  * VARIABLES
  * -------------------------------------------------------------- */
 
+// The time at which main() was entered.
+static std::chrono::steady_clock::time_point gStartTime = std::chrono::steady_clock::now();
+
+// The phases of start-up, in the order they ended.
+static wMainStartupPhase_t gStartupPhase[W_MAIN_STARTUP_PHASE_MAX_NUM];
+
+// The number of entries in gStartupPhase[].
+static unsigned int gStartupPhaseNum = 0;
+
+// Mutex to protect gStartupPhase[] and gStartupPhaseNum, since the
+// phases may run in different threads.
+static std::mutex gStartupPhaseMutex;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Return the number of milliseconds since main() was entered.
+static int64_t startupMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                                                 gStartTime).count();
+}
+
+// Run a phase of start-up, recording it for the start-up timeline,
+// and return its error code.
+static int startupPhase(const char *name, std::function<int()> function)
+{
+    int64_t startMs = startupMs();
+    int errorCode = function();
+
+    gStartupPhaseMutex.lock();
+    if (gStartupPhaseNum < W_UTIL_ARRAY_COUNT(gStartupPhase)) {
+        wMainStartupPhase_t *phase = &(gStartupPhase[gStartupPhaseNum]);
+        phase->name = name;
+        phase->startMs = startMs;
+        phase->endMs = startupMs();
+        phase->errorCode = errorCode;
+        gStartupPhaseNum++;
+    }
+    gStartupPhaseMutex.unlock();
+
+    return errorCode;
+}
+
+// Print the start-up timeline, a single log message with the
+// phases in the order they started.
+static void startupTimelinePrint()
+{
+    gStartupPhaseMutex.lock();
+    std::sort(gStartupPhase, gStartupPhase + gStartupPhaseNum,
+              [](const wMainStartupPhase_t &a, const wMainStartupPhase_t &b) {
+                  return a.startMs < b.startMs;
+              });
+    W_LOG_INFO_START("start-up took %lld ms:", (long long) startupMs());
+    for (unsigned int x = 0; x < gStartupPhaseNum; x++) {
+        wMainStartupPhase_t *phase = &(gStartupPhase[x]);
+        W_LOG_INFO_MORE("%s %s %lld-%lld", x > 0 ? "," : "", phase->name,
+                        (long long) phase->startMs, (long long) phase->endMs);
+        if (phase->errorCode != 0) {
+            W_LOG_INFO_MORE(" (error %d)", phase->errorCode);
+        }
+    }
+    W_LOG_INFO_MORE(".");
+    W_LOG_INFO_END;
+    gStartupPhaseMutex.unlock();
+}
+
+// Initialise the motors, THIS WILL CAUSE MOVEMENT, and set any user
+// rest/range values; this takes a while, since the motors have to
+// be run up to their limit switches, and so is done at the same
+// time as the rest of start-up.
+static int motorStart(const wCommandLineParameters_t *parameters)
+{
+    int errorCode = wMotorInit(parameters->doNotOperateMotors,
+                               parameters->motorCalibrationFilePath);
+    if (errorCode == 0) {
+        errorCode = wMotorRestSet(W_MOTOR_TYPE_VERTICAL,
+                                  parameters->restVerticalSteps);
+    }
+    if (errorCode == 0) {
+        wMotorMoveToRest(W_MOTOR_TYPE_VERTICAL);
+        errorCode = wMotorRestSet(W_MOTOR_TYPE_ROTATE,
+                                  parameters->restHorizontalSteps);
+    }
+    if (errorCode == 0) {
+        wMotorMoveToRest(W_MOTOR_TYPE_ROTATE);
+        errorCode = wMotorRangeSet(W_MOTOR_TYPE_VERTICAL,
+                                   parameters->lookUpLimitSteps,
+                                   parameters->lookDownLimitSteps);
+    }
+    if (errorCode == 0) {
+        errorCode = wMotorRangeSet(W_MOTOR_TYPE_ROTATE,
+                                   parameters->lookRightLimitSteps,
+                                   parameters->lookLeftLimitSteps);
+    }
+
+    return errorCode;
+}
+
+// Initialise image processing for each pipeline, which the cameras
+// must be for first; the motion regions are given in the video of
+// the main camera and so only apply to that.
+static int imageProcessingStart(const wCommandLineParameters_t *parameters)
+{
+    int errorCode = 0;
+
+    for (unsigned int p = 0; (p < parameters->pipelineNum) && (errorCode == 0); p++) {
+        errorCode = wImageProcessingInit(p);
+        if (errorCode == 0) {
+            const char *name = parameters->motionDetectorName.c_str();
+            errorCode = wImageProcessingDetectorSet(p, wImageProcessingDetectorGet(name));
+        }
+        if (errorCode == 0) {
+            if (p == W_COMMON_PIPELINE_MAIN) {
+                errorCode = wImageProcessingDetectCfgSet(p, parameters->motionPyramidLevels,
+                                                         parameters->motionRegions.data(),
+                                                         parameters->motionRegions.size());
+            } else {
+                errorCode = wImageProcessingDetectCfgSet(p, parameters->motionPyramidLevels);
+            }
+        }
+    }
+
+    return errorCode;
+}
+
+// Return the HLS output file name of a pipeline: that given on the
+// command-line for the main pipeline, with "_1" etc. appended for
+// the others.
+static std::string pipelineFileName(const wCommandLineParameters_t *parameters,
+                                    unsigned int pipeline)
+{
+    std::string fileName = parameters->outputFileName;
+
+    if (pipeline != W_COMMON_PIPELINE_MAIN) {
+        fileName += "_" + std::to_string(pipeline);
+    }
+
+    return fileName;
+}
+
+// Initialise video encoding for each pipeline; low-latency and
+// in-memory HLS are only for the main pipeline.
+static int videoEncodeInit(const wCommandLineParameters_t *parameters)
+{
+    int errorCode = 0;
+    wVideoEncodeCodecCfg_t codecCfg = parameters->videoEncodeCodecCfg;
+
+    if ((parameters->pipelineNum > 1) && (codecCfg.threads == 0)) {
+        // Left to itself each encoder would create a thread for
+        // every CPU, so share out the media CPUs between them
+        codecCfg.threads = wUtilThreadPlacementCpuCount(W_COMMON_THREAD_PLACEMENT_MEDIA) /
+                           parameters->pipelineNum;
+        if (codecCfg.threads == 0) {
+            codecCfg.threads = 1;
+        }
+    }
+    for (unsigned int p = 0; (p < parameters->pipelineNum) && (errorCode == 0); p++) {
+        errorCode = wVideoEncodeInit(p, parameters->outputDirectory,
+                                     pipelineFileName(parameters, p),
+                                     &codecCfg,
+                                     p == W_COMMON_PIPELINE_MAIN ? parameters->hlsMode :
+                                                                   W_HLS_MODE_DEFAULT);
+    }
+
+    return errorCode;
+}
+
+// Remove any old output files for a clean start and make sure that
+// the output directory exists.
+static int outputDirectoryPrepare(const wCommandLineParameters_t *parameters)
+{
+    system(std::string("rm " +
+                       parameters->outputDirectory +
+                       W_UTIL_DIR_SEPARATOR +
+                       parameters->outputFileName +
+                       W_HLS_PLAYLIST_FILE_EXTENSION +
+                       W_UTIL_SYSTEM_SILENT).c_str());
+    system(std::string("rm " +
+                       parameters->outputDirectory +
+                       W_UTIL_DIR_SEPARATOR +
+                       parameters->outputFileName +
+                       "*" W_HLS_SEGMENT_FILE_EXTENSION +
+                       W_UTIL_SYSTEM_SILENT).c_str());
+    system(std::string("rm " +
+                       parameters->outputDirectory +
+                       W_UTIL_DIR_SEPARATOR +
+                       parameters->outputFileName +
+                       "*" W_HLS_LOW_LATENCY_SEGMENT_FILE_EXTENSION +
+                       W_UTIL_SYSTEM_SILENT).c_str());
+    system(std::string("rm " +
+                       parameters->outputDirectory +
+                       W_UTIL_DIR_SEPARATOR +
+                       parameters->outputFileName +
+                       W_HLS_LOW_LATENCY_INIT_FILE_NAME_SUFFIX
+                       W_HLS_LOW_LATENCY_INIT_FILE_EXTENSION +
+                       W_UTIL_SYSTEM_SILENT).c_str());
+    // The event index and its thumbnails refer to the segments
+    // by number, which begins again at zero
+    system(std::string("rm " +
+                       parameters->outputDirectory +
+                       W_UTIL_DIR_SEPARATOR +
+                       parameters->outputFileName +
+                       W_EVENT_FILE_NAME_SUFFIX W_EVENT_FILE_EXTENSION +
+                       W_UTIL_SYSTEM_SILENT).c_str());
+    system(std::string("rm " +
+                       parameters->outputDirectory +
+                       W_UTIL_DIR_SEPARATOR +
+                       parameters->outputFileName +
+                       "*" W_EVENT_THUMBNAIL_FILE_EXTENSION +
+                       W_UTIL_SYSTEM_SILENT).c_str());
+
+    // Make sure the output directory exists
+    system(std::string("mkdir -p " +
+                       parameters->outputDirectory).c_str());
+
+    return 0;
+}
+
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -93,83 +342,155 @@ int main(int argc, char *argv[])
         // Capture CTRL-C so that we can exit in an organised fashion
         wUtilTerminationCaptureSet();
 
-        // Initialise configuration
-        errorCode = wCfgInit(commandLineParameters.cfgFilePath);
+        // Put ourselves on the media CPUs: the threads of the camera
+        // and of the video encoder's pool are created by libraries,
+        // from this thread, and so inherit its placement
+        wUtilThreadPlacementSet(pthread_self(), "main");
+
+        // Move printing of log messages to its own thread before
+        // any real-time threads are started
+        errorCode = wLogWriterStart();
+        if (errorCode == 0) {
+            // Initialise configuration
+            errorCode = startupPhase("configuration", [&commandLineParameters] {
+                return wCfgInit(commandLineParameters.cfgFilePath);
+            });
+        }
         if (errorCode == 0) {
             // Initialise GPIOs
-            errorCode = wGpioInit();
+            errorCode = startupPhase("GPIO", wGpioInit);
         }
         if (errorCode == 0) {
-            // Initialise the motors and set any user rest/range values
-            errorCode = wMotorInit(commandLineParameters.doNotOperateMotors);
-            if (errorCode == 0) {
-                errorCode = wMotorRestSet(W_MOTOR_TYPE_VERTICAL,
-                                          commandLineParameters.restVerticalSteps);
-            }
-            if (errorCode == 0) {
-                wMotorMoveToRest(W_MOTOR_TYPE_VERTICAL);
-                errorCode = wMotorRestSet(W_MOTOR_TYPE_ROTATE,
-                                          commandLineParameters.restHorizontalSteps);
-            }
-            if (errorCode == 0) {
-                wMotorMoveToRest(W_MOTOR_TYPE_ROTATE);
-                errorCode = wMotorRangeSet(W_MOTOR_TYPE_VERTICAL,
-                                           commandLineParameters.lookUpLimitSteps,
-                                           commandLineParameters.lookDownLimitSteps);
+            // Initialise messaging
+            errorCode = startupPhase("messaging", wMsgInit);
+        }
+
+        // The slow parts of start-up, bringing up the camera and
+        // calibrating the motors, need nothing from each other or
+        // from the rest of start-up, so they are run in threads of
+        // their own, the rest of start-up going on meanwhile.  Since
+        // messaging is NOT thread-safe, message queues must only be
+        // started from this thread, hence the camera thread does not
+        // go on to initialise image processing.  Threads created by
+        // the camera inherit the placement of the camera thread,
+        // which inherits that of this thread.
+        int motorErrorCode = -ENXIO;
+        int cameraErrorCode = -ENXIO;
+        std::thread motorThread;
+        std::thread cameraThread;
+        if (errorCode == 0) {
+            try {
+                motorThread = std::thread([&commandLineParameters, &motorErrorCode] {
+                    motorErrorCode = startupPhase("motors", [&commandLineParameters] {
+                        return motorStart(&commandLineParameters);
+                    });
+                });
+                pthread_setname_np(motorThread.native_handle(), "motorStart");
+                cameraThread = std::thread([&commandLineParameters, &cameraErrorCode] {
+                    cameraErrorCode = startupPhase("camera", [&commandLineParameters] {
+                        // List the cameras and then initialise a camera
+                        // for each pipeline, sharing out the frame
+                        // pool memory between them
+                        unsigned int pipelineNum = commandLineParameters.pipelineNum;
+                        int errorCode = 0;
+                        wCameraList();
+                        for (unsigned int p = 0; (p < pipelineNum) && (errorCode == 0); p++) {
+                            errorCode = wCameraInit(p, W_CAMERA_FRAME_POOL_MAX_BYTES /
+                                                       pipelineNum);
+                        }
+                        return errorCode;
+                    });
+                });
+                pthread_setname_np(cameraThread.native_handle(), "cameraStart");
             }
-            if (errorCode == 0) {
-                errorCode = wMotorRangeSet(W_MOTOR_TYPE_ROTATE,
-                                           commandLineParameters.lookRightLimitSteps,
-                                           commandLineParameters.lookLeftLimitSteps);
+            catch (std::exception &e) {
+                errorCode = -ENOMEM;
+                W_LOG_ERROR("unable to start the start-up threads (%s)!", e.what());
             }
         }
+
         if (errorCode == 0) {
-            // Initialise messaging
-            errorCode = wMsgInit();
+            // Intialise the LEDs
+            errorCode = startupPhase("LEDs", wLedInit);
         }
         if (errorCode == 0) {
-            // Now that messaging is available, we should
-            // be able to initialise control
-            errorCode = wControlInit();
+            errorCode = startupPhase("output directory", [&commandLineParameters] {
+                return outputDirectoryPrepare(&commandLineParameters);
+            });
+        }
+        if ((errorCode == 0) && (commandLineParameters.httpPort > 0)) {
+            // Serve from here, as Apache would; this has to be before
+            // video encoding is initialised since it moves the HLS
+            // output into memory
+            errorCode = startupPhase("HTTP", [&commandLineParameters] {
+                return wHttpStart(commandLineParameters.httpPort,
+                                  std::string(W_UTIL_DIR_THIS),
+                                  commandLineParameters.cfgFilePath);
+            });
+        }
+        if ((errorCode == 0) && !commandLineParameters.recordDirectory.empty()) {
+            // Event recording has to be ready before video encoding
+            // is initialised, so that it can be told about the stream
+            errorCode = startupPhase("recording", [&commandLineParameters] {
+                system(std::string("mkdir -p " +
+                                   commandLineParameters.recordDirectory).c_str());
+                return wRecordStart(commandLineParameters.recordDirectory,
+                                    commandLineParameters.outputFileName);
+            });
         }
         if (errorCode == 0) {
-            // Intialise the LEDs
-            errorCode = wLedInit();
+            // The event index, like event recording, has to be ready
+            // before video encoding begins
+            errorCode = startupPhase("event index", [&commandLineParameters] {
+                return wEventStart(commandLineParameters.outputDirectory,
+                                   commandLineParameters.outputFileName);
+            });
         }
         if (errorCode == 0) {
-            // List the cameras and then initialise the camera
-            wCameraList();
-            errorCode = wCameraInit();
+            // Video encoding does not need the camera or image
+            // processing until it is started
+            errorCode = startupPhase("video encode", [&commandLineParameters] {
+                return videoEncodeInit(&commandLineParameters);
+            });
         }
         if (errorCode == 0) {
-            // Now that the camera has been initialised, we
-            // should be able to initialise image processing
-            errorCode = wImageProcessingInit();
+            // Write the pipeline statistics next to the HLS output
+            errorCode = startupPhase("statistics", [&commandLineParameters] {
+                int errorCode = 0;
+                for (unsigned int p = 0; (p < commandLineParameters.pipelineNum) &&
+                                         (errorCode == 0); p++) {
+                    errorCode = wStatsStart(p, commandLineParameters.outputDirectory,
+                                            pipelineFileName(&commandLineParameters, p));
+                }
+                return errorCode;
+            });
+        }
+
+        // Wait for the camera, then initialise image processing
+        if (cameraThread.joinable()) {
+            cameraThread.join();
+            if (errorCode == 0) {
+                errorCode = cameraErrorCode;
+            }
+        }
+        if (errorCode == 0) {
+            errorCode = startupPhase("image processing", [&commandLineParameters] {
+                return imageProcessingStart(&commandLineParameters);
+            });
+        }
+
+        // Wait for the motors, then initialise control, which
+        // moves them
+        if (motorThread.joinable()) {
+            motorThread.join();
+            if (errorCode == 0) {
+                errorCode = motorErrorCode;
+            }
         }
         if (errorCode == 0) {
-            // Remove any old files for a clean start
-            system(std::string("rm " +
-                               commandLineParameters.outputDirectory +
-                               W_UTIL_DIR_SEPARATOR +
-                               commandLineParameters.outputFileName +
-                               W_HLS_PLAYLIST_FILE_EXTENSION +
-                               W_UTIL_SYSTEM_SILENT).c_str());
-            system(std::string("rm " +
-                               commandLineParameters.outputDirectory +
-                               W_UTIL_DIR_SEPARATOR +
-                               commandLineParameters.outputFileName +
-                               "*" W_HLS_SEGMENT_FILE_EXTENSION +
-                               W_UTIL_SYSTEM_SILENT).c_str());
-
-            // Make sure the output directory exists
-            system(std::string("mkdir -p " +
-                               commandLineParameters.outputDirectory).c_str());
-
-            // With image processing initialised, we should
-            // be able to initialise video encoding
-            errorCode = wVideoEncodeInit(commandLineParameters.outputDirectory,
-                                         commandLineParameters.outputFileName);
+            errorCode = startupPhase("control", wControlInit);
         }
+        startupTimelinePrint();
 
         if (errorCode == 0) {
             // Everything is now initialised, ready to go; kick things off
@@ -178,21 +499,40 @@ int main(int argc, char *argv[])
             // processing code, which will in turn start the camera
             errorCode = wControlStart(commandLineParameters.flagStaticCamera,
                                       commandLineParameters.motionContinuousSeconds);
+            // Control only starts the main pipeline, the others
+            // simply stream
+            for (unsigned int p = W_COMMON_PIPELINE_MAIN + 1;
+                 (p < commandLineParameters.pipelineNum) && (errorCode == 0); p++) {
+                errorCode = wVideoEncodeStart(p);
+            }
 
+            wUtilThreadPlacementReport();
             W_LOG_INFO("running, press CTRL-C to stop.");
             while ((errorCode == 0) && wUtilKeepGoing()) {
                 sleep(1);
             }
 
             // Done
+            for (unsigned int p = W_COMMON_PIPELINE_MAIN + 1;
+                 p < commandLineParameters.pipelineNum; p++) {
+                wVideoEncodeStop(p);
+            }
             wControlStop();
         } else {
             W_LOG_ERROR("initialisation failure (%d)!", errorCode);
         }
 
-        wVideoEncodeDeinit();
-        wImageProcessingDeinit();
-        wCameraDeinit();
+        wStatsStop();
+        for (unsigned int p = 0; p < commandLineParameters.pipelineNum; p++) {
+            wVideoEncodeDeinit(p);
+        }
+        wEventStop();
+        wRecordStop();
+        wHttpStop();
+        for (unsigned int p = 0; p < commandLineParameters.pipelineNum; p++) {
+            wImageProcessingDeinit(p);
+            wCameraDeinit(p);
+        }
         wLedDeinit();
         wControlDeinit();
         wMsgDeinit();
@@ -202,11 +542,13 @@ int main(int argc, char *argv[])
 
         W_LOG_INFO_START("exiting");
         if (errorCode != 0) {
-            W_LOG_INFO(" with error code %d", errorCode);
+            W_LOG_INFO_MORE(" with error code %d", errorCode);
         }
         W_LOG_INFO_MORE(".");
         W_LOG_INFO_END;
 
+        wLogWriterStop();
+
     } else {
         // Print help about the command line, including the defaults
         wCommandLinePrintHelp(&commandLineParameters);
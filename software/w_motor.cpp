@@ -19,8 +19,21 @@
  */
 
 // The CPP stuff.
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// The Linux/Posix stuff.
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 // Other parts of watchdog.
 #include <w_util.h>
@@ -38,6 +51,42 @@
  * TYPES
  * -------------------------------------------------------------- */
 
+// Where the stepper thread has got to with a motor.
+typedef enum {
+    W_MOTOR_STEPPER_PHASE_IDLE,      // Nothing to do
+    W_MOTOR_STEPPER_PHASE_DECIDE,    // Work out the next step at timeNs
+    W_MOTOR_STEPPER_PHASE_DIRECTION, // Direction set, start the step at timeNs
+    W_MOTOR_STEPPER_PHASE_PULSE      // Step pin low, raise it at timeNs
+} wMotorStepperPhase_t;
+
+// The stepper thread's view of a motor, in the same order as
+// gMotor[]; target and position are in steps counted from when the
+// stepper thread was started and have nothing to do with calibration.
+typedef struct {
+    std::atomic<int> target;
+    std::atomic<int> position;
+    std::atomic<bool> moving;
+    std::atomic<unsigned int> limitCount; // Times stopped at a limit switch
+    // These are only touched with gMutex locked, see sync()
+    int positionSynced;
+    unsigned int limitCountSynced;
+    // These are only touched by the stepper thread
+    wMotorStepperPhase_t phase;
+    int64_t timeNs;      // CLOCK_MONOTONIC
+    int64_t stepStartNs; // When the step pin of the current step dropped
+    double rateHz;       // Zero when at rest
+    int direction;       // Of the current movement, only valid if rateHz is non-zero
+} wMotorStepper_t;
+
+// A calibration of a motor, as kept in the calibration file.
+typedef struct {
+    bool valid; // Ignore the remaining values if this is false
+    int max;
+    int min;
+    int now;
+    int throwSteps;
+} wMotorCalibration_t;
+
 /* ----------------------------------------------------------------
  * VARIABLES
  * -------------------------------------------------------------- */
@@ -45,6 +94,30 @@
 // Mutex to protect the API.
 static std::mutex gMutex;
 
+// Mutex and condition variable that a wait for a motor to stop
+// moving uses.
+static std::mutex gStepperMutex;
+static std::condition_variable gStepperStopped;
+
+// The handle of the stepper thread.
+static std::thread gStepperThread;
+
+// Keep-going flag for the stepper thread.
+static std::atomic<bool> gStepperKeepGoing(false);
+
+// The file handle of the event that tells the stepper thread that
+// there is a new move or that it should stop.
+static int gStepperEventFd = -1;
+
+// The file handle of the one-shot timer for the next step edge.
+static int gStepperTimerFd = -1;
+
+// Monitor the number of steps taken and the worst lateness of a
+// step edge in nanoseconds, purely for information; written only
+// by the stepper thread.
+static uint64_t gStepperStepCount = 0;
+static int64_t gStepperLatenessMaxNs = 0;
+
 // Movement tracking: order must match wMovementType_t.
 // The compiler will initialise any uninitialised fields to zero.
 static wMotor_t gMotor[] = {{.name = "vertical",
@@ -68,10 +141,17 @@ static wMotor_t gMotor[] = {{.name = "vertical",
                              .restPosition = W_MOTOR_REST_POSITION_CENTRE,
                              .calibrated = false}};
 
+// The stepper thread's view of the motors, in the same order as gMotor[].
+static wMotorStepper_t gStepper[W_UTIL_ARRAY_COUNT(gMotor)];
+
 // Array of names for the rest positions, just for printing; must be in the
 // same order as wMotorRestPosition_t.
 static const char *gRestPositionStr[] = {"centre", "max", "min"};
 
+// The path of the file that the calibration of the motors is kept
+// in between runs, empty if it is not kept.
+static std::string gCalibrationFilePath;
+
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -112,8 +192,33 @@ static int enableAll(bool enableNotDisable = true)
     return errorCode;
 }
 
+// Get the monotonic time in nanoseconds.
+static int64_t timeNowNs()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((int64_t) now.tv_sec) * 1000000000LL + now.tv_nsec;
+}
+
+// Mark a motor as needing calibration.
+static void uncalibrate(wMotor_t *motor)
+{
+#if W_MOTOR_CALIBRATE_ONE_CALIBRATE_ALL
+    // If one motor has become uncalibrated we declare
+    // all uncalibrated
+    (void) motor;
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gMotor); x++) {
+        gMotor[x].calibrated = false;
+    }
+#else
+    motor->calibrated = false;
+#endif
+}
+
 // Set direction.
-// IMPORTANT: gMutex must be locked before this is called.
+// IMPORTANT: only the stepper thread should call this.
 static int directionSet(wMotor_t *motor, int step)
 {
     int errorCode = -EINVAL;
@@ -137,83 +242,362 @@ static int directionSet(wMotor_t *motor, int step)
     return errorCode;
 }
 
-// Perform a step; will not move if at a limit; being at
-// a limit does not constitute an error: supply stepTaken
-// if you want to know the outcome.
-// This does NOT advance motor->now.
-// IMPORTANT: gMutex must be locked before this is called.
-static int stepOnce(wMotor_t *motor, int stepUnit = 1, int *stepTaken = nullptr)
+// Work out the rate for the next step of a motor that has remaining
+// steps to go to its target: with v^2 = u^2 + 2as, and s being one
+// step, the square of the rate goes up or down by twice the
+// acceleration each step, which gives a trapezoidal speed profile
+// without any per-step storage.  The motor slows down when the steps
+// remaining are no more than it needs to stop, or if the target has
+// moved behind it, in which case it comes to rest and starts again
+// in the other direction.  stepper->rateHz is left at zero if the
+// motor is to stop.
+// IMPORTANT: only the stepper thread should call this.
+static void rateUpdate(wMotorStepper_t *stepper, int remaining)
 {
-    int errorCode = -EINVAL;
+    double rateMinSquared = ((double) W_MOTOR_STEP_RATE_MIN_HZ) * W_MOTOR_STEP_RATE_MIN_HZ;
+    double twoA = 2.0 * W_MOTOR_ACCELERATION_STEPS_PER_SECOND_SQUARED;
+
+    if (stepper->rateHz > 0) {
+        int remainingAhead = remaining * stepper->direction;
+        double rateSquared = stepper->rateHz * stepper->rateHz;
+        if ((remainingAhead <= 0) ||
+            (remainingAhead <= (rateSquared - rateMinSquared) / twoA)) {
+            // Slow down
+            rateSquared -= twoA;
+            if (rateSquared > rateMinSquared) {
+                stepper->rateHz = std::sqrt(rateSquared);
+            } else if (remainingAhead > 0) {
+                // Crawl the last step(s)
+                stepper->rateHz = W_MOTOR_STEP_RATE_MIN_HZ;
+            } else {
+                // Stop, maybe to start again the other way below
+                stepper->rateHz = 0;
+            }
+        } else {
+            // Speed up, or keep going at the maximum
+            rateSquared += twoA;
+            stepper->rateHz = W_MOTOR_STEP_RATE_MAX_HZ;
+            if (rateSquared < ((double) W_MOTOR_STEP_RATE_MAX_HZ) * W_MOTOR_STEP_RATE_MAX_HZ) {
+                stepper->rateHz = std::sqrt(rateSquared);
+            }
+        }
+    }
 
-    if (stepTaken) {
-        *stepTaken = 0;
+    if ((stepper->rateHz <= 0) && (remaining != 0)) {
+        // Start from rest
+        stepper->direction = (remaining > 0) ? 1 : -1;
+        stepper->rateHz = W_MOTOR_STEP_RATE_MIN_HZ;
     }
+}
 
-    if (motor) {
-        // Check for limits
-        errorCode = 0;
-        if (stepUnit > 0) {
-            errorCode = wGpioGet(motor->pinMax);
-        } else if (stepUnit < 0) {
-            errorCode = wGpioGet(motor->pinMin);
+// Bring a motor to rest in the stepper thread, telling anyone
+// waiting for it to stop, unless it has been given more steps
+// to take in the meantime.
+// IMPORTANT: only the stepper thread should call this.
+static void stepperRest(wMotorStepper_t *stepper)
+{
+    stepper->rateHz = 0;
+    stepper->phase = W_MOTOR_STEPPER_PHASE_IDLE;
+    stepper->moving = false;
+    if (stepper->target != stepper->position) {
+        // A move arrived while we were deciding to stop: carry on
+        stepper->moving = true;
+    } else {
+        // Lock the mutex, so that the notification can't fall
+        // between a waiter checking stepper->moving and waiting
+        gStepperMutex.lock();
+        gStepperMutex.unlock();
+        gStepperStopped.notify_all();
+    }
+}
+
+// Do whatever is next for a motor in the stepper thread, setting
+// stepper->timeNs to when the thing after that should be done.
+// IMPORTANT: only the stepper thread should call this.
+static void stepperProgress(wMotor_t *motor, wMotorStepper_t *stepper,
+                            int64_t nowNs)
+{
+    int errorCode = 0;
+
+    switch (stepper->phase) {
+        case W_MOTOR_STEPPER_PHASE_DECIDE:
+            rateUpdate(stepper, stepper->target - stepper->position);
+            if (stepper->rateHz <= 0) {
+                stepperRest(stepper);
+            } else if (stepper->direction != motor->lastUnitStep) {
+                // Set the direction and give it a moment to settle
+                errorCode = directionSet(motor, stepper->direction);
+                stepper->phase = W_MOTOR_STEPPER_PHASE_DIRECTION;
+                stepper->timeNs = nowNs + ((int64_t) W_MOTOR_DIRECTION_SETUP_US) * 1000;
+            } else {
+                stepper->phase = W_MOTOR_STEPPER_PHASE_DIRECTION;
+                stepper->timeNs = nowNs;
+            }
+            if (stepper->phase != W_MOTOR_STEPPER_PHASE_DIRECTION) {
+                break;
+            }
+            // Fall through
+        case W_MOTOR_STEPPER_PHASE_DIRECTION:
+            if (stepper->timeNs <= nowNs) {
+                // Check for limits: a limit level of 1 means the pin
+                // remains in its default pulled-up state, we can move
+                if (wGpioGet((stepper->direction > 0) ? motor->pinMax : motor->pinMin) == 1) {
+                    // Send out the start of a zero to one transition
+                    errorCode = wGpioSet(motor->pinStep, 0);
+                    stepper->stepStartNs = nowNs;
+                    stepper->phase = W_MOTOR_STEPPER_PHASE_PULSE;
+                    stepper->timeNs = nowNs + ((int64_t) W_MOTOR_STEP_PULSE_US) * 1000;
+                } else {
+                    W_LOG_DEBUG("%s: hit %s limit.", motor->name,
+                                stepper->direction > 0 ? "max" : "min");
+                    // Abandon the rest of the move
+                    stepper->target = (int) stepper->position;
+                    stepper->limitCount++;
+                    stepperRest(stepper);
+                }
+            }
+            break;
+        case W_MOTOR_STEPPER_PHASE_PULSE:
+            // The zero to one transition is the step
+            errorCode = wGpioSet(motor->pinStep, 1);
+            if (errorCode == 0) {
+                stepper->position += stepper->direction;
+                gStepperStepCount++;
+            }
+            stepper->phase = W_MOTOR_STEPPER_PHASE_DECIDE;
+            stepper->timeNs = stepper->stepStartNs + (int64_t) (1000000000.0 / stepper->rateHz);
+            if (stepper->timeNs < nowNs + ((int64_t) W_MOTOR_STEP_PULSE_US) * 1000) {
+                // Make sure we sit at a one for long enough
+                stepper->timeNs = nowNs + ((int64_t) W_MOTOR_STEP_PULSE_US) * 1000;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (errorCode < 0) {
+        W_LOG_ERROR("%s: error %d on step.", motor->name, errorCode);
+        // Give up on this move rather than keep failing
+        stepper->target = (int) stepper->position;
+        stepperRest(stepper);
+    }
+}
+
+// The stepper thread: steps all of the motors at the same time,
+// each towards its target, sleeping on a one-shot timer until
+// the next edge of any of the step pins is due, or until it is
+// told of a new move.  This loop should be run at high priority.
+static void stepperLoop()
+{
+    struct pollfd pollFd[2] = {};
+    uint64_t value;
+
+    pollFd[0].fd = gStepperEventFd;
+    pollFd[0].events = POLLIN;
+    pollFd[1].fd = gStepperTimerFd;
+    pollFd[1].events = POLLIN;
+
+    W_LOG_DEBUG("motor stepper loop has started.");
+    while (gStepperKeepGoing) {
+        int64_t nowNs = timeNowNs();
+        int64_t nextNs = 0;
+        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gStepper); x++) {
+            wMotorStepper_t *stepper = &(gStepper[x]);
+            if ((stepper->phase == W_MOTOR_STEPPER_PHASE_IDLE) &&
+                (stepper->target != stepper->position)) {
+                // A new move
+                stepper->phase = W_MOTOR_STEPPER_PHASE_DECIDE;
+                stepper->timeNs = nowNs;
+            }
+            if ((stepper->phase != W_MOTOR_STEPPER_PHASE_IDLE) &&
+                (stepper->timeNs <= nowNs)) {
+                if (nowNs - stepper->timeNs > gStepperLatenessMaxNs) {
+                    gStepperLatenessMaxNs = nowNs - stepper->timeNs;
+                }
+                stepperProgress(&(gMotor[x]), stepper, nowNs);
+            }
+            if ((stepper->phase != W_MOTOR_STEPPER_PHASE_IDLE) &&
+                ((nextNs == 0) || (stepper->timeNs < nextNs))) {
+                nextNs = stepper->timeNs;
+            }
         }
 
-        if (errorCode == 1) {
-            // A limit level of 1 means the pin remains in its default
-            // pulled-up state, we can move
-            errorCode = directionSet(motor, stepUnit);
+        // Set the timer for whatever is next, or disarm it if nothing is
+        struct itimerspec timerSpec = {};
+        timerSpec.it_value.tv_sec = nextNs / 1000000000LL;
+        timerSpec.it_value.tv_nsec = nextNs % 1000000000LL;
+        timerfd_settime(gStepperTimerFd, TFD_TIMER_ABSTIME, &timerSpec, nullptr);
+
+        if (poll(pollFd, W_UTIL_ARRAY_COUNT(pollFd), -1) > 0) {
+            for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(pollFd); x++) {
+                if ((pollFd[x].revents & POLLIN) &&
+                    (read(pollFd[x].fd, &value, sizeof(value)) != sizeof(value))) {
+                    W_LOG_DEBUG("motor stepper loop: unable to read fd %d (%d).",
+                                pollFd[x].fd, errno);
+                }
+            }
+        }
+    }
+
+    W_LOG_DEBUG("motor stepper loop has exited.");
+}
+
+// Start the stepper thread, and the timer and event it needs;
+// returns zero on success else negative error code.
+static int stepperStart()
+{
+    int errorCode = 0;
+
+    if (!gStepperThread.joinable()) {
+        gStepperTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (gStepperTimerFd >= 0) {
+            gStepperEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+        if ((gStepperTimerFd < 0) || (gStepperEventFd < 0)) {
+            errorCode = -errno;
+            W_LOG_ERROR("unable to create motor stepper timer/event (%d)!",
+                        errorCode);
+        }
+        if (errorCode == 0) {
+            gStepperKeepGoing = true;
+            try {
+                gStepperThread = std::thread(stepperLoop);
+            }
+            catch (std::exception &e) {
+                gStepperKeepGoing = false;
+                errorCode = -ENOMEM;
+                W_LOG_ERROR("unable to start motor stepper thread (%s)!", e.what());
+            }
             if (errorCode == 0) {
-                // Wait a moment for the direction pin to settle
-                std::this_thread::sleep_for(std::chrono::milliseconds(W_MOTOR_DIRECTION_WAIT_MS));
-                // Send out a zero to one transition and wait
-                errorCode = wGpioSet(motor->pinStep, 0);
+                // Set the required priority and name
+                struct sched_param scheduling;
+                scheduling.sched_priority = W_COMMON_THREAD_REAL_TIME_PRIORITY(W_COMMON_THREAD_PRIORITY_MOTOR);
+                errorCode = -pthread_setschedparam(gStepperThread.native_handle(),
+                                                   SCHED_FIFO, &scheduling);
                 if (errorCode == 0) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(W_MOTOR_STEP_WAIT_MS));
-                    errorCode = wGpioSet(motor->pinStep, 1);
-                    if (errorCode == 0) {
-                        // Make sure we sit at a one for long enough
-                        std::this_thread::sleep_for(std::chrono::milliseconds(W_MOTOR_STEP_WAIT_MS));
-                    }
+                    pthread_setname_np(gStepperThread.native_handle(), "stepperLoop");
+                    wUtilThreadPlacementSet(gStepperThread.native_handle(), "stepperLoop");
+                } else {
+                    W_LOG_ERROR("unable to set schedule of motor stepper thread (%d)!",
+                                errorCode);
                 }
             }
-            if ((errorCode == 0) && (stepTaken)) {
-                // We have taken a step
-                *stepTaken = stepUnit;
-            }
-        } else if ((errorCode == 0) && (stepUnit != 0)) {
-            W_LOG_DEBUG("%s: hit %s limit.", motor->name, stepUnit > 0 ? "max" : "min");
         }
+    }
 
-        if (errorCode < 0) {
-            W_LOG_ERROR("%s: error %d on step.", motor->name, errorCode);
+    return errorCode;
+}
+
+// Stop the stepper thread, and free the timer and event it needs;
+// any movement in progress is abandoned.
+static void stepperStop()
+{
+    if (gStepperThread.joinable()) {
+        uint64_t value = 1;
+        gStepperKeepGoing = false;
+        if (write(gStepperEventFd, &value, sizeof(value)) != sizeof(value)) {
+            W_LOG_ERROR("unable to tell motor stepper thread to stop (%d)!", errno);
+        }
+        gStepperThread.join();
+        if (gStepperStepCount > 0) {
+            W_LOG_INFO("%lld motor step(s), worst step edge lateness %lld us.",
+                       gStepperStepCount, gStepperLatenessMaxNs / 1000);
+        }
+    }
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gStepper); x++) {
+        wMotorStepper_t *stepper = &(gStepper[x]);
+        stepper->phase = W_MOTOR_STEPPER_PHASE_IDLE;
+        stepper->rateHz = 0;
+        stepper->target = (int) stepper->position;
+        stepper->moving = false;
+    }
+    gStepperStopped.notify_all();
+    if (gStepperEventFd >= 0) {
+        close(gStepperEventFd);
+        gStepperEventFd = -1;
+    }
+    if (gStepperTimerFd >= 0) {
+        close(gStepperTimerFd);
+        gStepperTimerFd = -1;
+    }
+}
+
+// Return the stepper thread's view of a motor.
+static wMotorStepper_t *stepperGet(const wMotor_t *motor)
+{
+    return &(gStepper[motor - gMotor]);
+}
+
+// Add steps to those a motor has to take; returns zero on success
+// else negative error code.
+static int stepperAdd(wMotorStepper_t *stepper, int steps)
+{
+    int errorCode = -EBADF;
+    uint64_t value = 1;
+
+    if (gStepperThread.joinable()) {
+        errorCode = 0;
+        stepper->target += steps;
+        stepper->moving = true;
+        if (write(gStepperEventFd, &value, sizeof(value)) != sizeof(value)) {
+            errorCode = -errno;
         }
     }
 
     return errorCode;
 }
 
-// Take multiple steps; being short on steps does not constitue an
-// error; supply stepsTaken if you want to know the outcome.
-// This does NOT advance motor->now.
+// Wait for a motor to stop moving.
+static void stepperWait(wMotorStepper_t *stepper)
+{
+    std::unique_lock<std::mutex> lock(gStepperMutex);
+
+    gStepperStopped.wait(lock, [stepper] {return !stepper->moving;});
+}
+
+// Bring motor->now up to date with the steps the stepper thread
+// has taken: if the motor is calibrated it is advanced and, should
+// the stepper thread have stopped the motor at a limit switch, the
+// motor is marked as needing calibration since, with the limits set
+// W_MOTOR_LIMIT_MARGIN_STEPS inside the switches, hitting one means
+// that our idea of the position has gone wrong.
+// IMPORTANT: gMutex must be locked before this is called.
+static void sync(wMotor_t *motor)
+{
+    wMotorStepper_t *stepper = stepperGet(motor);
+    int position = stepper->position;
+    unsigned int limitCount = stepper->limitCount;
+
+    if (motor->calibrated) {
+        motor->now += position - stepper->positionSynced;
+        if (limitCount != stepper->limitCountSynced) {
+            W_LOG_WARN("%s: hit a limit switch, motor now needs calibration.",
+                       motor->name);
+            uncalibrate(motor);
+        }
+    }
+    stepper->positionSynced = position;
+    stepper->limitCountSynced = limitCount;
+}
+
+// Take multiple steps and wait for them to be done; being short
+// on steps does not constitue an error; supply stepsTaken if you
+// want to know the outcome (the number of steps taken is added to
+// it).  This does NOT advance motor->now, call sync() for that.
 // IMPORTANT: gMutex must be locked before this is called.
 static int stepMany(wMotor_t *motor, int steps, int *stepsTaken = nullptr)
 {
     int errorCode = -EINVAL;
 
     if (motor) {
-        errorCode = 0;
-        int stepTaken = 1;
-        int stepUnit = stepTaken;
-        if (steps < 0) {
-            stepUnit = -stepUnit;
-        }
-        for (int x = 0; (x < steps * stepUnit) && (stepTaken != 0) &&
-                        (errorCode == 0); x++) {
-            stepTaken = 0;
-            errorCode = stepOnce(motor, stepUnit, &stepTaken);
-            if ((errorCode == 0) && (stepsTaken)) {
-                *stepsTaken += stepTaken;
+        wMotorStepper_t *stepper = stepperGet(motor);
+        stepperWait(stepper);
+        int positionStart = stepper->position;
+        errorCode = stepperAdd(stepper, steps);
+        if (errorCode == 0) {
+            stepperWait(stepper);
+            if (stepsTaken) {
+                *stepsTaken += stepper->position - positionStart;
             }
         }
     }
@@ -221,6 +605,23 @@ static int stepMany(wMotor_t *motor, int steps, int *stepsTaken = nullptr)
     return errorCode;
 }
 
+// Perform a step and wait for it to be done; will not move if at
+// a limit; being at a limit does not constitute an error: supply
+// stepTaken if you want to know the outcome.
+// This does NOT advance motor->now, call sync() for that.
+// IMPORTANT: gMutex must be locked before this is called.
+static int stepOnce(wMotor_t *motor, int stepUnit = 1, int *stepTaken = nullptr)
+{
+    int stepsTaken = 0;
+    int errorCode = stepMany(motor, stepUnit, &stepsTaken);
+
+    if (stepTaken) {
+        *stepTaken = stepsTaken;
+    }
+
+    return errorCode;
+}
+
 // Step away from a limit until the limit is no longer signalled.
 // Always returns a positive number on success.
 // This does NOT advance motor->now.
@@ -304,32 +705,41 @@ static int stepAwayFromLimit(wMotor_t *motor)
 }
 
 // Try to move the given number of steps, returning the
-// number actually stepped in stepsTaken; being short on
+// number actually stepped in stepsTaken if wait is true, else
+// the number of steps that will be attempted; being short on
 // steps does not constitute an error.  Will only move
 // if calibrated unless evenIfUnCalibrated is true.
 // This advances motor->now if the motor is calibrated.
 // IMPORTANT: gMutex must be locked before this is called.
 static int move(wMotor_t *motor, int steps, int *stepsTaken,
-                bool evenIfUnCalibrated)
+                bool evenIfUnCalibrated, bool wait = true)
 {
     int errorCode = -EINVAL;
     int stepsCompleted = 0;
 
     if (motor) {
+        wMotorStepper_t *stepper = stepperGet(motor);
+        if (wait) {
+            stepperWait(stepper);
+        }
+        sync(motor);
         if (motor->calibrated || evenIfUnCalibrated) {
             bool calibrationRequired = false;
+            // Where the motor will be once the steps it has
+            // still to take are done
+            int now = motor->now + (stepper->target - stepper->positionSynced);
             errorCode = 0;
             if (steps > 0) {
                 if (motor->calibrated) {
                     // Limit the steps against the calibrated
                     // and user maximums
-                    if (motor->now + steps > motor->max) {
-                        steps = motor->max - motor->now;
+                    if (now + steps > motor->max) {
+                        steps = motor->max - now;
                         calibrationRequired = true;
                     }
                     if ((motor->userMax > 0) &&
-                        (motor->now + steps > motor->userMax)) {
-                        steps = motor->userMax - motor->now;
+                        (now + steps > motor->userMax)) {
+                        steps = motor->userMax - now;
                     }
                 } else {
                     // Limit the steps against the hard-coded safety
@@ -342,13 +752,13 @@ static int move(wMotor_t *motor, int steps, int *stepsTaken,
                 if (motor->calibrated) {
                     // Limit the steps against the calibrated
                     // and user minimums
-                    if (motor->now + steps < motor->min) {
-                        steps = motor->min - motor->now;
+                    if (now + steps < motor->min) {
+                        steps = motor->min - now;
                         calibrationRequired = true;
                     }
                     if ((motor->userMin < 0) && 
-                        (motor->now + steps < motor->userMin)) {
-                        steps = motor->userMin - motor->now;
+                        (now + steps < motor->userMin)) {
+                        steps = motor->userMin - now;
                     }
                 } else {
                     // Limit the steps against the hard-coded safety
@@ -359,13 +769,17 @@ static int move(wMotor_t *motor, int steps, int *stepsTaken,
                 }
             }
 
-            if (steps != 0) {
+            if ((steps != 0) && !wait) {
+                // Just hand the steps to the stepper thread
+                errorCode = stepperAdd(stepper, steps);
+                if ((errorCode == 0) && stepsTaken) {
+                    *stepsTaken = steps;
+                }
+            } else if (steps != 0) {
                 // Actually move
                 stepsCompleted = 0;
                 errorCode = stepMany(motor, steps, &stepsCompleted);
-                if (motor->calibrated) {
-                    motor->now += stepsCompleted;
-                }
+                sync(motor);
                 if (stepsCompleted < steps) {
                     W_LOG_WARN_START("%s: only %+d step(s) taken (%d short)",
                                      motor->name, stepsCompleted, steps - stepsCompleted);
@@ -375,15 +789,7 @@ static int move(wMotor_t *motor, int steps, int *stepsTaken,
                     W_LOG_WARN_MORE(".");
                     W_LOG_WARN_END;
                     if (calibrationRequired && motor->calibrated) {
-#if W_MOTOR_CALIBRATE_ONE_CALIBRATE_ALL
-                        // If one motor has become uncalibrated we declare
-                        // all uncalibrated
-                        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gMotor); x++) {
-                            gMotor[x].calibrated = false;
-                        }
-#else
-                        motor->calibrated = false;
-#endif
+                        uncalibrate(motor);
                     }
                 }
 
@@ -412,6 +818,10 @@ static int moveToRest(wMotor_t *motor, int *stepsTaken = nullptr)
     int stepsCompleted = 0;
 
     if (motor) {
+        // Let any movement in progress finish so that we know
+        // where we are
+        stepperWait(stepperGet(motor));
+        sync(motor);
         if (motor->calibrated) {
             errorCode = 0;
             if (motor->userRestSet) {
@@ -534,6 +944,7 @@ static int calibrate(wMotor_t *motor)
                             steps -= W_MOTOR_LIMIT_MARGIN_STEPS;
                             motor->max = steps;
                             motor->min = -steps;
+                            motor->throwSteps = throwSteps;
                             errorCode = 0;
                             motor->calibrated = true;
                             limitUserRest(motor);
@@ -567,26 +978,197 @@ static int calibrate(wMotor_t *motor)
     return errorCode;
 }
 
+// Read the calibration of the motors from the calibration file,
+// which has a line per motor of its name then min, max, now and
+// the throw steps,
+// into calibration[], which must have an entry per entry of gMotor[];
+// entries for motors not in the file, or that make no sense, are
+// marked not valid.  The file is removed once read.
+static void calibrationLoad(const std::string &filePath,
+                            wMotorCalibration_t *calibration)
+{
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gMotor); x++) {
+        calibration[x].valid = false;
+    }
+
+    if (!filePath.empty()) {
+        FILE *file = fopen(filePath.c_str(), "r");
+        if (file) {
+            char name[32];
+            wMotorCalibration_t entry = {};
+            while (fscanf(file, "%31s %d %d %d %d", name, &(entry.min),
+                          &(entry.max), &(entry.now), &(entry.throwSteps)) == 5) {
+                for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gMotor); x++) {
+                    wMotor_t *motor = &(gMotor[x]);
+                    if ((strcmp(name, motor->name) == 0) &&
+                        (entry.min < 0) && (entry.max > 0) &&
+                        (entry.max - entry.min <= (int) motor->safetyLimit) &&
+                        (entry.now >= entry.min) && (entry.now <= entry.max) &&
+                        (entry.throwSteps >= 0) && (entry.throwSteps < (int) motor->safetyLimit)) {
+                        calibration[x] = entry;
+                        calibration[x].valid = true;
+                    }
+                }
+            }
+            fclose(file);
+            // Should we not exit cleanly this time, the motors could
+            // be anywhere, so the calibration is not to be used again
+            remove(filePath.c_str());
+        }
+    }
+}
+
+// Write the calibration of the motors to the calibration file, if
+// all of the motors are calibrated; the file is written to a
+// temporary file which is then renamed so that a half-written file
+// is never read.
+// IMPORTANT: gMutex must be locked before this is called.
+static int calibrationSave(const std::string &filePath)
+{
+    int errorCode = -EBADF;
+    bool allCalibrated = true;
+
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gMotor); x++) {
+        sync(&(gMotor[x]));
+        if (!gMotor[x].calibrated) {
+            allCalibrated = false;
+        }
+    }
+
+    if (!filePath.empty() && allCalibrated) {
+        errorCode = -EIO;
+        std::string filePathTemporary = filePath + ".tmp";
+        FILE *file = fopen(filePathTemporary.c_str(), "w");
+        if (file) {
+            bool written = true;
+            for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gMotor); x++) {
+                wMotor_t *motor = &(gMotor[x]);
+                if (fprintf(file, "%s %d %d %d %d\n", motor->name, motor->min,
+                            motor->max, motor->now, motor->throwSteps) < 0) {
+                    written = false;
+                }
+            }
+            if ((fclose(file) == 0) && written &&
+                (rename(filePathTemporary.c_str(), filePath.c_str()) == 0)) {
+                errorCode = 0;
+            }
+        }
+        if (errorCode == 0) {
+            W_LOG_INFO("motor calibration saved to \"%s\".", filePath.c_str());
+        } else {
+            W_LOG_WARN("unable to save motor calibration to \"%s\".",
+                       filePath.c_str());
+        }
+    }
+
+    return errorCode;
+}
+
+// Verify a saved calibration of a motor by running it to whichever
+// of its limit switches is nearer: calibrate() puts the point at
+// which the max limit switch is hit at max plus
+// W_MOTOR_LIMIT_MARGIN_STEPS and the point at which the min limit
+// switch lets go at min minus W_MOTOR_LIMIT_MARGIN_STEPS, the min
+// limit switch closing the saved throw steps before that so, if the
+// calibration still holds, that is where the switch will be.  If it
+// is there, give or take W_MOTOR_CALIBRATION_VERIFY_TOLERANCE_STEPS,
+// the motor is marked as calibrated with the saved range, else it
+// is left uncalibrated.
+// IMPORTANT: gMutex must be locked before this is called.
+static int calibrationVerify(wMotor_t *motor,
+                             const wMotorCalibration_t *calibration)
+{
+    int errorCode = -EINVAL;
+    int steps = 0;
+
+    if (motor && calibration && calibration->valid) {
+        motor->calibrated = false;
+        int direction = 1;
+        int expectedSteps = calibration->max - calibration->now + W_MOTOR_LIMIT_MARGIN_STEPS;
+        if (calibration->now < 0) {
+            direction = -1;
+            expectedSteps = calibration->now - calibration->min + W_MOTOR_LIMIT_MARGIN_STEPS +
+                            calibration->throwSteps;
+        }
+        errorCode = move(motor, direction * (expectedSteps + W_MOTOR_CALIBRATION_VERIFY_TOLERANCE_STEPS),
+                         &steps, true);
+        if (errorCode == 0) {
+            errorCode = -ENXIO;
+            steps *= direction;
+            if ((steps > expectedSteps - W_MOTOR_CALIBRATION_VERIFY_TOLERANCE_STEPS) &&
+                (steps < expectedSteps + W_MOTOR_CALIBRATION_VERIFY_TOLERANCE_STEPS)) {
+                // The limit switch is where it should be
+                if (direction > 0) {
+                    motor->now = calibration->max + W_MOTOR_LIMIT_MARGIN_STEPS;
+                    motor->throwSteps = calibration->throwSteps;
+                    errorCode = 0;
+                } else {
+                    // Step off the min limit switch, as calibrate() does,
+                    // and sync() while still uncalibrated so that the
+                    // steps taken doing so are not added to motor->now
+                    // later; we are then where the switch lets go
+                    errorCode = stepAwayFromLimit(motor);
+                    sync(motor);
+                    motor->now = calibration->min - W_MOTOR_LIMIT_MARGIN_STEPS;
+                    if (errorCode >= 0) {
+                        motor->throwSteps = errorCode;
+                    }
+                }
+                if (errorCode >= 0) {
+                    motor->max = calibration->max;
+                    motor->min = calibration->min;
+                    motor->calibrated = true;
+                    limitUserRest(motor);
+                    errorCode = 0;
+                    W_LOG_INFO("%s: saved calibration, range +/- %d step(s), verified"
+                               " (%s limit switch %+d step(s) from expected).",
+                               motor->name, motor->max, direction > 0 ? "max" : "min",
+                               steps - expectedSteps);
+                }
+            } else {
+                W_LOG_WARN("%s: saved calibration not verified, %s limit switch"
+                           " not found %d step(s) away (moved %d step(s)).",
+                           motor->name, direction > 0 ? "max" : "min",
+                           expectedSteps, steps);
+            }
+        }
+    }
+
+    return errorCode;
+}
+
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
 
 // Initialise the motors: THIS WILL CAUSE MOVEMENT.
-int wMotorInit(bool doNotOperateMotors)
+int wMotorInit(bool doNotOperateMotors, std::string calibrationFilePath)
 {
     int errorCode = 0;
+    wMotorCalibration_t calibration[W_UTIL_ARRAY_COUNT(gMotor)];
 
     if (!doNotOperateMotors) {
 
         gMutex.lock();
 
+        gCalibrationFilePath = calibrationFilePath;
+        calibrationLoad(gCalibrationFilePath, calibration);
+
         W_LOG_INFO("calibrating limits of movement, STAND CLEAR!");
 
-        // Calibrate movement
-        errorCode = enableAll();
+        // Calibrate movement, verifying any saved calibration
+        // instead where possible
+        errorCode = stepperStart();
+        if (errorCode == 0) {
+            errorCode = enableAll();
+        }
         for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gMotor)) &&
                                  (errorCode == 0); x++) {
-            errorCode = calibrate(&(gMotor[x]));
+            wMotor_t *motor = &(gMotor[x]);
+            if (!calibration[x].valid ||
+                (calibrationVerify(motor, &(calibration[x])) != 0)) {
+                errorCode = calibrate(motor);
+            }
         }
 
         if (errorCode == 0) {
@@ -609,10 +1191,9 @@ int wMotorInit(bool doNotOperateMotors)
     return errorCode;
 }
 
-// Try to move the given number of steps, returning
-// the number actually stepped in stepsTaken; being short
-// on steps does not constitute an error.  Will only move
-// if calibrated unless evenIfUnCalibrated is true.
+// Start moving the given number of steps, returning the
+// number that will be attempted in stepsTaken.  Will only
+// move if calibrated unless evenIfUnCalibrated is true.
 int wMotorMove(wMotorType_t type, int steps, int *stepsTaken,
                bool evenIfUnCalibrated)
 {
@@ -623,7 +1204,68 @@ int wMotorMove(wMotorType_t type, int steps, int *stepsTaken,
         gMutex.lock();
 
         errorCode = move(&(gMotor[type]), steps, stepsTaken,
-                         evenIfUnCalibrated);
+                         evenIfUnCalibrated, false);
+
+        gMutex.unlock();
+    }
+
+    return errorCode;
+}
+
+// Determine if a motor is moving.
+bool wMotorIsMoving(wMotorType_t type)
+{
+    bool isMoving = false;
+
+    if (type < W_UTIL_ARRAY_COUNT(gStepper)) {
+        isMoving = gStepper[type].moving;
+    }
+
+    return isMoving;
+}
+
+// Wait for a motor to stop moving.
+int wMotorWait(wMotorType_t type)
+{
+    int errorCode = -EINVAL;
+
+    if (type < W_UTIL_ARRAY_COUNT(gMotor)) {
+
+        gMutex.lock();
+
+        wMotor_t *motor = &(gMotor[type]);
+        stepperWait(stepperGet(motor));
+        sync(motor);
+        errorCode = 0;
+
+        gMutex.unlock();
+    }
+
+    return errorCode;
+}
+
+// Get the position of a motor.
+int wMotorPositionGet(wMotorType_t type, int *nowSteps, int *targetSteps)
+{
+    int errorCode = -EINVAL;
+
+    if (type < W_UTIL_ARRAY_COUNT(gMotor)) {
+
+        gMutex.lock();
+
+        wMotor_t *motor = &(gMotor[type]);
+        wMotorStepper_t *stepper = stepperGet(motor);
+        sync(motor);
+        errorCode = -EBADF;
+        if (motor->calibrated) {
+            if (nowSteps) {
+                *nowSteps = motor->now;
+            }
+            if (targetSteps) {
+                *targetSteps = motor->now + (stepper->target - stepper->positionSynced);
+            }
+            errorCode = 0;
+        }
 
         gMutex.unlock();
     }
@@ -660,6 +1302,7 @@ bool wMotorNeedsCalibration(wMotorType_t type)
         gMutex.lock();
 
         wMotor_t *motor = &(gMotor[type]);
+        sync(motor);
         needsCalibration = !motor->calibrated;
 
         gMutex.unlock();
@@ -793,6 +1436,10 @@ int wMotorRestReset(wMotorType_t type)
 void wMotorDeinit()
 {
     gMutex.lock();
+    stepperStop();
+    // Save the calibration while we still have it: it is lost
+    // when the motors are disabled
+    calibrationSave(gCalibrationFilePath);
     enableAll(false);
     gMutex.unlock();
 }
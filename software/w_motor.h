@@ -17,12 +17,25 @@
 #ifndef _W_MOTOR_H_
 #define _W_MOTOR_H_
 
-// This API is dependent on std::string.
+// This API is dependent on std::string and w_util.h (for
+// W_UTIL_DIR_THIS and W_UTIL_DIR_SEPARATOR).
 #include <string>
+#include <w_util.h>
 
 /** @file
  * @brief The motor API for the watchdog application; this API is
- * thread-safe.
+ * thread-safe.  The motors are stepped by a real-time stepper thread
+ * of this API, both at the same time, each following a trapezoidal
+ * speed profile (accelerating from W_MOTOR_STEP_RATE_MIN_HZ at
+ * W_MOTOR_ACCELERATION_STEPS_PER_SECOND_SQUARED up to
+ * W_MOTOR_STEP_RATE_MAX_HZ and decelerating to arrive); wMotorMove()
+ * only hands a move to that thread, whereas the calibration and rest
+ * functions wait for their movement to be completed.
+ *
+ * The calibration of the motors may be saved to a file by
+ * wMotorDeinit() and, on the next wMotorInit(), verified by running
+ * each motor to the nearer of its limit switches, rather than
+ * calibrated from scratch against both.
  */
 
 /* ----------------------------------------------------------------
@@ -61,19 +74,43 @@
 # define W_MOTOR_VERTICAL_DIRECTION_SENSE -1
 #endif
 
-#ifndef W_MOTOR_DIRECTION_WAIT_MS
-/** The pause between setting the direction that a step is to
- * take and requesting the step.
+#ifndef W_MOTOR_DIRECTION_SETUP_US
+/** The pause, in microseconds, between setting the direction that
+ * a step is to take and starting the step; stepper drivers need
+ * no more than a few microseconds.
+ */
+# define W_MOTOR_DIRECTION_SETUP_US 20
+#endif
+
+#ifndef W_MOTOR_STEP_PULSE_US
+/** The time, in microseconds, that a step pin is held low before
+ * being raised again, the rising edge being the step; also the
+ * least time that it is then held high.
  */
-# define W_MOTOR_DIRECTION_WAIT_MS 1
+# define W_MOTOR_STEP_PULSE_US 20
 #endif
 
-#ifndef W_MOTOR_STEP_WAIT_MS
-/** The pause between setting a step pin output low and raising it
- * high again; also the pause between a pin being high and
- * letting it drop again.
+#ifndef W_MOTOR_STEP_RATE_MIN_HZ
+/** The step rate that a motor starts from and stops at, i.e. a
+ * rate the motor can reach from standstill without ramping.
  */
-# define W_MOTOR_STEP_WAIT_MS 1
+# define W_MOTOR_STEP_RATE_MIN_HZ 200
+#endif
+
+#ifndef W_MOTOR_STEP_RATE_MAX_HZ
+/** The maximum step rate of a motor.
+ */
+# define W_MOTOR_STEP_RATE_MAX_HZ 1000
+#endif
+
+#ifndef W_MOTOR_ACCELERATION_STEPS_PER_SECOND_SQUARED
+/** The rate at which the step rate of a motor is ramped up from
+ * W_MOTOR_STEP_RATE_MIN_HZ to W_MOTOR_STEP_RATE_MAX_HZ and back
+ * down again: with the default values a little over 100 steps,
+ * about a fifth of a second, is spent ramping at each end of a
+ * long move.
+ */
+# define W_MOTOR_ACCELERATION_STEPS_PER_SECOND_SQUARED 4000
 #endif
 
 #ifndef W_MOTOR_LIMIT_MARGIN_STEPS
@@ -95,6 +132,22 @@
 # define W_MOTOR_CALIBRATE_ONE_CALIBRATE_ALL true
 #endif
 
+#ifndef W_MOTOR_CALIBRATION_FILE_PATH_DEFAULT
+/** The default path of the file that the calibration of the motors
+ * is kept in between runs, see wMotorInit().
+ */
+# define W_MOTOR_CALIBRATION_FILE_PATH_DEFAULT W_UTIL_DIR_THIS W_UTIL_DIR_SEPARATOR "watchdog_motor.cal"
+#endif
+
+#ifndef W_MOTOR_CALIBRATION_VERIFY_TOLERANCE_STEPS
+/** When a saved calibration is being verified, how far from where
+ * the saved calibration says it should be a limit switch may be
+ * found for the saved calibration to be trusted; must be less
+ * than W_MOTOR_LIMIT_MARGIN_STEPS.
+ */
+# define W_MOTOR_CALIBRATION_VERIFY_TOLERANCE_STEPS 10
+#endif
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
@@ -131,7 +184,7 @@ typedef struct {
     int pinMin;   // The pin which, when pulled low, indicates min has been reached
     int senseDirection; // 1 if a 1 at pinDirection moves towards max, else -1
     wMotorRestPosition_t restPosition;
-    int lastUnitStep; // Needed since Linux doesn't allow the state of an output pin to be read
+    int lastUnitStep; // Needed since Linux doesn't allow the state of an output pin to be read; stepper thread only
     int userMax;  // The user-override maximum limit in steps (see wMotorRangeSet())
     int userMin;  // The user-override maximum limit in steps (see wMotorRangeSet())
     int userRestSet; // If true then userRest has meaning
@@ -140,6 +193,7 @@ typedef struct {
     int max;      // The positive calibrated limit in steps
     int min;      // The negative calibrated limit in steps
     int now;
+    int throwSteps; // The steps taken to get off the min limit switch once it had closed
 } wMotor_t;
 
 /* ----------------------------------------------------------------
@@ -152,17 +206,36 @@ typedef struct {
  * will both function.  wGpioInit() must have returned successfully
  * before this is called.
  *
+ * If calibrationFilePath is given and the file holds the calibration
+ * saved by wMotorDeinit() at the end of the previous run, each motor
+ * is only run to the nearer of its limit switches: if the switch is
+ * found within W_MOTOR_CALIBRATION_VERIFY_TOLERANCE_STEPS of where
+ * the saved calibration says it should be, that calibration is used,
+ * else the motor is calibrated as normal.  The file is removed once read, so
+ * that a saved calibration is only ever trusted once, i.e. not after
+ * a crash.
+ *
  * @param doNotOperateMotors  if true, the motors will not be operated,
  *                            even for calibration; used for debug/
  *                            maintenance only as the API will not
  *                            do anything useful with this flag set.
+ * @param calibrationFilePath the path of the file to keep the
+ *                            calibration of the motors in between
+ *                            runs; empty if the calibration is not
+ *                            to be kept.
  * @return                    zero on success else negative error code.
  */
-int wMotorInit(bool doNotOperateMotors = false);
+int wMotorInit(bool doNotOperateMotors = false,
+               std::string calibrationFilePath = "");
 
-/** Try to move the given number of steps, returning the number
- * actually stepped in stepsTaken; being short on steps does not
- * constitute an error.  Will only move if calibrated unless
+/** Start moving the given number of steps, limited by the range
+ * of the motor, returning the number of steps that will be attempted
+ * in stepsTaken; this function does not wait for the movement, use
+ * wMotorIsMoving() or wMotorWait() for that.  If the motor is already
+ * moving the steps are added to those it has still to take, the
+ * motor slowing down and reversing if the move is now behind it.
+ * Should the motor hit a limit switch it stops and will be marked as
+ * needing calibration.  Will only move if calibrated unless
  * evenIfUnCalibrated is true.
  *
  * For W_MOTOR_TYPE_VERTICAL a positive step moves the watchdog to
@@ -174,7 +247,8 @@ int wMotorInit(bool doNotOperateMotors = false);
  * @param type               the motor type to move.
  * @param steps              the number of steps to move the motor.
  * @param stepsTaken         a pointer to a place to put the number
- *                           of steps actually taken; may be nullptr.
+ *                           of steps that will be attempted, after
+ *                           limiting; may be nullptr.
  * @param evenIfUnCalibrated if true then the motor will be moved
  *                           even if it is marked as uncalibrated,
  *                           else no steps will be taken if the motor
@@ -184,9 +258,38 @@ int wMotorInit(bool doNotOperateMotors = false);
 int wMotorMove(wMotorType_t type, int steps, int *stepsTaken = nullptr,
                bool evenIfUnCalibrated = false);
 
-/** Send a motor to its rest position; will only do so if the motor
- * is calibrated.  Not being able to get to the rest position _does_
- * constitute an error.
+/** Determine if a motor is moving.
+ *
+ * @param type the motor type.
+ * @return     true if the motor has steps still to take.
+ */
+bool wMotorIsMoving(wMotorType_t type);
+
+/** Wait for a motor to stop moving.
+ *
+ * @param type the motor type.
+ * @return     zero on success else negative error code.
+ */
+int wMotorWait(wMotorType_t type);
+
+/** Get the position of a motor; will return an error if the motor
+ * is uncalibrated.
+ *
+ * @param type        the motor type.
+ * @param nowSteps    a pointer to a place to put where the motor is,
+ *                    in steps from the centre of its calibrated range;
+ *                    may be nullptr.
+ * @param targetSteps a pointer to a place to put where the motor will
+ *                    be once the steps it has still to take are done;
+ *                    may be nullptr.
+ * @return            zero on success else negative error code.
+ */
+int wMotorPositionGet(wMotorType_t type, int *nowSteps,
+                      int *targetSteps = nullptr);
+
+/** Send a motor to its rest position, waiting until it gets there;
+ * will only do so if the motor is calibrated.  Not being able to get
+ * to the rest position _does_ constitute an error.
  *
  * @param type        the motor type to move.
  * @param stepsTaken  a pointer to a place to put the number of steps
@@ -275,7 +378,9 @@ int wMotorRestReset(wMotorType_t type);
 
 /** Deinitialise the motors: this will disable the motors and no
  * movement will be possible until motorInit() is called once
- * more.
+ * more.  If all of the motors are calibrated, and a calibration
+ * file path was given to wMotorInit(), the calibration is saved
+ * to that file first.
  */
 void wMotorDeinit();
 
@@ -20,15 +20,17 @@
 
 // The CPP stuff.
 #include <cstring>
+#include <cstddef> // For std::max_align_t
 #include <string>
 #include <memory>
 #include <thread>
 #include <mutex>
 #include <list>
+#include <atomic>
 #include <chrono>
 
 // The Linux/Posix stuff.
-#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
@@ -46,6 +48,14 @@
  * COMPILE-TIME MACROS
  * -------------------------------------------------------------- */
 
+// Round size up to a multiple of the alignment that any type needs.
+#define W_MSG_ALIGN(size) ((((size) + alignof(std::max_align_t) - 1) / \
+                            alignof(std::max_align_t)) * alignof(std::max_align_t))
+
+// The offset of the message body in a slot of a
+// W_MSG_QUEUE_TYPE_RING_SPSC queue.
+#define W_MSG_RING_SLOT_BODY_OFFSET W_MSG_ALIGN(sizeof(wMsgRingSlotHeader_t))
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
@@ -59,6 +69,14 @@ typedef struct {
     unsigned int bodySize;
 } wMsgContainer_t;
 
+/** The header of a slot in a W_MSG_QUEUE_TYPE_RING_SPSC queue, the
+ * message body following at W_MSG_RING_SLOT_BODY_OFFSET.
+ */
+typedef struct {
+    unsigned int type;
+    unsigned int bodySize;
+} wMsgRingSlotHeader_t;
+
 /** A message handler: the message handling function and the message
  * type it handles.
  */
@@ -77,12 +95,23 @@ typedef struct {
 typedef struct {
     unsigned int id; // The unique ID of this message queue
     bool keepGoing; // True if this queue is in use, else false
+    int eventFd; // Signalled by wMsgPush() to wake msgLoop()
     const char *name; // Name for queue, must not be longer than pthread_setname_np() allows (e.g. 16 characters)
     std::thread thread; // The thread at the end of the message queue
     void *context; // User context pointer for the message thread, will be passed to all message handlers
-    std::list<wMsgContainer_t> containerList; // A list of messages in containers
-    std::mutex mutex; // A mutex to protect the list
-    unsigned int sizeMax; // The maximum number of elements that one can put in containerList
+    wMsgQueueType_t type; // The type of queue: list or ring
+    std::list<wMsgContainer_t> containerList; // W_MSG_QUEUE_TYPE_LIST: a list of messages in containers
+    std::mutex mutex; // A mutex to protect the list (and, for all types, handlerList)
+    uint8_t *ring; // W_MSG_QUEUE_TYPE_RING_SPSC: ringSlotCount slots of ringSlotSize bytes
+    unsigned int ringSlotCount; // One more than sizeMax, so that head == tail means empty
+    unsigned int ringSlotSize; // Header plus room for bodySizeMax bytes of body, aligned
+    unsigned int bodySizeMax; // W_MSG_QUEUE_TYPE_RING_SPSC: the largest body that will fit
+    std::atomic<unsigned int> ringHead; // The next slot to pop, written only by the consumer
+    std::atomic<unsigned int> ringTail; // The next slot to push to, written only by the producer
+    unsigned int sizeMax; // The maximum number of elements that one can put in the queue
+    wMsgQueueOverflow_t overflow; // What to do when the queue is full
+    std::atomic<uint64_t> dropCount; // The number of messages dropped because of overflow
+    std::atomic<unsigned int> lengthMax; // High-water mark of the queue length, see wMsgQueueLengthMaxGet()
     std::list<wMsgHandler_t *> handlerList; // The list of pointers to message handlers for this queue
     uint64_t count; // The number of messages pushed, ever
     unsigned int previousSize; // The last recorded length of the list (for debug, used by the caller)
@@ -95,8 +124,8 @@ typedef struct {
 // A local keep-going flag.
 static bool gKeepGoing = false;
 
-// Timer that is employed by msgLoop().
-static int gTimerFd = -1;
+// True if wMsgInit() has been called.
+static bool gInitialised = false;
 
 // The next message queue ID to use.
 static unsigned int gQueueId = 0;
@@ -145,8 +174,8 @@ static wMsgHandler_t *handlerGet(wMsgQueue_t *queue,
 }
 
 // Wait for a lock on a mutex for a given time; this should only be
-// used by queueClear(): msgLoop() should run off the messaging
-// timer to ensure that it sleeps properly.
+// used by queueClear(): msgLoop() should block on the event file
+// descriptor of the queue to ensure that it sleeps properly.
 //
 // Note: see here:
 // https://stackoverflow.com/questions/44190865/stdtimed-mutextry-lock-for-fails-immediately
@@ -167,12 +196,138 @@ static bool queueMutexTryLockFor(std::mutex *mutex, std::chrono::nanoseconds wai
     return gotLock;
 }
 
+// Return a pointer to the given slot of a W_MSG_QUEUE_TYPE_RING_SPSC
+// queue.
+static wMsgRingSlotHeader_t *ringSlotGet(wMsgQueue_t *queue, unsigned int index)
+{
+    return (wMsgRingSlotHeader_t *) (queue->ring + (index * queue->ringSlotSize));
+}
+
+// Drop a message as a result of the overflow policy of a queue: calls
+// the free function for the message type, if there is one; the
+// caller must free the body itself if it was malloc()ed.
+static void msgDrop(wMsgQueue_t *queue, unsigned int msgType, void *body)
+{
+    wMsgHandler_t *handler = handlerGet(queue, msgType);
+    if (handler && handler->functionFree) {
+        handler->functionFree(body, queue->context);
+    }
+    queue->dropCount++;
+}
+
+// Return the number of messages in a W_MSG_QUEUE_TYPE_RING_SPSC queue.
+static unsigned int ringLength(wMsgQueue_t *queue)
+{
+    unsigned int head = queue->ringHead.load(std::memory_order_acquire);
+    unsigned int tail = queue->ringTail.load(std::memory_order_acquire);
+
+    return (tail + queue->ringSlotCount - head) % queue->ringSlotCount;
+}
+
+// Push a message onto a W_MSG_QUEUE_TYPE_RING_SPSC queue; must only
+// ever be called from one thread for a given queue.  Returns the
+// number of messages in the queue, including this one, or negative
+// error code.  If the queue is full and its overflow policy is not
+// W_MSG_QUEUE_OVERFLOW_REJECT the message is dropped and the (full)
+// length of the queue is returned.
+static int ringPush(wMsgQueue_t *queue, unsigned int msgType,
+                    void *body, unsigned int bodySize)
+{
+    int queueLengthOrErrorCode = -EMSGSIZE;
+
+    if (bodySize <= queue->bodySizeMax) {
+        queueLengthOrErrorCode = -ENOBUFS;
+        // Only we write the tail so relaxed is fine; acquire on the
+        // head so that the consumer has finished with a slot before
+        // we overwrite it
+        unsigned int tail = queue->ringTail.load(std::memory_order_relaxed);
+        unsigned int head = queue->ringHead.load(std::memory_order_acquire);
+        unsigned int nextTail = (tail + 1) % queue->ringSlotCount;
+        if (nextTail != head) {
+            wMsgRingSlotHeader_t *slot = ringSlotGet(queue, tail);
+            slot->type = msgType;
+            slot->bodySize = bodySize;
+            if (bodySize > 0) {
+                memcpy(((uint8_t *) slot) + W_MSG_RING_SLOT_BODY_OFFSET,
+                       body, bodySize);
+            }
+            // Release so that the consumer sees the slot contents
+            queue->ringTail.store(nextTail, std::memory_order_release);
+            queueLengthOrErrorCode = (int) ((nextTail + queue->ringSlotCount - head) %
+                                            queue->ringSlotCount);
+        } else if (queue->overflow != W_MSG_QUEUE_OVERFLOW_REJECT) {
+            // The producer can't pop, so whatever the policy the
+            // only thing we can drop here is the new message
+            msgDrop(queue, msgType, body);
+            queueLengthOrErrorCode = (int) queue->sizeMax;
+        }
+    }
+
+    return queueLengthOrErrorCode;
+}
+
+// Update the high-water mark of a queue given its length after
+// a push; lock-free since a ring queue has no mutex.
+static void lengthMaxUpdate(wMsgQueue_t *queue, unsigned int length)
+{
+    unsigned int lengthMax = queue->lengthMax.load(std::memory_order_relaxed);
+
+    while ((length > lengthMax) &&
+           !queue->lengthMax.compare_exchange_weak(lengthMax, length,
+                                                   std::memory_order_relaxed)) {
+    }
+}
+
+// Wake up msgLoop() for a queue.
+static void queueSignal(wMsgQueue_t *queue)
+{
+    uint64_t increment = 1;
+
+    if (queue->eventFd >= 0) {
+        // Nothing to be done about an error here, msgLoop() drains
+        // the queue on a guard timeout as well, so the message will
+        // be picked up within W_UTIL_POLL_TIMER_GUARD_MS
+        if (write(queue->eventFd, &increment, sizeof(increment)) != sizeof(increment)) {
+            W_LOG_DEBUG("%s: unable to signal message queue (%d).",
+                        queue->name, -errno);
+        }
+    }
+}
+
+// Free a queue that was new()'ed by wMsgQueueStart().
+static void queueFree(wMsgQueue_t *queue)
+{
+    if (queue) {
+        if (queue->eventFd >= 0) {
+            close(queue->eventFd);
+        }
+        free(queue->ring);
+        delete queue;
+    }
+}
+
+// Forward declarations of the pop functions, needed by queueClear().
+static int msgTryPop(wMsgQueue_t *queue, wMsgContainer_t *msg);
+static void msgPopDone(wMsgQueue_t *queue, wMsgContainer_t *msg);
+
 // Empty a message queue.
 static int queueClear(wMsgQueue_t *queue)
 {
     int errorCode = -EINVAL;
 
-    if (queue) {
+    if (queue && (queue->type == W_MSG_QUEUE_TYPE_RING_SPSC)) {
+        errorCode = 0;
+        // There is no mutex: this is only called once the consumer
+        // thread has stopped, hence we are now the consumer
+        wMsgContainer_t msg;
+        while (msgTryPop(queue, &msg) == 0) {
+            wMsgHandler_t *handler = handlerGet(queue, msg.type);
+            if (handler && handler->functionFree) {
+                handler->functionFree(msg.body, queue->context);
+            }
+            msgPopDone(queue, &msg);
+        }
+    } else if (queue) {
         errorCode = 0;
         if (queueMutexTryLockFor(&(queue->mutex),
                                  W_MSG_QUEUE_TRY_LOCK_WAIT)) {
@@ -203,8 +358,9 @@ static int queueClear(wMsgQueue_t *queue)
 static void queueStop(wMsgQueue_t *queue)
 {
     if (queue) {
-        // Stop the thread
+        // Stop the thread, waking it up so that it notices
         queue->keepGoing = false;
+        queueSignal(queue);
         if (queue->thread.joinable()) {
             queue->thread.join();
         }
@@ -217,26 +373,71 @@ static void queueStop(wMsgQueue_t *queue)
 }
 
 // Try to pop a message off a queue.  If a message is returned
-// the caller MUST call free() on msg->body.
+// the caller MUST call msgPopDone() once it is finished with
+// msg->body.  For a W_MSG_QUEUE_TYPE_RING_SPSC queue msg->body
+// points into the ring slot itself.
 static int msgTryPop(wMsgQueue_t *queue, wMsgContainer_t *msg)
 {
     int errorCode = -EINVAL;
 
-    if (queue && msg) {
+    if (queue && msg && (queue->type == W_MSG_QUEUE_TYPE_RING_SPSC)) {
         errorCode = -EAGAIN;
-        if (queue->mutex.try_lock()) {
-            if (!queue->containerList.empty()) {
-                *msg = queue->containerList.front();
-                queue->containerList.pop_front();
-                errorCode = 0;
-            }
-            queue->mutex.unlock();
+        // Only we write the head so relaxed is fine; acquire on the
+        // tail so that we see the contents of the slot the producer wrote
+        unsigned int head = queue->ringHead.load(std::memory_order_relaxed);
+        if (head != queue->ringTail.load(std::memory_order_acquire)) {
+            wMsgRingSlotHeader_t *slot = ringSlotGet(queue, head);
+            msg->type = slot->type;
+            msg->body = ((uint8_t *) slot) + W_MSG_RING_SLOT_BODY_OFFSET;
+            msg->bodySize = slot->bodySize;
+            errorCode = 0;
+        }
+    } else if (queue && msg) {
+        // Block on the mutex rather than try_lock(): it is only
+        // ever held for a push, a pop or a length check, and a lost
+        // try_lock() would end the drain with messages still queued
+        errorCode = -EAGAIN;
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        if (!queue->containerList.empty()) {
+            *msg = queue->containerList.front();
+            queue->containerList.pop_front();
+            errorCode = 0;
         }
     }
 
     return errorCode;
 }
 
+// Finish with a message returned by msgTryPop(): frees the body or,
+// for a W_MSG_QUEUE_TYPE_RING_SPSC queue, gives the slot back to the
+// producer.
+static void msgPopDone(wMsgQueue_t *queue, wMsgContainer_t *msg)
+{
+    if (queue->type == W_MSG_QUEUE_TYPE_RING_SPSC) {
+        unsigned int head = queue->ringHead.load(std::memory_order_relaxed);
+        // Release so that the producer only reuses the slot after
+        // we have finished with it
+        queue->ringHead.store((head + 1) % queue->ringSlotCount,
+                              std::memory_order_release);
+    } else {
+        free(msg->body);
+    }
+}
+
+// For a W_MSG_QUEUE_TYPE_RING_SPSC queue with overflow policy
+// W_MSG_QUEUE_OVERFLOW_LATEST_ONLY, given a message just returned by
+// msgTryPop(), drop it and any others behind it until msg is the
+// most recently pushed message.  This is done here, by the consumer,
+// since the producer cannot pop from the ring.
+static void ringSkipToLatest(wMsgQueue_t *queue, wMsgContainer_t *msg)
+{
+    while (ringLength(queue) > 1) {
+        msgDrop(queue, msg->type, msg->body);
+        msgPopDone(queue, msg);
+        msgTryPop(queue, msg);
+    }
+}
+
 // The message handler loop.
 //
 // Note: I tried a few ways of doing this:
@@ -246,37 +447,46 @@ static int msgTryPop(wMsgQueue_t *queue, wMsgContainer_t *msg)
 // - next would be to do a try_lock() and then loop with a sleep_for() as
 //   a kind of poll-interval if it fails, but that's clunky and sleep_for()
 //   also has a habit of returning spontaneously.
-// - experience with the GPIO stuff shows that running a timer that allows
-//   us to block on a file descriptor really does sleep, so FD and poll
-//   interval it is.
+// - experience with the GPIO stuff shows that blocking on a file
+//   descriptor really does sleep; originally this was a shared 1 ms
+//   timer but that woke every queue thread 1000 times a second, whether
+//   there was anything to do or not, and added up to 1 ms of latency
+//   per hop, so now each queue has an eventfd which wMsgPush() signals.
+//   Any message pushed after the eventfd has been read will signal it
+//   again, hence nothing can be missed by draining the queue in a batch
+//   each time we are woken; the queue is drained on a guard timeout
+//   too, belt and braces, in case a signal was lost.
 static void msgLoop(wMsgQueue_t *queue)
 {
     wMsgContainer_t msg;
 
-    if ((gTimerFd >= 0) && queue) {
+    if (gInitialised && queue) {
 
         W_LOG_DEBUG("%s: message loop has started.", queue->name);
 
         while (queue->keepGoing && gKeepGoing && wUtilKeepGoing()) {
-            // Block waiting for the messaging timer to go off for up to
-            // a time, or for CTRL-C to land
-            int numExpiries = wUtilBlockTimer(gTimerFd);
-            for (int x = 0; x < numExpiries; x++) {
-                // Pop all the messages waiting for us
-                while (msgTryPop(queue, &msg) == 0) {
-                    // Find the message handler for this message type
-                    wMsgHandler_t *handler = handlerGet(queue, msg.type);
-                    if (handler && (handler->function)) {
-                        // Call the handler
-                        handler->function(msg.body, msg.bodySize, queue->context);
-                        queue->count++;
-                    } else {
-                        W_LOG_ERROR("%s: unhandled message type (%d)",
-                                    queue->name, msg.type);
-                    }
-                    // Free the message body now that we're done
-                    free(msg.body);
+            // Block waiting for a message to be pushed, for up to
+            // a guard time, or for CTRL-C to land, then drain the
+            // queue whichever it was
+            wUtilBlockTimer(queue->eventFd);
+            // Pop all the messages waiting for us
+            while (queue->keepGoing && (msgTryPop(queue, &msg) == 0)) {
+                if ((queue->type == W_MSG_QUEUE_TYPE_RING_SPSC) &&
+                    (queue->overflow == W_MSG_QUEUE_OVERFLOW_LATEST_ONLY)) {
+                    ringSkipToLatest(queue, &msg);
                 }
+                // Find the message handler for this message type
+                wMsgHandler_t *handler = handlerGet(queue, msg.type);
+                if (handler && (handler->function)) {
+                    // Call the handler
+                    handler->function(msg.body, msg.bodySize, queue->context);
+                    queue->count++;
+                } else {
+                    W_LOG_ERROR("%s: unhandled message type (%d)",
+                                queue->name, msg.type);
+                }
+                // Free the message body now that we're done
+                msgPopDone(queue, &msg);
             }
         }
     }
@@ -293,45 +503,25 @@ int wMsgInit()
 {
     int errorCode = 0;
 
-    if (gTimerFd < 0) {
-        // Set up a tick to drive msgLoop()
-        // Note: can't use the utility function here as we
-        // use a single timer with multiple threads
-        errorCode = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-        if (errorCode >= 0) {
-            struct itimerspec timerSpec = {};
-            timerSpec.it_value.tv_sec = W_MSG_QUEUE_TICK_TIMER_PERIOD_MS / 1000;
-            timerSpec.it_value.tv_nsec = (W_MSG_QUEUE_TICK_TIMER_PERIOD_MS % 1000) * 1000000;
-            timerSpec.it_interval = timerSpec.it_value;
-            if (timerfd_settime(errorCode, 0, &timerSpec, nullptr) == 0) {
-                gTimerFd = errorCode;
-                errorCode = 0;
-                // Allow messaging loops to run
-                gKeepGoing = true;
-            } else {
-                // Tidy up the timer we started on error
-                close(errorCode);
-                errorCode = -errno;
-                W_LOG_ERROR("unable to set messaging tick-timer, error code %d.",
-                            errorCode);
-            }
-        } else {
-            errorCode = -errno;
-            W_LOG_ERROR("unable to create messaging tick-timer, error code %d.",
-                        errorCode);
-        }
+    if (!gInitialised) {
+        // Nothing much to do here since each queue has its own
+        // event file descriptor, created by wMsgQueueStart()
+        gInitialised = true;
+        // Allow messaging loops to run
+        gKeepGoing = true;
     }
 
     return errorCode;
 }
 
 // Start a message queue/thread.
-int wMsgQueueStart(void *context, unsigned int sizeMax, const char *name)
+int wMsgQueueStart(void *context, unsigned int sizeMax, const char *name,
+                   wMsgQueueType_t type, unsigned int bodySizeMax)
 {
     int idOrErrorCode = -EBADF;
     wMsgQueue_t *queue = nullptr;
 
-    if (gTimerFd >= 0) {
+    if (gInitialised) {
         // Create the new queue entry
         idOrErrorCode = 0;
         try {
@@ -347,6 +537,45 @@ int wMsgQueueStart(void *context, unsigned int sizeMax, const char *name)
             queue->name = name;
             queue->context = context;
             queue->sizeMax = sizeMax;
+            queue->overflow = W_MSG_QUEUE_OVERFLOW_REJECT;
+            queue->dropCount = 0;
+            queue->lengthMax = 0;
+            queue->count = 0;
+            queue->previousSize = 0;
+            queue->type = type;
+            queue->ring = nullptr;
+            queue->ringSlotCount = 0;
+            queue->ringSlotSize = 0;
+            queue->bodySizeMax = 0;
+            queue->ringHead = 0;
+            queue->ringTail = 0;
+            // The event file descriptor that wakes msgLoop(); non-blocking
+            // since wUtilBlockTimer() will poll it before reading it
+            queue->eventFd = eventfd(0, EFD_NONBLOCK);
+            if (queue->eventFd < 0) {
+                idOrErrorCode = -errno;
+                W_LOG_ERROR("unable to create event for message queue, error code %d.",
+                            idOrErrorCode);
+            }
+            if ((idOrErrorCode == 0) && (type == W_MSG_QUEUE_TYPE_RING_SPSC)) {
+                // Preallocate all of the slots, plus one so that
+                // a full ring can be distinguished from an empty one
+                queue->ringSlotCount = sizeMax + 1;
+                queue->ringSlotSize = W_MSG_ALIGN(W_MSG_RING_SLOT_BODY_OFFSET + bodySizeMax);
+                queue->bodySizeMax = queue->ringSlotSize - W_MSG_RING_SLOT_BODY_OFFSET;
+                queue->ring = (uint8_t *) malloc(queue->ringSlotCount * queue->ringSlotSize);
+                if (!queue->ring) {
+                    idOrErrorCode = -ENOMEM;
+                    W_LOG_ERROR("unable to allocate %d byte(s) for message ring.",
+                                queue->ringSlotCount * queue->ringSlotSize);
+                }
+            }
+        }
+        if (queue && (idOrErrorCode < 0)) {
+            queueFree(queue);
+            queue = nullptr;
+        }
+        if (queue) {
             gQueueId++;
             idOrErrorCode = queue->id;
             try {
@@ -361,7 +590,7 @@ int wMsgQueueStart(void *context, unsigned int sizeMax, const char *name)
                 }
             }
             catch (int x) {
-                delete queue;
+                queueFree(queue);
                 idOrErrorCode = -x;
                 W_LOG_ERROR("unable to start or set priority of message thread,"
                             " error code %d.", idOrErrorCode);
@@ -370,6 +599,7 @@ int wMsgQueueStart(void *context, unsigned int sizeMax, const char *name)
                 try {
                     // Best effort, add the name so that it is displayed when debugging
                     pthread_setname_np(queue->thread.native_handle(), queue->name);
+                    wUtilThreadPlacementSet(queue->thread.native_handle(), queue->name);
                     // Push the message queue onto the list (this will go bang on failure)
                     gQueueList.push_back(queue);
                 }
@@ -379,7 +609,7 @@ int wMsgQueueStart(void *context, unsigned int sizeMax, const char *name)
                     if (queue->thread.joinable()) {
                         queue->thread.join();
                     }
-                    delete queue;
+                    queueFree(queue);
                     idOrErrorCode = -x;
                     W_LOG_ERROR("unable to add queue to list, error code %d.",
                                 idOrErrorCode);
@@ -399,7 +629,7 @@ int wMsgQueueHandlerAdd(unsigned int queueId, unsigned int msgType,
     int errorCode = -EBADF;
     wMsgHandler_t *handler = nullptr;
 
-    if (gTimerFd >= 0) {
+    if (gInitialised) {
         // Find the queue
         errorCode = -EINVAL;
         wMsgQueue_t *queue = queueGet(queueId);
@@ -440,7 +670,7 @@ int wMsgQueueHandlerAdd(unsigned int queueId, unsigned int msgType,
 // Stop a message queue/thread.
 void wMsgQueueStop(unsigned int queueId)
 {
-    if (gTimerFd >= 0) {
+    if (gInitialised) {
         wMsgQueue_t *queue = queueGet(queueId);
         queueStop(queue);
     }
@@ -448,17 +678,29 @@ void wMsgQueueStop(unsigned int queueId)
 
 // Push a message onto a queue.  body is copied so it can be passed
 // in any which way (and it is up to the caller of msgTryPop()
-// to free the copied message body).
+// to call msgPopDone() to free the copied message body).
 int wMsgPush(unsigned int queueId, unsigned int msgType,
              void *body, unsigned int bodySize)
 {
     int queueLengthOrErrorCode = -EBADF;
 
-    if (gTimerFd >= 0) {
+    if (gInitialised) {
         // Find the queue
         queueLengthOrErrorCode = -EINVAL;
         wMsgQueue_t *queue = queueGet(queueId);
-        if (queue && queue->keepGoing) {
+        if (queue && queue->keepGoing && (queue->type == W_MSG_QUEUE_TYPE_RING_SPSC)) {
+            // No allocation and no mutex: the body is copied into a slot
+            queueLengthOrErrorCode = ringPush(queue, msgType, body, bodySize);
+            if (queueLengthOrErrorCode >= 0) {
+                lengthMaxUpdate(queue, queueLengthOrErrorCode);
+                queueSignal(queue);
+            } else {
+                W_LOG_ERROR("unable to push message type %d, body length %d,"
+                            " to %s message ring (%d)!",
+                            msgType, bodySize, queue->name,
+                            queueLengthOrErrorCode);
+            }
+        } else if (queue && queue->keepGoing) {
             queueLengthOrErrorCode = 0;
             void *bodyCopy = nullptr;
             if (bodySize > 0) {
@@ -469,6 +711,10 @@ int wMsgPush(unsigned int queueId, unsigned int msgType,
                     memcpy(bodyCopy, body, bodySize);
                 }
             }
+            // Messages dropped as a result of the overflow policy,
+            // dealt with once the mutex is released
+            std::list<wMsgContainer_t> droppedList;
+            bool dropNewest = false;
             if (queueLengthOrErrorCode == 0) {
                 wMsgContainer_t container = {.type = msgType,
                                              .body = bodyCopy,
@@ -476,6 +722,16 @@ int wMsgPush(unsigned int queueId, unsigned int msgType,
                 queue->mutex.lock();
                 queueLengthOrErrorCode = -ENOBUFS;
                 unsigned int queueLength = queue->containerList.size();
+                if (queue->overflow == W_MSG_QUEUE_OVERFLOW_LATEST_ONLY) {
+                    // splice() moves the list nodes, no allocation
+                    droppedList.splice(droppedList.end(), queue->containerList);
+                    queueLength = 0;
+                } else if ((queueLength >= queue->sizeMax) && (queueLength > 0) &&
+                           (queue->overflow == W_MSG_QUEUE_OVERFLOW_DROP_OLDEST)) {
+                    droppedList.splice(droppedList.end(), queue->containerList,
+                                       queue->containerList.begin());
+                    queueLength--;
+                }
                 if (queueLength < queue->sizeMax) {
                     queueLengthOrErrorCode = queueLength + 1;
                     try {
@@ -484,11 +740,28 @@ int wMsgPush(unsigned int queueId, unsigned int msgType,
                     catch (int x) {
                         queueLengthOrErrorCode = -x;
                     }
+                } else if (queue->overflow != W_MSG_QUEUE_OVERFLOW_REJECT) {
+                    dropNewest = true;
+                    queueLengthOrErrorCode = queueLength;
                 }
                 queue->mutex.unlock();
             }
 
-            if (queueLengthOrErrorCode < 0) {
+            for (auto &dropped: droppedList) {
+                msgDrop(queue, dropped.type, dropped.body);
+                free(dropped.body);
+            }
+            if (dropNewest) {
+                msgDrop(queue, msgType, bodyCopy);
+                free(bodyCopy);
+                bodyCopy = nullptr;
+            }
+
+            if (queueLengthOrErrorCode >= 0) {
+                lengthMaxUpdate(queue, queueLengthOrErrorCode);
+                // Signal outside the lock so that msgLoop() can get it
+                queueSignal(queue);
+            } else {
                 if (bodyCopy) {
                     free(bodyCopy);
                 }
@@ -519,6 +792,89 @@ int64_t wMsgPushCountGet(unsigned int queueId)
     return countOrErrorCode;
 }
 
+// Set the overflow policy of a message queue.
+int wMsgQueueOverflowSet(unsigned int queueId,
+                         wMsgQueueOverflow_t overflow)
+{
+    int errorCode = -EINVAL;
+
+    // Find the queue
+    wMsgQueue_t *queue = queueGet(queueId);
+    if (queue && ((queue->type != W_MSG_QUEUE_TYPE_RING_SPSC) ||
+                  (overflow != W_MSG_QUEUE_OVERFLOW_DROP_OLDEST))) {
+        queue->overflow = overflow;
+        errorCode = 0;
+    }
+
+    return errorCode;
+}
+
+// Get the number of messages in a message queue.
+int wMsgQueueLengthGet(unsigned int queueId)
+{
+    int lengthOrErrorCode = -EINVAL;
+
+    // Find the queue
+    wMsgQueue_t *queue = queueGet(queueId);
+    if (queue) {
+        if (queue->type == W_MSG_QUEUE_TYPE_RING_SPSC) {
+            lengthOrErrorCode = (int) ringLength(queue);
+        } else {
+            queue->mutex.lock();
+            lengthOrErrorCode = (int) queue->containerList.size();
+            queue->mutex.unlock();
+        }
+    }
+
+    return lengthOrErrorCode;
+}
+
+// Get the high-water mark of the length of a message queue.
+int wMsgQueueLengthMaxGet(unsigned int queueId, bool reset)
+{
+    int lengthMaxOrErrorCode = -EINVAL;
+
+    // Find the queue
+    wMsgQueue_t *queue = queueGet(queueId);
+    if (queue) {
+        if (reset) {
+            lengthMaxOrErrorCode = (int) queue->lengthMax.exchange(0);
+        } else {
+            lengthMaxOrErrorCode = (int) queue->lengthMax;
+        }
+    }
+
+    return lengthMaxOrErrorCode;
+}
+
+// Get the name of a message queue.
+const char *wMsgQueueNameGet(unsigned int queueId)
+{
+    const char *name = nullptr;
+
+    // Find the queue
+    wMsgQueue_t *queue = queueGet(queueId);
+    if (queue) {
+        name = queue->name;
+    }
+
+    return name;
+}
+
+// Get the number of messages dropped from a message queue.
+int64_t wMsgQueueDropCountGet(unsigned int queueId)
+{
+    int64_t countOrErrorCode = -EINVAL;
+
+    // Find the queue
+    wMsgQueue_t *queue = queueGet(queueId);
+    if (queue) {
+        countOrErrorCode = (int64_t) queue->dropCount;
+    }
+
+    return countOrErrorCode;
+}
+
 // Get the previousSize record for the given message queue, used
 // by the caller for debugging queue build-ups.
 int wMsgQueuePreviousSizeGet(unsigned int queueId)
@@ -549,7 +905,7 @@ void wMsgQueuePreviousSizeSet(unsigned int queueId,
 // Deinitialise messaging.
 void wMsgDeinit()
 {
-    if (gTimerFd >= 0) {
+    if (gInitialised) {
         // Close all of the message queues and their threads
         gKeepGoing = false;
         while (!gQueueList.empty()) {
@@ -565,11 +921,9 @@ void wMsgDeinit()
                 delete handler;
             }
             // Free the previously new()ed queue
-            delete queue;
+            queueFree(queue);
         }
-        // Stop the timer
-        close(gTimerFd);
-        gTimerFd = -1;
+        gInitialised = false;
     }
 }
 
@@ -27,8 +27,8 @@
  * -------------------------------------------------------------- */
 
 #ifndef W_MSG_QUEUE_TRY_LOCK_WAIT
-/** How long to wait for a mutex lock when pulling a message off a
- * a queue (see also W_MSG_QUEUE_TICK_TIMER_PERIOD below).  This
+/** How long to wait for a mutex lock when clearing the messages
+ * off a queue (see also W_MSG_QUEUE_TICK_TIMER_PERIOD below).  This
  * should be relatively long, we only need the timeout to go
  * check if the loop should exit.
  */
@@ -37,7 +37,8 @@
 
 #ifndef W_MSG_QUEUE_TICK_TIMER_PERIOD_MS
 /** The interval between polls for a lock on the mutex of a queue
- * in milliseconds.
+ * when clearing it, in milliseconds.  Note that the message loops
+ * do not poll: each queue has an event which wMsgPush() signals.
  */
 # define W_MSG_QUEUE_TICK_TIMER_PERIOD_MS 1
 #endif
@@ -48,10 +49,60 @@
 # define W_MSG_QUEUE_MAX_SIZE 100
 #endif
 
+#ifndef W_MSG_QUEUE_RING_BODY_SIZE_MAX
+/** The default maximum size of a message body that can be pushed
+ * to a queue of type W_MSG_QUEUE_TYPE_RING_SPSC; each slot of
+ * the ring has room for this many bytes of body.
+ */
+# define W_MSG_QUEUE_RING_BODY_SIZE_MAX 64
+#endif
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
 
+/** The types of message queue.
+ */
+typedef enum {
+    W_MSG_QUEUE_TYPE_LIST, /**< a mutex-protected list, messages bodies
+                                are malloc()ed on push; any number of
+                                threads may push to the queue. */
+    W_MSG_QUEUE_TYPE_RING_SPSC /**< a preallocated ring of fixed-size slots
+                                    with the message bodies stored inline;
+                                    pushing and popping involve neither a
+                                    heap allocation nor a mutex but ONLY
+                                    ONE thread may push to the queue. */
+} wMsgQueueType_t;
+
+/** What wMsgPush() should do when a queue is full, see
+ * wMsgQueueOverflowSet().  When a message is dropped its free
+ * function (see wMsgQueueHandlerAdd()) is called, so anything
+ * referenced by the message body is released, and wMsgPush()
+ * returns success: the caller does not need to do anything
+ * different.
+ */
+typedef enum {
+    W_MSG_QUEUE_OVERFLOW_REJECT, /**< the default: wMsgPush() returns
+                                      -ENOBUFS, the caller retains
+                                      ownership of anything referenced
+                                      by the message body. */
+    W_MSG_QUEUE_OVERFLOW_DROP_NEWEST, /**< the message being pushed is
+                                           dropped. */
+    W_MSG_QUEUE_OVERFLOW_DROP_OLDEST, /**< the message at the front of
+                                           the queue is dropped to make
+                                           room; not supported for a queue
+                                           of type W_MSG_QUEUE_TYPE_RING_SPSC,
+                                           since only the consumer may pop
+                                           from such a queue. */
+    W_MSG_QUEUE_OVERFLOW_LATEST_ONLY /**< only the most recently pushed
+                                          message is kept; for a queue of
+                                          type W_MSG_QUEUE_TYPE_RING_SPSC
+                                          the older messages are dropped
+                                          by the consumer, hence if such
+                                          a queue is full the message being
+                                          pushed is dropped. */
+} wMsgQueueOverflow_t;
+
 /** Function signature of a message handler function.
  *
  * @param body     a pointer to the message body, which will be
@@ -97,13 +148,21 @@ int wMsgInit();
  *                may be nullptr; should be no more than the number
  *                of characters that pthread_setname_np() allows,
  *                e.g. 16.
+ * @param type    the type of queue; if W_MSG_QUEUE_TYPE_RING_SPSC
+ *                is chosen then only one thread may ever call
+ *                wMsgPush() for this queue.
+ * @param bodySizeMax the maximum size of message body that may be
+ *                pushed; only used if type is
+ *                W_MSG_QUEUE_TYPE_RING_SPSC.
  * @return        a unique ID for the message queue, which can
  *                be used with the other functions in this API,
  *                else negative error code.
  */
 int wMsgQueueStart(void *context = nullptr,
                    unsigned int sizeMax = W_MSG_QUEUE_MAX_SIZE,
-                   const char *name = nullptr);
+                   const char *name = nullptr,
+                   wMsgQueueType_t type = W_MSG_QUEUE_TYPE_LIST,
+                   unsigned int bodySizeMax = W_MSG_QUEUE_RING_BODY_SIZE_MAX);
 
 /** Add a message handler to a queue.  This should only be called
 * before wMsgPush() is called on the given queue, it should not be
@@ -126,6 +185,17 @@ int wMsgQueueHandlerAdd(unsigned int queueId, unsigned int msgType,
                         wMsgHandlerFunction_t *function,
                         wMsgHandlerFunctionFree_t *functionFree = nullptr);
 
+/** Set what happens when a message is pushed to a queue which is
+ * full.  Should be called before wMsgPush() is called on the given
+ * queue.
+ *
+ * @param queueId   the ID of the queue.
+ * @param overflow  the overflow policy.
+ * @return          zero on success, else negative error code.
+ */
+int wMsgQueueOverflowSet(unsigned int queueId,
+                         wMsgQueueOverflow_t overflow);
+
 /** Stop a message queue/thread.  Once a message queue has been free'd
  * it cannot be used again.  You do not _have_ to call this function,
  * wMsgDeinit() will perform a full clean-up.
@@ -144,7 +214,11 @@ void wMsgQueueStop(unsigned int queueId);
  *                    if msgType has no body.  The body is copied
  *                    and hence may be assembled on the stack.
  * @param bodySize    the size of body; must be 0 if body is nullptr.
- * @return            zero on success else negative error code.
+ *                    For a queue of type W_MSG_QUEUE_TYPE_RING_SPSC
+ *                    this must be no larger than the bodySizeMax given
+ *                    to wMsgQueueStart().
+ * @return            the number of messages in the queue, including
+ *                    this one, on success else negative error code.
  */
 int wMsgPush(unsigned int queueId, unsigned int msgType,
              void *body, unsigned int bodySize);
@@ -153,6 +227,43 @@ int wMsgPush(unsigned int queueId, unsigned int msgType,
  */
 int64_t wMsgPushCountGet(unsigned int queueId);
 
+/** Get the number of messages currently in a message queue.
+ *
+ * @param queueId the ID of the queue.
+ * @return        the number of messages in the queue, else
+ *                negative error code.
+ */
+int wMsgQueueLengthGet(unsigned int queueId);
+
+/** Get the largest number of messages there have been in a
+ * message queue, as seen on a push, since the queue was started
+ * or since the high-water mark was last reset.
+ *
+ * @param queueId the ID of the queue.
+ * @param reset   if true the high-water mark is reset to zero
+ *                once it has been read.
+ * @return        the high-water mark, else negative error code.
+ */
+int wMsgQueueLengthMaxGet(unsigned int queueId, bool reset = false);
+
+/** Get the name of a message queue, as passed to wMsgQueueStart().
+ *
+ * @param queueId the ID of the queue.
+ * @return        the name of the queue; nullptr if the queue
+ *                cannot be found or it has no name.
+ */
+const char *wMsgQueueNameGet(unsigned int queueId);
+
+/** Get the number of messages that have been dropped from, or not
+ * pushed to, a message queue as a result of its overflow policy
+ * (see wMsgQueueOverflowSet()).
+ *
+ * @param queueId the ID of the queue.
+ * @return        the number of messages dropped, else negative
+ *                error code.
+ */
+int64_t wMsgQueueDropCountGet(unsigned int queueId);
+
 /** Set the previousSize record for the given message queue, may
  * be useful for debugging queue build-ups.
  *
@@ -0,0 +1,593 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief The implementation of the event recording API for the
+ * watchdog application.
+ *
+ * This code makes use of FFmpeg, hence must be linked with
+ * the FFmpeg libraries libavformat, libavcodec and libavutil.
+ */
+
+// The CPP stuff.
+#include <cstdio>
+#include <cassert>
+#include <string>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// The Linux/Posix stuff.
+#include <time.h>
+
+extern "C" {
+// The FFMPEG stuff, in good 'ole C.
+# include <libavformat/avformat.h>
+# include <libavcodec/avcodec.h>
+}
+
+// Other parts of watchdog.
+#include <w_common.h>
+#include <w_util.h>
+#include <w_log.h>
+#include <w_msg.h>
+
+// Us.
+#include <w_record.h>
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// How long wRecordStop() waits for the packets already queued to be
+// written before giving up on them.
+#define W_RECORD_STOP_DRAIN_TIMEOUT_MS 5000
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** The state of event recording on the video encode thread, where
+ * the pre-roll ring is maintained and events are started and ended.
+ */
+typedef struct {
+    std::deque<AVPacket *> ring; // Oldest first, always beginning with a key frame
+    size_t ringBytes;
+    bool recording;
+    bool dropUntilKeyFrame; // True if the queue overflowed during this event
+    std::chrono::steady_clock::time_point eventStart;
+    uint64_t eventCount;
+    uint64_t dropCount; // Packets that didn't make it into a recording
+} wRecordEncodeState_t;
+
+/** The state of event recording on its own message queue thread,
+ * where the files are written.
+ */
+typedef struct {
+    AVFormatContext *formatContext; // Non-null while a file is open
+    AVStream *stream;
+    std::string path; // Of the file being written
+    int64_t timestampOffset; // Subtracted from every timestamp so that a file begins at zero
+    bool timestampOffsetSet;
+    int64_t packetCount;
+} wRecordWriteState_t;
+
+/** Context for event recording.
+ */
+typedef struct {
+    std::string outputDirectory;
+    std::string outputFileName;
+    AVCodecParameters *codecParameters; // Nullptr until wRecordStreamSet()
+    AVRational timeBase;
+    wRecordEncodeState_t encode;
+    wRecordWriteState_t write;
+} wRecordContext_t;
+
+/** Event recording message types.
+ */
+typedef enum {
+    W_RECORD_MSG_TYPE_EVENT_START, // wRecordMsgBodyTimeUnix_t
+    W_RECORD_MSG_TYPE_PACKET, // wRecordMsgBodyPacket_t
+    W_RECORD_MSG_TYPE_EVENT_END // No body
+} wRecordMsgType_t;
+
+/** The message body for W_RECORD_MSG_TYPE_EVENT_START: the wall-clock
+ * time of the start of the event, used to name the file.
+ */
+typedef time_t wRecordMsgBodyTimeUnix_t;
+
+/** The message body for W_RECORD_MSG_TYPE_PACKET: a reference to an
+ * encoded packet, owned by the message.
+ */
+typedef AVPacket *wRecordMsgBodyPacket_t;
+
+/** Union of message bodies; if you add a member here you must add
+ * a type for it in wRecordMsgType_t.
+ */
+typedef union {
+    wRecordMsgBodyTimeUnix_t timeUnix; // W_RECORD_MSG_TYPE_EVENT_START
+    wRecordMsgBodyPacket_t packet;     // W_RECORD_MSG_TYPE_PACKET
+} wRecordMsgBody_t;
+
+/** A structure containing the message handling/freeing function
+ * and the message type they handle, for use in gMsgHandler[].
+ */
+typedef struct {
+    wRecordMsgType_t msgType;
+    wMsgHandlerFunction_t *function;
+    wMsgHandlerFunctionFree_t *functionFree;
+} wRecordMsgHandler_t;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// NOTE: there are more messaging-related variables below
+// the definition of the message handling functions.
+
+// The ID of the event recording message queue.
+static int gMsgQueueId = -1;
+
+// Context for event recording.
+static wRecordContext_t *gContext = nullptr;
+
+// The time of the last motion large enough to matter, as a count
+// of steady_clock ticks, zero if there has been none; written by the
+// image processing thread, read by the video encode thread.
+static std::atomic<int64_t> gActivityTicks(0);
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: THE FILE, ON THE MESSAGE QUEUE THREAD
+ * -------------------------------------------------------------- */
+
+// Finish the file being written, if there is one: it is written
+// with a .tmp extension and renamed once complete, so that anything
+// looking for recordings never finds half of one.
+static void fileClose(wRecordContext_t *context)
+{
+    wRecordWriteState_t *write = &(context->write);
+
+    if (write->formatContext) {
+        bool success = (av_write_trailer(write->formatContext) == 0);
+        if (avio_closep(&(write->formatContext->pb)) != 0) {
+            success = false;
+        }
+        avformat_free_context(write->formatContext);
+        write->formatContext = nullptr;
+        write->stream = nullptr;
+        std::string pathTemporary = write->path + ".tmp";
+        if (success && (write->packetCount > 0) &&
+            (rename(pathTemporary.c_str(), write->path.c_str()) == 0)) {
+            W_LOG_INFO("event recording \"%s\" written, %lld frame(s).",
+                       write->path.c_str(), (long long) write->packetCount);
+        } else {
+            remove(pathTemporary.c_str());
+            W_LOG_ERROR("unable to complete event recording \"%s\"!",
+                        write->path.c_str());
+        }
+    }
+}
+
+// Begin a new file, named after the local time at timeUnix.
+static int fileOpen(wRecordContext_t *context, time_t timeUnix)
+{
+    int errorCode = -EBADF;
+    wRecordWriteState_t *write = &(context->write);
+    struct tm tmLocal;
+    char buffer[32];
+
+    fileClose(context);
+
+    if (context->codecParameters) {
+        errorCode = -ENOMEM;
+        localtime_r(&timeUnix, &tmLocal);
+        strftime(buffer, sizeof(buffer), "_%Y%m%d_%H%M%S", &tmLocal);
+        write->path = context->outputDirectory + std::string(W_UTIL_DIR_SEPARATOR) +
+                      context->outputFileName + std::string(buffer) +
+                      std::string(W_RECORD_FILE_EXTENSION);
+        std::string pathTemporary = write->path + ".tmp";
+        write->timestampOffset = 0;
+        write->timestampOffsetSet = false;
+        write->packetCount = 0;
+        // The format is given explicitly since the extension is .tmp
+        avformat_alloc_output_context2(&(write->formatContext), nullptr, "mp4",
+                                       pathTemporary.c_str());
+        if (write->formatContext) {
+            write->stream = avformat_new_stream(write->formatContext, nullptr);
+        }
+        if (write->stream &&
+            (avcodec_parameters_copy(write->stream->codecpar,
+                                     context->codecParameters) >= 0)) {
+            errorCode = -EIO;
+            // A hint, the muxer will choose its own
+            write->stream->time_base = context->timeBase;
+            if ((avio_open(&(write->formatContext->pb), pathTemporary.c_str(),
+                           AVIO_FLAG_WRITE) >= 0) &&
+                (avformat_write_header(write->formatContext, nullptr) >= 0)) {
+                errorCode = 0;
+            }
+        }
+        if (errorCode != 0) {
+            W_LOG_ERROR("unable to open event recording \"%s\" (%d)!",
+                        pathTemporary.c_str(), errorCode);
+            if (write->formatContext) {
+                avio_closep(&(write->formatContext->pb));
+                avformat_free_context(write->formatContext);
+                write->formatContext = nullptr;
+                write->stream = nullptr;
+            }
+            remove(pathTemporary.c_str());
+        }
+    }
+
+    return errorCode;
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MESSAGE HANDLERS
+ * -------------------------------------------------------------- */
+
+// Message handler for W_RECORD_MSG_TYPE_EVENT_START.
+static void msgHandlerRecordEventStart(void *msgBody, unsigned int bodySize,
+                                       void *context)
+{
+    wRecordMsgBodyTimeUnix_t *msg = &(((wRecordMsgBody_t *) msgBody)->timeUnix);
+
+    assert(bodySize == sizeof(*msg));
+
+    fileOpen((wRecordContext_t *) context, *msg);
+}
+
+// Message handler for W_RECORD_MSG_TYPE_PACKET.
+static void msgHandlerRecordPacket(void *msgBody, unsigned int bodySize,
+                                   void *context)
+{
+    wRecordMsgBodyPacket_t *msg = &(((wRecordMsgBody_t *) msgBody)->packet);
+    wRecordWriteState_t *write = &(((wRecordContext_t *) context)->write);
+    AVPacket *packet = *msg;
+
+    assert(bodySize == sizeof(*msg));
+
+    if (write->formatContext) {
+        // Start the file at zero: the timestamps are the camera
+        // sequence numbers
+        if (!write->timestampOffsetSet) {
+            write->timestampOffset = (packet->dts != AV_NOPTS_VALUE) ? packet->dts : packet->pts;
+            write->timestampOffsetSet = true;
+        }
+        if (packet->pts != AV_NOPTS_VALUE) {
+            packet->pts -= write->timestampOffset;
+        }
+        if (packet->dts != AV_NOPTS_VALUE) {
+            packet->dts -= write->timestampOffset;
+        }
+        av_packet_rescale_ts(packet, ((wRecordContext_t *) context)->timeBase,
+                             write->stream->time_base);
+        packet->stream_index = write->stream->index;
+        // This takes the reference
+        if (av_interleaved_write_frame(write->formatContext, packet) == 0) {
+            write->packetCount++;
+        }
+    }
+
+    av_packet_free(msg);
+}
+
+// Message handler free() function for W_RECORD_MSG_TYPE_PACKET.
+static void msgHandlerRecordPacketFree(void *msgBody, void *context)
+{
+    wRecordMsgBodyPacket_t *msg = &(((wRecordMsgBody_t *) msgBody)->packet);
+
+    // This handler doesn't use any context
+    (void) context;
+
+    av_packet_free(msg);
+}
+
+// Message handler for W_RECORD_MSG_TYPE_EVENT_END.
+static void msgHandlerRecordEventEnd(void *msgBody, unsigned int bodySize,
+                                     void *context)
+{
+    (void) msgBody;
+    (void) bodySize;
+
+    fileClose((wRecordContext_t *) context);
+}
+
+/* ----------------------------------------------------------------
+ * MORE VARIABLES: THE MESSAGES WITH THEIR MESSAGE HANDLERS
+ * -------------------------------------------------------------- */
+
+// Array of message handlers with the message type they handle.
+static wRecordMsgHandler_t gMsgHandler[] = {{.msgType = W_RECORD_MSG_TYPE_EVENT_START,
+                                             .function = msgHandlerRecordEventStart,
+                                             .functionFree = nullptr},
+                                            {.msgType = W_RECORD_MSG_TYPE_PACKET,
+                                             .function = msgHandlerRecordPacket,
+                                             .functionFree = msgHandlerRecordPacketFree},
+                                            {.msgType = W_RECORD_MSG_TYPE_EVENT_END,
+                                             .function = msgHandlerRecordEventEnd,
+                                             .functionFree = nullptr}};
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: THE RING, ON THE VIDEO ENCODE THREAD
+ * -------------------------------------------------------------- */
+
+// Return the index of the first key frame in the ring after the
+// first packet, or the size of the ring if there is none.
+static size_t ringNextKeyFrame(const wRecordEncodeState_t *encode)
+{
+    size_t x = 1;
+
+    while ((x < encode->ring.size()) &&
+           !(encode->ring[x]->flags & AV_PKT_FLAG_KEY)) {
+        x++;
+    }
+
+    return x;
+}
+
+// Drop the oldest count packets from the ring.
+static void ringDrop(wRecordEncodeState_t *encode, size_t count)
+{
+    for (size_t x = 0; (x < count) && !encode->ring.empty(); x++) {
+        AVPacket *packet = encode->ring.front();
+        encode->ringBytes -= packet->size;
+        av_packet_free(&packet);
+        encode->ring.pop_front();
+    }
+}
+
+// Add a packet to the ring and then trim it: whole GOPs are dropped
+// from the front while what remains still covers the pre-roll, or
+// while the ring is too big.
+static void ringAdd(wRecordContext_t *context, const AVPacket *packet)
+{
+    wRecordEncodeState_t *encode = &(context->encode);
+    int64_t preRollTicks = av_rescale_q(W_RECORD_PRE_ROLL_SECONDS, {1, 1},
+                                        context->timeBase);
+
+    // The ring must begin with a key frame
+    if (!encode->ring.empty() || (packet->flags & AV_PKT_FLAG_KEY)) {
+        AVPacket *reference = av_packet_clone(packet);
+        if (reference) {
+            encode->ring.push_back(reference);
+            encode->ringBytes += reference->size;
+        }
+    }
+
+    bool trimmed = true;
+    while (trimmed && !encode->ring.empty()) {
+        trimmed = false;
+        size_t next = ringNextKeyFrame(encode);
+        if (next < encode->ring.size()) {
+            int64_t covered = encode->ring.back()->pts - encode->ring[next]->pts;
+            if ((covered >= preRollTicks) ||
+                (encode->ringBytes > W_RECORD_RING_MAX_BYTES)) {
+                ringDrop(encode, next);
+                trimmed = true;
+            }
+        }
+    }
+}
+
+// Send a packet to the message queue thread for the recording,
+// dropping packets up to the next key frame if the queue is full.
+static void eventPacketSend(wRecordEncodeState_t *encode, const AVPacket *packet)
+{
+    if (encode->dropUntilKeyFrame && (packet->flags & AV_PKT_FLAG_KEY)) {
+        encode->dropUntilKeyFrame = false;
+    }
+    if (!encode->dropUntilKeyFrame) {
+        AVPacket *reference = av_packet_clone(packet);
+        if (!reference ||
+            (wMsgPush(gMsgQueueId, W_RECORD_MSG_TYPE_PACKET,
+                      &reference, sizeof(reference)) < 0)) {
+            av_packet_free(&reference);
+            encode->dropUntilKeyFrame = true;
+            W_LOG_WARN("event recording cannot keep up, dropping video"
+                       " up to the next key frame.");
+        }
+    }
+    if (encode->dropUntilKeyFrame) {
+        encode->dropCount++;
+    }
+}
+
+// Start an event: begin a file and send it the pre-roll.
+static void eventStart(wRecordContext_t *context)
+{
+    wRecordEncodeState_t *encode = &(context->encode);
+    wRecordMsgBodyTimeUnix_t timeUnix = time(nullptr);
+
+    if (wMsgPush(gMsgQueueId, W_RECORD_MSG_TYPE_EVENT_START,
+                 &timeUnix, sizeof(timeUnix)) >= 0) {
+        encode->recording = true;
+        encode->dropUntilKeyFrame = false;
+        encode->eventStart = std::chrono::steady_clock::now();
+        encode->eventCount++;
+        W_LOG_DEBUG("event recording started, %d frame(s) of pre-roll.",
+                    (int) encode->ring.size());
+        // The ring keeps its own references, ready for the next event
+        for (auto packet: encode->ring) {
+            eventPacketSend(encode, packet);
+        }
+    }
+}
+
+// End an event.
+static void eventEnd(wRecordContext_t *context)
+{
+    wRecordEncodeState_t *encode = &(context->encode);
+
+    if (encode->recording) {
+        // If this fails the file is closed by wRecordStop() or the
+        // start of the next event
+        wMsgPush(gMsgQueueId, W_RECORD_MSG_TYPE_EVENT_END, nullptr, 0);
+        encode->recording = false;
+        W_LOG_DEBUG("event recording ended.");
+    }
+}
+
+// Free the context, closing any file that is still open.
+static void cleanUp()
+{
+    if (gMsgQueueId >= 0) {
+        wMsgQueueStop(gMsgQueueId);
+        gMsgQueueId = -1;
+    }
+
+    if (gContext) {
+        // The message queue thread is gone, safe to do this here
+        fileClose(gContext);
+        ringDrop(&(gContext->encode), gContext->encode.ring.size());
+        avcodec_parameters_free(&(gContext->codecParameters));
+        delete gContext;
+        gContext = nullptr;
+    }
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Start event recording.
+int wRecordStart(std::string outputDirectory, std::string outputFileName)
+{
+    int errorCode = 0;
+
+    if (!gContext) {
+        gContext = new wRecordContext_t();
+        gContext->outputDirectory = outputDirectory;
+        gContext->outputFileName = outputFileName;
+        gActivityTicks = 0;
+        // Only the video encode thread pushes to this queue, so it
+        // can be a single-producer ring
+        errorCode = wMsgQueueStart(gContext, W_RECORD_MSG_QUEUE_MAX_SIZE, "record",
+                                   W_MSG_QUEUE_TYPE_RING_SPSC, sizeof(wRecordMsgBody_t));
+        if (errorCode >= 0) {
+            gMsgQueueId = errorCode;
+            errorCode = 0;
+            // Register the message handlers
+            for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gMsgHandler)) &&
+                                     (errorCode == 0); x++) {
+                wRecordMsgHandler_t *handler = &(gMsgHandler[x]);
+                errorCode = wMsgQueueHandlerAdd(gMsgQueueId,
+                                                handler->msgType,
+                                                handler->function,
+                                                handler->functionFree);
+            }
+        }
+        if (errorCode == 0) {
+            W_LOG_INFO("event recording to %s, %d second(s) of pre-roll,"
+                       " %d second(s) of tail.", outputDirectory.c_str(),
+                       W_RECORD_PRE_ROLL_SECONDS, W_RECORD_TAIL_SECONDS);
+        } else {
+            cleanUp();
+        }
+    }
+
+    return errorCode;
+}
+
+// Determine whether event recording is started.
+bool wRecordIsStarted()
+{
+    return (gContext != nullptr);
+}
+
+// Tell event recording what the stream is.
+int wRecordStreamSet(const struct AVCodecContext *codecContext)
+{
+    int errorCode = -EBADF;
+
+    if (gContext) {
+        errorCode = -ENOMEM;
+        if (!gContext->codecParameters) {
+            gContext->codecParameters = avcodec_parameters_alloc();
+        }
+        if (gContext->codecParameters &&
+            (avcodec_parameters_from_context(gContext->codecParameters,
+                                             codecContext) >= 0)) {
+            gContext->timeBase = codecContext->time_base;
+            errorCode = 0;
+        }
+    }
+
+    return errorCode;
+}
+
+// Hand an encoded packet to event recording.
+void wRecordPacket(const struct AVPacket *packet)
+{
+    if (gContext && gContext->codecParameters && packet) {
+        wRecordEncodeState_t *encode = &(gContext->encode);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        int64_t activityTicks = gActivityTicks;
+        bool active = (activityTicks != 0) &&
+                      (now - std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(activityTicks)) <
+                       std::chrono::seconds(W_RECORD_TAIL_SECONDS));
+
+        if (encode->recording &&
+            (!active || (now - encode->eventStart >= std::chrono::seconds(W_RECORD_EVENT_MAX_SECONDS)))) {
+            // Motion has stopped for long enough, or this event is
+            // long enough: if there is still motion the next event
+            // begins straight away, its pre-roll overlapping the end
+            // of this one
+            eventEnd(gContext);
+        }
+        ringAdd(gContext, packet);
+        if (encode->recording) {
+            eventPacketSend(encode, packet);
+        } else if (active && !encode->ring.empty()) {
+            // The ring, which always begins with a key frame, includes
+            // this packet
+            eventStart(gContext);
+        }
+    }
+}
+
+// Report the amount of motion in a video frame.
+void wRecordActivity(int areaPixels)
+{
+    if (areaPixels >= W_RECORD_ACTIVITY_AREA_PIXELS_MIN) {
+        int64_t ticks = std::chrono::steady_clock::now().time_since_epoch().count();
+        // Zero means "never"
+        gActivityTicks = (ticks != 0) ? ticks : 1;
+    }
+}
+
+// Stop event recording.
+void wRecordStop()
+{
+    if (gContext) {
+        eventEnd(gContext);
+        // Give what is already queued a chance to get to disk
+        wUtilTimeoutStart_t start = wUtilTimeoutStart();
+        while ((gMsgQueueId >= 0) && (wMsgQueueLengthGet(gMsgQueueId) > 0) &&
+               !wUtilTimeoutExpired(start, std::chrono::milliseconds(W_RECORD_STOP_DRAIN_TIMEOUT_MS))) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        W_LOG_INFO("%llu event(s) recorded, %llu frame(s) dropped from"
+                   " event recordings.",
+                   (unsigned long long) gContext->encode.eventCount,
+                   (unsigned long long) gContext->encode.dropCount);
+        cleanUp();
+    }
+}
+
+// End of file
@@ -0,0 +1,159 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _W_RECORD_H_
+#define _W_RECORD_H_
+
+// This API is dependent on std::string and w_common.h (for
+// W_COMMON_WIDTH_PIXELS etc.); the FFmpeg types are only ever
+// passed by pointer, hence are simply declared here.
+#include <string>
+#include <w_common.h>
+
+struct AVCodecContext;
+struct AVPacket;
+
+/** @file
+ * @brief The event recording API for the watchdog application: the
+ * video encoder hands every encoded packet to this API, which keeps
+ * the last W_RECORD_PRE_ROLL_SECONDS of them in a ring (of references,
+ * the packet data is not copied); when image processing reports
+ * motion of at least W_RECORD_ACTIVITY_AREA_PIXELS_MIN, the ring and
+ * then the live packets are remuxed, no re-encode, into an MP4 file
+ * until there has been no such motion for W_RECORD_TAIL_SECONDS.
+ * The files are written by a message queue thread of this API, so
+ * the video encoder never waits for the disk.
+ *
+ * wRecordPacket() should only be called from the video encode
+ * thread; wRecordActivity() may be called from any thread.
+ */
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+#ifndef W_RECORD_FILE_EXTENSION
+/** Event recording file extension.
+ */
+# define W_RECORD_FILE_EXTENSION ".mp4"
+#endif
+
+#ifndef W_RECORD_PRE_ROLL_SECONDS
+/** The minimum amount of video before the motion that is included
+ * in an event recording; since a recording must begin with a key
+ * frame, up to a GOP (W_HLS_SEGMENT_DURATION_SECONDS) more may be
+ * included.
+ */
+# define W_RECORD_PRE_ROLL_SECONDS 5
+#endif
+
+#ifndef W_RECORD_TAIL_SECONDS
+/** How long after the last motion an event recording ends.
+ */
+# define W_RECORD_TAIL_SECONDS 10
+#endif
+
+#ifndef W_RECORD_EVENT_MAX_SECONDS
+/** The maximum length of an event recording: if motion continues
+ * beyond this a new recording is begun.
+ */
+# define W_RECORD_EVENT_MAX_SECONDS (10 * 60)
+#endif
+
+#ifndef W_RECORD_ACTIVITY_AREA_PIXELS_MIN
+/** The area of motion, in pixels, that starts, or keeps going, an
+ * event recording; 0.5% of the frame by default.
+ */
+# define W_RECORD_ACTIVITY_AREA_PIXELS_MIN ((W_COMMON_WIDTH_PIXELS * W_COMMON_HEIGHT_PIXELS) / 200)
+#endif
+
+#ifndef W_RECORD_RING_MAX_BYTES
+/** An upper limit on the amount of packet data held in the pre-roll
+ * ring, in case the bit rate is very much higher than expected;
+ * the pre-roll is shortened, a GOP at a time, to stay within it.
+ */
+# define W_RECORD_RING_MAX_BYTES (8 * 1024 * 1024)
+#endif
+
+#ifndef W_RECORD_MSG_QUEUE_MAX_SIZE
+/** The maximum number of packets waiting to be written to an event
+ * recording: enough for the whole pre-roll plus a few seconds of
+ * the disk being slow.  If it fills up, packets are dropped up to
+ * the next key frame.
+ */
+# define W_RECORD_MSG_QUEUE_MAX_SIZE ((W_RECORD_PRE_ROLL_SECONDS + 2 + 10) * W_COMMON_FRAME_RATE_HERTZ)
+#endif
+
+/* ----------------------------------------------------------------
+ * FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/** Start event recording; this must be called before the video
+ * encoder is initialised.  wMsgInit() must have returned successfully
+ * before this is called.  If event recording is already started this
+ * function will do nothing and return success.
+ *
+ * @param outputDirectory the directory to write the recordings to,
+ *                        which must exist; should not end in a "/".
+ * @param outputFileName  the start of the file name of a recording,
+ *                        to which the local date/time of the start
+ *                        of the recording and W_RECORD_FILE_EXTENSION
+ *                        are appended.
+ * @return                zero on success else negative error code.
+ */
+int wRecordStart(std::string outputDirectory, std::string outputFileName);
+
+/** Determine whether event recording is started.
+ *
+ * @return true if wRecordStart() has been called successfully.
+ */
+bool wRecordIsStarted();
+
+/** Tell event recording what the stream is; called by the video
+ * encoder once its codec is open, before the first call to
+ * wRecordPacket().
+ *
+ * @param codecContext the codec context of the video encoder; the
+ *                     codec parameters and time base are copied.
+ * @return             zero on success else negative error code.
+ */
+int wRecordStreamSet(const struct AVCodecContext *codecContext);
+
+/** Hand an encoded packet to event recording; called by the video
+ * encoder for every packet, before the packet is written to the
+ * HLS output.  The packet is not modified, a new reference is taken
+ * if it is needed.
+ *
+ * @param packet the packet, timestamps in the time base of the
+ *               codec context passed to wRecordStreamSet().
+ */
+void wRecordPacket(const struct AVPacket *packet);
+
+/** Report the amount of motion in a video frame; called by image
+ * processing for every frame on which motion detection is performed.
+ *
+ * @param areaPixels the area of motion, zero if there was none.
+ */
+void wRecordActivity(int areaPixels);
+
+/** Stop event recording, finishing the file of any event in progress;
+ * should be called after the video encoder has been deinitialised.
+ */
+void wRecordStop();
+
+#endif // _W_RECORD_H_
+
+// End of file
@@ -0,0 +1,965 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief A microbenchmark for the real-time core of the watchdog
+ * application, main().
+ *
+ * Three things are measured: the latency, from wMsgPush() to the
+ * message handler, and the throughput of messaging, for each type of
+ * queue across a range of queue sizes and body sizes; the wake-up
+ * jitter of wUtilBlockTimer() at each of the tick periods that the
+ * application uses; and the period error of the software PWM loop
+ * and of the LED loop.  Each is measured with the CPUs otherwise
+ * idle and then again with every CPU kept busy by a synthetic load,
+ * the results being printed as histograms.
+ *
+ * This is linked in place of w_gpio.cpp: it provides a mock
+ * implementation of the wGpio API which runs the software PWM loop
+ * of the real thing, at the same tick period and priority, but
+ * drives no pins, so that this can be run on any Linux machine.
+ * w_led.cpp, the real thing, is linked against it.  wStatsQueueAdd()
+ * is also provided here since w_stats.cpp needs the camera.
+ *
+ * Since the message queue and ticked threads are real-time, this
+ * needs to be run with sudo, just like the watchdog itself.
+ */
+
+// The CPP stuff.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>  // For std::sort()
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+// The Linux/Posix stuff.
+#include <unistd.h>
+#include <pthread.h>
+
+// The watchdog stuff.
+#include <w_common.h>
+#include <w_util.h>
+#include <w_log.h>
+#include <w_msg.h>
+#include <w_gpio.h>
+#include <w_led.h>
+#include <w_stats.h>
+#include <w_control.h>
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+#ifndef W_RT_BENCHMARK_DURATION_SECONDS_DEFAULT
+/** The default duration of each timer and GPIO measurement.
+ */
+# define W_RT_BENCHMARK_DURATION_SECONDS_DEFAULT 5
+#endif
+
+#ifndef W_RT_BENCHMARK_MSG_COUNT_DEFAULT
+/** The default number of messages to push for each messaging
+ * measurement.
+ */
+# define W_RT_BENCHMARK_MSG_COUNT_DEFAULT 10000
+#endif
+
+#ifndef W_RT_BENCHMARK_DRAIN_TIMEOUT_SECONDS
+/** How long to wait, once the last message has been pushed, for
+ * the handler to have been called for all of them.
+ */
+# define W_RT_BENCHMARK_DRAIN_TIMEOUT_SECONDS 10
+#endif
+
+#ifndef W_RT_BENCHMARK_SETTLE_MS
+/** How long to let the GPIO and LED loops run before measuring.
+ */
+# define W_RT_BENCHMARK_SETTLE_MS 200
+#endif
+
+#ifndef W_RT_BENCHMARK_LOAD_BUFFER_BYTES
+/** The amount of memory that each thread of the synthetic load
+ * runs over, enough to push the real-time threads out of the cache.
+ */
+# define W_RT_BENCHMARK_LOAD_BUFFER_BYTES (1024 * 1024)
+#endif
+
+#ifndef W_RT_BENCHMARK_HISTOGRAM_BAR_MAX
+/** The length of the bar of the largest bucket of a histogram.
+ */
+# define W_RT_BENCHMARK_HISTOGRAM_BAR_MAX 40
+#endif
+
+/** The message type used for messaging measurements.
+ */
+#define W_RT_BENCHMARK_MSG_TYPE 0
+
+/** The number of GPIO pins of the mock GPIO, those of the Pi.
+ */
+#define W_RT_BENCHMARK_GPIO_PIN_NUM 28
+
+/** The tests that may be run, a bit-map.
+ */
+#define W_RT_BENCHMARK_TEST_MSG   0x01
+#define W_RT_BENCHMARK_TEST_TIMER 0x02
+#define W_RT_BENCHMARK_TEST_GPIO  0x04
+#define W_RT_BENCHMARK_TEST_ALL   (W_RT_BENCHMARK_TEST_MSG |   \
+                                   W_RT_BENCHMARK_TEST_TIMER | \
+                                   W_RT_BENCHMARK_TEST_GPIO)
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** Whether the measurements are made with or without the synthetic
+ * CPU load, or both.
+ */
+typedef enum {
+    W_RT_BENCHMARK_LOAD_BOTH, // Without and then with the load
+    W_RT_BENCHMARK_LOAD_NONE,
+    W_RT_BENCHMARK_LOAD_CPU
+} wRtBenchmarkLoad_t;
+
+/** Parameters passed to the benchmark.
+ */
+typedef struct {
+    std::string programName;
+    unsigned int tests; // A bit-map of W_RT_BENCHMARK_TEST_xxx
+    wRtBenchmarkLoad_t load;
+    unsigned int durationSeconds;
+    unsigned int msgCount;
+} wRtBenchmarkParameters_t;
+
+/** The context of a message queue under measurement.
+ */
+typedef struct {
+    std::vector<int64_t> latencyNs; // Written only by the handler
+    std::atomic<unsigned int> handledCount;
+} wRtBenchmarkMsgContext_t;
+
+/** The result of a messaging measurement.
+ */
+typedef struct {
+    unsigned int count;
+    double seconds; // From the first push to the last message handled
+    uint64_t fullCount; // Times the pusher had to wait for room
+    std::vector<int64_t> latencyNs;
+} wRtBenchmarkMsgResult_t;
+
+/** The record of the ticks of a loop: the error of each period,
+ * from one tick to the next, against the period it should have
+ * been.  Samples are only recorded while record is true and only
+ * while there is reserved room for them, so that a real-time
+ * thread never allocates memory.
+ */
+typedef struct {
+    int64_t periodNs;
+    std::atomic<bool> record;
+    int64_t previousNs; // -1 until the first tick is recorded
+    uint64_t slipCount; // Expiries beyond the first at a wake-up
+    std::vector<int64_t> errorNs;
+} wRtBenchmarkTicks_t;
+
+/** A tick period as used by the application, to measure the
+ * wake-up jitter of: the name of the thread is that of the loop
+ * it stands in for, so that the thread is placed on the same CPUs.
+ */
+typedef struct {
+    int periodMs;
+    wCommonThreadPriority_t priority;
+    const char *name;
+    const char *description;
+} wRtBenchmarkTimerCfg_t;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// The parameters, as given on the command-line.
+static wRtBenchmarkParameters_t gParameters;
+
+// The queue sizes that messaging is measured with.
+static const unsigned int gMsgQueueSize[] = {10, W_MSG_QUEUE_MAX_SIZE, 1000};
+
+// The message body sizes that messaging is measured with; the
+// smallest must have room for a time-stamp.
+static const unsigned int gMsgBodySize[] = {sizeof(int64_t),
+                                            W_MSG_QUEUE_RING_BODY_SIZE_MAX,
+                                            1024};
+
+// The names of the queues, by wMsgQueueType_t; wMsgQueueStart()
+// does not copy the name.
+static const char *gMsgQueueName[] = {"bench list", "bench ring"};
+
+// The tick periods to measure the wake-up jitter of.
+static const wRtBenchmarkTimerCfg_t gTimerCfg[] = {{W_GPIO_PWM_TICK_TIMER_PERIOD_MS,
+                                                    W_COMMON_THREAD_PRIORITY_GPIO_PWM,
+                                                    "pwmLoop", "software PWM"},
+                                                   {W_CONTROL_TICK_TIMER_PERIOD_MS,
+                                                    W_COMMON_THREAD_PRIORITY_CONTROL,
+                                                    "controlLoop", "control"},
+                                                   {W_LED_TICK_TIMER_PERIOD_MS,
+                                                    W_COMMON_THREAD_PRIORITY_LED,
+                                                    "ledLoop", "LED"}};
+
+// Keep going flag for the synthetic load.
+static std::atomic<bool> gLoadKeepGoing(false);
+
+// The threads of the synthetic load.
+static std::vector<std::thread> gLoadThread;
+
+// The output levels of the pins of the mock GPIO.
+static std::atomic<unsigned int> gGpioLevel[W_RT_BENCHMARK_GPIO_PIN_NUM];
+
+// The levels of the pins of the mock GPIO driven by software PWM,
+// the eyes, as a percentage.
+static std::atomic<unsigned int> gGpioPwmLevelPercent[W_RT_BENCHMARK_GPIO_PIN_NUM];
+
+// The PWM pins of the mock GPIO, as in w_gpio.cpp.
+static const unsigned int gGpioPwmPin[] = {W_GPIO_PIN_OUTPUT_EYE_LEFT,
+                                           W_GPIO_PIN_OUTPUT_EYE_RIGHT};
+
+// Keep going flag for the software PWM loop of the mock GPIO.
+static bool gGpioPwmKeepGoing = false;
+
+// The tick timer of the software PWM loop of the mock GPIO.
+static int gGpioPwmTimerFd = -1;
+
+// The software PWM loop of the mock GPIO.
+static std::thread gGpioPwmThread;
+
+// The ticks of the software PWM loop of the mock GPIO.
+static wRtBenchmarkTicks_t gGpioPwmTicks;
+
+// The ticks of the LED loop, as seen in calls to wGpioPwmSet() for
+// the left eye.
+static wRtBenchmarkTicks_t gGpioLedTicks;
+
+// Mutex to protect gGpioLedTicks, since wGpioPwmSet() may be
+// called from any thread.
+static std::mutex gGpioLedTicksMutex;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MISC
+ * -------------------------------------------------------------- */
+
+// Return a monotonic time in nanoseconds.
+static int64_t timeNowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Return the given percentile of a sorted vector of samples.
+static int64_t percentileNs(const std::vector<int64_t> *samplesNs,
+                            unsigned int percent)
+{
+    int64_t valueNs = 0;
+
+    if (!samplesNs->empty()) {
+        size_t index = ((samplesNs->size() * percent) + 99) / 100;
+        if (index > 0) {
+            index--;
+        }
+        valueNs = (*samplesNs)[index];
+    }
+
+    return valueNs;
+}
+
+// Sort a vector of samples and print the histogram of them, in
+// power-of-two buckets of microseconds.
+static void histogramPrint(const char *title, std::vector<int64_t> *samplesNs)
+{
+    std::vector<uint64_t> bucket;
+    uint64_t bucketMax = 0;
+
+    std::sort(samplesNs->begin(), samplesNs->end());
+    for (auto valueNs: *samplesNs) {
+        int64_t valueUs = valueNs / 1000;
+        size_t index = 0;
+        while ((valueUs > 0) && (index < 63)) {
+            valueUs >>= 1;
+            index++;
+        }
+        if (index >= bucket.size()) {
+            bucket.resize(index + 1, 0);
+        }
+        bucket[index]++;
+        if (bucket[index] > bucketMax) {
+            bucketMax = bucket[index];
+        }
+    }
+
+    std::printf("  %s: %d sample(s), p50 %.3f ms, p99 %.3f ms, max %.3f ms.\n",
+                title, (int) samplesNs->size(),
+                ((double) percentileNs(samplesNs, 50)) / 1000000,
+                ((double) percentileNs(samplesNs, 99)) / 1000000,
+                ((double) percentileNs(samplesNs, 100)) / 1000000);
+    for (size_t x = 0; x < bucket.size(); x++) {
+        // Bucket zero is less than 1 us, bucket x is from
+        // 2^(x - 1) up to 2^x us
+        std::string label = "<1";
+        if (x > 0) {
+            label = std::to_string(1ULL << (x - 1)) + "-" + std::to_string(1ULL << x);
+        }
+        unsigned int barLength = 0;
+        if (bucketMax > 0) {
+            barLength = (bucket[x] * W_RT_BENCHMARK_HISTOGRAM_BAR_MAX + bucketMax - 1) / bucketMax;
+        }
+        std::printf("    %13s us %8llu %s\n", label.c_str(),
+                    (unsigned long long) bucket[x],
+                    std::string(barLength, '#').c_str());
+    }
+}
+
+// Reset the record of the ticks of a loop, reserving room for the
+// given duration of ticks, and start recording.
+static void ticksStart(wRtBenchmarkTicks_t *ticks, int periodMs,
+                       unsigned int durationSeconds)
+{
+    ticks->record = false;
+    ticks->periodNs = ((int64_t) periodMs) * 1000000;
+    ticks->previousNs = -1;
+    ticks->slipCount = 0;
+    ticks->errorNs.clear();
+    // Twice what is expected, in case ticks come back-to-back
+    ticks->errorNs.reserve(((durationSeconds * 1000) / periodMs) * 2 + 1);
+    ticks->record = true;
+}
+
+// Record a tick of a loop which was woken up by the given number
+// of expiries of its timer.
+static void ticksRecord(wRtBenchmarkTicks_t *ticks, int numExpiries)
+{
+    if (ticks->record) {
+        int64_t nowNs = timeNowNs();
+        if (ticks->previousNs >= 0) {
+            int64_t errorNs = nowNs - ticks->previousNs - (ticks->periodNs * numExpiries);
+            if (ticks->errorNs.size() < ticks->errorNs.capacity()) {
+                ticks->errorNs.push_back(W_UTIL_ABS(errorNs));
+            }
+        }
+        if (numExpiries > 1) {
+            ticks->slipCount += numExpiries - 1;
+        }
+        ticks->previousNs = nowNs;
+    }
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: SYNTHETIC LOAD
+ * -------------------------------------------------------------- */
+
+// A thread of the synthetic load: keep a CPU busy and its cache full
+// of something else.
+static void loadLoop()
+{
+    std::vector<uint8_t> buffer(W_RT_BENCHMARK_LOAD_BUFFER_BYTES);
+    volatile uint8_t *data = buffer.data();
+    uint8_t value = 0;
+
+    while (gLoadKeepGoing) {
+        for (size_t x = 0; x < buffer.size(); x += 64) {
+            data[x] += value;
+        }
+        value++;
+    }
+}
+
+// Start a thread of synthetic load for every CPU; the threads are
+// not placed, they run wherever the scheduler puts them.
+static int loadStart()
+{
+    int errorCode = 0;
+    unsigned int count = std::thread::hardware_concurrency();
+
+    if (count == 0) {
+        count = 1;
+    }
+    gLoadKeepGoing = true;
+    try {
+        for (unsigned int x = 0; x < count; x++) {
+            gLoadThread.push_back(std::thread(loadLoop));
+            pthread_setname_np(gLoadThread.back().native_handle(), "load");
+        }
+    }
+    catch (std::exception &e) {
+        errorCode = -ENOMEM;
+        W_LOG_ERROR("unable to start the load threads (%s)!", e.what());
+    }
+
+    return errorCode;
+}
+
+// Stop the synthetic load.
+static void loadStop()
+{
+    gLoadKeepGoing = false;
+    for (auto &thread: gLoadThread) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    gLoadThread.clear();
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: MESSAGING
+ * -------------------------------------------------------------- */
+
+// Message handler: body begins with the time it was pushed.
+static void msgHandler(void *body, unsigned int bodySize, void *context)
+{
+    wRtBenchmarkMsgContext_t *msgContext = (wRtBenchmarkMsgContext_t *) context;
+    int64_t pushedNs;
+
+    if (bodySize >= sizeof(pushedNs)) {
+        memcpy(&pushedNs, body, sizeof(pushedNs));
+        if (msgContext->latencyNs.size() < msgContext->latencyNs.capacity()) {
+            msgContext->latencyNs.push_back(timeNowNs() - pushedNs);
+        }
+    }
+    msgContext->handledCount++;
+}
+
+// Push count messages through a queue of the given type and size:
+// if paced is true each message is pushed only once the previous
+// one has been handled, measuring the latency of an idle queue,
+// otherwise they are pushed as fast as the queue will take them.
+static int msgMeasure(wMsgQueueType_t type, unsigned int queueSize,
+                      unsigned int bodySize, bool paced,
+                      unsigned int count, wRtBenchmarkMsgResult_t *result)
+{
+    int errorCode;
+    wRtBenchmarkMsgContext_t context;
+    std::vector<uint8_t> body(bodySize, 0);
+    unsigned int pushedCount = 0;
+    int64_t startNs;
+
+    context.latencyNs.reserve(count);
+    context.handledCount = 0;
+    result->count = 0;
+    result->seconds = 0;
+    result->fullCount = 0;
+    result->latencyNs.clear();
+
+    errorCode = wMsgQueueStart(&context, queueSize, gMsgQueueName[type],
+                               type, bodySize);
+    if (errorCode >= 0) {
+        unsigned int queueId = errorCode;
+        errorCode = wMsgQueueHandlerAdd(queueId, W_RT_BENCHMARK_MSG_TYPE,
+                                        msgHandler);
+        startNs = timeNowNs();
+        while ((errorCode == 0) && (pushedCount < count) && wUtilKeepGoing()) {
+            if (paced) {
+                while ((context.handledCount < pushedCount) && wUtilKeepGoing()) {
+                    std::this_thread::yield();
+                }
+            } else {
+                // Wait for room rather than have wMsgPush() fail
+                while ((wMsgQueueLengthGet(queueId) >= (int) queueSize) &&
+                       wUtilKeepGoing()) {
+                    result->fullCount++;
+                    std::this_thread::yield();
+                }
+            }
+            int64_t nowNs = timeNowNs();
+            memcpy(body.data(), &nowNs, sizeof(nowNs));
+            errorCode = wMsgPush(queueId, W_RT_BENCHMARK_MSG_TYPE,
+                                 body.data(), body.size());
+            if (errorCode >= 0) {
+                pushedCount++;
+                errorCode = 0;
+            }
+        }
+        // Let the handler catch up
+        wUtilTimeoutStart_t drainStart = wUtilTimeoutStart();
+        while ((context.handledCount < pushedCount) && wUtilKeepGoing() &&
+               !wUtilTimeoutExpired(drainStart,
+                                    std::chrono::seconds(W_RT_BENCHMARK_DRAIN_TIMEOUT_SECONDS))) {
+            std::this_thread::yield();
+        }
+        result->seconds = ((double) (timeNowNs() - startNs)) / 1000000000;
+        result->count = context.handledCount;
+        wMsgQueueStop(queueId);
+        result->latencyNs = context.latencyNs;
+        if ((errorCode == 0) && (result->count < pushedCount)) {
+            errorCode = -ETIMEDOUT;
+        }
+    }
+
+    return errorCode;
+}
+
+// Measure messaging.
+static int msgRun(const char *loadStr)
+{
+    int errorCode = 0;
+    static const char *typeStr[] = {"list", "ring SPSC"};
+    wMsgQueueType_t type[] = {W_MSG_QUEUE_TYPE_LIST, W_MSG_QUEUE_TYPE_RING_SPSC};
+    wRtBenchmarkMsgResult_t result;
+
+    // Throughput, and latency when there is a queue, for each
+    // type of queue, queue size and body size
+    std::printf("messaging, %s, %d message(s) pushed as fast as the queue"
+                " will take them:\n", loadStr, gParameters.msgCount);
+    for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(type)) && (errorCode == 0); x++) {
+        for (unsigned int y = 0; (y < W_UTIL_ARRAY_COUNT(gMsgQueueSize)) &&
+                                 (errorCode == 0); y++) {
+            for (unsigned int z = 0; (z < W_UTIL_ARRAY_COUNT(gMsgBodySize)) &&
+                                     (errorCode == 0); z++) {
+                errorCode = msgMeasure(type[x], gMsgQueueSize[y], gMsgBodySize[z],
+                                       false, gParameters.msgCount, &result);
+                if (errorCode == 0) {
+                    std::sort(result.latencyNs.begin(), result.latencyNs.end());
+                    std::printf("  %-9s queue %4d, body %4d byte(s): %9.0f messages/second,"
+                                " latency p50 %.3f ms, p99 %.3f ms, max %.3f ms,"
+                                " full %llu time(s).\n", typeStr[x],
+                                gMsgQueueSize[y], gMsgBodySize[z],
+                                result.seconds > 0 ? result.count / result.seconds : 0,
+                                ((double) percentileNs(&result.latencyNs, 50)) / 1000000,
+                                ((double) percentileNs(&result.latencyNs, 99)) / 1000000,
+                                ((double) percentileNs(&result.latencyNs, 100)) / 1000000,
+                                (unsigned long long) result.fullCount);
+                }
+            }
+        }
+    }
+
+    // Latency from wMsgPush() to the handler when the queue is
+    // empty, i.e. the wake-up of the queue thread, for each
+    // type of queue and body size
+    if (errorCode == 0) {
+        std::printf("messaging, %s, %d message(s) pushed one at a time,"
+                    " wMsgPush() to handler:\n", loadStr, gParameters.msgCount);
+    }
+    for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(type)) && (errorCode == 0); x++) {
+        for (unsigned int z = 0; (z < W_UTIL_ARRAY_COUNT(gMsgBodySize)) &&
+                                 (errorCode == 0); z++) {
+            errorCode = msgMeasure(type[x], W_MSG_QUEUE_MAX_SIZE, gMsgBodySize[z],
+                                   true, gParameters.msgCount, &result);
+            if (errorCode == 0) {
+                std::string title = std::string(typeStr[x]) + ", body " +
+                                    std::to_string(gMsgBodySize[z]) + " byte(s)";
+                histogramPrint(title.c_str(), &result.latencyNs);
+            }
+        }
+    }
+
+    if (errorCode != 0) {
+        W_LOG_ERROR("messaging measurement failed (%d)!", errorCode);
+    }
+
+    return errorCode;
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: TIMERS
+ * -------------------------------------------------------------- */
+
+// A ticked thread that does nothing but record its wake-ups.
+static void timerLoop(int timerFd, bool *keepGoing, void *context)
+{
+    wRtBenchmarkTicks_t *ticks = (wRtBenchmarkTicks_t *) context;
+
+    while (*keepGoing && wUtilKeepGoing()) {
+        int numExpiries = wUtilBlockTimer(timerFd);
+        if (numExpiries > 0) {
+            ticksRecord(ticks, numExpiries);
+        }
+    }
+}
+
+// Measure the wake-up jitter of wUtilBlockTimer() at each of the
+// tick periods in gTimerCfg[], all running at once, as they do in
+// the application.
+static int timerRun(const char *loadStr)
+{
+    int errorCode = 0;
+    wRtBenchmarkTicks_t ticks[W_UTIL_ARRAY_COUNT(gTimerCfg)];
+    bool keepGoing[W_UTIL_ARRAY_COUNT(gTimerCfg)];
+    int timerFd[W_UTIL_ARRAY_COUNT(gTimerCfg)];
+    std::thread thread[W_UTIL_ARRAY_COUNT(gTimerCfg)];
+
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gTimerCfg); x++) {
+        keepGoing[x] = true;
+        timerFd[x] = -1;
+        ticksStart(&(ticks[x]), gTimerCfg[x].periodMs, gParameters.durationSeconds);
+    }
+    for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gTimerCfg)) && (errorCode == 0); x++) {
+        errorCode = wUtilThreadTickedStart(gTimerCfg[x].priority,
+                                           gTimerCfg[x].periodMs,
+                                           &(keepGoing[x]), timerLoop,
+                                           gTimerCfg[x].name, &(thread[x]),
+                                           &(ticks[x]));
+        if (errorCode >= 0) {
+            timerFd[x] = errorCode;
+            errorCode = 0;
+        }
+    }
+    if (errorCode == 0) {
+        wUtilTimeoutStart_t start = wUtilTimeoutStart();
+        while (wUtilKeepGoing() &&
+               !wUtilTimeoutExpired(start, std::chrono::seconds(gParameters.durationSeconds))) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gTimerCfg); x++) {
+        wUtilThreadTickedStop(&(timerFd[x]), &(thread[x]), &(keepGoing[x]));
+    }
+
+    if (errorCode == 0) {
+        std::printf("timers, %s, error of each period from wUtilBlockTimer():\n",
+                    loadStr);
+        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gTimerCfg); x++) {
+            std::string title = std::to_string(gTimerCfg[x].periodMs) + " ms (" +
+                                gTimerCfg[x].description + "), " +
+                                std::to_string(ticks[x].slipCount) + " tick(s) slipped";
+            histogramPrint(title.c_str(), &(ticks[x].errorNs));
+        }
+    } else {
+        W_LOG_ERROR("unable to start timer threads (%d)!", errorCode);
+    }
+
+    return errorCode;
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: GPIO
+ * -------------------------------------------------------------- */
+
+// The software PWM loop of the mock GPIO: does what pwmLoop() in
+// w_gpio.cpp does, only to gGpioLevel[], and records its ticks.
+static void gpioPwmLoop(int timerFd, bool *keepGoing, void *context)
+{
+    unsigned int pwmCount = 0;
+    unsigned int levelPercent[W_UTIL_ARRAY_COUNT(gGpioPwmPin)] = {};
+
+    (void) context;
+
+    while (*keepGoing && wUtilKeepGoing()) {
+        int numExpiries = wUtilBlockTimer(timerFd);
+        if (numExpiries > 0) {
+            ticksRecord(&gGpioPwmTicks, numExpiries);
+        }
+        for (int y = 0; y < numExpiries; y++) {
+            for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gGpioPwmPin); x++) {
+                unsigned int pin = gGpioPwmPin[x];
+                if (pwmCount == 0) {
+                    levelPercent[x] = gGpioPwmLevelPercent[pin];
+                    if (levelPercent[x] > 0) {
+                        gGpioLevel[pin] = 1;
+                    }
+                } else if (pwmCount >= levelPercent[x] * W_GPIO_PWM_MAX_COUNT / 100) {
+                    gGpioLevel[pin] = 0;
+                }
+            }
+            pwmCount++;
+            if (pwmCount >= W_GPIO_PWM_MAX_COUNT) {
+                pwmCount = 0;
+            }
+        }
+    }
+}
+
+// Measure the period error of the software PWM loop and of the
+// LED loop, the LEDs breathing so that the LED loop sets their
+// level on every tick.
+static int gpioRun(const char *loadStr)
+{
+    int errorCode = wGpioInit();
+
+    if (errorCode == 0) {
+        errorCode = wLedInit();
+    }
+    if (errorCode == 0) {
+        errorCode = wLedModeBreatheSet();
+    }
+    if (errorCode == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(W_RT_BENCHMARK_SETTLE_MS));
+        gGpioLedTicksMutex.lock();
+        ticksStart(&gGpioLedTicks, W_LED_TICK_TIMER_PERIOD_MS, gParameters.durationSeconds);
+        gGpioLedTicksMutex.unlock();
+        ticksStart(&gGpioPwmTicks, W_GPIO_PWM_TICK_TIMER_PERIOD_MS, gParameters.durationSeconds);
+        wUtilTimeoutStart_t start = wUtilTimeoutStart();
+        while (wUtilKeepGoing() &&
+               !wUtilTimeoutExpired(start, std::chrono::seconds(gParameters.durationSeconds))) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        gGpioPwmTicks.record = false;
+        gGpioLedTicksMutex.lock();
+        gGpioLedTicks.record = false;
+        gGpioLedTicksMutex.unlock();
+    }
+    wLedDeinit();
+    wGpioDeinit();
+
+    if (errorCode == 0) {
+        std::printf("GPIO, %s, error of each period of the loops:\n", loadStr);
+        std::string title = std::to_string(W_GPIO_PWM_TICK_TIMER_PERIOD_MS) +
+                            " ms software PWM loop, " +
+                            std::to_string(gGpioPwmTicks.slipCount) +
+                            " PWM count(s) slipped";
+        histogramPrint(title.c_str(), &gGpioPwmTicks.errorNs);
+        title = std::to_string(W_LED_TICK_TIMER_PERIOD_MS) +
+                " ms LED loop, as seen by wGpioPwmSet()";
+        histogramPrint(title.c_str(), &gGpioLedTicks.errorNs);
+    } else {
+        W_LOG_ERROR("GPIO measurement failed (%d)!", errorCode);
+    }
+
+    return errorCode;
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: COMMAND LINE
+ * -------------------------------------------------------------- */
+
+// Parse the command-line; if this returns an error the parameters
+// will still be populated with the defaults.
+static int commandLineParse(int argc, char *argv[],
+                            wRtBenchmarkParameters_t *parameters)
+{
+    int errorCode = 0;
+    int x = 1;
+
+    parameters->programName = std::string(argc > 0 ? argv[0] : "watchdog_rt_benchmark");
+    parameters->tests = W_RT_BENCHMARK_TEST_ALL;
+    parameters->load = W_RT_BENCHMARK_LOAD_BOTH;
+    parameters->durationSeconds = W_RT_BENCHMARK_DURATION_SECONDS_DEFAULT;
+    parameters->msgCount = W_RT_BENCHMARK_MSG_COUNT_DEFAULT;
+
+    while ((x < argc) && (errorCode == 0)) {
+        std::string option = std::string(argv[x]);
+        std::string value;
+        errorCode = -EINVAL;
+        if ((option != "-h") && (x + 1 < argc)) {
+            x++;
+            value = std::string(argv[x]);
+            if (option == "-m") {
+                errorCode = 0;
+                if (value == "all") {
+                    parameters->tests = W_RT_BENCHMARK_TEST_ALL;
+                } else if (value == "msg") {
+                    parameters->tests = W_RT_BENCHMARK_TEST_MSG;
+                } else if (value == "timer") {
+                    parameters->tests = W_RT_BENCHMARK_TEST_TIMER;
+                } else if (value == "gpio") {
+                    parameters->tests = W_RT_BENCHMARK_TEST_GPIO;
+                } else {
+                    errorCode = -EINVAL;
+                }
+            } else if (option == "-l") {
+                errorCode = 0;
+                if (value == "both") {
+                    parameters->load = W_RT_BENCHMARK_LOAD_BOTH;
+                } else if (value == "none") {
+                    parameters->load = W_RT_BENCHMARK_LOAD_NONE;
+                } else if (value == "cpu") {
+                    parameters->load = W_RT_BENCHMARK_LOAD_CPU;
+                } else {
+                    errorCode = -EINVAL;
+                }
+            } else if ((option == "-t") || (option == "-n")) {
+                int integer = atoi(value.c_str());
+                if (integer > 0) {
+                    errorCode = 0;
+                    if (option == "-t") {
+                        parameters->durationSeconds = integer;
+                    } else {
+                        parameters->msgCount = integer;
+                    }
+                }
+            }
+        }
+        x++;
+    }
+
+    return errorCode;
+}
+
+// Print command-line help.
+static void commandLinePrintHelp(wRtBenchmarkParameters_t *defaults)
+{
+    std::cout << defaults->programName << ", options are:" << std::endl;
+    std::cout << "  -m  all|msg|timer|gpio what to measure: messaging latency"
+              << " and throughput, timer wake-up jitter or the period error"
+              << " of the software PWM and LED loops (default all)." << std::endl;
+    std::cout << "  -l  both|none|cpu measure without a synthetic load on every"
+              << " CPU, with it, or both (default both)." << std::endl;
+    std::cout << "  -t  <integer> the duration of each timer and GPIO measurement"
+              << " in seconds (default " << defaults->durationSeconds << ")."
+              << std::endl;
+    std::cout << "  -n  <integer> the number of messages to push for each"
+              << " messaging measurement (default " << defaults->msgCount
+              << ")." << std::endl;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: THE wGpio API, MOCKED
+ * -------------------------------------------------------------- */
+
+// Initialise the mock GPIO, starting its software PWM loop.
+int wGpioInit()
+{
+    int errorCode = 0;
+
+    if (gGpioPwmTimerFd < 0) {
+        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gGpioLevel); x++) {
+            gGpioLevel[x] = 0;
+            gGpioPwmLevelPercent[x] = 0;
+        }
+        gGpioPwmKeepGoing = true;
+        errorCode = wUtilThreadTickedStart(W_COMMON_THREAD_PRIORITY_GPIO_PWM,
+                                           W_GPIO_PWM_TICK_TIMER_PERIOD_MS,
+                                           &gGpioPwmKeepGoing,
+                                           gpioPwmLoop, "pwmLoop",
+                                           &gGpioPwmThread);
+        if (errorCode >= 0) {
+            gGpioPwmTimerFd = errorCode;
+            errorCode = 0;
+        }
+    }
+
+    return errorCode;
+}
+
+// Get the state of a pin of the mock GPIO.
+int wGpioGet(unsigned int pin)
+{
+    int levelOrErrorCode = -EINVAL;
+
+    if (pin < W_UTIL_ARRAY_COUNT(gGpioLevel)) {
+        levelOrErrorCode = gGpioLevel[pin];
+    }
+
+    return levelOrErrorCode;
+}
+
+// Set the state of a pin of the mock GPIO.
+int wGpioSet(unsigned int pin, unsigned int level)
+{
+    int errorCode = -EINVAL;
+
+    if (pin < W_UTIL_ARRAY_COUNT(gGpioLevel)) {
+        gGpioLevel[pin] = (level != 0);
+        errorCode = 0;
+    }
+
+    return errorCode;
+}
+
+// Set the level of a PWM pin of the mock GPIO, recording the ticks
+// of the LED loop from the left eye.
+int wGpioPwmSet(unsigned int pin, unsigned int levelPercent)
+{
+    int errorCode = -EINVAL;
+
+    if ((pin < W_UTIL_ARRAY_COUNT(gGpioPwmLevelPercent)) && (levelPercent <= 100)) {
+        gGpioPwmLevelPercent[pin] = levelPercent;
+        if (pin == W_GPIO_PIN_OUTPUT_EYE_LEFT) {
+            gGpioLedTicksMutex.lock();
+            ticksRecord(&gGpioLedTicks, 1);
+            gGpioLedTicksMutex.unlock();
+        }
+        errorCode = 0;
+    }
+
+    return errorCode;
+}
+
+// Deinitialise the mock GPIO.
+void wGpioDeinit()
+{
+    wUtilThreadTickedStop(&gGpioPwmTimerFd, &gGpioPwmThread, &gGpioPwmKeepGoing);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: THE wStats API, WHAT IS NEEDED OF IT
+ * -------------------------------------------------------------- */
+
+// Statistics are not gathered here: w_stats.cpp needs the camera.
+int wStatsQueueAdd(unsigned int queueId, unsigned int pipeline)
+{
+    (void) queueId;
+    (void) pipeline;
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: MAIN
+ * -------------------------------------------------------------- */
+
+// The entry point.
+int main(int argc, char *argv[])
+{
+    int errorCode = commandLineParse(argc, argv, &gParameters);
+
+    if (errorCode == 0) {
+        // Capture CTRL-C so that we can exit in an organised fashion
+        wUtilTerminationCaptureSet();
+
+        // Log messages are printed by their own thread, as in the
+        // real thing; the results are printed straight to stdout,
+        // since there are too many lines for the rate limit of
+        // the log
+        errorCode = wLogWriterStart();
+        if (errorCode == 0) {
+            errorCode = wMsgInit();
+        }
+
+        for (unsigned int pass = 0; (pass < 2) && (errorCode == 0) &&
+                                    wUtilKeepGoing(); pass++) {
+            // The first pass is without the load, the second with it
+            bool loaded = (pass > 0);
+            if ((loaded && (gParameters.load != W_RT_BENCHMARK_LOAD_NONE)) ||
+                (!loaded && (gParameters.load != W_RT_BENCHMARK_LOAD_CPU))) {
+                std::string loadStr = "idle";
+                if (loaded) {
+                    errorCode = loadStart();
+                    loadStr = "load on " + std::to_string(gLoadThread.size()) + " CPU(s)";
+                }
+                if ((errorCode == 0) && (gParameters.tests & W_RT_BENCHMARK_TEST_MSG)) {
+                    errorCode = msgRun(loadStr.c_str());
+                }
+                if ((errorCode == 0) && (gParameters.tests & W_RT_BENCHMARK_TEST_TIMER)) {
+                    errorCode = timerRun(loadStr.c_str());
+                }
+                if ((errorCode == 0) && (gParameters.tests & W_RT_BENCHMARK_TEST_GPIO)) {
+                    errorCode = gpioRun(loadStr.c_str());
+                }
+                loadStop();
+                std::fflush(stdout);
+            }
+        }
+        wUtilThreadPlacementReport();
+
+        wMsgDeinit();
+        wLogWriterStop();
+    } else {
+        commandLinePrintHelp(&gParameters);
+    }
+
+    return errorCode;
+}
+
+// End of file
@@ -0,0 +1,544 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief Implementation of the statistics API for the watchdog
+ * application.
+ *
+ * This code makes use of cJSON hence must be linked with libcjson.
+ */
+
+// The CPP stuff.
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+// The Linux/Posix stuff.
+#include <time.h>
+
+// The cJSON stuff.
+#include <cJSON.h>
+
+// Other parts of watchdog.
+#include <w_common.h>
+#include <w_util.h>
+#include <w_log.h>
+#include <w_msg.h>
+#include <w_camera.h>
+
+// Us.
+#include <w_stats.h>
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// The number of bits of sub-bucket in a histogram: the histogram
+// buckets are log-linear, each power of two of microseconds being
+// divided into 1 << W_STATS_HISTOGRAM_SUB_BUCKET_BITS buckets, so
+// 2 bits gives a resolution of better than 25%.
+#define W_STATS_HISTOGRAM_SUB_BUCKET_BITS 2
+
+// The number of sub-buckets in each power of two.
+#define W_STATS_HISTOGRAM_SUB_BUCKET_NUM (1U << W_STATS_HISTOGRAM_SUB_BUCKET_BITS)
+
+// The number of buckets in a histogram, enough for 32 bits of
+// microseconds (over an hour), anything larger going in the top
+// bucket.
+#define W_STATS_HISTOGRAM_BUCKET_NUM ((32 - W_STATS_HISTOGRAM_SUB_BUCKET_BITS + 1) * \
+                                      W_STATS_HISTOGRAM_SUB_BUCKET_NUM)
+
+// The number of stage histograms, one for each point after
+// W_STATS_POINT_SENSOR.
+#define W_STATS_STAGE_NUM (W_STATS_POINT_MAX_NUM - 1)
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** A lock-free latency histogram, values in microseconds.
+ */
+typedef struct {
+    std::atomic<uint32_t> bucket[W_STATS_HISTOGRAM_BUCKET_NUM];
+    std::atomic<uint64_t> maxUs;
+} wStatsHistogram_t;
+
+/** The timestamps of a frame at each point in the pipeline.
+ */
+typedef struct {
+    std::atomic<unsigned int> sequence;
+    std::atomic<int64_t> timestampNs[W_STATS_POINT_MAX_NUM];
+} wStatsFrame_t;
+
+/** The statistics of a pipeline (see W_COMMON_PIPELINE_MAX_NUM).
+ */
+typedef struct {
+    wStatsHistogram_t histogramStage[W_STATS_STAGE_NUM]; // The histogram for each stage
+    wStatsHistogram_t histogramEndToEnd; // From W_STATS_POINT_SENSOR to W_STATS_POINT_PACKET_WRITTEN
+    wStatsFrame_t frame[W_STATS_FRAME_HISTORY_LENGTH]; // Indexed by sequence number modulo W_STATS_FRAME_HISTORY_LENGTH
+    std::string filePath; // Empty if wStatsStart() has not been called for the pipeline, protected by gFilePathMutex
+    uint64_t framePoolStarvedCountPrevious; // The camera frame pool starved count at the previous export
+} wStatsPipeline_t;
+
+/** A message queue that has been registered with wStatsQueueAdd(),
+ * with the counts at the last export so that rates can be worked out.
+ */
+typedef struct {
+    unsigned int id;
+    unsigned int pipeline;
+    int64_t countPrevious;
+    int64_t dropCountPrevious;
+} wStatsQueue_t;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// The names of the stages in the statistics file, in the order of
+// wStatsPoint_t but starting at W_STATS_POINT_REQUEST_COMPLETED; each is
+// named after the point at which the stage ends.
+static const char *gStageName[] = {"requestCompleted",     // From W_STATS_POINT_SENSOR
+                                   "imageProcessingStart", // From W_STATS_POINT_REQUEST_COMPLETED
+                                   "imageProcessingEnd",   // From W_STATS_POINT_IMAGE_PROCESSING_START
+                                   "encodeSend",           // From W_STATS_POINT_IMAGE_PROCESSING_END
+                                   "packetWritten"};       // From W_STATS_POINT_ENCODE_SEND
+
+// The statistics of each pipeline: static, and hence the histograms
+// and timestamps are zeroed, so that wStatsTimestamp() can be called
+// at any time.
+static wStatsPipeline_t gPipeline[W_COMMON_PIPELINE_MAX_NUM];
+
+// The message queues registered with wStatsQueueAdd().
+static wStatsQueue_t gQueue[W_STATS_QUEUE_MAX_NUM];
+
+// The number of entries in gQueue[].
+static unsigned int gQueueNum = 0;
+
+// Mutex to protect gQueue[] and gQueueNum.
+static std::mutex gQueueMutex;
+
+// Mutex to protect the filePath of each entry in gPipeline[].
+static std::mutex gFilePathMutex;
+
+// The file descriptor of the tick-timer that drives statsLoop().
+static int gTimerFd = -1;
+
+// The keep-going flag for statsLoop().
+static bool gKeepGoing = false;
+
+// The thread that runs statsLoop().
+static std::thread gThread;
+
+// The time of the previous export in nanoseconds.
+static int64_t gExportPreviousNs = 0;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Return the current time on CLOCK_MONOTONIC in nanoseconds, the
+// same clock that V4L2, and hence libcamera, uses for the sensor
+// timestamp.
+static int64_t timeNowNs()
+{
+    struct timespec timeSpec = {};
+
+    clock_gettime(CLOCK_MONOTONIC, &timeSpec);
+
+    return (((int64_t) timeSpec.tv_sec) * 1000000000) + timeSpec.tv_nsec;
+}
+
+// Return the histogram bucket for a value in microseconds.
+static unsigned int bucketIndex(uint64_t valueUs)
+{
+    if (valueUs > UINT32_MAX) {
+        valueUs = UINT32_MAX;
+    }
+    unsigned int index = (unsigned int) valueUs;
+    if (valueUs >= W_STATS_HISTOGRAM_SUB_BUCKET_NUM) {
+        // The position of the most significant bit selects the power
+        // of two, the bits below it the sub-bucket
+        unsigned int msb = 63 - __builtin_clzll(valueUs);
+        unsigned int shift = msb - W_STATS_HISTOGRAM_SUB_BUCKET_BITS;
+        index = ((shift + 1) * W_STATS_HISTOGRAM_SUB_BUCKET_NUM) +
+                ((unsigned int) (valueUs >> shift) & (W_STATS_HISTOGRAM_SUB_BUCKET_NUM - 1));
+    }
+
+    return index;
+}
+
+// Return the smallest value in microseconds that would go in the
+// given histogram bucket.
+static uint64_t bucketLowerUs(unsigned int index)
+{
+    uint64_t valueUs = index;
+
+    if (index >= W_STATS_HISTOGRAM_SUB_BUCKET_NUM) {
+        unsigned int shift = (index / W_STATS_HISTOGRAM_SUB_BUCKET_NUM) - 1;
+        valueUs = ((uint64_t) (W_STATS_HISTOGRAM_SUB_BUCKET_NUM +
+                               (index % W_STATS_HISTOGRAM_SUB_BUCKET_NUM))) << shift;
+    }
+
+    return valueUs;
+}
+
+// Add a value in nanoseconds to a histogram; lock-free.
+static void histogramAdd(wStatsHistogram_t *histogram, int64_t valueNs)
+{
+    if (valueNs >= 0) {
+        uint64_t valueUs = valueNs / 1000;
+        histogram->bucket[bucketIndex(valueUs)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t maxUs = histogram->maxUs.load(std::memory_order_relaxed);
+        while ((valueUs > maxUs) &&
+               !histogram->maxUs.compare_exchange_weak(maxUs, valueUs,
+                                                       std::memory_order_relaxed)) {
+        }
+    }
+}
+
+// Return the value in microseconds below which the given percentage
+// of the values in a snapshot of a histogram fall; this is the top
+// of the bucket, capped at the maximum, so errs on the high side.
+static uint64_t percentileUs(const uint32_t *bucket, uint64_t count,
+                             uint64_t maxUs, unsigned int percent)
+{
+    uint64_t valueUs = 0;
+    uint64_t threshold = ((count * percent) + 99) / 100;
+    uint64_t total = 0;
+    bool found = false;
+
+    for (unsigned int x = 0; (x < W_STATS_HISTOGRAM_BUCKET_NUM) &&
+                             (count > 0) && !found; x++) {
+        total += bucket[x];
+        if (total >= threshold) {
+            found = true;
+            valueUs = maxUs;
+            if (x + 1 < W_STATS_HISTOGRAM_BUCKET_NUM) {
+                uint64_t upperUs = bucketLowerUs(x + 1) - 1;
+                if (upperUs < maxUs) {
+                    valueUs = upperUs;
+                }
+            }
+        }
+    }
+
+    return valueUs;
+}
+
+// Take a snapshot of a histogram, resetting it, and add it, as
+// an object with the given name, to the given JSON object.
+static void histogramExport(wStatsHistogram_t *histogram, const char *name,
+                            double periodSeconds, cJSON *json)
+{
+    uint32_t bucket[W_STATS_HISTOGRAM_BUCKET_NUM];
+    uint64_t count = 0;
+
+    // Each bucket is reset as it is read; a value that lands part
+    // way through will just be counted in this period or the next
+    for (unsigned int x = 0; x < W_STATS_HISTOGRAM_BUCKET_NUM; x++) {
+        bucket[x] = histogram->bucket[x].exchange(0, std::memory_order_relaxed);
+        count += bucket[x];
+    }
+    uint64_t maxUs = histogram->maxUs.exchange(0, std::memory_order_relaxed);
+
+    cJSON *stageJson = cJSON_AddObjectToObject(json, name);
+    if (stageJson) {
+        cJSON_AddNumberToObject(stageJson, "count", (double) count);
+        cJSON_AddNumberToObject(stageJson, "rateHz", periodSeconds > 0 ? count / periodSeconds : 0);
+        cJSON_AddNumberToObject(stageJson, "p50Us", (double) percentileUs(bucket, count, maxUs, 50));
+        cJSON_AddNumberToObject(stageJson, "p99Us", (double) percentileUs(bucket, count, maxUs, 99));
+        cJSON_AddNumberToObject(stageJson, "maxUs", (double) maxUs);
+    }
+}
+
+// Add the state of the message queues registered for the given
+// pipeline to the given JSON object.
+static void queuesExport(unsigned int pipeline, double periodSeconds,
+                         cJSON *json)
+{
+    cJSON *queuesJson = cJSON_AddObjectToObject(json, "queues");
+
+    if (queuesJson) {
+        gQueueMutex.lock();
+        for (unsigned int x = 0; x < gQueueNum; x++) {
+            wStatsQueue_t *queue = &(gQueue[x]);
+            if (queue->pipeline != pipeline) {
+                continue;
+            }
+            const char *name = wMsgQueueNameGet(queue->id);
+            int length = wMsgQueueLengthGet(queue->id);
+            int lengthMax = wMsgQueueLengthMaxGet(queue->id, true);
+            int64_t count = wMsgPushCountGet(queue->id);
+            int64_t dropCount = wMsgQueueDropCountGet(queue->id);
+            if (name && (length >= 0) && (lengthMax >= 0) &&
+                (count >= 0) && (dropCount >= 0)) {
+                cJSON *queueJson = cJSON_AddObjectToObject(queuesJson, name);
+                if (queueJson) {
+                    cJSON_AddNumberToObject(queueJson, "depth", length);
+                    cJSON_AddNumberToObject(queueJson, "depthMax", lengthMax);
+                    cJSON_AddNumberToObject(queueJson, "rateHz", periodSeconds > 0 ?
+                                            (count - queue->countPrevious) / periodSeconds : 0);
+                    cJSON_AddNumberToObject(queueJson, "dropped",
+                                            (double) (dropCount - queue->dropCountPrevious));
+                    cJSON_AddNumberToObject(queueJson, "droppedTotal", (double) dropCount);
+                }
+                queue->countPrevious = count;
+                queue->dropCountPrevious = dropCount;
+            }
+        }
+        gQueueMutex.unlock();
+    }
+}
+
+// Add the state of the camera frame pool of the given pipeline to
+// the given JSON object; nothing is added if the camera is not
+// initialised.
+static void framePoolExport(unsigned int pipeline, cJSON *json)
+{
+    wCameraFramePool_t pool;
+    wStatsPipeline_t *statsPipeline = &(gPipeline[pipeline]);
+
+    if (wCameraFramePoolGet(pipeline, &pool, true) == 0) {
+        cJSON *poolJson = cJSON_AddObjectToObject(json, "framePool");
+        if (poolJson) {
+            cJSON_AddNumberToObject(poolJson, "count", pool.count);
+            cJSON_AddNumberToObject(poolJson, "bytes", pool.bytes);
+            cJSON_AddNumberToObject(poolJson, "inUse", pool.inUse);
+            cJSON_AddNumberToObject(poolJson, "inUseMax", pool.inUseMax);
+            cJSON_AddNumberToObject(poolJson, "starved",
+                                    (double) (pool.starvedCount -
+                                               statsPipeline->framePoolStarvedCountPrevious));
+            cJSON_AddNumberToObject(poolJson, "starvedTotal", (double) pool.starvedCount);
+        }
+        statsPipeline->framePoolStarvedCountPrevious = pool.starvedCount;
+    }
+}
+
+// Write the statistics file of a pipeline; it is written to a
+// temporary file which is then renamed so that whoever is reading it
+// never sees half a file.
+static int pipelineExport(unsigned int pipeline, std::string filePath,
+                          double periodSeconds)
+{
+    int errorCode = -ENOMEM;
+    wStatsPipeline_t *statsPipeline = &(gPipeline[pipeline]);
+
+    cJSON *json = cJSON_CreateObject();
+    if (json) {
+        cJSON_AddNumberToObject(json, "timeUnix", (double) time(nullptr));
+        cJSON_AddNumberToObject(json, "periodSeconds", periodSeconds);
+        cJSON *stagesJson = cJSON_AddObjectToObject(json, "stages");
+        if (stagesJson) {
+            for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(statsPipeline->histogramStage); x++) {
+                histogramExport(&(statsPipeline->histogramStage[x]), gStageName[x],
+                                periodSeconds, stagesJson);
+            }
+            histogramExport(&(statsPipeline->histogramEndToEnd), "endToEnd",
+                            periodSeconds, stagesJson);
+        }
+        queuesExport(pipeline, periodSeconds, json);
+        framePoolExport(pipeline, json);
+
+        char *text = cJSON_Print(json);
+        if (text) {
+            errorCode = -EIO;
+            std::string filePathTemporary = filePath + ".tmp";
+            FILE *file = fopen(filePathTemporary.c_str(), "w");
+            if (file) {
+                bool written = (fputs(text, file) >= 0);
+                if ((fclose(file) == 0) && written &&
+                    (rename(filePathTemporary.c_str(), filePath.c_str()) == 0)) {
+                    errorCode = 0;
+                }
+            }
+            if (errorCode != 0) {
+                W_LOG_DEBUG("unable to write statistics file \"%s\".",
+                            filePath.c_str());
+            }
+            free(text);
+        }
+        cJSON_Delete(json);
+    }
+
+    return errorCode;
+}
+
+// Write the statistics file of each pipeline that has been given one.
+static void statsExport()
+{
+    int64_t nowNs = timeNowNs();
+    double periodSeconds = 0;
+
+    if (gExportPreviousNs > 0) {
+        periodSeconds = ((double) (nowNs - gExportPreviousNs)) / 1000000000;
+    }
+    gExportPreviousNs = nowNs;
+
+    for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gPipeline); x++) {
+        gFilePathMutex.lock();
+        std::string filePath = gPipeline[x].filePath;
+        gFilePathMutex.unlock();
+        if (!filePath.empty()) {
+            pipelineExport(x, filePath, periodSeconds);
+        }
+    }
+}
+
+// The loop that writes the statistics file.
+static void statsLoop(int timerFd, bool *keepGoing, void *context)
+{
+    (void) context;
+
+    if (timerFd >= 0) {
+        W_LOG_DEBUG("stats loop has started.");
+
+        while (*keepGoing && wUtilKeepGoing()) {
+            // Block waiting for our tick-timer to go off or for
+            // CTRL-C to land
+            if (wUtilBlockTimer(timerFd) > 0) {
+                statsExport();
+            }
+        }
+    }
+
+    W_LOG_DEBUG("stats loop has exited.");
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Record that a frame has reached a point in the video pipeline.
+void wStatsTimestamp(unsigned int pipeline, wStatsPoint_t point,
+                     unsigned int sequence, int64_t timestampNs)
+{
+    if (pipeline >= W_UTIL_ARRAY_COUNT(gPipeline)) {
+        return;
+    }
+
+    wStatsPipeline_t *statsPipeline = &(gPipeline[pipeline]);
+    wStatsFrame_t *frame = &(statsPipeline->frame[sequence % W_UTIL_ARRAY_COUNT(statsPipeline->frame)]);
+
+    if (timestampNs == 0) {
+        timestampNs = timeNowNs();
+    }
+
+    if (point == W_STATS_POINT_SENSOR) {
+        // Start a new record for this frame, overwriting whatever
+        // frame was in this entry before
+        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(frame->timestampNs); x++) {
+            frame->timestampNs[x].store(0, std::memory_order_relaxed);
+        }
+        frame->timestampNs[point].store(timestampNs, std::memory_order_relaxed);
+        frame->sequence.store(sequence, std::memory_order_release);
+    } else if ((point > W_STATS_POINT_SENSOR) && (point < W_STATS_POINT_MAX_NUM) &&
+               (frame->sequence.load(std::memory_order_acquire) == sequence)) {
+        int64_t previousNs = frame->timestampNs[point - 1].load(std::memory_order_relaxed);
+        if (previousNs > 0) {
+            histogramAdd(&(statsPipeline->histogramStage[point - 1]), timestampNs - previousNs);
+        }
+        frame->timestampNs[point].store(timestampNs, std::memory_order_relaxed);
+        if (point == W_STATS_POINT_PACKET_WRITTEN) {
+            int64_t sensorNs = frame->timestampNs[W_STATS_POINT_SENSOR].load(std::memory_order_relaxed);
+            if (sensorNs > 0) {
+                histogramAdd(&(statsPipeline->histogramEndToEnd), timestampNs - sensorNs);
+            }
+        }
+    }
+}
+
+// Register a message queue with the statistics API.
+int wStatsQueueAdd(unsigned int queueId, unsigned int pipeline)
+{
+    int errorCode = -ENOBUFS;
+
+    gQueueMutex.lock();
+    if (pipeline >= W_UTIL_ARRAY_COUNT(gPipeline)) {
+        errorCode = -EINVAL;
+    } else if (gQueueNum < W_UTIL_ARRAY_COUNT(gQueue)) {
+        wStatsQueue_t *queue = &(gQueue[gQueueNum]);
+        queue->id = queueId;
+        queue->pipeline = pipeline;
+        queue->countPrevious = wMsgPushCountGet(queueId);
+        queue->dropCountPrevious = wMsgQueueDropCountGet(queueId);
+        errorCode = -EINVAL;
+        if ((queue->countPrevious >= 0) && (queue->dropCountPrevious >= 0)) {
+            gQueueNum++;
+            errorCode = 0;
+        }
+    }
+    gQueueMutex.unlock();
+
+    if (errorCode != 0) {
+        W_LOG_ERROR("unable to add message queue %d to statistics (%d)!",
+                    queueId, errorCode);
+    }
+
+    return errorCode;
+}
+
+// Start writing the statistics file of a pipeline periodically.
+int wStatsStart(unsigned int pipeline, std::string outputDirectory,
+                std::string outputFileName)
+{
+    int errorCode = -EINVAL;
+
+    if (pipeline < W_UTIL_ARRAY_COUNT(gPipeline)) {
+        errorCode = 0;
+        gFilePathMutex.lock();
+        if (gPipeline[pipeline].filePath.empty()) {
+            gPipeline[pipeline].filePath = outputDirectory + std::string(W_UTIL_DIR_SEPARATOR) +
+                                           outputFileName + std::string(W_STATS_FILE_NAME_SUFFIX) +
+                                           std::string(W_STATS_FILE_EXTENSION);
+            W_LOG_INFO("statistics for pipeline %d will be written to \"%s\".",
+                       pipeline, gPipeline[pipeline].filePath.c_str());
+        }
+        gFilePathMutex.unlock();
+    }
+
+    if ((errorCode == 0) && (gTimerFd < 0)) {
+        gExportPreviousNs = timeNowNs();
+        // Set up the thread and tick-timer to drive statsLoop()
+        errorCode = wUtilThreadTickedStart(W_COMMON_THREAD_PRIORITY_STATS,
+                                           W_STATS_EXPORT_PERIOD_SECONDS * 1000,
+                                           &gKeepGoing,
+                                           statsLoop, "statsLoop",
+                                           &gThread);
+        if (errorCode >= 0) {
+            gTimerFd = errorCode;
+            errorCode = 0;
+            W_LOG_INFO("statistics will be written every %d second(s).",
+                       W_STATS_EXPORT_PERIOD_SECONDS);
+        }
+    }
+
+    return errorCode;
+}
+
+// Stop writing the statistics file.
+void wStatsStop()
+{
+    if (gTimerFd >= 0) {
+        wUtilThreadTickedStop(&gTimerFd, &gThread, &gKeepGoing);
+        // One last time, so that what is left reflects the end
+        statsExport();
+    }
+}
+
+// End of file
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2025 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _W_STATS_H_
+#define _W_STATS_H_
+
+// This API is dependent on std::string, int64_t and w_common.h (for
+// W_COMMON_PIPELINE_MAIN).
+#include <cstdint>
+#include <string>
+#include <w_common.h>
+
+/** @file
+ * @brief The statistics API for the watchdog application: per-frame
+ * timestamps are recorded at each stage of the video pipeline and
+ * fed into latency histograms, which are written, along with the
+ * state of any registered message queues and of the camera frame
+ * pool, to a JSON file next to the HLS output every
+ * W_STATS_EXPORT_PERIOD_SECONDS; each pipeline (see
+ * W_COMMON_PIPELINE_MAX_NUM) has its own histograms and its own file.
+ *
+ * wStatsTimestamp() is lock-free and may be called from any thread,
+ * before wStatsStart() or after wStatsStop() (in which case it
+ * simply accumulates); wStatsQueueAdd() is thread-safe.
+ * wStatsStart() and wStatsStop() should not be called at the same
+ * time as each other.
+ */
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+#ifndef W_STATS_FILE_NAME_SUFFIX
+/** What to append to the HLS output file name to make the name
+ * of the statistics file.
+ */
+# define W_STATS_FILE_NAME_SUFFIX "_stats"
+#endif
+
+#ifndef W_STATS_FILE_EXTENSION
+/** Statistics file extension.
+ */
+# define W_STATS_FILE_EXTENSION ".json"
+#endif
+
+#ifndef W_STATS_EXPORT_PERIOD_SECONDS
+/** How often to write the statistics file; the percentiles and
+ * maxima in the file cover this period.
+ */
+# define W_STATS_EXPORT_PERIOD_SECONDS 5
+#endif
+
+#ifndef W_STATS_FRAME_HISTORY_LENGTH
+/** The number of frames for which per-stage timestamps are kept,
+ * must be larger than the number of frames that can be in flight
+ * in the pipeline at any one time (see W_CAMERA_BUFFER_COUNT).
+ */
+# define W_STATS_FRAME_HISTORY_LENGTH 64
+#endif
+
+#ifndef W_STATS_QUEUE_MAX_NUM
+/** The maximum number of message queues that can be registered
+ * with wStatsQueueAdd(), across all pipelines.
+ */
+# define W_STATS_QUEUE_MAX_NUM 16
+#endif
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** The points in the video pipeline at which a frame is timestamped,
+ * in the order that a frame passes through them; the latency of
+ * a stage is the time from the previous point to this one.
+ */
+typedef enum {
+    W_STATS_POINT_SENSOR, // The sensor timestamp from the libcamera FrameMetadata
+    W_STATS_POINT_REQUEST_COMPLETED, // The start of requestCompleted() in the camera API
+    W_STATS_POINT_IMAGE_PROCESSING_START, // Image processing has popped the frame from its queue
+    W_STATS_POINT_IMAGE_PROCESSING_END, // Image processing is done with the frame
+    W_STATS_POINT_ENCODE_SEND, // avcodec_send_frame() has accepted the frame
+    W_STATS_POINT_PACKET_WRITTEN, // The encoded packet for the frame has been written
+    W_STATS_POINT_MAX_NUM
+} wStatsPoint_t;
+
+/* ----------------------------------------------------------------
+ * FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/** Record that a frame has reached a point in the video pipeline.
+ * W_STATS_POINT_SENSOR begins a new record for the frame; any
+ * other point is ignored if the frame has no record or the record
+ * has since been overwritten, hence frames that are dropped along
+ * the way simply don't contribute to the later stages.
+ *
+ * @param pipeline    the pipeline that the frame belongs to.
+ * @param point       the point the frame has reached.
+ * @param sequence    the camera sequence number of the frame.
+ * @param timestampNs the time in nanoseconds, on CLOCK_MONOTONIC,
+ *                    at which the frame reached point; use zero
+ *                    to mean "now".
+ */
+void wStatsTimestamp(unsigned int pipeline, wStatsPoint_t point,
+                     unsigned int sequence, int64_t timestampNs = 0);
+
+/** Register a message queue with the statistics API so that its
+ * depth, rate and drops are included in the statistics file.
+ *
+ * @param queueId  the ID of the queue, as returned by
+ *                 wMsgQueueStart().
+ * @param pipeline the pipeline the queue belongs to, i.e. the
+ *                 statistics file it appears in.
+ * @return         zero on success else negative error code.
+ */
+int wStatsQueueAdd(unsigned int queueId,
+                   unsigned int pipeline = W_COMMON_PIPELINE_MAIN);
+
+/** Start writing the statistics file of a pipeline periodically.
+ * If wStatsStart() has already been called for the pipeline this
+ * function will do nothing and return success.
+ *
+ * @param pipeline        the pipeline.
+ * @param outputDirectory the directory to write the file to, usually
+ *                        the HLS output directory; should not end
+ *                        in a "/".
+ * @param outputFileName  the HLS output file name, without extension;
+ *                        the statistics file will be this with
+ *                        W_STATS_FILE_NAME_SUFFIX and
+ *                        W_STATS_FILE_EXTENSION appended.
+ * @return                zero on success else negative error code.
+ */
+int wStatsStart(unsigned int pipeline, std::string outputDirectory,
+                std::string outputFileName);
+
+/** Stop writing the statistics files, writing them one last time
+ * as the thread exits.  Should be called before the message queues that have
+ * been registered with wStatsQueueAdd() are stopped.
+ */
+void wStatsStop();
+
+#endif // _W_STATS_H_
+
+// End of file
@@ -20,9 +20,15 @@
 
 // The CPP stuff.
 #include <thread>
+#include <mutex>
+#include <string>
+#include <list>
 
 // The Linux/Posix stuff.
 #include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <string.h>
 #include <sys/timerfd.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -38,10 +44,42 @@
  * COMPILE-TIME MACROS
  * -------------------------------------------------------------- */
 
+// The file that lists the online CPUs.
+#define W_UTIL_CPU_LIST_PATH_ONLINE "/sys/devices/system/cpu/online"
+
+// The file that lists the CPUs isolated with "isolcpus=".
+#define W_UTIL_CPU_LIST_PATH_ISOLATED "/sys/devices/system/cpu/isolated"
+
+// The longest CPU list that will be read from one of the files above.
+#define W_UTIL_CPU_LIST_LENGTH_MAX 256
+
+// The number of placed threads that wUtilThreadPlacementReport()
+// can report.
+#define W_UTIL_THREAD_PLACED_MAX_NUM 32
+
+// The length of a thread name, including the terminator, as limited
+// by pthread_setname_np().
+#define W_UTIL_THREAD_NAME_LENGTH_MAX 16
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
 
+// An entry in the table of thread placement, by thread name.
+typedef struct {
+    const char *name;
+    wCommonThreadPlacement_t placement;
+} wUtilThreadPlacementName_t;
+
+// A record of a placed thread, for wUtilThreadPlacementReport().
+typedef struct {
+    char name[W_UTIL_THREAD_NAME_LENGTH_MAX];
+    wCommonThreadPlacement_t placement;
+    int policy;
+    int priority;
+    int errorCode;
+} wUtilThreadPlaced_t;
+
 /* ----------------------------------------------------------------
  * VARIABLES
  * -------------------------------------------------------------- */
@@ -49,6 +87,51 @@
 // Flag that tells us whether or not we've had a CTRL-C.
 static volatile sig_atomic_t gKeepGoing = true;
 
+// The placement of threads by name: any thread not in here is
+// W_COMMON_THREAD_PLACEMENT_HOUSEKEEPING.
+static const wUtilThreadPlacementName_t gThreadPlacementName[] = {
+    {"readLoop", W_COMMON_THREAD_PLACEMENT_REAL_TIME},
+    {"pwmLoop", W_COMMON_THREAD_PLACEMENT_REAL_TIME},
+    {"stepperLoop", W_COMMON_THREAD_PLACEMENT_REAL_TIME},
+    {"main", W_COMMON_THREAD_PLACEMENT_MEDIA},
+    {"image process", W_COMMON_THREAD_PLACEMENT_MEDIA},
+    {"image motion", W_COMMON_THREAD_PLACEMENT_MEDIA},
+    {"image overlay", W_COMMON_THREAD_PLACEMENT_MEDIA},
+    {"video encode", W_COMMON_THREAD_PLACEMENT_MEDIA},
+    {"record", W_COMMON_THREAD_PLACEMENT_MEDIA},
+    {"feedLoop", W_COMMON_THREAD_PLACEMENT_MEDIA}
+};
+
+// Names for the placement classes, for debug.
+static const char *gThreadPlacementStr[] = {"real-time", "media", "housekeeping"};
+
+// Mutex to protect the placement variables below.
+static std::mutex gThreadPlacementMutex;
+
+// Whether gThreadPlacementCpuSet[] has been worked out yet.
+static bool gThreadPlacementResolved = false;
+
+// The CPUs of each placement class; an empty set means that
+// threads of that class are left where they are.
+static cpu_set_t gThreadPlacementCpuSet[W_COMMON_THREAD_PLACEMENT_MAX_NUM];
+
+// The CPUs that are isolated, for the report.
+static cpu_set_t gThreadPlacementCpuSetIsolated;
+
+// The threads that have been placed.
+static wUtilThreadPlaced_t gThreadPlaced[W_UTIL_THREAD_PLACED_MAX_NUM];
+
+// The number of entries in gThreadPlaced[].
+static unsigned int gThreadPlacedCount = 0;
+
+// The names made by wUtilPipelineName(), kept for the life of the
+// process since they are used as the names of message queues; a
+// list since its entries never move.
+static std::list<std::string> gPipelineName;
+
+// Mutex to protect gPipelineName.
+static std::mutex gPipelineNameMutex;
+
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -78,6 +161,188 @@ static void cleanUpThreadTicked(int *timerFd,
     }
 }
 
+// Parse a Linux CPU list, e.g. "0-2,5", into set, returning the
+// number of CPUs in it or negative error code.
+static int cpuListParse(const char *str, cpu_set_t *set)
+{
+    int countOrErrorCode = 0;
+    const char *pos = str;
+
+    CPU_ZERO(set);
+    while ((countOrErrorCode >= 0) && (*pos != 0) && (*pos != '\n')) {
+        char *end = nullptr;
+        long first = strtol(pos, &end, 10);
+        long last = first;
+        if ((end == pos) || (first < 0)) {
+            countOrErrorCode = -EINVAL;
+        } else if (*end == '-') {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            if ((end == pos) || (last < first)) {
+                countOrErrorCode = -EINVAL;
+            }
+        }
+        if (countOrErrorCode >= 0) {
+            for (long cpu = first; (cpu <= last) && (cpu < CPU_SETSIZE); cpu++) {
+                CPU_SET(cpu, set);
+            }
+            pos = end;
+            if (*pos == ',') {
+                pos++;
+            }
+        }
+    }
+    if (countOrErrorCode >= 0) {
+        countOrErrorCode = CPU_COUNT(set);
+    } else {
+        CPU_ZERO(set);
+    }
+
+    return countOrErrorCode;
+}
+
+// Read a CPU list from a file into set, returning the number
+// of CPUs in it or negative error code.
+static int cpuListRead(const char *path, cpu_set_t *set)
+{
+    int countOrErrorCode = 0;
+    char buffer[W_UTIL_CPU_LIST_LENGTH_MAX];
+
+    CPU_ZERO(set);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+        if (length >= 0) {
+            buffer[length] = 0;
+            countOrErrorCode = cpuListParse(buffer, set);
+        } else {
+            countOrErrorCode = -errno;
+        }
+        close(fd);
+    } else {
+        countOrErrorCode = -errno;
+    }
+
+    return countOrErrorCode;
+}
+
+// Return a CPU set as a Linux CPU list, e.g. "0-2,5".
+static std::string cpuListString(const cpu_set_t *set)
+{
+    std::string str;
+    int first = -1;
+
+    for (int cpu = 0; cpu <= CPU_SETSIZE; cpu++) {
+        bool isSet = (cpu < CPU_SETSIZE) && CPU_ISSET(cpu, set);
+        if (isSet && (first < 0)) {
+            first = cpu;
+        } else if (!isSet && (first >= 0)) {
+            if (!str.empty()) {
+                str += ",";
+            }
+            str += std::to_string(first);
+            if (cpu - 1 > first) {
+                str += "-" + std::to_string(cpu - 1);
+            }
+            first = -1;
+        }
+    }
+    if (str.empty()) {
+        str = "any";
+    }
+
+    return str;
+}
+
+// Work out the CPUs of a placement class: the given macro value if
+// there is one, else defaultSet, either way only the online CPUs.
+static void cpuSetResolve(cpu_set_t *set, const char *macroValue,
+                          const char *macroName, const cpu_set_t *defaultSet,
+                          const cpu_set_t *onlineSet)
+{
+    if (strlen(macroValue) > 0) {
+        if (cpuListParse(macroValue, set) < 0) {
+            W_LOG_WARN("%s (\"%s\") is not a valid CPU list, ignoring it.",
+                       macroName, macroValue);
+        }
+        CPU_AND(set, set, onlineSet);
+        if (CPU_COUNT(set) == 0) {
+            W_LOG_WARN("%s (\"%s\") contains no online CPUs, using the default.",
+                       macroName, macroValue);
+            CPU_OR(set, defaultSet, defaultSet);
+        }
+    } else {
+        CPU_OR(set, defaultSet, defaultSet);
+    }
+}
+
+// Return true if the given thread name is the given name from the
+// table of thread placement, or is that name with " <pipeline>"
+// appended by wUtilPipelineName().
+static bool threadPlacementNameMatch(const char *tableName, const char *name)
+{
+    size_t length = strlen(tableName);
+    bool match = (strncmp(tableName, name, length) == 0);
+
+    if (match && (name[length] != 0)) {
+        match = (name[length] == ' ') && (name[length + 1] != 0);
+        for (const char *c = name + length + 1; match && (*c != 0); c++) {
+            match = (*c >= '0') && (*c <= '9');
+        }
+    }
+
+    return match;
+}
+
+// Work out the CPUs of each placement class; gThreadPlacementMutex
+// must be locked.
+static void threadPlacementResolve()
+{
+    cpu_set_t onlineSet;
+    cpu_set_t defaultSet;
+    cpu_set_t *realTimeSet = &(gThreadPlacementCpuSet[W_COMMON_THREAD_PLACEMENT_REAL_TIME]);
+
+    if (cpuListRead(W_UTIL_CPU_LIST_PATH_ONLINE, &onlineSet) <= 0) {
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long cpu = 0; (cpu < count) && (cpu < CPU_SETSIZE); cpu++) {
+            CPU_SET(cpu, &onlineSet);
+        }
+    }
+    cpuListRead(W_UTIL_CPU_LIST_PATH_ISOLATED, &gThreadPlacementCpuSetIsolated);
+    CPU_AND(&gThreadPlacementCpuSetIsolated, &gThreadPlacementCpuSetIsolated, &onlineSet);
+
+    // Real-time: the isolated CPUs or else the last CPU, so long as
+    // there is something left over for everyone else
+    CPU_ZERO(&defaultSet);
+    if (CPU_COUNT(&gThreadPlacementCpuSetIsolated) > 0) {
+        CPU_OR(&defaultSet, &gThreadPlacementCpuSetIsolated,
+               &gThreadPlacementCpuSetIsolated);
+    } else if (CPU_COUNT(&onlineSet) > 1) {
+        for (int cpu = CPU_SETSIZE - 1; (cpu >= 0) && (CPU_COUNT(&defaultSet) == 0); cpu--) {
+            if (CPU_ISSET(cpu, &onlineSet)) {
+                CPU_SET(cpu, &defaultSet);
+            }
+        }
+    }
+    cpuSetResolve(realTimeSet, W_COMMON_CPU_LIST_REAL_TIME,
+                  "W_COMMON_CPU_LIST_REAL_TIME", &defaultSet, &onlineSet);
+
+    // Media and housekeeping: whatever real-time left
+    CPU_XOR(&defaultSet, &onlineSet, realTimeSet);
+    CPU_AND(&defaultSet, &defaultSet, &onlineSet);
+    if (CPU_COUNT(&defaultSet) == 0) {
+        CPU_OR(&defaultSet, &onlineSet, &onlineSet);
+    }
+    cpuSetResolve(&(gThreadPlacementCpuSet[W_COMMON_THREAD_PLACEMENT_MEDIA]),
+                  W_COMMON_CPU_LIST_MEDIA, "W_COMMON_CPU_LIST_MEDIA",
+                  &defaultSet, &onlineSet);
+    cpuSetResolve(&(gThreadPlacementCpuSet[W_COMMON_THREAD_PLACEMENT_HOUSEKEEPING]),
+                  W_COMMON_CPU_LIST_HOUSEKEEPING, "W_COMMON_CPU_LIST_HOUSEKEEPING",
+                  &defaultSet, &onlineSet);
+
+    gThreadPlacementResolved = true;
+}
+
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -163,6 +428,10 @@ int wUtilThreadTickedStart(wCommonThreadPriority_t priority,
                 timerFdOrErrorCode = -errno;
             }
         }
+        if ((timerFdOrErrorCode >= 0) && name) {
+            // Best effort, put the thread on its CPUs
+            wUtilThreadPlacementSet(thread->native_handle(), name);
+        }
     }
 
     return timerFdOrErrorCode;
@@ -174,6 +443,142 @@ void wUtilThreadTickedStop(int *timerFd, std::thread *thread, bool *keepGoingFla
     cleanUpThreadTicked(timerFd, thread, keepGoingFlag);
 }
 
+// Apply the CPU placement policy to a thread.
+int wUtilThreadPlacementSet(std::thread::native_handle_type thread,
+                            const char *name)
+{
+    int errorCode = -EINVAL;
+
+    if (name) {
+        wCommonThreadPlacement_t placement = W_COMMON_THREAD_PLACEMENT_HOUSEKEEPING;
+        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(gThreadPlacementName); x++) {
+            if (threadPlacementNameMatch(gThreadPlacementName[x].name, name)) {
+                placement = gThreadPlacementName[x].placement;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(gThreadPlacementMutex);
+        if (!gThreadPlacementResolved) {
+            threadPlacementResolve();
+        }
+        errorCode = 0;
+        const cpu_set_t *set = &(gThreadPlacementCpuSet[placement]);
+        if (CPU_COUNT(set) > 0) {
+            errorCode = -pthread_setaffinity_np(thread, sizeof(*set), set);
+            if (errorCode != 0) {
+                W_LOG_WARN("unable to put thread \"%s\" on CPU(s) %s (%d).",
+                           name, cpuListString(set).c_str(), errorCode);
+            }
+        }
+
+        // Record the outcome for wUtilThreadPlacementReport(),
+        // replacing any earlier record of the same name (e.g.
+        // from a thread that has been restarted)
+        wUtilThreadPlaced_t *placed = nullptr;
+        for (unsigned int x = 0; (x < gThreadPlacedCount) && !placed; x++) {
+            if (strncmp(gThreadPlaced[x].name, name, sizeof(gThreadPlaced[x].name) - 1) == 0) {
+                placed = &(gThreadPlaced[x]);
+            }
+        }
+        if (!placed && (gThreadPlacedCount < W_UTIL_ARRAY_COUNT(gThreadPlaced))) {
+            placed = &(gThreadPlaced[gThreadPlacedCount]);
+            gThreadPlacedCount++;
+        }
+        if (placed) {
+            struct sched_param scheduling = {};
+            strncpy(placed->name, name, sizeof(placed->name) - 1);
+            placed->name[sizeof(placed->name) - 1] = 0;
+            placed->placement = placement;
+            placed->policy = SCHED_OTHER;
+            pthread_getschedparam(thread, &(placed->policy), &scheduling);
+            placed->priority = scheduling.sched_priority;
+            placed->errorCode = errorCode;
+        }
+    }
+
+    return errorCode;
+}
+
+// Log the placement of the threads.
+void wUtilThreadPlacementReport()
+{
+    std::lock_guard<std::mutex> lock(gThreadPlacementMutex);
+    if (!gThreadPlacementResolved) {
+        threadPlacementResolve();
+    }
+
+    W_LOG_INFO("thread placement (isolated CPU(s) %s):",
+               (CPU_COUNT(&gThreadPlacementCpuSetIsolated) > 0) ?
+               cpuListString(&gThreadPlacementCpuSetIsolated).c_str() : "none");
+    for (unsigned int placement = 0; placement < W_UTIL_ARRAY_COUNT(gThreadPlacementCpuSet); placement++) {
+        // One line per class, listing its threads and their scheduling
+        std::string str;
+        for (unsigned int x = 0; x < gThreadPlacedCount; x++) {
+            wUtilThreadPlaced_t *placed = &(gThreadPlaced[x]);
+            if (placed->placement == (wCommonThreadPlacement_t) placement) {
+                if (!str.empty()) {
+                    str += ", ";
+                }
+                str += "\"" + std::string(placed->name) + "\"";
+                if (placed->policy == SCHED_FIFO) {
+                    str += " FIFO " + std::to_string(placed->priority);
+                } else {
+                    str += " OTHER";
+                }
+                if (placed->errorCode != 0) {
+                    str += " (not placed)";
+                }
+            }
+        }
+        W_LOG_INFO("  %s, CPU(s) %s: %s.", gThreadPlacementStr[placement],
+                   cpuListString(&(gThreadPlacementCpuSet[placement])).c_str(),
+                   str.empty() ? "no threads" : str.c_str());
+    }
+}
+
+// Get the number of CPUs of a placement class.
+unsigned int wUtilThreadPlacementCpuCount(wCommonThreadPlacement_t placement)
+{
+    unsigned int count = 0;
+
+    if (placement < W_COMMON_THREAD_PLACEMENT_MAX_NUM) {
+        std::lock_guard<std::mutex> lock(gThreadPlacementMutex);
+        if (!gThreadPlacementResolved) {
+            threadPlacementResolve();
+        }
+        count = CPU_COUNT(&(gThreadPlacementCpuSet[placement]));
+        if (count == 0) {
+            // Left where they are, which is anywhere
+            count = std::thread::hardware_concurrency();
+        }
+    }
+
+    return count;
+}
+
+// Get the name of something that belongs to a pipeline.
+const char *wUtilPipelineName(const char *name, unsigned int pipeline)
+{
+    const char *pipelineName = name;
+
+    if (name && (pipeline != W_COMMON_PIPELINE_MAIN)) {
+        std::string str = std::string(name) + " " + std::to_string(pipeline);
+        std::lock_guard<std::mutex> lock(gPipelineNameMutex);
+        pipelineName = nullptr;
+        for (auto &entry: gPipelineName) {
+            if (entry == str) {
+                pipelineName = entry.c_str();
+            }
+        }
+        if (!pipelineName) {
+            gPipelineName.push_back(str);
+            pipelineName = gPipelineName.back().c_str();
+        }
+    }
+
+    return pipelineName;
+}
+
 // Poll the given timer for expiry.
 int wUtilBlockTimer(int timerFd, int guardMs)
 {
@@ -180,7 +180,9 @@ int wUtilThreadTickedStart(wCommonThreadPriority_t priority,
  * has expired at least once or if CTRL-C is pressed or if
  * the guard timer is hit.  A ticked thread created by a call
  * to wUtilThreadTickedStart() may call this function to determine
- * if its timer has expired and then perform some action.
+ * if its timer has expired and then perform some action.  This
+ * function may equally be given a non-blocking eventfd, in which
+ * case the return value is the event count.
  *
  * @param timerFd the file descriptor of the timer to poll, must
  *                be a non-negative number.
@@ -221,6 +223,62 @@ int wUtilBlockTimer(int timerFd,
 void wUtilThreadTickedStop(int *timerFd, std::thread *thread,
                            bool *keepGoingFlag);
 
+/** Apply the CPU placement policy to a thread: the thread is given
+ * the CPUs of its wCommonThreadPlacement_t class, the class being
+ * looked up by the name of the thread, ignoring any pipeline number
+ * appended by wUtilPipelineName() (unknown names are
+ * W_COMMON_THREAD_PLACEMENT_HOUSEKEEPING).  The CPU sets of the
+ * classes are worked out on first call, from the
+ * W_COMMON_CPU_LIST_xxx macros, /sys/devices/system/cpu/online and
+ * /sys/devices/system/cpu/isolated.  This should be called once the
+ * scheduling of the thread has been set, since that is recorded for
+ * wUtilThreadPlacementReport(); wUtilThreadTickedStart() calls it.
+ * Any thread that the placed thread goes on to create inherits its
+ * CPUs, which is how threads created by libraries (the camera, the
+ * pool of the video encoder) are placed.
+ *
+ * @param thread the native handle of the thread, e.g. from
+ *               std::thread::native_handle() or pthread_self().
+ * @param name   the name of the thread, as given to
+ *               pthread_setname_np(); cannot be nullptr.
+ * @return       zero on success else negative error code; on
+ *               failure the thread is left where it was, which
+ *               is no worse than before.
+ */
+int wUtilThreadPlacementSet(std::thread::native_handle_type thread,
+                            const char *name);
+
+/** Log the CPUs of each placement class, and the class, CPUs and
+ * scheduling of each thread placed with wUtilThreadPlacementSet()
+ * so far; called by main() once everything is started.
+ */
+void wUtilThreadPlacementReport();
+
+/** Get the number of CPUs of a placement class, e.g. to share the
+ * media CPUs amongst the video encoders of several pipelines.
+ *
+ * @param placement the placement class.
+ * @return          the number of CPUs of the class; if the class
+ *                  has no CPUs of its own, because its threads are
+ *                  left where they are, the number of CPUs there
+ *                  are.
+ */
+unsigned int wUtilThreadPlacementCpuCount(wCommonThreadPlacement_t placement);
+
+/** Get the name of something (e.g. a message queue, hence a thread)
+ * that belongs to a pipeline: for W_COMMON_PIPELINE_MAIN this is
+ * simply name, else it is name with " <pipeline>" appended, e.g.
+ * "video encode 1", which wUtilThreadPlacementSet() treats as name.
+ * Since the name of a thread is limited to 15 characters, name
+ * should be no longer than 13.  This function is thread-safe.
+ *
+ * @param name     the name; cannot be nullptr.
+ * @param pipeline the pipeline.
+ * @return         the name for the pipeline, which remains valid
+ *                 for the life of the process.
+ */
+const char *wUtilPipelineName(const char *name, unsigned int pipeline);
+
 /** Initialise a time-out with the current time.
  *
  * @return a timeout structure populated with the current time.
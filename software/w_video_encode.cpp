@@ -24,8 +24,12 @@
  */
 
 // The CPP stuff.
+#include <cstring>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <vector>
+#include <chrono>
 
 extern "C" {
 // The FFMPEG stuff, in good 'ole C.
@@ -40,8 +44,12 @@ extern "C" {
 #include <w_util.h>
 #include <w_log.h>
 #include <w_msg.h>
+#include <w_camera.h>
 #include <w_image_processing.h>
 #include <w_hls.h>
+#include <w_record.h>
+#include <w_event.h>
+#include <w_stats.h>
 
 // Us.
 #include <w_video_encode.h>
@@ -57,17 +65,87 @@ extern "C" {
 // The video stream frame rate in units of the video stream time-base.
 #define W_VIDEO_ENCODE_FRAME_RATE_AVRATIONAL {W_COMMON_FRAME_RATE_HERTZ, 1}
 
+#ifndef W_VIDEO_ENCODE_AVFRAME_POOL_SIZE
+// The number of AVFrames kept for re-use: enough for a full video
+// encode queue, plus the one being encoded, plus the one being
+// pushed; if the pool runs dry more are allocated.
+# define W_VIDEO_ENCODE_AVFRAME_POOL_SIZE (W_VIDEO_ENCODE_MSG_QUEUE_MAX_SIZE + 2)
+#endif
+
+#ifndef W_VIDEO_ENCODE_AVIO_BUFFER_SIZE
+// The size of the buffer of the AVIOContext through which the
+// fragmented MP4 is written in low-latency HLS mode.
+# define W_VIDEO_ENCODE_AVIO_BUFFER_SIZE (64 * 1024)
+#endif
+
+// The mp4 muxer flags for low-latency HLS mode: fragments only
+// when told (i.e. once per partial segment), the moov is written
+// with the first fragment, once the codec parameters are known, each
+// fragment is self-contained, as CMAF/MSE want, and no index at the
+// end, since the output is never seeked.
+#define W_VIDEO_ENCODE_LOW_LATENCY_MOVFLAGS "+frag_custom+delay_moov+default_base_moof+skip_trailer"
+
+// The prefix given to the playlist URL when the FFmpeg hls muxer is
+// writing to the in-memory store: anything that isn't a file path
+// will do, it is only there to stop the muxer treating the output as
+// a file (e.g. writing the playlist to a temporary file and renaming
+// it), our io_open()/io_close2() callbacks handle everything.
+#define W_VIDEO_ENCODE_MEMORY_URL_PREFIX "memory://"
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
 
-/** Context needed by the video encode message handler.
+/** Context needed by the video encode message handler, one per
+ * pipeline.
  */
 typedef struct {
+    unsigned int pipeline; // The index of this context in gContext[]
+    int msgQueueId; // The ID of the video encode message queue of this pipeline
     AVFormatContext *formatContext;
+    AVStream *avStream; // Storage for the video stream
+    unsigned int frameOutputCount; // Count of frames received from the video codec, purely for information
+    wUtilMonitorTiming_t monitorTiming; // Keep track of timing on the video stream, purely for information
+    // The number of frames still to be skipped after the last frame
+    // that was pushed to the video encode queue, see
+    // W_VIDEO_ENCODE_QOS_FRAME_SKIP, and the total number of frames
+    // skipped, purely for information
+    unsigned int frameSkipRemaining;
+    uint64_t frameSkipCount;
     AVCodecContext *codecContext;
+    AVPacket *packet; // Re-used for every packet received from the codec
+    // AVFrames for re-use, taken by the thread that pushes frames and
+    // given back by whichever thread frees them, hence the mutex
+    std::mutex avFramePoolMutex;
+    AVFrame *avFramePool[W_VIDEO_ENCODE_AVFRAME_POOL_SIZE];
+    unsigned int avFramePoolCount; // The number of AVFrames in avFramePool
+    uint64_t avFramePoolMissCount; // The number of times the pool was empty, purely for information
+    wHlsMode_t hlsMode;
+    bool memory; // True if the output is to the in-memory store of the wHls API
+    // Low-latency HLS mode only: the fragmented MP4 output of the
+    // muxer is collected in fragment and handed to the wHls API a
+    // partial segment at a time
+    std::vector<uint8_t> fragment; // Cleared, but not freed, after each part
+    bool initWritten;
+    int64_t partDurationFrames; // The duration of the part being muxed, zero if none
+    bool partIndependent; // True if the part being muxed began with a key frame
+    bool partSegmentStart; // True if the part being muxed begins a segment
+    int64_t segmentDurationFrames; // The duration of the segment being muxed
+    // Both modes: the media sequence number of the segment being
+    // muxed, -1 before the first packet, and the presentation
+    // time-stamp of the first packet, for the event index
+    int64_t segmentNumber;
+    int64_t segmentFirstPts;
 } wVideoEncodeContext_t;
 
+/** A file being written by the FFmpeg hls muxer to the in-memory
+ * store: the opaque of the AVIOContext handed out by memoryIoOpen().
+ */
+typedef struct {
+    std::string name; // Without a directory or W_VIDEO_ENCODE_MEMORY_URL_PREFIX
+    std::vector<uint8_t> data;
+} wVideoEncodeMemoryFile_t;
+
 /** Video encoding message types; just the one.
  */
 typedef enum {
@@ -103,21 +181,8 @@ typedef struct {
 // NOTE: there are more messaging-related variables below
 // the definition of the message handling functions.
 
-// The ID of the video encode message queue
-static int gMsgQueueId = -1;
-
-// Context for video encoding.
-static wVideoEncodeContext_t *gContext = nullptr;
-
-// Storage for the video stream.
-static AVStream *gAvStream = nullptr;
-
-// Count of frames received from the video codec, purely for
-// information.
-static unsigned int gFrameOutputCount = 0;
-
-// Keep track of timing on the video stream, purely for information.
-static wUtilMonitorTiming_t gMonitorTiming = {};
+// Contexts for video encoding, one per pipeline.
+static wVideoEncodeContext_t *gContext[W_COMMON_PIPELINE_MAX_NUM] = {};
 
 // NOTE: there are more messaging-related variables below
 // the definition of the message handling functions.
@@ -126,88 +191,438 @@ static wUtilMonitorTiming_t gMonitorTiming = {};
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
 
-// Callback for FFmpeg to call when it has finished with a buffer;
-// the opaque pointer should be the sequence number of the frame,
-// for debug purposes.
+// Callback for FFmpeg to call when it has finished with a buffer,
+// which gives the camera frame buffer back; the opaque pointer
+// should be the sequence number of the frame, for debug purposes.
 static void avFrameFreeCallback(void *opaque, uint8_t *data)
 {
-    free(data);
+    wCameraFrameRelease(data);
     (void) opaque;
     // W_LOG_DEBUG("video codec is done with frame %llu.", (uint64_t) opaque);
 }
 
-// Push a frame of video data onto the queue; data _must_ be a
-// malloc()ed buffer and this function _will_ free that malloc()ed
-// data, even in a fail case.
-static int avFrameQueuePush(uint8_t *data, unsigned int length,
+// Get the context of a pipeline, nullptr if there isn't one.
+static wVideoEncodeContext_t *contextGet(unsigned int pipeline)
+{
+    wVideoEncodeContext_t *context = nullptr;
+
+    if (pipeline < W_UTIL_ARRAY_COUNT(gContext)) {
+        context = gContext[pipeline];
+    }
+
+    return context;
+}
+
+// Get an AVFrame from the pool of a context, allocating one if the
+// pool is empty.
+static AVFrame *avFrameGet(wVideoEncodeContext_t *context)
+{
+    AVFrame *avFrame = nullptr;
+
+    context->avFramePoolMutex.lock();
+    if (context->avFramePoolCount > 0) {
+        context->avFramePoolCount--;
+        avFrame = context->avFramePool[context->avFramePoolCount];
+    } else {
+        context->avFramePoolMissCount++;
+    }
+    context->avFramePoolMutex.unlock();
+
+    if (!avFrame) {
+        avFrame = av_frame_alloc();
+    }
+
+    return avFrame;
+}
+
+// Give an AVFrame back to the pool of a context, or free it if the
+// pool is full; the AVFrame is unreferenced, which will give the
+// camera frame buffer back (via avFrameFreeCallback()) if the codec
+// is also done with it, and *avFrame is set to nullptr.
+static void avFramePut(wVideoEncodeContext_t *context, AVFrame **avFrame)
+{
+    if (*avFrame) {
+        av_frame_unref(*avFrame);
+        context->avFramePoolMutex.lock();
+        if (context->avFramePoolCount < W_UTIL_ARRAY_COUNT(context->avFramePool)) {
+            context->avFramePool[context->avFramePoolCount] = *avFrame;
+            context->avFramePoolCount++;
+            *avFrame = nullptr;
+        }
+        context->avFramePoolMutex.unlock();
+        // Does nothing if the AVFrame went into the pool
+        av_frame_free(avFrame);
+    }
+}
+
+// Work out the duration, in frames, to give to a frame that is about
+// to be pushed to the video encode queue: if the encoder is falling
+// behind, the frame is made to last longer and frameSkipRemaining
+// is set so that the frames that follow it are skipped.
+static unsigned int frameDurationQos(wVideoEncodeContext_t *context)
+{
+    unsigned int duration = 1;
+
+#if W_VIDEO_ENCODE_QOS_FRAME_SKIP
+    int backlog = wMsgQueueLengthGet(context->msgQueueId);
+    if (backlog >= W_VIDEO_ENCODE_QOS_BACKLOG_THRESHOLD) {
+        duration += backlog - W_VIDEO_ENCODE_QOS_BACKLOG_THRESHOLD + 1;
+        if (duration > W_VIDEO_ENCODE_QOS_FRAME_DURATION_MAX) {
+            duration = W_VIDEO_ENCODE_QOS_FRAME_DURATION_MAX;
+        }
+    }
+    context->frameSkipRemaining = duration - 1;
+#else
+    (void) context;
+#endif
+
+    return duration;
+}
+
+// Push a frame of video data onto the queue of a pipeline; data
+// _must_ be a camera frame buffer and this function _will_ release
+// it with wCameraFrameRelease(), even in a fail case.  The frame
+// buffer is wrapped in the AVFrame, it is not copied.  If the
+// encoder is falling behind the frame may be skipped (see
+// W_VIDEO_ENCODE_QOS_FRAME_SKIP), in which case the current length
+// of the queue is returned.
+static int avFrameQueuePush(unsigned int pipeline,
+                            uint8_t *data, unsigned int length,
                             unsigned int sequenceNumber,
                             unsigned int width, unsigned int height,
                             unsigned int yStride)
 {
     int queueLengthOrErrorCode = -ENOMEM;
+    wVideoEncodeContext_t *context = contextGet(pipeline);
 
-    AVFrame *avFrame = av_frame_alloc();
-    if (avFrame) {
-        avFrame->format = AV_PIX_FMT_YUV420P;
-        avFrame->width = width;
-        avFrame->height = height;
-        // Each line size is the width of a plane (Y, U or V) plus packing,
-        // e.g. in the case of a 960 pixel wide frame the stride is 1024.
-        // But in YUV420 only the Y plane is at full resolution, the U and
-        // V planes are at half resolution (e.g. 512), hence the divide by
-        // two for planes 1 and 2 below
-        avFrame->linesize[0] = yStride;
-        avFrame->linesize[1] = yStride >> 1;
-        avFrame->linesize[2] = yStride >> 1;
-        avFrame->time_base = W_VIDEO_ENCODE_TIME_BASE_AVRATIONAL;
-        avFrame->pts = sequenceNumber;
-        avFrame->duration = 1;
-        // avFrameFreeCallback() is the function which ultimately frees
-        // the video data we are passing around, once the video codec has
-        // finished with it
-        avFrame->buf[0] = av_buffer_create(data, length,
-                                           avFrameFreeCallback,
-                                           (void *) (uint64_t) sequenceNumber,
-                                           0);
-        if (avFrame->buf[0]) {
-            queueLengthOrErrorCode = 0;
-        }
-        if (queueLengthOrErrorCode == 0) {
-            queueLengthOrErrorCode =  av_image_fill_pointers(avFrame->data,
-                                                             AV_PIX_FMT_YUV420P,
-                                                             avFrame->height,
-                                                             avFrame->buf[0]->data,
-                                                             avFrame->linesize);
-        }
-        if (queueLengthOrErrorCode >= 0) {
-            queueLengthOrErrorCode = av_frame_make_writable(avFrame);
-        }
-
-        if (queueLengthOrErrorCode == 0) {
-            queueLengthOrErrorCode = wMsgPush(gMsgQueueId,
-                                              W_VIDEO_ENCODE_MSG_TYPE_AVFRAME_PTR_PTR,
-                                              &avFrame, sizeof(avFrame));
-        }
-
-        if (queueLengthOrErrorCode < 0) {
-            // This will cause avFrameFreeCallback() to be
-            // called and free the data
-            av_frame_free(&avFrame);
-            W_LOG_ERROR("unable to push frame %d to video queue (%d)!",
-                        sequenceNumber, queueLengthOrErrorCode);
+    if (!context) {
+        queueLengthOrErrorCode = -EBADF;
+        wCameraFrameRelease(data);
+    } else if (context->frameSkipRemaining > 0) {
+        // The previous frame we pushed covers this one
+        context->frameSkipRemaining--;
+        context->frameSkipCount++;
+        wCameraFrameRelease(data);
+        queueLengthOrErrorCode = wMsgQueueLengthGet(context->msgQueueId);
+    } else {
+        AVFrame *avFrame = avFrameGet(context);
+        if (avFrame) {
+            avFrame->format = AV_PIX_FMT_YUV420P;
+            avFrame->width = width;
+            avFrame->height = height;
+            // Each line size is the width of a plane (Y, U or V) plus packing,
+            // e.g. in the case of a 960 pixel wide frame the stride is 1024.
+            // But in YUV420 only the Y plane is at full resolution, the U and
+            // V planes are at half resolution (e.g. 512), hence the divide by
+            // two for planes 1 and 2 below
+            avFrame->linesize[0] = yStride;
+            avFrame->linesize[1] = yStride >> 1;
+            avFrame->linesize[2] = yStride >> 1;
+            avFrame->time_base = W_VIDEO_ENCODE_TIME_BASE_AVRATIONAL;
+            avFrame->pts = sequenceNumber;
+            avFrame->duration = frameDurationQos(context);
+            // avFrameFreeCallback() is the function which ultimately releases
+            // the camera frame buffer we are passing around, once the video
+            // codec has finished with it
+            avFrame->buf[0] = av_buffer_create(data, length,
+                                               avFrameFreeCallback,
+                                               (void *) (uint64_t) sequenceNumber,
+                                               0);
+            if (avFrame->buf[0]) {
+                queueLengthOrErrorCode = 0;
+            } else {
+                // Not attached to the frame, so release it here
+                wCameraFrameRelease(data);
+            }
+            if (queueLengthOrErrorCode == 0) {
+                queueLengthOrErrorCode =  av_image_fill_pointers(avFrame->data,
+                                                                 AV_PIX_FMT_YUV420P,
+                                                                 avFrame->height,
+                                                                 avFrame->buf[0]->data,
+                                                                 avFrame->linesize);
+            }
+            // Note: the encoder only reads the frame, so there is no need
+            // to av_frame_make_writable() it, which could make a copy
+            if (queueLengthOrErrorCode >= 0) {
+                queueLengthOrErrorCode = wMsgPush(context->msgQueueId,
+                                                  W_VIDEO_ENCODE_MSG_TYPE_AVFRAME_PTR_PTR,
+                                                  &avFrame, sizeof(avFrame));
+            }
+
+            if (queueLengthOrErrorCode < 0) {
+                // This will cause avFrameFreeCallback() to be
+                // called and release the data
+                avFramePut(context, &avFrame);
+                W_LOG_ERROR("unable to push frame %d to video queue %d (%d)!",
+                            sequenceNumber, pipeline, queueLengthOrErrorCode);
+            }
+        } else {
+            wCameraFrameRelease(data);
         }
     }
 
     return queueLengthOrErrorCode;
 }
 
-// Get video from the codec and write it to the output.
-static int videoOutput(AVCodecContext *codecContext, AVFormatContext *formatContext)
+// The write function of the AVIOContext in low-latency HLS mode,
+// which simply collects what is written in the fragment buffer,
+// passed as opaque.
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int avioWrite(void *opaque, const uint8_t *buffer, int size)
+#else
+static int avioWrite(void *opaque, uint8_t *buffer, int size)
+#endif
+{
+    std::vector<uint8_t> *fragment = (std::vector<uint8_t> *) opaque;
+
+    fragment->insert(fragment->end(), buffer, buffer + size);
+
+    return size;
+}
+
+// The write function of an AVIOContext opened by memoryIoOpen(),
+// which collects what is written in the wVideoEncodeMemoryFile_t
+// passed as opaque.
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int memoryIoWrite(void *opaque, const uint8_t *buffer, int size)
+#else
+static int memoryIoWrite(void *opaque, uint8_t *buffer, int size)
+#endif
+{
+    wVideoEncodeMemoryFile_t *file = (wVideoEncodeMemoryFile_t *) opaque;
+
+    file->data.insert(file->data.end(), buffer, buffer + size);
+
+    return size;
+}
+
+// The io_open() callback of the AVFormatContext when the FFmpeg hls
+// muxer is writing to the in-memory store: instead of opening a file,
+// give the muxer an AVIOContext that collects what it writes.
+static int memoryIoOpen(struct AVFormatContext *formatContext, AVIOContext **pb,
+                        const char *url, int flags, AVDictionary **options)
+{
+    int errorCode = -ENOMEM;
+    const char *name = strrchr(url, '/');
+
+    (void) formatContext;
+    (void) options;
+
+    if (flags & AVIO_FLAG_READ) {
+        // The muxer only ever writes
+        errorCode = AVERROR(EINVAL);
+    } else {
+        wVideoEncodeMemoryFile_t *file = new wVideoEncodeMemoryFile_t();
+        file->name = name ? name + 1 : url;
+        uint8_t *buffer = (uint8_t *) av_malloc(W_VIDEO_ENCODE_AVIO_BUFFER_SIZE);
+        if (buffer) {
+            *pb = avio_alloc_context(buffer, W_VIDEO_ENCODE_AVIO_BUFFER_SIZE,
+                                     1, file, nullptr, memoryIoWrite, nullptr);
+        }
+        if (buffer && *pb) {
+            errorCode = 0;
+        } else {
+            av_free(buffer);
+            delete file;
+            errorCode = AVERROR(ENOMEM);
+        }
+    }
+
+    return errorCode;
+}
+
+// The io_close2() callback that goes with memoryIoOpen(): put what
+// was written in the in-memory store, segments in its ring since,
+// without the delete_segments flag, the muxer never deletes them.
+static int memoryIoClose(struct AVFormatContext *formatContext, AVIOContext *pb)
+{
+    (void) formatContext;
+
+    if (pb) {
+        avio_flush(pb);
+        wVideoEncodeMemoryFile_t *file = (wVideoEncodeMemoryFile_t *) pb->opaque;
+        std::string extension = W_HLS_SEGMENT_FILE_EXTENSION;
+        bool ring = (file->name.length() >= extension.length()) &&
+                    (file->name.compare(file->name.length() - extension.length(),
+                                        extension.length(), extension) == 0);
+        wHlsMemoryFileWrite(file->name, file->data.data(), file->data.size(), ring);
+        delete file;
+        av_freep(&(pb->buffer));
+        avio_context_free(&pb);
+    }
+
+    return 0;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR < 60
+// Older FFmpeg only has io_close(), with no return value.
+static void memoryIoCloseVoid(struct AVFormatContext *formatContext, AVIOContext *pb)
+{
+    memoryIoClose(formatContext, pb);
+}
+#endif
+
+// Return the offset of the first top-level MP4 box of the given type
+// (e.g. "moof") in data, or length if there is none.
+static size_t mp4BoxFind(const uint8_t *data, size_t length, const char *type)
+{
+    size_t offset = 0;
+    bool found = false;
+
+    while (!found && (offset + 8 <= length)) {
+        uint64_t size = (((uint32_t) data[offset]) << 24) |
+                        (((uint32_t) data[offset + 1]) << 16) |
+                        (((uint32_t) data[offset + 2]) << 8) |
+                        data[offset + 3];
+        if (memcmp(data + offset + 4, type, 4) == 0) {
+            found = true;
+        } else {
+            if ((size == 1) && (offset + 16 <= length)) {
+                // 64-bit size follows the type
+                size = 0;
+                for (unsigned int x = 0; x < 8; x++) {
+                    size = (size << 8) | data[offset + 8 + x];
+                }
+            }
+            if ((size < 8) || (size > length - offset)) {
+                // Either "to the end" or broken, either way we're done
+                offset = length;
+            } else {
+                offset += size;
+            }
+        }
+    }
+    if (!found) {
+        offset = length;
+    }
+
+    return offset;
+}
+
+// Low-latency HLS mode: end the part being muxed, flushing the
+// fragment the mp4 muxer has built up and passing it to the wHls API;
+// the first time around, everything before the first moof box (i.e.
+// the ftyp and the moov) is the initialisation segment.
+static int lowLatencyPartEnd(wVideoEncodeContext_t *context)
+{
+    int errorCode = 0;
+
+    if (context->partDurationFrames > 0) {
+        errorCode = av_write_frame(context->formatContext, nullptr);
+        if (errorCode >= 0) {
+            avio_flush(context->formatContext->pb);
+            errorCode = 0;
+            const uint8_t *data = context->fragment.data();
+            size_t length = context->fragment.size();
+            if (!context->initWritten) {
+                size_t offset = mp4BoxFind(data, length, "moof");
+                if (offset < length) {
+                    errorCode = wHlsLowLatencyInitWrite(data, offset);
+                    data += offset;
+                    length -= offset;
+                    context->initWritten = true;
+                }
+            }
+            if ((errorCode == 0) && context->initWritten && (length > 0)) {
+                errorCode = wHlsLowLatencyPartWrite(data, length,
+                                                    ((double) context->partDurationFrames) /
+                                                    W_COMMON_FRAME_RATE_HERTZ,
+                                                    context->partIndependent,
+                                                    context->partSegmentStart);
+            }
+        } else {
+            W_LOG_ERROR("error %d flushing MP4 fragment!", errorCode);
+        }
+        context->fragment.clear();
+        context->partDurationFrames = 0;
+    }
+
+    return errorCode;
+}
+
+// Low-latency HLS mode: write a packet to the mp4 muxer, first
+// ending the part being muxed if the packet is a key frame (which
+// may also begin a new segment) or if adding the packet would take
+// the part beyond W_HLS_LOW_LATENCY_PART_DURATION_FRAMES.  The packet
+// is unreferenced.
+static int lowLatencyPacketWrite(wVideoEncodeContext_t *context, AVPacket *packet)
+{
+    int errorCode = 0;
+    bool keyFrame = ((packet->flags & AV_PKT_FLAG_KEY) != 0);
+    int64_t duration = (packet->duration > 0) ? packet->duration : 1;
+
+    if (keyFrame ||
+        (context->partDurationFrames + duration > W_HLS_LOW_LATENCY_PART_DURATION_FRAMES)) {
+        errorCode = lowLatencyPartEnd(context);
+    }
+    if (context->partDurationFrames == 0) {
+        // A new part: like the FFmpeg hls muxer, a segment begins at
+        // the first key frame after the segment duration is reached
+        context->partIndependent = keyFrame;
+        context->partSegmentStart = keyFrame &&
+                                    (context->segmentDurationFrames >=
+                                     W_HLS_SEGMENT_DURATION_SECONDS * W_COMMON_FRAME_RATE_HERTZ);
+        if (context->partSegmentStart) {
+            context->segmentDurationFrames = 0;
+        }
+    }
+    context->partDurationFrames += duration;
+    context->segmentDurationFrames += duration;
+
+    if (errorCode == 0) {
+        av_packet_rescale_ts(packet, W_VIDEO_ENCODE_TIME_BASE_AVRATIONAL,
+                             context->avStream->time_base);
+        packet->stream_index = context->avStream->index;
+        errorCode = av_write_frame(context->formatContext, packet);
+    }
+    av_packet_unref(packet);
+
+    return errorCode;
+}
+
+// Work out whether a packet, about to be written to the output,
+// begins a new HLS segment, in the same way as the muxer will, and
+// if it does tell the event index which segment it is.
+static void segmentTrack(wVideoEncodeContext_t *context, const AVPacket *packet)
+{
+    bool keyFrame = ((packet->flags & AV_PKT_FLAG_KEY) != 0);
+    int64_t segmentFrames = W_HLS_SEGMENT_DURATION_SECONDS * W_COMMON_FRAME_RATE_HERTZ;
+    // The first packet always begins the first segment
+    bool segmentStart = (context->segmentNumber < 0);
+
+    if (!segmentStart && keyFrame && (packet->pts != AV_NOPTS_VALUE)) {
+        if (context->hlsMode == W_HLS_MODE_LOW_LATENCY) {
+            // As lowLatencyPacketWrite() will decide
+            segmentStart = (context->segmentDurationFrames >= segmentFrames);
+        } else {
+            // The FFmpeg hls muxer begins a segment at the first key
+            // frame at least hls_time (which is left at its default,
+            // the same as W_HLS_SEGMENT_DURATION_SECONDS) per segment
+            // so far from the start of the stream
+            segmentStart = (packet->pts - context->segmentFirstPts >=
+                            (context->segmentNumber + 1) * segmentFrames);
+        }
+    }
+    if (segmentStart) {
+        if (context->segmentNumber < 0) {
+            context->segmentFirstPts = packet->pts;
+        }
+        context->segmentNumber++;
+        wEventSegment(context->segmentNumber, packet->pts);
+    }
+}
+
+// Get video from the codec of a context and write it to the output,
+// using the packet of the context, which is left unreferenced, to
+// receive it.
+static int videoOutput(wVideoEncodeContext_t *context)
 {
     int errorCode = -ENOMEM;
     unsigned int numReceivedPackets = 0;
+    AVCodecContext *codecContext = context->codecContext;
+    AVFormatContext *formatContext = context->formatContext;
+    AVPacket *packet = context->packet;
 
-    AVPacket *packet = av_packet_alloc();
     if (packet) {
         errorCode = 0;
         // Call avcodec_receive_packet until it returns AVERROR(EAGAIN),
@@ -217,10 +632,28 @@ static int videoOutput(AVCodecContext *codecContext, AVFormatContext *formatCont
             if (errorCode == 0) {
                 numReceivedPackets++;
                 packet->time_base = W_VIDEO_ENCODE_TIME_BASE_AVRATIONAL;
-                errorCode = av_interleaved_write_frame(formatContext, packet);
-                // Apparently av_interleave_write_frame() unreferences the
-                // packet so we don't need to worry about that
-                gFrameOutputCount++;
+                if (context->pipeline == W_COMMON_PIPELINE_MAIN) {
+                    // Event recording takes its own reference, if it
+                    // wants one; it and the event index are for the
+                    // main pipeline only
+                    wRecordPacket(packet);
+                    segmentTrack(context, packet);
+                }
+                // The presentation time-stamp is the camera sequence
+                // number, grab it before the packet is unreferenced
+                int64_t pts = packet->pts;
+                if (context->hlsMode == W_HLS_MODE_LOW_LATENCY) {
+                    errorCode = lowLatencyPacketWrite(context, packet);
+                } else {
+                    errorCode = av_interleaved_write_frame(formatContext, packet);
+                    // Apparently av_interleave_write_frame() unreferences the
+                    // packet so we don't need to worry about that
+                }
+                context->frameOutputCount++;
+                if ((errorCode == 0) && (pts != AV_NOPTS_VALUE)) {
+                    wStatsTimestamp(context->pipeline, W_STATS_POINT_PACKET_WRITTEN,
+                                    (unsigned int) pts);
+                }
             }
         } while (errorCode == 0);
         if ((numReceivedPackets > 0) &&
@@ -231,26 +664,28 @@ static int videoOutput(AVCodecContext *codecContext, AVFormatContext *formatCont
             W_LOG_DEBUG("FFmpeg returned error %d (might be because it needs"
                         " more frames to form an output).", errorCode);
         }
-        av_packet_free(&packet);
+        // In case of an error part-way through
+        av_packet_unref(packet);
     } else {
-         W_LOG_ERROR("unable to allocate packet for FFmpeg encode!");
+         W_LOG_ERROR("no packet for FFmpeg encode!");
     }
 
     return errorCode;
 }
 
-// Flush the video output.
-static int videoOutputFlush(AVCodecContext *codecContext, AVFormatContext *formatContext)
+// Flush the video output of a context.
+static int videoOutputFlush(wVideoEncodeContext_t *context)
 {
     int errorCode = 0;
+    AVCodecContext *codecContext = context->codecContext;
 
-    W_LOG_DEBUG("flushing video output.");
+    W_LOG_DEBUG("flushing video output %d.", context->pipeline);
 
-    if (codecContext && formatContext) {
+    if (codecContext && context->formatContext) {
         // This puts the codec into flush mode
         errorCode = avcodec_send_frame(codecContext, nullptr);
         if (errorCode == 0) {
-            errorCode = videoOutput(codecContext, formatContext);
+            errorCode = videoOutput(context);
         }
         // In case we want to use the codec again
         avcodec_flush_buffers(codecContext);
@@ -259,30 +694,287 @@ static int videoOutputFlush(AVCodecContext *codecContext, AVFormatContext *forma
     return errorCode;
 }
 
-// Release the queue, contexts, etc.
-static void cleanUp()
+// Allocate a codec context for the given encoder, configure it and
+// open it; on success *codecContext is populated, else it is set
+// to nullptr.
+static int codecOpen(const AVCodec *codec, const wVideoEncodeCodecCfg_t *codecCfg,
+                     AVCodecContext **codecContext)
+{
+    int errorCode = -ENOMEM;
+    AVDictionary *codecOptions = nullptr;
+    bool isX264 = (std::string(codec->name) == "libx264");
+    bool isHardware = ((codec->capabilities & AV_CODEC_CAP_HARDWARE) != 0);
+
+    *codecContext = avcodec_alloc_context3(codec);
+    if (*codecContext) {
+        AVCodecContext *context = *codecContext;
+        W_LOG_DEBUG("video codec %s capabilities 0x%08x.", codec->name, codec->capabilities);
+        context->width = W_COMMON_WIDTH_PIXELS;
+        context->height = W_COMMON_HEIGHT_PIXELS;
+        context->time_base = W_VIDEO_ENCODE_TIME_BASE_AVRATIONAL;
+        context->framerate = W_VIDEO_ENCODE_FRAME_RATE_AVRATIONAL;
+        // Make sure we get a key frame every segment, otherwise if the
+        // HLS client has to seek backwards from the front and can't find
+        // a key frame it may fail to play the stream
+        context->gop_size = W_HLS_SEGMENT_DURATION_SECONDS * W_COMMON_FRAME_RATE_HERTZ;
+        // See the discussion here on setting keyint_min:
+        // https://superuser.com/questions/908280/what-is-the-correct-way-to-fix-keyframes-in-ffmpeg-for-dash/1223359#1223359
+        // ...noting that the [current version of the] libx264
+        // codec doesn't seem to have a keyint field.
+        context->keyint_min = context->gop_size;
+        context->pix_fmt = AV_PIX_FMT_YUV420P;
+        context->codec_id = AV_CODEC_ID_H264;
+        context->codec_type = AVMEDIA_TYPE_VIDEO;
+        // This is needed to include the frame duration in the encoded
+        // output, otherwise the HLS bit of av_interleaved_write_frame()
+        // will emit a warning that frames having zero duration will mean
+        // the HLS segment timing is orf
+        context->flags = AV_CODEC_FLAG_FRAME_DURATION;
+        if (codecCfg && (codecCfg->threads > 0)) {
+            context->thread_count = codecCfg->threads;
+        }
+        if (codecCfg && codecCfg->sliceThreads) {
+            // Slice threads add no frames of latency, frame threads
+            // add one per thread
+            context->thread_type = FF_THREAD_SLICE;
+        }
+        if (codecCfg && (codecCfg->bitRateKbps > 0)) {
+            context->bit_rate = ((int64_t) codecCfg->bitRateKbps) * 1000;
+        } else if (isHardware) {
+            context->bit_rate = ((int64_t) W_VIDEO_ENCODE_CODEC_BIT_RATE_KBPS_HARDWARE_DEFAULT) * 1000;
+        }
+        errorCode = 0;
+        if (isX264) {
+            // Note: have to set "tune" to "zerolatency" below for the hls.js HLS
+            // client to work correctly: if you do not then hls.js will only work
+            // if it is started at exactly the same time as the served stream is
+            // first started and, also, without this setting hls.js will never
+            // regain sync should it fall off the stream.  I have no idea why; it
+            // took me a week of trial and error with a zillion settings to find
+            // this out
+            errorCode = av_dict_set(&codecOptions, "tune", "zerolatency", 0);
+            if ((errorCode == 0) && codecCfg && !codecCfg->preset.empty()) {
+                errorCode = av_dict_set(&codecOptions, "preset", codecCfg->preset.c_str(), 0);
+            }
+            if ((errorCode == 0) && codecCfg && (codecCfg->crf >= 0)) {
+                errorCode = av_dict_set_int(&codecOptions, "crf", codecCfg->crf, 0);
+            }
+        }
+        if ((errorCode == 0) && codecCfg && !codecCfg->options.empty()) {
+            errorCode = av_dict_parse_string(&codecOptions, codecCfg->options.c_str(),
+                                             "=", ":", 0);
+            if (errorCode != 0) {
+                W_LOG_ERROR("unable to parse codec options \"%s\" (%d)!",
+                            codecCfg->options.c_str(), errorCode);
+            }
+        }
+        if (errorCode == 0) {
+            errorCode = avcodec_open2(context, codec, &codecOptions);
+        }
+        if (errorCode == 0) {
+            // avcodec_open2() modifies the options passed to it to be
+            // any options that weren't found
+            const AVDictionaryEntry *entry = nullptr;
+            while ((entry = av_dict_iterate(codecOptions, entry))) {
+                W_LOG_WARN("codec option \"%s\", or value \"%s\", not found.",
+                           entry->key, entry->value);
+            }
+        } else {
+            avcodec_free_context(codecContext);
+        }
+        av_dict_free(&codecOptions);
+    }
+
+    return errorCode;
+}
+
+// Encode W_VIDEO_ENCODE_PROBE_FRAME_COUNT frames with a throw-away
+// copy of the encoder and return the number of frames per second
+// it managed, or negative error code.  The frames are noise, shifted
+// each frame, so that the encoder has some proper work to do.
+static int codecProbe(const AVCodec *codec, const wVideoEncodeCodecCfg_t *codecCfg)
+{
+    int framesPerSecondOrErrorCode = -ENOMEM;
+    AVCodecContext *codecContext = nullptr;
+    unsigned int lengthY = W_COMMON_WIDTH_PIXELS * W_COMMON_HEIGHT_PIXELS;
+    uint8_t *noise = (uint8_t *) malloc(lengthY * 2);
+    uint8_t *chroma = (uint8_t *) malloc(lengthY / 4);
+    AVFrame *avFrame = av_frame_alloc();
+    AVPacket *packet = av_packet_alloc();
+
+    if (noise && chroma && avFrame && packet) {
+        uint32_t random = 0x12345678;
+        for (unsigned int x = 0; x < lengthY * 2; x++) {
+            // Any old linear-congruential generator will do
+            random = (random * 1103515245) + 12345;
+            noise[x] = (uint8_t) (random >> 24);
+        }
+        memset(chroma, 0x80, lengthY / 4);
+        framesPerSecondOrErrorCode = codecOpen(codec, codecCfg, &codecContext);
+        if (framesPerSecondOrErrorCode == 0) {
+            avFrame->format = AV_PIX_FMT_YUV420P;
+            avFrame->width = W_COMMON_WIDTH_PIXELS;
+            avFrame->height = W_COMMON_HEIGHT_PIXELS;
+            avFrame->linesize[0] = W_COMMON_WIDTH_PIXELS;
+            avFrame->linesize[1] = W_COMMON_WIDTH_PIXELS >> 1;
+            avFrame->linesize[2] = W_COMMON_WIDTH_PIXELS >> 1;
+            avFrame->data[1] = chroma;
+            avFrame->data[2] = chroma;
+            std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+            for (unsigned int x = 0; (x < W_VIDEO_ENCODE_PROBE_FRAME_COUNT) &&
+                                     (framesPerSecondOrErrorCode == 0); x++) {
+                // Not reference counted, the encoder will take a copy
+                avFrame->data[0] = noise + (((x * 7919) % W_COMMON_HEIGHT_PIXELS) *
+                                            W_COMMON_WIDTH_PIXELS);
+                avFrame->pts = x;
+                framesPerSecondOrErrorCode = avcodec_send_frame(codecContext, avFrame);
+                if (framesPerSecondOrErrorCode == AVERROR(EAGAIN)) {
+                    // Full up: empty it and try again
+                    while (avcodec_receive_packet(codecContext, packet) == 0) {
+                        av_packet_unref(packet);
+                    }
+                    framesPerSecondOrErrorCode = avcodec_send_frame(codecContext, avFrame);
+                }
+                while ((framesPerSecondOrErrorCode == 0) &&
+                       (avcodec_receive_packet(codecContext, packet) == 0)) {
+                    av_packet_unref(packet);
+                }
+            }
+            if (framesPerSecondOrErrorCode == 0) {
+                // Get everything out so that the time is honest
+                avcodec_send_frame(codecContext, nullptr);
+                while (avcodec_receive_packet(codecContext, packet) == 0) {
+                    av_packet_unref(packet);
+                }
+                std::chrono::duration<double> duration = std::chrono::steady_clock::now() - startTime;
+                framesPerSecondOrErrorCode = 0;
+                if (duration.count() > 0) {
+                    framesPerSecondOrErrorCode = (int) (W_VIDEO_ENCODE_PROBE_FRAME_COUNT /
+                                                        duration.count());
+                }
+            }
+            avcodec_free_context(&codecContext);
+        }
+    }
+
+    av_packet_free(&packet);
+    av_frame_free(&avFrame);
+    free(chroma);
+    free(noise);
+
+    return framesPerSecondOrErrorCode;
+}
+
+// Open the first encoder in the list given by codecCfg that can be
+// opened and report what it is and what it can do.
+static int codecOpenFirst(const wVideoEncodeCodecCfg_t *codecCfg,
+                          AVCodecContext **codecContext)
 {
-    // Release the message queue
-    if (gMsgQueueId >= 0) {
-        wMsgQueueStop(gMsgQueueId);
-        gMsgQueueId = -1;
+    int errorCode = -ENODEV;
+    std::string names = W_VIDEO_ENCODE_CODEC_NAME_DEFAULT;
+    const AVCodec *codec = nullptr;
+
+    if (codecCfg && !codecCfg->name.empty()) {
+        names = codecCfg->name;
+    }
+    if (names == W_VIDEO_ENCODE_CODEC_NAME_AUTO) {
+        names = W_VIDEO_ENCODE_CODEC_NAME_AUTO_LIST;
+    }
+
+    *codecContext = nullptr;
+    size_t start = 0;
+    while ((start < names.length()) && (*codecContext == nullptr)) {
+        size_t end = names.find(',', start);
+        if (end == std::string::npos) {
+            end = names.length();
+        }
+        std::string name = names.substr(start, end - start);
+        codec = avcodec_find_encoder_by_name(name.c_str());
+        if (codec) {
+            errorCode = codecOpen(codec, codecCfg, codecContext);
+            if (errorCode != 0) {
+                W_LOG_WARN("unable to open video encoder %s (%d).",
+                           name.c_str(), errorCode);
+            }
+        } else {
+            W_LOG_WARN("video encoder %s is not available in FFmpeg.", name.c_str());
+        }
+        start = end + 1;
     }
 
-    if (gContext) {
-        videoOutputFlush(gContext->codecContext,
-                         gContext->formatContext);
+    if (*codecContext) {
+        W_LOG_INFO("video encoder is %s (%s, %s), %dx%d at %d frames/second,"
+                   " %d thread(s) (%s), bit rate %lld kbits/s.", codec->name,
+                   codec->long_name ? codec->long_name : "",
+                   (codec->capabilities & AV_CODEC_CAP_HARDWARE) ? "hardware" : "software",
+                   (*codecContext)->width, (*codecContext)->height,
+                   W_COMMON_FRAME_RATE_HERTZ, (*codecContext)->thread_count,
+                   ((*codecContext)->active_thread_type & FF_THREAD_SLICE) ? "slice" : "frame",
+                   (long long) ((*codecContext)->bit_rate / 1000));
+        if (W_VIDEO_ENCODE_PROBE_FRAME_COUNT > 0) {
+            int framesPerSecond = codecProbe(codec, codecCfg);
+            if (framesPerSecond >= W_COMMON_FRAME_RATE_HERTZ) {
+                W_LOG_INFO("video encoder can sustain around %d frames/second.",
+                           framesPerSecond);
+            } else if (framesPerSecond >= 0) {
+                W_LOG_WARN("video encoder can only sustain around %d frames/second,"
+                           " %d needed, frames will be skipped.",
+                           framesPerSecond, W_COMMON_FRAME_RATE_HERTZ);
+            }
+        }
+    } else {
+        W_LOG_ERROR("unable to open any of the video encoder(s) \"%s\"!",
+                    names.c_str());
+    }
+
+    return errorCode;
+}
+
+// Release the queue, contexts, etc. of a pipeline.
+static void cleanUp(unsigned int pipeline)
+{
+    wVideoEncodeContext_t *context = contextGet(pipeline);
+
+    if (context) {
+        // Release the message queue
+        if (context->msgQueueId >= 0) {
+            wMsgQueueStop(context->msgQueueId);
+            context->msgQueueId = -1;
+        }
+
+        videoOutputFlush(context);
 
         // Free all of the FFmpeg stuff
-        if (gContext->formatContext) {
-            av_write_trailer(gContext->formatContext);
+        if (context->formatContext) {
+            if (context->hlsMode == W_HLS_MODE_LOW_LATENCY) {
+                // Get the last part out before the muxer closes
+                lowLatencyPartEnd(context);
+            }
+            av_write_trailer(context->formatContext);
         }
-        avcodec_free_context(&(gContext->codecContext));
-        if (gContext->formatContext) {
-            avio_closep(&(gContext->formatContext->pb));
-            avformat_free_context(gContext->formatContext);
+        avcodec_free_context(&(context->codecContext));
+        if (context->formatContext) {
+            if (context->formatContext->flags & AVFMT_FLAG_CUSTOM_IO) {
+                // Ours, not opened by FFmpeg
+                if (context->formatContext->pb) {
+                    av_freep(&(context->formatContext->pb->buffer));
+                }
+                avio_context_free(&(context->formatContext->pb));
+            } else {
+                avio_closep(&(context->formatContext->pb));
+            }
+            avformat_free_context(context->formatContext);
+        }
+        if (context->hlsMode == W_HLS_MODE_LOW_LATENCY) {
+            wHlsLowLatencyStop();
         }
-        delete gContext;
-        gContext = nullptr;
+        av_packet_free(&(context->packet));
+        // Nothing can be using the pooled AVFrames now
+        for (unsigned int x = 0; x < context->avFramePoolCount; x++) {
+            av_frame_free(&(context->avFramePool[x]));
+        }
+        delete context;
+        gContext[pipeline] = nullptr;
     }
 }
 
@@ -304,21 +996,23 @@ static void msgHandlerVideoEncodeAvFramePtrPtr(void *msgBody,
 
     // Procedure from https://ffmpeg.org/doxygen/7.0/group__lavc__encdec.html
     // Ownership of the data in the frame now passes
-    // to the video codec and will be free'd by
+    // to the video codec and will be released by
     // avFrameFreeCallback()
     errorCode = avcodec_send_frame(videoEncodeContext->codecContext, *avFrame);
     if (errorCode == 0) {
-        errorCode = videoOutput(videoEncodeContext->codecContext,
-                                videoEncodeContext->formatContext);
+        wStatsTimestamp(videoEncodeContext->pipeline, W_STATS_POINT_ENCODE_SEND,
+                        (unsigned int) (*avFrame)->pts);
+        errorCode = videoOutput(videoEncodeContext);
         // Keep track of timing here, at the end of the 
         // complicated camera/video-frame antics, for debug
         // purposes
-        wUtilMonitorTimingUpdate(&gMonitorTiming);
+        wUtilMonitorTimingUpdate(&(videoEncodeContext->monitorTiming));
     } else {
         W_LOG_ERROR("error %d from avcodec_send_frame()!", errorCode);
     }
-    // Now we can free the frame
-    av_frame_free(avFrame);
+    // Now we can give the frame back to the pool: the codec has
+    // its own reference to the data if it still needs it
+    avFramePut(videoEncodeContext, avFrame);
     if ((errorCode != 0) && (errorCode != AVERROR(EAGAIN))) {
         W_LOG_ERROR("error %d from FFmpeg!", errorCode);
     }
@@ -330,10 +1024,7 @@ static void msgHandlerVideoEncodeAvFramePtrPtrFree(void *msgBody, void *context)
     wVideoEncodeMsgBodyAvFramePtrPtr_t *msg = &(((wVideoEncodeMsgBody_t *) msgBody)->avFramePtrPtr);
     AVFrame **avFrame = (AVFrame **) msg;
 
-    // This handler doesn't use any context
-    (void) context;
-
-    av_frame_free(avFrame);
+    avFramePut((wVideoEncodeContext_t *) context, avFrame);
 }
 
 /* ----------------------------------------------------------------
@@ -350,25 +1041,79 @@ static wVideoEncodeMsgHandler_t gMsgHandler[] = {{.msgType = W_VIDEO_ENCODE_MSG_
  * -------------------------------------------------------------- */
 
 // Initialise video encoding.
-int wVideoEncodeInit(std::string outputDirectory, std::string outputFileName)
+int wVideoEncodeInit(unsigned int pipeline,
+                     std::string outputDirectory, std::string outputFileName,
+                     const wVideoEncodeCodecCfg_t *codecCfg, wHlsMode_t hlsMode)
 {
     int errorCode = 0;
 
-    if (!gContext) {
-        gContext = new wVideoEncodeContext_t;
+    if ((pipeline >= W_UTIL_ARRAY_COUNT(gContext)) ||
+        ((pipeline != W_COMMON_PIPELINE_MAIN) &&
+         (hlsMode == W_HLS_MODE_LOW_LATENCY))) {
+        // Low-latency HLS, like the in-memory store, has only
+        // the one output, that of the main pipeline
+        errorCode = -EINVAL;
+    } else if (!gContext[pipeline]) {
+        wVideoEncodeContext_t *context = new wVideoEncodeContext_t();
+        gContext[pipeline] = context;
+        context->pipeline = pipeline;
+        context->msgQueueId = -1;
+        context->segmentNumber = -1;
         errorCode = -ENOMEM;
+        // Allocate the packet and fill the AVFrame pool now, so that
+        // there is no heap traffic for them once frames are flowing
+        context->packet = av_packet_alloc();
+        for (unsigned int x = 0; x < W_UTIL_ARRAY_COUNT(context->avFramePool); x++) {
+            context->avFramePool[context->avFramePoolCount] = av_frame_alloc();
+            if (context->avFramePool[context->avFramePoolCount]) {
+                context->avFramePoolCount++;
+            }
+        }
+        context->hlsMode = hlsMode;
+        context->memory = (pipeline == W_COMMON_PIPELINE_MAIN) && wHlsMemoryIsStarted();
         // Set up the output stream for video recording, format being
-        // HLS containing H.264-encoded data.
-        const AVOutputFormat *avOutputFormat = av_guess_format("hls", nullptr, nullptr);
+        // HLS containing H.264-encoded data or, in low-latency mode,
+        // fragmented MP4 which we write through our own AVIOContext
+        // and make HLS of with the wHls API
         AVFormatContext *formatContext = nullptr;
-        avformat_alloc_output_context2(&formatContext, avOutputFormat,
-                                       nullptr,
-                                       (outputDirectory + 
-                                        std::string(W_UTIL_DIR_SEPARATOR) +
-                                        outputFileName +
-                                        std::string(W_HLS_PLAYLIST_FILE_EXTENSION)).c_str());
+        if (context->packet) {
+            if (hlsMode == W_HLS_MODE_LOW_LATENCY) {
+                avformat_alloc_output_context2(&formatContext, nullptr, "mp4", nullptr);
+                uint8_t *avioBuffer = (uint8_t *) av_malloc(W_VIDEO_ENCODE_AVIO_BUFFER_SIZE);
+                if (formatContext && avioBuffer) {
+                    formatContext->pb = avio_alloc_context(avioBuffer,
+                                                           W_VIDEO_ENCODE_AVIO_BUFFER_SIZE,
+                                                           1, &(context->fragment),
+                                                           nullptr, avioWrite, nullptr);
+                    formatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+                }
+                if (!formatContext || !formatContext->pb) {
+                    av_free(avioBuffer);
+                    avformat_free_context(formatContext);
+                    formatContext = nullptr;
+                }
+            } else {
+                const AVOutputFormat *avOutputFormat = av_guess_format("hls", nullptr, nullptr);
+                std::string url = outputDirectory + std::string(W_UTIL_DIR_SEPARATOR);
+                if (context->memory) {
+                    url = std::string(W_VIDEO_ENCODE_MEMORY_URL_PREFIX);
+                }
+                url += outputFileName + std::string(W_HLS_PLAYLIST_FILE_EXTENSION);
+                avformat_alloc_output_context2(&formatContext, avOutputFormat,
+                                               nullptr, url.c_str());
+                if (formatContext && context->memory) {
+                    // The playlist and segments go to the in-memory store
+                    formatContext->io_open = memoryIoOpen;
+#if LIBAVFORMAT_VERSION_MAJOR >= 60
+                    formatContext->io_close2 = memoryIoClose;
+#else
+                    formatContext->io_close = memoryIoCloseVoid;
+#endif
+                }
+            }
+        }
         if (formatContext) {
-            gContext->formatContext = formatContext;
+            context->formatContext = formatContext;
             // Configure the HLS options
             AVDictionary *hlsOptions = nullptr;
             // Note: the original example I was following:
@@ -390,84 +1135,65 @@ int wVideoEncodeInit(std::string outputDirectory, std::string outputFileName)
             // W_HLS_SEGMENT_DURATION_SECONDS and then the HLS muxer picks that up and uses it
             // as the segment size, which is much better, since it ensures a key-frame at the
             // start of every segment.
-            if ((av_dict_set(&hlsOptions, "hls_segment_type", "mpegts", 0) == 0) &&
-                (av_dict_set_int(&hlsOptions, "hls_list_size", W_HLS_LIST_SIZE, 0) == 0) &&
-                (av_dict_set_int(&hlsOptions, "hls_allow_cache", 0, 0) == 0) &&
-                (av_dict_set(&hlsOptions, "hls_flags", "delete_segments+" // Delete segments no longer in .m3u8 file
-                                                       "program_date_time", 0) == 0)) { // Not required but nice to have
+            // In low-latency mode the FFmpeg hls muxer is not used (it
+            // has no notion of partial segments), the only options are
+            // those of the mp4 muxer
+            bool optionsSet = false;
+            if (hlsMode == W_HLS_MODE_LOW_LATENCY) {
+                optionsSet = (av_dict_set(&hlsOptions, "movflags",
+                                          W_VIDEO_ENCODE_LOW_LATENCY_MOVFLAGS, 0) == 0) &&
+                             (wHlsLowLatencyStart(outputDirectory, outputFileName) == 0);
+            } else {
+                // In memory the ring of the store does the deleting of
+                // old segments
+                optionsSet = (av_dict_set(&hlsOptions, "hls_segment_type", "mpegts", 0) == 0) &&
+                             (av_dict_set_int(&hlsOptions, "hls_list_size", W_HLS_LIST_SIZE, 0) == 0) &&
+                             (av_dict_set_int(&hlsOptions, "hls_allow_cache", 0, 0) == 0) &&
+                             (av_dict_set(&hlsOptions, "hls_flags",
+                                          context->memory ? "program_date_time" :
+                                          "delete_segments+" // Delete segments no longer in .m3u8 file
+                                          "program_date_time", 0) == 0); // Not required but nice to have
+            }
+            if (optionsSet) {
                 //  Set up the H264 video output stream over HLS
-                gAvStream = avformat_new_stream(formatContext, nullptr);
-                if (gAvStream) {
-                    errorCode = -ENODEV;
-                    const AVCodec *videoOutputCodec = avcodec_find_encoder_by_name("libx264");
-                    if (videoOutputCodec) {
-                        errorCode = -ENOMEM;
-                        AVCodecContext *codecContext = avcodec_alloc_context3(videoOutputCodec);
-                        if (codecContext) {
-                            gContext->codecContext = codecContext;
-                            W_LOG_DEBUG("video codec capabilities 0x%08x.", videoOutputCodec->capabilities);
-                            codecContext->width = W_COMMON_WIDTH_PIXELS;
-                            codecContext->height = W_COMMON_HEIGHT_PIXELS;
-                            codecContext->time_base = W_VIDEO_ENCODE_TIME_BASE_AVRATIONAL;
-                            codecContext->framerate = W_VIDEO_ENCODE_FRAME_RATE_AVRATIONAL;
-                            // Make sure we get a key frame every segment, otherwise if the
-                            // HLS client has to seek backwards from the front and can't find
-                            // a key frame it may fail to play the stream
-                            codecContext->gop_size = W_HLS_SEGMENT_DURATION_SECONDS * W_COMMON_FRAME_RATE_HERTZ;
-                            // See the discussion here on setting keyint_min:
-                            // https://superuser.com/questions/908280/what-is-the-correct-way-to-fix-keyframes-in-ffmpeg-for-dash/1223359#1223359
-                            // ...noting that the [current version of the] libx264
-                            // codec doesn't seem to have a keyint field.
-                            codecContext->keyint_min = codecContext->gop_size;
-                            codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
-                            codecContext->codec_id = AV_CODEC_ID_H264;
-                            codecContext->codec_type = AVMEDIA_TYPE_VIDEO;
-                            // This is needed to include the frame duration in the encoded
-                            // output, otherwise the HLS bit of av_interleaved_write_frame()
-                            // will emit a warning that frames having zero duration will mean
-                            // the HLS segment timing is orf
-                            codecContext->flags = AV_CODEC_FLAG_FRAME_DURATION;
-                            AVDictionary *codecOptions = nullptr;
-                            // Note: have to set "tune" to "zerolatency" below for the hls.js HLS
-                            // client to work correctly: if you do not then hls.js will only work
-                            // if it is started at exactly the same time as the served stream is
-                            // first started and, also, without this setting hls.js will never
-                            // regain sync should it fall off the stream.  I have no idea why; it
-                            // took me a week of trial and error with a zillion settings to find
-                            // this out
-                            if ((av_dict_set(&codecOptions, "tune", "zerolatency", 0) == 0) &&
-                                (avcodec_open2(codecContext,
-                                               videoOutputCodec, &codecOptions) == 0) &&
-                                (avcodec_parameters_from_context(gAvStream->codecpar,
-                                                                 gContext->codecContext) == 0) &&
-                                (avformat_write_header(formatContext, &hlsOptions) >= 0)) {
-                                // avformat_write_header() and avcodec_open2() modify
-                                // the options passed to them to be any options that weren't
-                                // found
-                                const AVDictionaryEntry *entry = nullptr;
-                                while ((entry = av_dict_iterate(hlsOptions, entry))) {
-                                    W_LOG_WARN("HLS option \"%s\", or value \"%s\", not found.",
-                                               entry->key, entry->value);
-                                }
-                                while ((entry = av_dict_iterate(codecOptions, entry))) {
-                                    W_LOG_WARN("codec option \"%s\", or value \"%s\", not found.",
-                                               entry->key, entry->value);
-                                }
-                                // Don't see why this should be necessary (everything in here
-                                // seems to have its own copy of time_base: the AVCodecContext does,
-                                // AVFrame does and apparently AVStream does), but the example:
-                                // https://ffmpeg.org/doxygen/trunk/transcode_8c-example.html
-                                // does it and if you don't do it the output has no timing.
-                                gAvStream->time_base = gContext->codecContext->time_base;
-                                errorCode = 0;
-                            } else {
-                                W_LOG_ERROR("unable to either open video codec or write AV format header!");
+                context->avStream = avformat_new_stream(formatContext, nullptr);
+                if (context->avStream) {
+                    // Open the first encoder that will open
+                    errorCode = codecOpenFirst(codecCfg, &(context->codecContext));
+                    if ((errorCode == 0) && (pipeline == W_COMMON_PIPELINE_MAIN) &&
+                        wRecordIsStarted() &&
+                        (wRecordStreamSet(context->codecContext) != 0)) {
+                        // Not fatal, there will just be no recordings
+                        W_LOG_ERROR("unable to give the stream to event recording!");
+                    }
+                    if (errorCode == 0) {
+                        errorCode = -EIO;
+                        // A hint for the muxer, it may choose otherwise
+                        context->avStream->time_base = context->codecContext->time_base;
+                        if ((avcodec_parameters_from_context(context->avStream->codecpar,
+                                                             context->codecContext) == 0) &&
+                            (avformat_write_header(formatContext, &hlsOptions) >= 0)) {
+                            // avformat_write_header() modifies the options passed
+                            // to it to be any options that weren't found
+                            const AVDictionaryEntry *entry = nullptr;
+                            while ((entry = av_dict_iterate(hlsOptions, entry))) {
+                                W_LOG_WARN("HLS option \"%s\", or value \"%s\", not found.",
+                                           entry->key, entry->value);
+                            }
+                            // Don't see why this should be necessary (everything in here
+                            // seems to have its own copy of time_base: the AVCodecContext does,
+                            // AVFrame does and apparently AVStream does), but the example:
+                            // https://ffmpeg.org/doxygen/trunk/transcode_8c-example.html
+                            // does it and if you don't do it the output has no timing.
+                            // In low-latency mode the mp4 muxer has chosen its
+                            // own time base and packets are rescaled to it
+                            if (hlsMode != W_HLS_MODE_LOW_LATENCY) {
+                                context->avStream->time_base = context->codecContext->time_base;
                             }
+                            errorCode = 0;
                         } else {
-                            W_LOG_ERROR("unable to allocate memory for video output context!");
+                            W_LOG_ERROR("unable to write AV format header!");
                         }
-                    } else {
-                        W_LOG_ERROR("unable to find H.264 codec in FFmpeg!");
                     }
                 } else {
                     W_LOG_ERROR("unable to allocate memory for video output stream!");
@@ -480,25 +1206,37 @@ int wVideoEncodeInit(std::string outputDirectory, std::string outputFileName)
         }
 
         if (errorCode == 0) {
-            // Create our message queue
-            errorCode = wMsgQueueStart(gContext, W_VIDEO_ENCODE_MSG_QUEUE_MAX_SIZE, "video encode");
+            // Create our message queue: the only thing that pushes to it is
+            // the image processing thread, via avFrameQueuePush(), so it can
+            // be a single-producer ring, which avoids a heap allocation and
+            // a mutex per frame
+            errorCode = wMsgQueueStart(context, W_VIDEO_ENCODE_MSG_QUEUE_MAX_SIZE,
+                                       wUtilPipelineName("video encode", pipeline),
+                                       W_MSG_QUEUE_TYPE_RING_SPSC, sizeof(wVideoEncodeMsgBody_t));
             if (errorCode >= 0) {
-                gMsgQueueId = errorCode;
+                context->msgQueueId = errorCode;
                 errorCode = 0;
                 // Register the message handler
                 for (unsigned int x = 0; (x < W_UTIL_ARRAY_COUNT(gMsgHandler)) &&
                                          (errorCode == 0); x++) {
                     wVideoEncodeMsgHandler_t *handler = &(gMsgHandler[x]);
-                    errorCode = wMsgQueueHandlerAdd(gMsgQueueId,
+                    errorCode = wMsgQueueHandlerAdd(context->msgQueueId,
                                                     handler->msgType,
                                                     handler->function,
                                                     handler->functionFree);
                 }
+                if (errorCode == 0) {
+                    errorCode = wMsgQueueOverflowSet(context->msgQueueId,
+                                                     W_VIDEO_ENCODE_MSG_QUEUE_OVERFLOW);
+                }
+                if (errorCode == 0) {
+                    errorCode = wStatsQueueAdd(context->msgQueueId, pipeline);
+                }
             }
         }
 
         if (errorCode < 0) {
-            cleanUp();
+            cleanUp(pipeline);
         }
     }
 
@@ -506,44 +1244,73 @@ int wVideoEncodeInit(std::string outputDirectory, std::string outputFileName)
 }
 
 // Start video encoding.
-int wVideoEncodeStart()
+int wVideoEncodeStart(unsigned int pipeline)
 {
     int errorCode = -EBADF;
 
-    if (gContext) {
-        errorCode = wImageProcessingStart(avFrameQueuePush);
+    if (contextGet(pipeline)) {
+        errorCode = wImageProcessingStart(pipeline, avFrameQueuePush);
     }
 
     return errorCode;
 }
 
+// Push a frame directly to the video encoder.
+int wVideoEncodeFramePush(unsigned int pipeline,
+                          uint8_t *data, unsigned int length,
+                          unsigned int sequence,
+                          unsigned int width, unsigned int height,
+                          unsigned int stride)
+{
+    // Releases data if there is no context
+    return avFrameQueuePush(pipeline, data, length, sequence,
+                            width, height, stride);
+}
+
 // Stop video encoding.
-int wVideoEncodeStop()
+int wVideoEncodeStop(unsigned int pipeline)
 {
     int errorCode = -EBADF;
 
-    if (gContext) {
-        errorCode = wImageProcessingStop();
+    if (contextGet(pipeline)) {
+        errorCode = wImageProcessingStop(pipeline);
     }
 
     return errorCode;
 }
 
 // Deinitialise video encoding.
-void wVideoEncodeDeinit()
+void wVideoEncodeDeinit(unsigned int pipeline)
 {
-    if (gContext) {
-        wImageProcessingStop();
-        cleanUp();
-
-        // Print some useful diagnostic information
-        W_LOG_INFO("average frame gap (at end of video output) over the last"
-                   " %d frames %lld ms (a rate of %lld frames/second), largest"
-                   " gap %lld ms.",
-                   W_UTIL_ARRAY_COUNT(gMonitorTiming.gap),
-                   std::chrono::duration_cast<std::chrono::milliseconds>(gMonitorTiming.average).count(),
-                   1000 / std::chrono::duration_cast<std::chrono::milliseconds>(gMonitorTiming.average).count(),
-                   std::chrono::duration_cast<std::chrono::milliseconds>(gMonitorTiming.largest).count());
+    wVideoEncodeContext_t *context = contextGet(pipeline);
+
+    if (context) {
+        wImageProcessingStop(pipeline);
+        int64_t dropCount = wMsgQueueDropCountGet(context->msgQueueId);
+        uint64_t avFramePoolMissCount = context->avFramePoolMissCount;
+        uint64_t frameSkipCount = context->frameSkipCount;
+        wUtilMonitorTiming_t monitorTiming = context->monitorTiming;
+        cleanUp(pipeline);
+
+        // Print some useful diagnostic information; the average gap
+        // is zero if the pipeline saw no frames (or they were less
+        // than a millisecond apart), in which case there is no rate
+        long long averageMs = std::chrono::duration_cast<std::chrono::milliseconds>(monitorTiming.average).count();
+        long long rateHertz = 0;
+        if (averageMs > 0) {
+            rateHertz = 1000 / averageMs;
+        }
+        W_LOG_INFO("video output %d: average frame gap (at end of video output)"
+                   " over the last %d frames %lld ms (a rate of %lld frames/second),"
+                   " largest gap %lld ms.", pipeline,
+                   W_UTIL_ARRAY_COUNT(monitorTiming.gap),
+                   averageMs, rateHertz,
+                   (long long) std::chrono::duration_cast<std::chrono::milliseconds>(monitorTiming.largest).count());
+        W_LOG_INFO("video output %d: %llu frame(s) skipped by the encoder, %lld"
+                   " frame(s) dropped from the video queue, AVFrame pool empty"
+                   " %llu time(s).", pipeline,
+                   (unsigned long long) frameSkipCount, (long long) dropCount,
+                   (unsigned long long) avFramePoolMissCount);
     }
 }
 
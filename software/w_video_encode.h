@@ -17,12 +17,20 @@
 #ifndef _W_VIDEO_ENCODE_H_
 #define _W_VIDEO_ENCODE_H_
 
-// This API is dependent on std::string (used by wVideoEncodeInit()).
+// This API is dependent on std::string (used by wVideoEncodeInit()),
+// uint8_t, w_common.h (for W_COMMON_PIPELINE_MAIN) and w_hls.h (for
+// wHlsMode_t).
+#include <cstdint>
 #include <string>
+#include <w_common.h>
+#include <w_hls.h>
 
 /** @file
  * @brief The video encoding API for the watchdog application; this
- * API is NOT thread-safe.
+ * API is NOT thread-safe.  Each pipeline (see
+ * W_COMMON_PIPELINE_MAX_NUM) has its own encoder, queue and HLS
+ * output; only the main pipeline feeds event recording and the event
+ * index, and only it may use low-latency HLS or the in-memory store.
  */
 
 /* ----------------------------------------------------------------
@@ -31,50 +39,183 @@
 
 #ifndef W_VIDEO_ENCODE_MSG_QUEUE_MAX_SIZE
 /** The maximum number of frames allowed in the video processing
- * queue; lots of room needed.
+ * queue.  The frames in the queue are camera frame buffers, which
+ * the camera cannot refill until they have been encoded, hence
+ * this should be comfortably less than W_CAMERA_BUFFER_COUNT so
+ * that image processing can keep going when the encoder stalls.
  */
-# define W_VIDEO_ENCODE_MSG_QUEUE_MAX_SIZE 1000
+# define W_VIDEO_ENCODE_MSG_QUEUE_MAX_SIZE 4
+#endif
+
+#ifndef W_VIDEO_ENCODE_MSG_QUEUE_OVERFLOW
+/** What to do when the video encode queue is full, a value from
+ * wMsgQueueOverflow_t (see w_msg.h): by default the newest frame
+ * is dropped.
+ */
+# define W_VIDEO_ENCODE_MSG_QUEUE_OVERFLOW W_MSG_QUEUE_OVERFLOW_DROP_NEWEST
+#endif
+
+#ifndef W_VIDEO_ENCODE_QOS_FRAME_SKIP
+/** If true then, when the encoder falls behind, frames are skipped
+ * before they reach the video encode queue, the frame that is
+ * encoded being given a duration that covers the frames skipped
+ * after it, so that the video timeline has no gaps; image
+ * processing (motion detection) still sees every frame.
+ */
+# define W_VIDEO_ENCODE_QOS_FRAME_SKIP true
+#endif
+
+#ifndef W_VIDEO_ENCODE_QOS_BACKLOG_THRESHOLD
+/** The number of frames waiting in the video encode queue at which
+ * frame skipping (see W_VIDEO_ENCODE_QOS_FRAME_SKIP) starts.  Each
+ * frame of backlog beyond this adds one to the number of frames
+ * skipped.
+ */
+# define W_VIDEO_ENCODE_QOS_BACKLOG_THRESHOLD 2
+#endif
+
+#ifndef W_VIDEO_ENCODE_QOS_FRAME_DURATION_MAX
+/** The maximum duration, in frames, that frame skipping (see
+ * W_VIDEO_ENCODE_QOS_FRAME_SKIP) may give to one encoded frame,
+ * i.e. one more than the maximum number of frames skipped in a row.
+ */
+# define W_VIDEO_ENCODE_QOS_FRAME_DURATION_MAX 4
+#endif
+
+#ifndef W_VIDEO_ENCODE_CODEC_NAME_DEFAULT
+/** The default video encoder: the name of an FFmpeg H.264 encoder or
+ * a comma-separated list of them, in order of preference, or
+ * W_VIDEO_ENCODE_CODEC_NAME_AUTO.
+ */
+# define W_VIDEO_ENCODE_CODEC_NAME_DEFAULT "libx264"
+#endif
+
+/** The encoder name which means "whatever is best on this board".
+ */
+#define W_VIDEO_ENCODE_CODEC_NAME_AUTO "auto"
+
+#ifndef W_VIDEO_ENCODE_CODEC_NAME_AUTO_LIST
+/** The encoders tried, in order, when the encoder name is
+ * W_VIDEO_ENCODE_CODEC_NAME_AUTO: the V4L2 memory-to-memory hardware
+ * encoder, which the Pi 4 and earlier have (the Pi 5 does not), then
+ * libx264.
+ */
+# define W_VIDEO_ENCODE_CODEC_NAME_AUTO_LIST "h264_v4l2m2m,libx264"
+#endif
+
+#ifndef W_VIDEO_ENCODE_CODEC_BIT_RATE_KBPS_HARDWARE_DEFAULT
+/** The bit rate to use for a hardware encoder if none is given;
+ * hardware encoders are generally rate-controlled only and the
+ * FFmpeg default would be far too low.
+ */
+# define W_VIDEO_ENCODE_CODEC_BIT_RATE_KBPS_HARDWARE_DEFAULT 2000
+#endif
+
+#ifndef W_VIDEO_ENCODE_PROBE_FRAME_COUNT
+/** The number of frames encoded at start of day, with a throw-away
+ * copy of the encoder, to find out what frame rate the encoder can
+ * sustain; zero to not do this.
+ */
+# define W_VIDEO_ENCODE_PROBE_FRAME_COUNT 30
 #endif
 
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
 
+/** The configuration of the video encoder.  The preset and CRF
+ * are only applied to libx264; everything else applies to any
+ * encoder that supports it.
+ */
+typedef struct {
+    std::string name; // As W_VIDEO_ENCODE_CODEC_NAME_DEFAULT; empty for the default
+    std::string preset; // libx264 preset, e.g. "ultrafast"; empty for the default
+    int threads; // The number of encode threads; zero for the FFmpeg default
+    bool sliceThreads; // If true then threads encode slices of a frame rather than whole frames
+    int bitRateKbps; // The target bit rate; zero for the default
+    int crf; // libx264 constant rate factor, 0 to 51; negative for the default
+    std::string options; // Any other codec options, "key=value:key=value"; may be empty
+} wVideoEncodeCodecCfg_t;
+
 /* ----------------------------------------------------------------
  * FUNCTIONS
  * -------------------------------------------------------------- */
 
-/** Initialise video encoding; if video encoding is already
+/** Initialise the video encoding of a pipeline; if it is already
  * initialised this function will do nothing and return success.
  * wMsgInit() must have returned successfully before this is called.
+ * The encoder that is chosen, and the frame rate it can sustain, is
+ * printed.
  *
+ * @param pipeline           the pipeline, from 0 to
+ *                           W_COMMON_PIPELINE_MAX_NUM - 1.
  * @param outputDirectory    the output directory (with no trailing
  *                           slash).
  * @param outputFileName     the output file name, with no
  *                           extension.
+ * @param codecCfg           the configuration of the video encoder;
+ *                           may be nullptr for the defaults.  The first
+ *                           of the named encoders that can be opened
+ *                           with this configuration is used.
+ * @param hlsMode            the HLS output mode, see wHlsMode_t;
+ *                           W_HLS_MODE_LOW_LATENCY is only allowed
+ *                           for W_COMMON_PIPELINE_MAIN.
  * @return                   zero on success else negative error code.
  */
-int wVideoEncodeInit(std::string outputDirectory, std::string outputFileName);
+int wVideoEncodeInit(unsigned int pipeline,
+                     std::string outputDirectory, std::string outputFileName,
+                     const wVideoEncodeCodecCfg_t *codecCfg = nullptr,
+                     wHlsMode_t hlsMode = W_HLS_MODE_DEFAULT);
 
-/** Start video encoding; this will call wImageProcessingStart(),
- * providing it with a callback to obtain a flow of processed
- * images.  wImageProcessingInit() must have been called and returned
- * success for this function to succeed.
+/** Start the video encoding of a pipeline; this will call
+ * wImageProcessingStart() for the pipeline, providing it with a
+ * callback to obtain a flow of processed images.
+ * wImageProcessingInit() must have been called for the pipeline and
+ * returned success for this function to succeed.
  *
- * @return zero on success else negative error code.
+ * @param pipeline the pipeline.
+ * @return         zero on success else negative error code.
  */
-int wVideoEncodeStart();
+int wVideoEncodeStart(unsigned int pipeline);
 
-/** Stop video encoding; you do not have to call this function
- * on exit, wVideoEncodeDeinit() will tidy up appropriately.
+/** Push a frame directly to the video encoder, bypassing image
+ * processing; this is the function that wVideoEncodeStart() passes
+ * to wImageProcessingStart() and hence follows the rules of
+ * wCommonFrameFunction_t, in particular the frame is always given up
+ * with wCameraFrameRelease(), even on failure.  Only really of use
+ * when the encoder is being measured on its own, e.g. by the
+ * benchmark; wVideoEncodeInit() must have returned success.
  *
- * @return zero on success else negative error code.
+ * @param pipeline the pipeline.
+ * @param data     a pointer to the YUV420 image data.
+ * @param length   the amount of memory pointed to by data.
+ * @param sequence a monotonically-increasing sequence number.
+ * @param width    the width of the image in pixels.
+ * @param height   the height of the image in pixels.
+ * @param stride   the stride of the Y plane of the image.
+ * @return         the number of frames now in the video encode
+ *                 queue, else negative error code.
  */
-int wVideoEncodeStop();
+int wVideoEncodeFramePush(unsigned int pipeline,
+                          uint8_t *data, unsigned int length,
+                          unsigned int sequence,
+                          unsigned int width, unsigned int height,
+                          unsigned int stride);
 
-/** Deinitialise video encoding and free resources.
+/** Stop the video encoding of a pipeline; you do not have to call
+ * this function on exit, wVideoEncodeDeinit() will tidy up
+ * appropriately.
+ *
+ * @param pipeline the pipeline.
+ * @return         zero on success else negative error code.
+ */
+int wVideoEncodeStop(unsigned int pipeline);
+
+/** Deinitialise the video encoding of a pipeline and free resources.
+ *
+ * @param pipeline the pipeline.
  */
-void wVideoEncodeDeinit();
+void wVideoEncodeDeinit(unsigned int pipeline);
 
 #endif // _W_VIDEO_ENCODE_H_
 